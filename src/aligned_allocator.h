@@ -0,0 +1,84 @@
+#ifndef IGPUP_DITHERING_PROJECT_ALIGNED_ALLOCATOR_H_
+#define IGPUP_DITHERING_PROJECT_ALIGNED_ALLOCATOR_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+/*!
+ * \brief Allocator that starts allocations on a cache line, and allocations
+ * of at least a page on a page.
+ *
+ * Used for pixel data so that rows and planes that are sized in whole cache
+ * lines never share a cache line with their neighbors. Images of at least a
+ * page start on a page and are padded to whole pages, so that OpenCL devices
+ * with unified memory can use them without copying (see GetAllocatedSize()).
+ */
+template <typename T>
+class CacheAlignedAllocator {
+ public:
+  typedef T value_type;
+
+  static constexpr std::size_t kCacheLineSize = 64;
+  static constexpr std::size_t kPageSize = 4096;
+
+  CacheAlignedAllocator() = default;
+
+  template <typename U>
+  CacheAlignedAllocator(const CacheAlignedAllocator<U> &) {}
+
+  /// Returns the alignment of allocations of size bytes
+  static std::size_t GetAlignment(std::size_t size) {
+    return size >= kPageSize ? kPageSize : kCacheLineSize;
+  }
+
+  /*!
+   * \brief Returns the number of bytes that an allocation of size bytes
+   * provides, which is size rounded up to GetAlignment(size).
+   *
+   * The bytes past size may be used, e.g. by an OpenCL buffer that wraps the
+   * allocation, but hold no data.
+   */
+  static std::size_t GetAllocatedSize(std::size_t size) {
+    const std::size_t alignment = GetAlignment(size);
+    return (size + alignment - 1) & ~(alignment - 1);
+  }
+
+  T *allocate(std::size_t count) {
+    // C++11 has no aligned operator new, so extra space is allocated for
+    // aligning and for the pointer that is freed
+    const std::size_t size = GetAllocatedSize(count * sizeof(T));
+    const std::size_t alignment = GetAlignment(size);
+    void *allocation = std::malloc(size + alignment - 1 + sizeof(void *));
+    if (allocation == nullptr) {
+      throw std::bad_alloc();
+    }
+    std::uintptr_t aligned =
+        (reinterpret_cast<std::uintptr_t>(allocation) + sizeof(void *) +
+         alignment - 1) &
+        ~static_cast<std::uintptr_t>(alignment - 1);
+    reinterpret_cast<void **>(aligned)[-1] = allocation;
+    return reinterpret_cast<T *>(aligned);
+  }
+
+  void deallocate(T *ptr, std::size_t) {
+    if (ptr != nullptr) {
+      std::free(reinterpret_cast<void **>(ptr)[-1]);
+    }
+  }
+};
+
+template <typename T, typename U>
+bool operator==(const CacheAlignedAllocator<T> &,
+                const CacheAlignedAllocator<U> &) {
+  return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const CacheAlignedAllocator<T> &,
+                const CacheAlignedAllocator<U> &) {
+  return false;
+}
+
+#endif
@@ -1,22 +1,45 @@
 #include "arg_parse.h"
 
+#include <climits>
+#include <cstdlib>
 #include <cstring>
 #include <iostream>
 
+#include "cache_dir.h"
+#include "opencl_handle.h"
+
 Args::Args()
     : do_dither_image_(true),
       do_dither_grayscaled_(false),
       do_overwrite_(false),
       do_video_pngs_(false),
+      do_stream_(false),
+      do_planar_(false),
+      do_profile_(false),
+      do_list_devices_(false),
+      dither_backend_(DitherBackend::kAuto),
+      blue_noise_memory_(BlueNoiseMemory::kAuto),
+      thread_count_(0),
+      pipeline_depth_(OpenCLContext::GetPipelineDepth()),
+      cl_platform_index_(-1),
+      cl_device_index_(-1),
+      cache_directory_(GetCacheDirectory()),
+      profile_json_filename_(),
       input_filename(),
-      output_filename() {}
+      output_filename(),
+      input_filenames(),
+      output_filenames() {}
 
 void Args::PrintUsage() {
   std::cout
       << "Usage: [-h | --help] [-i <filename> | --input <filename>] [-o "
          "<filename> | --output <filename>] [-b <filename> | --blue "
          "<filename>] [-g | --gray] [--image] [--video] [--video-pngs] "
-         "[--overwrite]\n"
+         "[--stream] [--planar] [--overwrite] [--backend "
+         "<auto|opencl|cpu|simd>] [--cache-dir <directory>] [--threads "
+         "<count>] [--pipeline-depth <count>] [--blue-noise "
+         "<auto|buffer|image|local>] [--profile] [--profile-json <filename>] "
+         "[--cl-platform <index>] [--cl-device <index>] [--list-devices]\n"
          "  -h | --help\t\t\t\tPrint this usage text\n"
          "  -i <filename> | --input <filename>\tSet input filename\n"
          "  -o <filename> | --output <filename>\tSet output filename\n"
@@ -25,7 +48,37 @@ void Args::PrintUsage() {
          "  --image\t\t\t\tDither a single image\n"
          "  --video\t\t\t\tDither frames in a video\n"
          "  --video-pngs\t\t\t\tDither frames but output as individual pngs\n"
+         "  --stream\t\t\t\tDither a png image in strips to limit "
+         "memory use\n"
+         "  --planar\t\t\t\tStore a color image as separate channel "
+         "planes\n"
          "  --overwrite\t\t\t\tAllow overwriting existing files\n"
+         "  --backend <auto|opencl|cpu|simd>\tSet where dithering is done "
+         "(default: auto)\n"
+         "  --cache-dir <directory>\t\tSet directory of compiled OpenCL "
+         "kernels and measured backends, work group sizes, and blue noise "
+         "memories (\"\" to not save)\n"
+         "  --threads <count>\t\t\tSet number of CPU threads (default: 0, "
+         "which is one per hardware thread)\n"
+         "  --pipeline-depth <count>\t\tSet number of strips of an image "
+         "in flight per OpenCL device (default: "
+      << OpenCLContext::GetPipelineDepth()
+      << ")\n"
+         "  --blue-noise <auto|buffer|image|local>\tSet where OpenCL kernels "
+         "read blue noise from (default: auto)\n"
+         "  --profile\t\t\t\tPrint time spent in OpenCL copies and kernels "
+         "at exit\n"
+         "  --profile-json <filename>\t\tWrite time spent in OpenCL copies "
+         "and kernels to a JSON file at exit\n"
+         "  --cl-platform <index>\t\t\tOnly use OpenCL devices of the "
+         "platform at index (default: all)\n"
+         "  --cl-device <index>\t\t\tOnly use the OpenCL device at index of "
+         "the platform (default: all)\n"
+         "  --list-devices\t\t\tPrint the OpenCL platforms and devices with "
+         "their indices and exit\n"
+         "Several images can be dithered at once with --image by giving an "
+         "-i and an -o for each, the outputs in the same order as the "
+         "inputs.\n"
          "It is recommended to use the .png extension for image output, and "
          ".mp4 for video output."
       << std::endl;
@@ -42,11 +95,13 @@ bool Args::ParseArgs(int argc, char **argv) {
     } else if (argc > 1 && (std::strcmp(argv[0], "-i") == 0 ||
                             std::strcmp(argv[0], "--input") == 0)) {
       input_filename = std::string(argv[1]);
+      input_filenames.push_back(input_filename);
       --argc;
       ++argv;
     } else if (argc > 1 && (std::strcmp(argv[0], "-o") == 0 ||
                             std::strcmp(argv[0], "--output") == 0)) {
       output_filename = std::string(argv[1]);
+      output_filenames.push_back(output_filename);
       --argc;
       ++argv;
     } else if (argc > 1 && (std::strcmp(argv[0], "-b") == 0 ||
@@ -64,8 +119,75 @@ bool Args::ParseArgs(int argc, char **argv) {
     } else if (std::strcmp(argv[0], "--video-pngs") == 0) {
       do_dither_image_ = false;
       do_video_pngs_ = true;
+    } else if (std::strcmp(argv[0], "--stream") == 0) {
+      do_dither_image_ = true;
+      do_stream_ = true;
+    } else if (std::strcmp(argv[0], "--planar") == 0) {
+      do_planar_ = true;
     } else if (std::strcmp(argv[0], "--overwrite") == 0) {
       do_overwrite_ = true;
+    } else if (argc > 1 && std::strcmp(argv[0], "--backend") == 0) {
+      if (!ParseDitherBackend(argv[1], &dither_backend_)) {
+        std::cout << "WARNING: Ignoring invalid backend \"" << argv[1] << '"'
+                  << std::endl;
+      }
+      --argc;
+      ++argv;
+    } else if (argc > 1 && std::strcmp(argv[0], "--cache-dir") == 0) {
+      cache_directory_ = std::string(argv[1]);
+      --argc;
+      ++argv;
+    } else if (argc > 1 && std::strcmp(argv[0], "--threads") == 0) {
+      char *end = nullptr;
+      unsigned long count = std::strtoul(argv[1], &end, 10);
+      if (end == argv[1] || *end != 0) {
+        std::cout << "WARNING: Ignoring invalid thread count \"" << argv[1]
+                  << '"' << std::endl;
+      } else {
+        thread_count_ = count;
+      }
+      --argc;
+      ++argv;
+    } else if (argc > 1 && std::strcmp(argv[0], "--blue-noise") == 0) {
+      if (!ParseBlueNoiseMemory(argv[1], &blue_noise_memory_)) {
+        std::cout << "WARNING: Ignoring invalid blue noise memory \"" << argv[1]
+                  << '"' << std::endl;
+      }
+      --argc;
+      ++argv;
+    } else if (std::strcmp(argv[0], "--profile") == 0) {
+      do_profile_ = true;
+    } else if (argc > 1 && std::strcmp(argv[0], "--profile-json") == 0) {
+      profile_json_filename_ = std::string(argv[1]);
+      --argc;
+      ++argv;
+    } else if (argc > 1 && (std::strcmp(argv[0], "--cl-platform") == 0 ||
+                            std::strcmp(argv[0], "--cl-device") == 0)) {
+      char *end = nullptr;
+      long index = std::strtol(argv[1], &end, 10);
+      if (end == argv[1] || *end != 0 || index < 0 || index > INT_MAX) {
+        std::cout << "WARNING: Ignoring invalid " << argv[0] << " index \""
+                  << argv[1] << '"' << std::endl;
+      } else if (std::strcmp(argv[0], "--cl-platform") == 0) {
+        cl_platform_index_ = static_cast<int>(index);
+      } else {
+        cl_device_index_ = static_cast<int>(index);
+      }
+      --argc;
+      ++argv;
+    } else if (std::strcmp(argv[0], "--list-devices") == 0) {
+      do_list_devices_ = true;
+    } else if (argc > 1 && std::strcmp(argv[0], "--pipeline-depth") == 0) {
+      char *end = nullptr;
+      unsigned long depth = std::strtoul(argv[1], &end, 10);
+      if (end == argv[1] || *end != 0 || depth == 0) {
+        std::cout << "WARNING: Ignoring invalid pipeline depth \"" << argv[1]
+                  << '"' << std::endl;
+      } else {
+        pipeline_depth_ = depth;
+      }
+      --argc;
+      ++argv;
     } else {
       std::cout << "WARNING: Ignoring invalid input \"" << argv[0] << '"'
                 << std::endl;
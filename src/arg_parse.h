@@ -2,6 +2,10 @@
 #define IGPUP_DITHERING_PROJECT_ARG_PARSE_
 
 #include <string>
+#include <vector>
+
+#include "blue_noise_memory.h"
+#include "dither_backend.h"
 
 struct Args {
   Args();
@@ -15,8 +19,28 @@ struct Args {
   bool do_dither_grayscaled_;
   bool do_overwrite_;
   bool do_video_pngs_;
+  bool do_stream_;
+  bool do_planar_;
+  bool do_profile_;
+  bool do_list_devices_;
+  DitherBackend dither_backend_;
+  BlueNoiseMemory blue_noise_memory_;
+  unsigned int thread_count_;
+  unsigned int pipeline_depth_;
+  /// OpenCL platform and device of OpenCLContext::SetDeviceSelection(), -1
+  /// for all
+  int cl_platform_index_;
+  int cl_device_index_;
+  /// Directory of OpenCL programs and measured tuning results, empty to not
+  /// save them
+  std::string cache_directory_;
+  std::string profile_json_filename_;
   std::string input_filename;
   std::string output_filename;
+  /// Every -i and -o in order, input_filename and output_filename are the
+  /// last of them
+  std::vector<std::string> input_filenames;
+  std::vector<std::string> output_filenames;
   std::string blue_noise_filename;
 };
 
@@ -0,0 +1,198 @@
+#include "backend_tuner.h"
+
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+#include "image.h"
+#include "opencl_handle.h"
+#include "simd_dither.h"
+
+constexpr unsigned int BackendTuner::kBucketCount;
+constexpr unsigned int BackendTuner::kTimedRuns;
+
+// the last bucket holds every larger image
+const BackendTuner::Bucket BackendTuner::kBuckets[kBucketCount] = {
+    {"small", 640ULL * 480ULL, 640, 480},
+    {"hd", 1920ULL * 1080ULL, 1920, 1080},
+    {"uhd", 3840ULL * 2160ULL, 3840, 2160},
+    {"huge", ~0ULL, 7680, 4320}};
+
+MeasuredCache<BackendTuner::Key, DitherBackend> BackendTuner::backends_(
+    "igpup_dithering_backends", "dithering backends",
+    &BackendTuner::ParseCacheLine, &BackendTuner::WriteCacheLine);
+
+DitherBackend BackendTuner::GetBackend(
+    unsigned int width, unsigned int height, bool grayscale,
+    Image *blue_noise, const OpenCLHandle::Ptr &opencl_handle,
+    const std::vector<std::size_t> &split_devices) {
+  const bool is_opencl_valid = opencl_handle && opencl_handle->IsValid();
+  const Key key(GetDeviceKey(opencl_handle, split_devices),
+                SIMDDither::ISAToString(SIMDDither::GetISA()),
+                GetBucket(width, height), grayscale);
+
+  // the vectorized CPU loops are always available, so they are used while
+  // another thread measures the same key
+  return backends_.Get(key, DitherBackend::kSIMD, [&]() {
+    return Measure(std::get<2>(key), grayscale, blue_noise,
+                   is_opencl_valid ? opencl_handle : OpenCLHandle::Ptr(),
+                   split_devices);
+  });
+}
+
+void BackendTuner::SetCacheDirectory(const std::string &directory) {
+  backends_.SetDirectory(directory);
+}
+
+unsigned int BackendTuner::GetBucket(unsigned int width, unsigned int height) {
+  const unsigned long long pixels =
+      static_cast<unsigned long long>(width) * height;
+  unsigned int bucket = 0;
+  while (bucket + 1 < kBucketCount && pixels > kBuckets[bucket].max_pixels) {
+    ++bucket;
+  }
+  return bucket;
+}
+
+unsigned int BackendTuner::GetBucketCount() { return kBucketCount; }
+
+const char *BackendTuner::GetBucketName(unsigned int bucket) {
+  return kBuckets[bucket].name;
+}
+
+std::unique_ptr<Image> BackendTuner::CreateTimingImage(unsigned int bucket) {
+  // synthetic RGBA input, the values only need to vary
+  std::unique_ptr<Image> image(new Image{});
+  image->width_ = kBuckets[bucket].width;
+  image->height_ = kBuckets[bucket].height;
+  image->is_grayscale_ = false;
+  image->data_.resize(static_cast<std::size_t>(image->width_) *
+                      image->height_ * 4);
+  for (std::size_t i = 0; i < image->data_.size(); ++i) {
+    image->data_[i] = static_cast<uint8_t>((i * 2654435761ULL) >> 24);
+  }
+  return image;
+}
+
+double BackendTuner::TimeDithering(Image *image, bool grayscale,
+                                   Image *blue_noise) {
+  double best_seconds = -1.0;
+  // the first run is not timed, it builds OpenCL kernels and buffers
+  for (unsigned int run = 0; run <= kTimedRuns; ++run) {
+    auto start = std::chrono::steady_clock::now();
+    std::unique_ptr<Image> dithered =
+        grayscale ? image->ToGrayscaleDitheredWithBlueNoise(blue_noise)
+                  : image->ToColorDitheredWithBlueNoise(blue_noise);
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    if (!dithered) {
+      return -1.0;
+    } else if (run > 0 &&
+               (best_seconds < 0.0 || elapsed.count() < best_seconds)) {
+      best_seconds = elapsed.count();
+    }
+  }
+  return best_seconds;
+}
+
+std::string BackendTuner::GetDeviceKey(
+    const OpenCLHandle::Ptr &opencl_handle,
+    const std::vector<std::size_t> &split_devices) {
+  // a key without a device is only used when OpenCL is unavailable
+  if (!opencl_handle || !opencl_handle->IsValid()) {
+    return "none";
+  } else if (split_devices.empty()) {
+    return opencl_handle->GetDeviceKey();
+  }
+
+  // an image split between devices is timed on all of them, so the result
+  // only applies to the same devices
+  std::string key;
+  for (std::size_t device : split_devices) {
+    if (!key.empty()) {
+      key += '+';
+    }
+    key += OpenCLContext::GetHandle(device)->GetDeviceKey();
+  }
+  return key;
+}
+
+DitherBackend BackendTuner::Measure(
+    unsigned int bucket, bool grayscale, Image *blue_noise,
+    const OpenCLHandle::Ptr &opencl_handle,
+    const std::vector<std::size_t> &split_devices) {
+  std::cout << "INFO: Timing dithering backends for " << kBuckets[bucket].width
+            << 'x' << kBuckets[bucket].height
+            << (grayscale ? " grayscale" : " color") << " dithering..."
+            << std::endl;
+
+  std::unique_ptr<Image> image = CreateTimingImage(bucket);
+  std::vector<DitherBackend> candidates{DitherBackend::kSIMD,
+                                        DitherBackend::kCPU};
+  if (opencl_handle) {
+    // the image gets the same handles of this thread, so the kernels and
+    // buffers built while timing are kept for later images, and is split
+    // between the same devices as the calling Image, or uses its device
+    candidates.push_back(DitherBackend::kOpenCL);
+    image->opencl_device_index_ =
+        split_devices.empty()
+            ? static_cast<int>(opencl_handle->GetDeviceIndex())
+            : -1;
+  }
+
+  DitherBackend best_backend = DitherBackend::kSIMD;
+  double best_seconds = -1.0;
+  for (DitherBackend backend : candidates) {
+    image->SetDitherBackend(backend);
+    double seconds = TimeDithering(image.get(), grayscale, blue_noise);
+    if (seconds < 0.0) {
+      std::cout << "INFO:   " << DitherBackendToString(backend) << " failed"
+                << std::endl;
+      continue;
+    }
+    std::cout << "INFO:   " << DitherBackendToString(backend) << ": "
+              << seconds * 1000.0 << " ms" << std::endl;
+    if (best_seconds < 0.0 || seconds < best_seconds) {
+      best_seconds = seconds;
+      best_backend = backend;
+    }
+  }
+
+  std::cout << "INFO: Using " << DitherBackendToString(best_backend)
+            << " for " << kBuckets[bucket].name << " images" << std::endl;
+  return best_backend;
+}
+
+bool BackendTuner::ParseCacheLine(const std::string &line, Key *key,
+                                  DitherBackend *backend) {
+  // "<device key> <isa> <bucket> <gray|color> <backend>"
+  std::istringstream iss(line);
+  std::string device_key;
+  std::string isa_name;
+  std::string bucket_name;
+  std::string mode;
+  std::string backend_name;
+  if (!(iss >> device_key >> isa_name >> bucket_name >> mode >>
+        backend_name) ||
+      !ParseDitherBackend(backend_name, backend) ||
+      *backend == DitherBackend::kAuto ||
+      (mode != "gray" && mode != "color")) {
+    return false;
+  }
+  for (unsigned int i = 0; i < kBucketCount; ++i) {
+    if (bucket_name == kBuckets[i].name) {
+      *key = Key(device_key, isa_name, i, mode == "gray");
+      return true;
+    }
+  }
+  return false;
+}
+
+void BackendTuner::WriteCacheLine(std::ostream &out, const Key &key,
+                                  const DitherBackend &backend) {
+  out << std::get<0>(key) << ' ' << std::get<1>(key) << ' '
+      << kBuckets[std::get<2>(key)].name << ' '
+      << (std::get<3>(key) ? "gray" : "color") << ' '
+      << DitherBackendToString(backend);
+}
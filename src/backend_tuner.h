@@ -0,0 +1,117 @@
+#ifndef IGPUP_DITHERING_PROJECT_BACKEND_TUNER_H_
+#define IGPUP_DITHERING_PROJECT_BACKEND_TUNER_H_
+
+#include <memory>
+#include <ostream>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "dither_backend.h"
+#include "measured_cache.h"
+#include "opencl_handle.h"
+
+class Image;
+
+/*!
+ * \brief Picks the fastest dithering backend of this machine for
+ * DitherBackend::kAuto.
+ *
+ * Images are sorted into buckets by their number of pixels. The first time
+ * a bucket is dithered, every available backend (OpenCL, CPU, and SIMD)
+ * dithers a synthetic image of the bucket's resolution, and the fastest is
+ * used from then on. Results are saved to a cache file per device key (see
+ * OpenCLHandle::GetDeviceKey()), joined for every device that an Image is
+ * split between, and SIMD ISA, so later runs on the same hardware pick a
+ * backend without measuring again.
+ *
+ * OpenCL is not always the fastest, e.g. on CPU-only OpenCL implementations
+ * such as pocl, where copying to and from buffers costs more than dithering
+ * on the host.
+ */
+class BackendTuner {
+ public:
+  /*!
+   * \brief Returns the fastest backend for dithering a width x height image.
+   *
+   * grayscale selects between timing grayscale and color dithering.
+   * opencl_handle is the handle of the calling Image, which OpenCL is timed
+   * with, or empty if OpenCL is unavailable. split_devices are the devices
+   * that the calling Image splits its rows between (see
+   * Image::GetOpenCLSplitDevices()), which OpenCL is timed with instead if
+   * not empty. The returned backend is never DitherBackend::kAuto.
+   *
+   * Other threads are not blocked while a bucket is measured. Those that
+   * need the same bucket get DitherBackend::kSIMD until it is measured.
+   */
+  static DitherBackend GetBackend(
+      unsigned int width, unsigned int height, bool grayscale,
+      Image *blue_noise, const OpenCLHandle::Ptr &opencl_handle,
+      const std::vector<std::size_t> &split_devices);
+
+  /*!
+   * \brief Sets the directory that measured backends are loaded from and
+   * saved to, as "igpup_dithering_backends".
+   *
+   * Defaults to GetCacheDirectory(). An empty directory disables the cache
+   * file, so backends are measured once per run.
+   */
+  static void SetCacheDirectory(const std::string &directory);
+
+  /// Returns the bucket of a width x height image
+  static unsigned int GetBucket(unsigned int width, unsigned int height);
+
+  /// Returns the number of buckets
+  static unsigned int GetBucketCount();
+
+  /// Returns the name of bucket, as used in cache files
+  static const char *GetBucketName(unsigned int bucket);
+
+  /// Returns a synthetic RGBA image of the resolution that bucket is timed
+  /// with
+  static std::unique_ptr<Image> CreateTimingImage(unsigned int bucket);
+
+  /// Returns the fastest of kTimedRuns dithers of image in seconds, or a
+  /// negative value if dithering failed
+  static double TimeDithering(Image *image, bool grayscale, Image *blue_noise);
+
+ private:
+  /// Device key, SIMD ISA, bucket, and grayscale (true) or color (false)
+  typedef std::tuple<std::string, std::string, unsigned int, bool> Key;
+
+  struct Bucket {
+    const char *name;
+    /// Largest number of pixels of images in the bucket
+    unsigned long long max_pixels;
+    /// Resolution of the synthetic image that is timed
+    unsigned int width;
+    unsigned int height;
+  };
+
+  static constexpr unsigned int kBucketCount = 4;
+  static constexpr unsigned int kTimedRuns = 3;
+  static const Bucket kBuckets[kBucketCount];
+
+  static MeasuredCache<Key, DitherBackend> backends_;
+
+  /// Returns the device part of the key of GetBackend(), "none" if OpenCL
+  /// is unavailable
+  static std::string GetDeviceKey(
+      const OpenCLHandle::Ptr &opencl_handle,
+      const std::vector<std::size_t> &split_devices);
+
+  /// Times each available backend, returns the fastest
+  static DitherBackend Measure(unsigned int bucket, bool grayscale,
+                               Image *blue_noise,
+                               const OpenCLHandle::Ptr &opencl_handle,
+                               const std::vector<std::size_t> &split_devices);
+
+  /// Reads a line of the cache file, see MeasuredCache
+  static bool ParseCacheLine(const std::string &line, Key *key,
+                             DitherBackend *backend);
+  /// Writes a line of the cache file, see MeasuredCache
+  static void WriteCacheLine(std::ostream &out, const Key &key,
+                             const DitherBackend &backend);
+};
+
+#endif
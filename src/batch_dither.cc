@@ -0,0 +1,286 @@
+#include "batch_dither.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+#include "pixel_format.h"
+
+constexpr unsigned long long BatchDither::kMaxBatchedPixels;
+constexpr std::size_t BatchDither::kMaxBatchBytes;
+constexpr std::size_t BatchDither::kWorkGroupSize;
+
+const std::string BatchDither::kBufferInputName = "BatchBufferInput";
+const std::string BatchDither::kBufferImagesName = "BatchBufferImages";
+const std::string BatchDither::kBufferBlueNoiseName = "BatchBufferBlueNoise";
+const std::string BatchDither::kBufferOutputName = "BatchBufferOutput";
+
+BatchDither::BatchDither() : input_(), output_() {}
+
+std::vector<std::unique_ptr<Image>>
+BatchDither::ToGrayscaleDitheredWithBlueNoise(
+    const std::vector<Image *> &images, Image *blue_noise) {
+  return Dither(images, blue_noise, true);
+}
+
+std::vector<std::unique_ptr<Image>> BatchDither::ToColorDitheredWithBlueNoise(
+    const std::vector<Image *> &images, Image *blue_noise) {
+  return Dither(images, blue_noise, false);
+}
+
+std::vector<std::unique_ptr<Image>> BatchDither::Dither(
+    const std::vector<Image *> &images, Image *blue_noise, bool grayscale) {
+  std::vector<std::unique_ptr<Image>> results(images.size());
+  if (!blue_noise->IsGrayscale()) {
+    std::cout << "ERROR BatchDither: blue_noise is not grayscale" << std::endl;
+    return results;
+  }
+
+  // batches are split so that each fits in one input buffer
+  std::vector<bool> is_dithered(images.size(), false);
+  std::vector<std::size_t> indices;
+  std::size_t batch_bytes = 0;
+  for (std::size_t i = 0; i <= images.size(); ++i) {
+    const bool is_batched =
+        i < images.size() && IsBatched(images[i], grayscale);
+    if (!indices.empty() &&
+        (i == images.size() ||
+         (is_batched &&
+          batch_bytes + images[i]->data_.size() > kMaxBatchBytes))) {
+      if (DitherWithOpenCL(images, indices, blue_noise, grayscale, &results)) {
+        for (std::size_t index : indices) {
+          is_dithered[index] = true;
+        }
+      } else {
+        std::cout << "WARNING BatchDither: OpenCL dithering failed, "
+                     "dithering each image on its own"
+                  << std::endl;
+      }
+      indices.clear();
+      batch_bytes = 0;
+    }
+    if (is_batched) {
+      indices.push_back(i);
+      batch_bytes += images[i]->data_.size();
+    }
+  }
+
+  for (std::size_t i = 0; i < images.size(); ++i) {
+    if (is_dithered[i] || images[i] == nullptr) {
+      continue;
+    }
+    results[i] = grayscale
+                     ? images[i]->ToGrayscaleDitheredWithBlueNoise(blue_noise)
+                     : images[i]->ToColorDitheredWithBlueNoise(blue_noise);
+  }
+
+  return results;
+}
+
+bool BatchDither::IsBatched(const Image *image, bool grayscale) {
+  // images that Image's functions would refuse are left to them, so that
+  // they print the same errors
+  return image != nullptr && image->IsValid() && !image->IsDithered() &&
+         (grayscale || !image->IsGrayscale()) &&
+         static_cast<unsigned long long>(image->width_) * image->height_ <=
+             kMaxBatchedPixels &&
+         (image->dither_backend_ == DitherBackend::kAuto ||
+          image->dither_backend_ == DitherBackend::kOpenCL);
+}
+
+bool BatchDither::DitherWithOpenCL(
+    const std::vector<Image *> &images, const std::vector<std::size_t> &indices,
+    Image *blue_noise, bool grayscale,
+    std::vector<std::unique_ptr<Image>> *results) {
+  // the handle of the calling thread, which may differ between calls
+  const OpenCLHandle::Ptr opencl_handle = OpenCLContext::GetHandle();
+  const std::string &kernel_name = GetKernelName(opencl_handle, grayscale);
+  if (kernel_name.empty()) {
+    return false;
+  }
+
+  // pack the images and fill their table, see
+  // Image::GetBatchDitheringKernel()
+  const unsigned int pixels_per_item = Image::kOpenCLColorPixelsPerItem;
+  std::vector<cl_uint> table(indices.size() * Image::kBatchImageInfoSize, 0);
+  std::vector<std::size_t> output_offsets(indices.size() + 1, 0);
+  std::size_t input_size = 0;
+  unsigned long long item_count = 0;
+  for (std::size_t i = 0; i < indices.size(); ++i) {
+    Image *image = images[indices[i]];
+    if (!image->is_preserving_blue_noise_offsets_) {
+      image->GenerateBlueNoiseOffsets();
+    }
+    const unsigned int row_items =
+        (image->width_ + pixels_per_item - 1) / pixels_per_item;
+    const std::size_t output_size =
+        static_cast<std::size_t>(
+            grayscale ? PixelFormat::Bilevel::GetRowSize(image->width_)
+                      : PixelFormat::Palette16::GetRowSize(image->width_)) *
+        image->height_;
+
+    cl_uint *info = table.data() + i * Image::kBatchImageInfoSize;
+    info[0] = static_cast<cl_uint>(item_count);
+    info[1] = row_items;
+    info[2] = image->width_;
+    info[3] = image->height_;
+    info[4] = static_cast<cl_uint>(input_size);
+    info[5] = static_cast<cl_uint>(output_offsets[i]);
+    // steps between pixels and between channels, of RGBA or of planes. The
+    // three channels of a grayscale pixel are the pixel itself.
+    if (image->IsGrayscale()) {
+      info[6] = 1;
+      info[7] = 0;
+    } else {
+      info[6] = image->IsPlanar() ? 1 : 4;
+      info[7] = image->IsPlanar() ? image->GetPlaneSize() : 1;
+    }
+    // offsets of each channel as in Image::SetOpenCLBlueNoise()
+    for (unsigned int c = 0; c < 3; ++c) {
+      info[8 + c * 2] = image->blue_noise_offsets_.at(c) % blue_noise->width_;
+      info[9 + c * 2] = (image->blue_noise_offsets_.at(c) / blue_noise->width_ +
+                         image->row_offset_) %
+                        blue_noise->height_;
+    }
+
+    item_count += static_cast<unsigned long long>(row_items) * image->height_;
+    input_size += image->data_.size();
+    output_offsets[i + 1] = output_offsets[i] + output_size;
+  }
+  const std::size_t output_size = output_offsets.back();
+
+  input_.resize(input_size);
+  for (std::size_t i = 0; i < indices.size(); ++i) {
+    const Image *image = images[indices[i]];
+    std::memcpy(input_.data() + table[i * Image::kBatchImageInfoSize + 4],
+                image->data_.data(), image->data_.size());
+  }
+  output_.resize(output_size);
+
+  if (!PrepareBuffer(opencl_handle, kernel_name, kBufferInputName,
+                     CL_MEM_READ_ONLY, input_size) ||
+      !PrepareBuffer(opencl_handle, kernel_name, kBufferImagesName,
+                     CL_MEM_READ_ONLY, table.size() * sizeof(cl_uint)) ||
+      !PrepareBuffer(opencl_handle, kernel_name, kBufferBlueNoiseName,
+                     CL_MEM_READ_ONLY, blue_noise->data_.size()) ||
+      !PrepareBuffer(opencl_handle, kernel_name, kBufferOutputName,
+                     CL_MEM_WRITE_ONLY, output_size)) {
+    std::cout << "ERROR BatchDither: Failed to alloc buffers" << std::endl;
+    opencl_handle->CleanupKernel(kernel_name);
+    return false;
+  }
+
+  const OpenCLHandle::KernelRef kernel = opencl_handle->GetKernel(kernel_name);
+  const OpenCLHandle::BufferRef input =
+      opencl_handle->GetBuffer(kernel, kBufferInputName);
+  const OpenCLHandle::BufferRef images_table =
+      opencl_handle->GetBuffer(kernel, kBufferImagesName);
+  const OpenCLHandle::BufferRef blue_noise_buffer =
+      opencl_handle->GetBuffer(kernel, kBufferBlueNoiseName);
+  const OpenCLHandle::BufferRef output =
+      opencl_handle->GetBuffer(kernel, kBufferOutputName);
+
+  // every copy and the launch are in one queue, so only the last is waited
+  // on
+  OpenCLHandle::Event written;
+  if (!opencl_handle->SetKernelBufferRegionAsync(
+          input, 0, input_size, input_.data(), 0, {}, nullptr) ||
+      !opencl_handle->SetKernelBufferRegionAsync(
+          images_table, 0, table.size() * sizeof(cl_uint), table.data(), 0,
+          {}, nullptr) ||
+      !opencl_handle->SetKernelBufferRegionAsync(
+          blue_noise_buffer, 0, blue_noise->data_.size(),
+          blue_noise->data_.data(), 0, {}, &written)) {
+    std::cout << "ERROR BatchDither: Failed to copy images" << std::endl;
+    opencl_handle->CleanupKernel(kernel_name);
+    return false;
+  }
+
+  const cl_uint image_count = static_cast<cl_uint>(indices.size());
+  const cl_uint items = static_cast<cl_uint>(item_count);
+  cl_uint2 blue_noise_size;
+  blue_noise_size.s[0] = blue_noise->width_;
+  blue_noise_size.s[1] = blue_noise->height_;
+  if (!opencl_handle->AssignKernelBuffer(kernel, 0, input) ||
+      !opencl_handle->AssignKernelBuffer(kernel, 1, images_table) ||
+      !opencl_handle->AssignKernelBuffer(kernel, 2, blue_noise_buffer) ||
+      !opencl_handle->AssignKernelBuffer(kernel, 3, output) ||
+      !opencl_handle->AssignKernelArgument(kernel, 4, sizeof(cl_uint),
+                                           &image_count) ||
+      !opencl_handle->AssignKernelArgument(kernel, 5, sizeof(cl_uint),
+                                           &items) ||
+      !opencl_handle->AssignKernelArgument(kernel, 6, sizeof(cl_uint2),
+                                           &blue_noise_size)) {
+    std::cout << "ERROR BatchDither: Failed to set parameters" << std::endl;
+    opencl_handle->CleanupKernel(kernel_name);
+    return false;
+  }
+
+  const std::size_t local_size =
+      std::min(kWorkGroupSize, opencl_handle->GetWorkGroupSize(kernel_name));
+  OpenCLHandle::Event dithered;
+  OpenCLHandle::Event read;
+  if (local_size == 0 ||
+      !opencl_handle->ExecuteKernelAsync(
+          kernel, (item_count + local_size - 1) / local_size * local_size,
+          local_size, {written}, &dithered) ||
+      !opencl_handle->GetBufferRegionAsync(output, 0, output_size,
+                                           output_.data(), 0, {dithered},
+                                           &read) ||
+      !read.Wait()) {
+    std::cout << "ERROR BatchDither: Failed to dither images" << std::endl;
+    opencl_handle->CleanupKernel(kernel_name);
+    return false;
+  }
+
+  // scatter the output into an Image each, like Image's functions make them
+  for (std::size_t i = 0; i < indices.size(); ++i) {
+    const Image *image = images[indices[i]];
+    std::unique_ptr<Image> result(new Image{});
+    result->width_ = image->width_;
+    result->height_ = image->height_;
+    result->is_grayscale_ = grayscale;
+    result->is_dithered_grayscale_ = grayscale;
+    result->is_dithered_color_ = !grayscale;
+    result->data_.assign(output_.begin() + output_offsets[i],
+                         output_.begin() + output_offsets[i + 1]);
+    (*results)[indices[i]] = std::move(result);
+  }
+
+  return true;
+}
+
+const std::string &BatchDither::GetKernelName(
+    const OpenCLHandle::Ptr &opencl_handle, bool grayscale) {
+  const std::string &kernel_name = grayscale ? Image::kBatchGrayscaleKernelName
+                                             : Image::kBatchColorKernelName;
+  if (!opencl_handle || !opencl_handle->IsValid()) {
+    return Image::kEmptyString;
+  } else if (!opencl_handle->HasKernel(kernel_name)) {
+    if (!opencl_handle->CreateKernelFromSource(
+            grayscale ? Image::GetBatchGrayscaleDitheringKernel()
+                      : Image::GetBatchColorDitheringKernel(),
+            kernel_name)) {
+      std::cout << "ERROR: Failed to create " << kernel_name
+                << " OpenCL Kernel" << std::endl;
+      return Image::kEmptyString;
+    }
+  }
+
+  return kernel_name;
+}
+
+bool BatchDither::PrepareBuffer(const OpenCLHandle::Ptr &opencl_handle,
+                                const std::string &kernel_name,
+                                const std::string &buffer_name,
+                                cl_mem_flags flags, std::size_t size) {
+  // buffers of another size are swapped through the handle's buffer pool
+  if (opencl_handle->HasBuffer(kernel_name, buffer_name)) {
+    if (opencl_handle->GetBufferSize(kernel_name, buffer_name) == size) {
+      return true;
+    }
+    opencl_handle->CleanupBuffer(kernel_name, buffer_name);
+  }
+  return opencl_handle->CreateKernelBuffer(kernel_name, flags, size, nullptr,
+                                           buffer_name);
+}
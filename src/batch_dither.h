@@ -0,0 +1,109 @@
+#ifndef IGPUP_DITHERING_PROJECT_BATCH_DITHER_H_
+#define IGPUP_DITHERING_PROJECT_BATCH_DITHER_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "image.h"
+#include "opencl_handle.h"
+
+/*!
+ * \brief Helper class that dithers many small images with one OpenCL kernel
+ * launch, for icons, thumbnails, and sprites.
+ *
+ * Dithering a small Image on its own costs more in setting arguments,
+ * copying, and launching than in dithering. BatchDither packs the images
+ * into one input buffer with a table of their sizes and offsets, dithers
+ * all of them with one launch, and copies the output of all of them back at
+ * once. Images of different sizes and layouts may be mixed.
+ *
+ * Images larger than kMaxBatchedPixels, images whose DitherBackend is not
+ * DitherBackend::kAuto or DitherBackend::kOpenCL, and every image if OpenCL
+ * fails, are dithered on their own with Image's functions instead. The
+ * output is the same either way.
+ *
+ * Like OpenCLHandle, a BatchDither must only be used by one thread at a
+ * time.
+ */
+class BatchDither {
+ public:
+  BatchDither();
+
+  // disable copy
+  BatchDither(const BatchDither &other) = delete;
+  BatchDither &operator=(const BatchDither &other) = delete;
+
+  // disable move
+  BatchDither(BatchDither &&other) = delete;
+  BatchDither &operator=(BatchDither &&other) = delete;
+
+  /*!
+   * \brief Returns grayscaled and dithered versions of images, same as
+   * Image::ToGrayscaleDitheredWithBlueNoise() of each.
+   *
+   * \return The dithered images in the order of images, each empty if
+   * dithering that Image failed.
+   */
+  std::vector<std::unique_ptr<Image>> ToGrayscaleDitheredWithBlueNoise(
+      const std::vector<Image *> &images, Image *blue_noise);
+
+  /*!
+   * \brief Returns colored dithered versions of images, same as
+   * Image::ToColorDitheredWithBlueNoise() of each.
+   *
+   * \return The dithered images in the order of images, each empty if
+   * dithering that Image failed.
+   */
+  std::vector<std::unique_ptr<Image>> ToColorDitheredWithBlueNoise(
+      const std::vector<Image *> &images, Image *blue_noise);
+
+ private:
+  /// Largest number of pixels of a batched Image, larger images are
+  /// dithered on their own with pipelined strips
+  static constexpr unsigned long long kMaxBatchedPixels = 512ULL * 512ULL;
+  /// Largest input of one launch, batches are split at this size
+  static constexpr std::size_t kMaxBatchBytes = 64 * 1024 * 1024;
+  static constexpr std::size_t kWorkGroupSize = 64;
+  static const std::string kBufferInputName;
+  static const std::string kBufferImagesName;
+  static const std::string kBufferBlueNoiseName;
+  static const std::string kBufferOutputName;
+
+  /// Packed input and output of a batch, kept to reuse their memory
+  std::vector<uint8_t> input_;
+  std::vector<uint8_t> output_;
+
+  /// Dithers images, batching those that IsBatched()
+  std::vector<std::unique_ptr<Image>> Dither(const std::vector<Image *> &images,
+                                             Image *blue_noise,
+                                             bool grayscale);
+
+  /// Returns true if image is dithered in a batch
+  static bool IsBatched(const Image *image, bool grayscale);
+
+  /*!
+   * \brief Dithers the images of indices with one kernel launch into
+   * results.
+   *
+   * \return False if OpenCL failed, in which case results are not set.
+   */
+  bool DitherWithOpenCL(const std::vector<Image *> &images,
+                        const std::vector<std::size_t> &indices,
+                        Image *blue_noise, bool grayscale,
+                        std::vector<std::unique_ptr<Image>> *results);
+
+  /// Returns the name of the batch kernel, creating it on opencl_handle on
+  /// first use, or an empty string on failure
+  const std::string &GetKernelName(const OpenCLHandle::Ptr &opencl_handle,
+                                   bool grayscale);
+
+  /// Creates buffer_name of kernel_name, unless it exists with size already
+  bool PrepareBuffer(const OpenCLHandle::Ptr &opencl_handle,
+                     const std::string &kernel_name,
+                     const std::string &buffer_name, cl_mem_flags flags,
+                     std::size_t size);
+};
+
+#endif
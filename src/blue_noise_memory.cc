@@ -0,0 +1,31 @@
+#include "blue_noise_memory.h"
+
+bool ParseBlueNoiseMemory(const std::string &name,
+                          BlueNoiseMemory *memory_out) {
+  if (name == "buffer") {
+    *memory_out = BlueNoiseMemory::kBuffer;
+  } else if (name == "image") {
+    *memory_out = BlueNoiseMemory::kImage;
+  } else if (name == "local") {
+    *memory_out = BlueNoiseMemory::kLocal;
+  } else if (name == "auto") {
+    *memory_out = BlueNoiseMemory::kAuto;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+const char *BlueNoiseMemoryToString(BlueNoiseMemory memory) {
+  switch (memory) {
+    case BlueNoiseMemory::kBuffer:
+      return "buffer";
+    case BlueNoiseMemory::kImage:
+      return "image";
+    case BlueNoiseMemory::kLocal:
+      return "local";
+    case BlueNoiseMemory::kAuto:
+      return "auto";
+  }
+  return "unknown";
+}
@@ -0,0 +1,33 @@
+#ifndef IGPUP_DITHERING_PROJECT_BLUE_NOISE_MEMORY_H_
+#define IGPUP_DITHERING_PROJECT_BLUE_NOISE_MEMORY_H_
+
+#include <string>
+
+/*!
+ * \brief Selects where the OpenCL kernels read blue noise from.
+ *
+ * kBuffer expands the blue noise into per-pixel thresholds on the host (see
+ * CPUDither::GetGrayscaleThresholds()), which are copied to a global buffer
+ * for every image. kImage copies only the blue noise to an image, and the
+ * kernels sample it with a repeating sampler, so the texture hardware wraps
+ * the offsets. kLocal copies only the blue noise to a buffer, and each work
+ * group copies it into local memory before dithering.
+ *
+ * kImage needs a device with image support, and kLocal a device with enough
+ * local memory for the blue noise. Otherwise kBuffer is used. kAuto uses the
+ * fastest of the three on each device, measured by BlueNoiseTuner.
+ */
+enum class BlueNoiseMemory { kBuffer, kImage, kLocal, kAuto };
+
+/*!
+ * \brief Parses a blue noise memory name ("buffer", "image", "local", or
+ * "auto").
+ *
+ * \return True on success, in which case memory_out is set.
+ */
+bool ParseBlueNoiseMemory(const std::string &name, BlueNoiseMemory *memory_out);
+
+/// Returns the name of the given blue noise memory
+const char *BlueNoiseMemoryToString(BlueNoiseMemory memory);
+
+#endif
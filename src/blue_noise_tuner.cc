@@ -0,0 +1,113 @@
+#include "blue_noise_tuner.h"
+
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+#include "backend_tuner.h"
+#include "image.h"
+
+MeasuredCache<BlueNoiseTuner::Key, BlueNoiseMemory> BlueNoiseTuner::memories_(
+    "igpup_dithering_blue_noise", "blue noise memories",
+    &BlueNoiseTuner::ParseCacheLine, &BlueNoiseTuner::WriteCacheLine);
+
+BlueNoiseMemory BlueNoiseTuner::GetMemory(
+    unsigned int width, unsigned int height, bool grayscale, Image *blue_noise,
+    const OpenCLHandle::Ptr &opencl_handle) {
+  if (!opencl_handle || !opencl_handle->IsValid()) {
+    return BlueNoiseMemory::kBuffer;
+  }
+  const Key key(opencl_handle->GetDeviceKey(),
+                BackendTuner::GetBucket(width, height), grayscale);
+
+  // every device supports kBuffer, so it is used while another thread
+  // measures the same key
+  return memories_.Get(key, BlueNoiseMemory::kBuffer, [&]() {
+    return Measure(std::get<1>(key), grayscale, blue_noise, opencl_handle);
+  });
+}
+
+void BlueNoiseTuner::SetCacheDirectory(const std::string &directory) {
+  memories_.SetDirectory(directory);
+}
+
+BlueNoiseMemory BlueNoiseTuner::Measure(
+    unsigned int bucket, bool grayscale, Image *blue_noise,
+    const OpenCLHandle::Ptr &opencl_handle) {
+  std::unique_ptr<Image> image = BackendTuner::CreateTimingImage(bucket);
+  std::cout << "INFO: Timing OpenCL blue noise memories for "
+            << image->GetWidth() << 'x' << image->GetHeight()
+            << (grayscale ? " grayscale" : " color") << " dithering..."
+            << std::endl;
+
+  // only the memories the device can hold the blue noise in
+  std::vector<BlueNoiseMemory> candidates{BlueNoiseMemory::kBuffer};
+  if (opencl_handle->HasImageSupport()) {
+    candidates.push_back(BlueNoiseMemory::kImage);
+  }
+  if (blue_noise->GetSize() <= opencl_handle->GetDeviceLocalMemSize()) {
+    candidates.push_back(BlueNoiseMemory::kLocal);
+  }
+
+  // the image gets the same handle of this thread, so the kernels built
+  // while timing are kept for later images
+  image->SetDitherBackend(DitherBackend::kOpenCL);
+  image->opencl_device_index_ =
+      static_cast<int>(opencl_handle->GetDeviceIndex());
+
+  BlueNoiseMemory best_memory = BlueNoiseMemory::kBuffer;
+  double best_seconds = -1.0;
+  for (BlueNoiseMemory memory : candidates) {
+    image->opencl_blue_noise_memory_ = memory;
+    double seconds =
+        BackendTuner::TimeDithering(image.get(), grayscale, blue_noise);
+    if (seconds < 0.0) {
+      std::cout << "INFO:   " << BlueNoiseMemoryToString(memory) << " failed"
+                << std::endl;
+      continue;
+    }
+    std::cout << "INFO:   " << BlueNoiseMemoryToString(memory) << ": "
+              << seconds * 1000.0 << " ms" << std::endl;
+    if (best_seconds < 0.0 || seconds < best_seconds) {
+      best_seconds = seconds;
+      best_memory = memory;
+    }
+  }
+
+  std::cout << "INFO: Reading blue noise from "
+            << BlueNoiseMemoryToString(best_memory) << " memory for "
+            << BackendTuner::GetBucketName(bucket) << " images" << std::endl;
+  return best_memory;
+}
+
+bool BlueNoiseTuner::ParseCacheLine(const std::string &line, Key *key,
+                                    BlueNoiseMemory *memory) {
+  // "<device key> <bucket> <gray|color> <memory>"
+  std::istringstream iss(line);
+  std::string device_key;
+  std::string bucket_name;
+  std::string mode;
+  std::string memory_name;
+  if (!(iss >> device_key >> bucket_name >> mode >> memory_name) ||
+      !ParseBlueNoiseMemory(memory_name, memory) ||
+      *memory == BlueNoiseMemory::kAuto ||
+      (mode != "gray" && mode != "color")) {
+    return false;
+  }
+  for (unsigned int i = 0; i < BackendTuner::GetBucketCount(); ++i) {
+    if (bucket_name == BackendTuner::GetBucketName(i)) {
+      *key = Key(device_key, i, mode == "gray");
+      return true;
+    }
+  }
+  return false;
+}
+
+void BlueNoiseTuner::WriteCacheLine(std::ostream &out, const Key &key,
+                                    const BlueNoiseMemory &memory) {
+  out << std::get<0>(key) << ' '
+      << BackendTuner::GetBucketName(std::get<1>(key)) << ' '
+      << (std::get<2>(key) ? "gray" : "color") << ' '
+      << BlueNoiseMemoryToString(memory);
+}
@@ -0,0 +1,71 @@
+#ifndef IGPUP_DITHERING_PROJECT_BLUE_NOISE_TUNER_H_
+#define IGPUP_DITHERING_PROJECT_BLUE_NOISE_TUNER_H_
+
+#include <ostream>
+#include <string>
+#include <tuple>
+
+#include "blue_noise_memory.h"
+#include "measured_cache.h"
+#include "opencl_handle.h"
+
+class Image;
+
+/*!
+ * \brief Picks the fastest BlueNoiseMemory of an OpenCL device for
+ * BlueNoiseMemory::kAuto.
+ *
+ * Like BackendTuner, images are sorted into buckets by their number of
+ * pixels. The first time a bucket is dithered on a device, a synthetic image
+ * of the bucket's resolution is dithered with the kernels of every
+ * BlueNoiseMemory that the device supports, and the fastest is used from
+ * then on. Timings include expanding the thresholds of BlueNoiseMemory::kBuffer
+ * on the host, which the other kernels do without. Results are saved to a
+ * cache file per device key (see OpenCLHandle::GetDeviceKey()).
+ */
+class BlueNoiseTuner {
+ public:
+  /*!
+   * \brief Returns the fastest BlueNoiseMemory for dithering a width x
+   * height image on the device of opencl_handle.
+   *
+   * grayscale selects between timing grayscale and color dithering. The
+   * returned memory is never BlueNoiseMemory::kAuto, and is
+   * BlueNoiseMemory::kBuffer if opencl_handle is not valid.
+   *
+   * Other threads are not blocked while a bucket is measured. Those that
+   * need the same key get BlueNoiseMemory::kBuffer until it is measured.
+   */
+  static BlueNoiseMemory GetMemory(unsigned int width, unsigned int height,
+                                   bool grayscale, Image *blue_noise,
+                                   const OpenCLHandle::Ptr &opencl_handle);
+
+  /*!
+   * \brief Sets the directory that measured memories are loaded from and
+   * saved to, as "igpup_dithering_blue_noise".
+   *
+   * Defaults to GetCacheDirectory(). An empty directory disables the cache
+   * file, so memories are measured once per run.
+   */
+  static void SetCacheDirectory(const std::string &directory);
+
+ private:
+  /// Device key, bucket, and grayscale (true) or color (false)
+  typedef std::tuple<std::string, unsigned int, bool> Key;
+
+  static MeasuredCache<Key, BlueNoiseMemory> memories_;
+
+  /// Times each memory supported by the device, returns the fastest
+  static BlueNoiseMemory Measure(unsigned int bucket, bool grayscale,
+                                 Image *blue_noise,
+                                 const OpenCLHandle::Ptr &opencl_handle);
+
+  /// Reads a line of the cache file, see MeasuredCache
+  static bool ParseCacheLine(const std::string &line, Key *key,
+                             BlueNoiseMemory *memory);
+  /// Writes a line of the cache file, see MeasuredCache
+  static void WriteCacheLine(std::ostream &out, const Key &key,
+                             const BlueNoiseMemory &memory);
+};
+
+#endif
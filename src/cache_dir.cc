@@ -0,0 +1,49 @@
+#include "cache_dir.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <sstream>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+std::string GetCacheDirectory() {
+  const char *cache_dir = std::getenv("XDG_CACHE_HOME");
+  if (cache_dir != nullptr && cache_dir[0] != 0) {
+    return std::string(cache_dir);
+  }
+  const char *home_dir = std::getenv("HOME");
+  if (home_dir != nullptr && home_dir[0] != 0) {
+    return std::string(home_dir) + "/.cache";
+  }
+  return {};
+}
+
+bool CreateParentDirectories(const std::string &filename) {
+  const std::string::size_type end = filename.rfind('/');
+  if (end == std::string::npos || end == 0) {
+    // in the working or root directory
+    return true;
+  }
+
+  // each parent is created before the directories in it
+  std::string::size_type separator = 0;
+  do {
+    separator = filename.find('/', separator + 1);
+    const std::string directory = filename.substr(0, separator);
+    if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) {
+      return false;
+    }
+  } while (separator != end);
+  return true;
+}
+
+std::string GetTemporaryFilename(const std::string &filename) {
+  static std::atomic<unsigned int> temporary_count(0);
+  std::ostringstream temporary_filename;
+  temporary_filename << filename << '.' << getpid() << '.'
+                     << temporary_count.fetch_add(1) << ".tmp";
+  return temporary_filename.str();
+}
@@ -0,0 +1,32 @@
+#ifndef IGPUP_DITHERING_PROJECT_CACHE_DIR_H_
+#define IGPUP_DITHERING_PROJECT_CACHE_DIR_H_
+
+#include <string>
+
+/*!
+ * \brief Returns the directory that per-machine caches are saved in.
+ *
+ * This is $XDG_CACHE_HOME, or $HOME/.cache if XDG_CACHE_HOME is not set.
+ * Returns an empty string if neither is set.
+ */
+std::string GetCacheDirectory();
+
+/*!
+ * \brief Creates the directory that filename is in, and its parents, if they
+ * do not exist.
+ *
+ * \return False if a directory could not be created.
+ */
+bool CreateParentDirectories(const std::string &filename);
+
+/*!
+ * \brief Returns a temporary filename next to filename, to write a cache file
+ * to before renaming it to filename.
+ *
+ * Names differ by process and call, so that concurrent saves never write to
+ * the same temporary file, and other processes never read a partially
+ * written cache file.
+ */
+std::string GetTemporaryFilename(const std::string &filename);
+
+#endif
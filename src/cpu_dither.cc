@@ -0,0 +1,381 @@
+#include "cpu_dither.h"
+
+#include <cstring>
+#include <vector>
+
+#include "pixel_format.h"
+#include "thread_pool.h"
+
+namespace {
+// Selects bit (7 - i) from the i-th byte of 8 bytes loaded from memory.
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+constexpr uint64_t kPackBitsMask = 0x8040201008040201ULL;
+#else
+constexpr uint64_t kPackBitsMask = 0x0102040810204080ULL;
+#endif
+
+/// Packs width thresholded pixels of OutputFormat::DitherFormat
+template <typename OutputFormat>
+void PackRow(const uint8_t *dithered, unsigned int width, uint8_t *output);
+
+/// Packs width bytes of 0 or 255 into bits, first byte in the top bit
+template <>
+void PackRow<PixelFormat::Bilevel>(const uint8_t *dithered, unsigned int width,
+                                   uint8_t *output) {
+  unsigned int x = 0;
+  for (; x + 8 <= width; x += 8) {
+    uint64_t bytes;
+    std::memcpy(&bytes, dithered + x, sizeof(bytes));
+    // every byte keeps a different bit, so the multiply sums them into the
+    // top byte without carries
+    *output++ = ((bytes & kPackBitsMask) * 0x0101010101010101ULL) >> 56;
+  }
+  if (x < width) {
+    uint8_t last = 0;
+    for (unsigned int bit = 0; x < width; ++x, ++bit) {
+      last |= dithered[x] & (0x80 >> bit);
+    }
+    *output = last;
+  }
+}
+
+/// Packs width RGBA pixels of 0 or 255 into nibbles, first pixel high
+template <>
+void PackRow<PixelFormat::Palette16>(const uint8_t *dithered,
+                                     unsigned int width, uint8_t *output) {
+  unsigned int x = 0;
+  for (; x + 2 <= width; x += 2) {
+    const uint8_t *rgba = dithered + x * 4;
+    *output++ = (((rgba[0] & IGPUP_PROJECT_NIBBLE_RED) |
+                  (rgba[1] & IGPUP_PROJECT_NIBBLE_GREEN) |
+                  (rgba[2] & IGPUP_PROJECT_NIBBLE_BLUE))
+                 << 4) |
+                (rgba[4] & IGPUP_PROJECT_NIBBLE_RED) |
+                (rgba[5] & IGPUP_PROJECT_NIBBLE_GREEN) |
+                (rgba[6] & IGPUP_PROJECT_NIBBLE_BLUE);
+  }
+  if (x < width) {
+    const uint8_t *rgba = dithered + x * 4;
+    *output = ((rgba[0] & IGPUP_PROJECT_NIBBLE_RED) |
+               (rgba[1] & IGPUP_PROJECT_NIBBLE_GREEN) |
+               (rgba[2] & IGPUP_PROJECT_NIBBLE_BLUE))
+              << 4;
+  }
+}
+
+/// Packs width pixels from rows of 0 or 255 that are channel_size bytes apart
+template <typename OutputFormat>
+void PackPlanarRow(const uint8_t *dithered, std::size_t channel_size,
+                   unsigned int width, uint8_t *output);
+
+template <>
+void PackPlanarRow<PixelFormat::Bilevel>(const uint8_t *dithered, std::size_t,
+                                         unsigned int width, uint8_t *output) {
+  PackRow<PixelFormat::Bilevel>(dithered, width, output);
+}
+
+template <>
+void PackPlanarRow<PixelFormat::Palette16>(const uint8_t *dithered,
+                                           std::size_t channel_size,
+                                           unsigned int width,
+                                           uint8_t *output) {
+  const uint8_t *red = dithered;
+  const uint8_t *green = dithered + channel_size;
+  const uint8_t *blue = dithered + channel_size * 2;
+  unsigned int x = 0;
+  for (; x + 2 <= width; x += 2) {
+    *output++ = (((red[x] & IGPUP_PROJECT_NIBBLE_RED) |
+                  (green[x] & IGPUP_PROJECT_NIBBLE_GREEN) |
+                  (blue[x] & IGPUP_PROJECT_NIBBLE_BLUE))
+                 << 4) |
+                (red[x + 1] & IGPUP_PROJECT_NIBBLE_RED) |
+                (green[x + 1] & IGPUP_PROJECT_NIBBLE_GREEN) |
+                (blue[x + 1] & IGPUP_PROJECT_NIBBLE_BLUE);
+  }
+  if (x < width) {
+    *output = ((red[x] & IGPUP_PROJECT_NIBBLE_RED) |
+               (green[x] & IGPUP_PROJECT_NIBBLE_GREEN) |
+               (blue[x] & IGPUP_PROJECT_NIBBLE_BLUE))
+              << 4;
+  }
+}
+
+/*!
+ * \brief Thresholds one row of each dithered channel of a planar image.
+ *
+ * Bilevel dithers 1 channel, gray converted from the planes. Palette16
+ * dithers 3 channels, one plane each. dithered holds a row of input_width
+ * bytes per channel.
+ */
+template <typename OutputFormat>
+struct PlanarDitherRow;
+
+template <>
+struct PlanarDitherRow<PixelFormat::Bilevel> {
+  static constexpr unsigned int kChannels = 1;
+  static void Threshold(const uint8_t *input_row, std::size_t plane_size,
+                        const uint8_t *threshold_row, std::size_t,
+                        unsigned int input_width, uint8_t *dithered,
+                        SIMDDither::ISA isa) {
+    PixelFormat::ConvertRowFromPlanes<PixelFormat::Gray8>(
+        input_row, plane_size, input_width, dithered);
+    SIMDDither::ThresholdRow(dithered, threshold_row, dithered, input_width,
+                             isa);
+  }
+};
+
+template <>
+struct PlanarDitherRow<PixelFormat::Palette16> {
+  static constexpr unsigned int kChannels = 3;
+  static void Threshold(const uint8_t *input_row, std::size_t plane_size,
+                        const uint8_t *threshold_row,
+                        std::size_t threshold_plane_size,
+                        unsigned int input_width, uint8_t *dithered,
+                        SIMDDither::ISA isa) {
+    for (unsigned int c = 0; c < kChannels; ++c) {
+      SIMDDither::ThresholdRow(input_row + c * plane_size,
+                               threshold_row + c * threshold_plane_size,
+                               dithered + c * input_width, input_width, isa);
+    }
+  }
+};
+
+/*!
+ * \brief Returns a row of InputFormat as DitherFormat.
+ *
+ * The row is converted into buffer, unless it is already in DitherFormat.
+ */
+template <typename InputFormat, typename DitherFormat>
+struct DitherInputRow {
+  static const uint8_t *Get(const uint8_t *row, unsigned int width,
+                            uint8_t *buffer) {
+    PixelFormat::ConvertRow<InputFormat, DitherFormat>(row, width, buffer);
+    return buffer;
+  }
+};
+
+template <typename Format>
+struct DitherInputRow<Format, Format> {
+  static const uint8_t *Get(const uint8_t *row, unsigned int, uint8_t *) {
+    return row;
+  }
+};
+
+/// Wraps blue-noise coordinates, with a mask if kTileSize is not 0
+template <unsigned int kTileSize>
+struct BlueNoiseTile {
+  static_assert((kTileSize & (kTileSize - 1)) == 0,
+                "kTileSize must be a power of two");
+  static unsigned int Wrap(unsigned int i, unsigned int) {
+    return i & (kTileSize - 1);
+  }
+};
+
+/// Blue noise with a size that is only known at runtime
+template <>
+struct BlueNoiseTile<0> {
+  static unsigned int Wrap(unsigned int i, unsigned int size) {
+    return i % size;
+  }
+};
+
+/*!
+ * \brief Fills rows [y_begin, y_end) of one channel of thresholds.
+ *
+ * Thresholds of a pixel are kStride bytes apart, and are the blue noise
+ * rotated by offset_x and offset_y.
+ */
+template <unsigned int kTileSize, unsigned int kStride>
+void FillThresholds(const uint8_t *blue_noise, unsigned int blue_noise_width,
+                    unsigned int blue_noise_height, unsigned int input_width,
+                    unsigned int offset_x, unsigned int offset_y,
+                    unsigned int y_begin, unsigned int y_end,
+                    uint8_t *thresholds) {
+  typedef BlueNoiseTile<kTileSize> Tile;
+  for (unsigned int y = y_begin; y < y_end; ++y) {
+    const uint8_t *bn_row =
+        blue_noise +
+        Tile::Wrap(offset_y + y, blue_noise_height) * blue_noise_width;
+    uint8_t *row =
+        thresholds + static_cast<std::size_t>(y) * input_width * kStride;
+    for (unsigned int x = 0; x < input_width; ++x) {
+      row[x * kStride] = bn_row[Tile::Wrap(offset_x + x, blue_noise_width)];
+    }
+  }
+}
+
+/// Calls FillThresholds() with the size of the blue noise in res/ if it is
+/// one of them
+template <unsigned int kStride>
+void FillThresholdsForTile(const uint8_t *blue_noise,
+                           unsigned int blue_noise_width,
+                           unsigned int blue_noise_height,
+                           unsigned int input_width, unsigned int offset_x,
+                           unsigned int offset_y, unsigned int y_begin,
+                           unsigned int y_end, uint8_t *thresholds) {
+  auto fill_fn = FillThresholds<0, kStride>;
+  if (blue_noise_width == 64 && blue_noise_height == 64) {
+    fill_fn = FillThresholds<64, kStride>;
+  } else if (blue_noise_width == 128 && blue_noise_height == 128) {
+    fill_fn = FillThresholds<128, kStride>;
+  }
+  fill_fn(blue_noise, blue_noise_width, blue_noise_height, input_width,
+          offset_x, offset_y, y_begin, y_end, thresholds);
+}
+}  // namespace
+
+std::vector<uint8_t> CPUDither::GetGrayscaleThresholds(
+    const uint8_t *blue_noise, unsigned int blue_noise_width,
+    unsigned int blue_noise_height, unsigned int input_width,
+    unsigned int input_height, unsigned int first_row,
+    unsigned int blue_noise_offset) {
+  const unsigned int rows = GetThresholdRows(blue_noise_height, input_height);
+  const unsigned int offset_x = blue_noise_offset % blue_noise_width;
+  const unsigned int offset_y =
+      (blue_noise_offset / blue_noise_width + first_row) % blue_noise_height;
+  std::vector<uint8_t> thresholds(static_cast<std::size_t>(rows) *
+                                  input_width);
+
+  auto fill_fn = [&](unsigned int y_begin, unsigned int y_end) {
+    FillThresholdsForTile<1>(blue_noise, blue_noise_width, blue_noise_height,
+                             input_width, offset_x, offset_y, y_begin, y_end,
+                             thresholds.data());
+  };
+  ThreadPool::GetInstance().ParallelFor(0, rows, 0, fill_fn);
+
+  return thresholds;
+}
+
+std::vector<uint8_t> CPUDither::GetColorThresholds(
+    const uint8_t *blue_noise, unsigned int blue_noise_width,
+    unsigned int blue_noise_height, unsigned int input_width,
+    unsigned int input_height, unsigned int first_row,
+    const std::array<unsigned int, 3> &blue_noise_offsets) {
+  const unsigned int rows = GetThresholdRows(blue_noise_height, input_height);
+  // alpha is not dithered, so its threshold is the highest value
+  std::vector<uint8_t> thresholds(
+      static_cast<std::size_t>(rows) * input_width * 4, 255);
+
+  auto fill_fn = [&](unsigned int y_begin, unsigned int y_end) {
+    for (unsigned int c = 0; c < 3; ++c) {
+      const unsigned int offset_x = blue_noise_offsets[c] % blue_noise_width;
+      const unsigned int offset_y =
+          (blue_noise_offsets[c] / blue_noise_width + first_row) %
+          blue_noise_height;
+      FillThresholdsForTile<4>(blue_noise, blue_noise_width,
+                               blue_noise_height, input_width, offset_x,
+                               offset_y, y_begin, y_end, thresholds.data() + c);
+    }
+  };
+  ThreadPool::GetInstance().ParallelFor(0, rows, 0, fill_fn);
+
+  return thresholds;
+}
+
+std::vector<uint8_t> CPUDither::GetPlanarColorThresholds(
+    const uint8_t *blue_noise, unsigned int blue_noise_width,
+    unsigned int blue_noise_height, unsigned int input_width,
+    unsigned int input_height, unsigned int first_row,
+    const std::array<unsigned int, 3> &blue_noise_offsets) {
+  const unsigned int rows = GetThresholdRows(blue_noise_height, input_height);
+  const std::size_t plane_size = static_cast<std::size_t>(rows) * input_width;
+  std::vector<uint8_t> thresholds(plane_size * 3);
+
+  auto fill_fn = [&](unsigned int y_begin, unsigned int y_end) {
+    for (unsigned int c = 0; c < 3; ++c) {
+      const unsigned int offset_x = blue_noise_offsets[c] % blue_noise_width;
+      const unsigned int offset_y =
+          (blue_noise_offsets[c] / blue_noise_width + first_row) %
+          blue_noise_height;
+      FillThresholdsForTile<1>(blue_noise, blue_noise_width,
+                               blue_noise_height, input_width, offset_x,
+                               offset_y, y_begin, y_end,
+                               thresholds.data() + c * plane_size);
+    }
+  };
+  ThreadPool::GetInstance().ParallelFor(0, rows, 0, fill_fn);
+
+  return thresholds;
+}
+
+template <typename InputFormat, typename OutputFormat>
+void CPUDither::Dither(const uint8_t *input, const uint8_t *thresholds,
+                       unsigned int threshold_rows, uint8_t *output,
+                       unsigned int input_width, unsigned int input_height,
+                       SIMDDither::ISA isa) {
+  typedef typename OutputFormat::DitherFormat DitherFormat;
+  const unsigned int input_row_size = InputFormat::GetRowSize(input_width);
+  const unsigned int dither_row_size = DitherFormat::GetRowSize(input_width);
+  const unsigned int output_row_size = OutputFormat::GetRowSize(input_width);
+
+  auto dither_fn = [&](unsigned int y_begin, unsigned int y_end) {
+    // only one row is held at a time, and is dithered in place
+    std::vector<uint8_t> dithered_row(dither_row_size);
+    for (unsigned int y = y_begin; y < y_end; ++y) {
+      const uint8_t *row = DitherInputRow<InputFormat, DitherFormat>::Get(
+          input + static_cast<std::size_t>(y) * input_row_size, input_width,
+          dithered_row.data());
+      SIMDDither::ThresholdRow(
+          row,
+          thresholds +
+              static_cast<std::size_t>(y % threshold_rows) * dither_row_size,
+          dithered_row.data(), dither_row_size, isa);
+      PackRow<OutputFormat>(
+          dithered_row.data(), input_width,
+          output + static_cast<std::size_t>(y) * output_row_size);
+    }
+  };
+  ThreadPool::GetInstance().ParallelFor(0, input_height, 0, dither_fn);
+}
+
+template void CPUDither::Dither<PixelFormat::Gray8, PixelFormat::Bilevel>(
+    const uint8_t *input, const uint8_t *thresholds,
+    unsigned int threshold_rows, uint8_t *output, unsigned int input_width,
+    unsigned int input_height, SIMDDither::ISA isa);
+template void CPUDither::Dither<PixelFormat::RGBA32, PixelFormat::Bilevel>(
+    const uint8_t *input, const uint8_t *thresholds,
+    unsigned int threshold_rows, uint8_t *output, unsigned int input_width,
+    unsigned int input_height, SIMDDither::ISA isa);
+template void CPUDither::Dither<PixelFormat::RGBA32, PixelFormat::Palette16>(
+    const uint8_t *input, const uint8_t *thresholds,
+    unsigned int threshold_rows, uint8_t *output, unsigned int input_width,
+    unsigned int input_height, SIMDDither::ISA isa);
+
+template <typename OutputFormat>
+void CPUDither::DitherPlanar(const uint8_t *input, std::size_t plane_size,
+                             const uint8_t *thresholds,
+                             unsigned int threshold_rows, uint8_t *output,
+                             unsigned int input_width,
+                             unsigned int input_height, SIMDDither::ISA isa) {
+  typedef PlanarDitherRow<OutputFormat> DitherRow;
+  const std::size_t threshold_plane_size =
+      static_cast<std::size_t>(threshold_rows) * input_width;
+  const unsigned int output_row_size = OutputFormat::GetRowSize(input_width);
+
+  auto dither_fn = [&](unsigned int y_begin, unsigned int y_end) {
+    // one row per dithered channel is held at a time
+    std::vector<uint8_t> dithered(DitherRow::kChannels * input_width);
+    for (unsigned int y = y_begin; y < y_end; ++y) {
+      DitherRow::Threshold(input + static_cast<std::size_t>(y) * input_width,
+                           plane_size,
+                           thresholds + static_cast<std::size_t>(
+                                            y % threshold_rows) *
+                                            input_width,
+                           threshold_plane_size, input_width, dithered.data(),
+                           isa);
+      PackPlanarRow<OutputFormat>(dithered.data(), input_width, input_width,
+                                  output + static_cast<std::size_t>(y) *
+                                               output_row_size);
+    }
+  };
+  ThreadPool::GetInstance().ParallelFor(0, input_height, 0, dither_fn);
+}
+
+template void CPUDither::DitherPlanar<PixelFormat::Bilevel>(
+    const uint8_t *input, std::size_t plane_size, const uint8_t *thresholds,
+    unsigned int threshold_rows, uint8_t *output, unsigned int input_width,
+    unsigned int input_height, SIMDDither::ISA isa);
+template void CPUDither::DitherPlanar<PixelFormat::Palette16>(
+    const uint8_t *input, std::size_t plane_size, const uint8_t *thresholds,
+    unsigned int threshold_rows, uint8_t *output, unsigned int input_width,
+    unsigned int input_height, SIMDDither::ISA isa);
@@ -0,0 +1,147 @@
+#ifndef IGPUP_DITHERING_PROJECT_CPU_DITHER_H_
+#define IGPUP_DITHERING_PROJECT_CPU_DITHER_H_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "simd_dither.h"
+
+// Fixed-point luminance weights for 0.2126, 0.7152, and 0.0722 (values taken
+// from Wikipedia article about conversion of color to grayscale). They sum to
+// 1 << IGPUP_PROJECT_GRAY_WEIGHT_SHIFT so that white stays white. These are
+// macros so that the same values can be pasted into OpenCL kernel source.
+#define IGPUP_PROJECT_GRAY_WEIGHT_RED 13933
+#define IGPUP_PROJECT_GRAY_WEIGHT_GREEN 46871
+#define IGPUP_PROJECT_GRAY_WEIGHT_BLUE 4732
+#define IGPUP_PROJECT_GRAY_WEIGHT_SHIFT 16
+
+// Bits of a dithered color pixel packed into 4 bits. The layout matches
+// AV_PIX_FMT_RGB4 ((msb)1R 2G 1B(lsb)), and each value is also an index into
+// the 16 color PNG palette.
+#define IGPUP_PROJECT_NIBBLE_RED 8
+#define IGPUP_PROJECT_NIBBLE_GREEN 6
+#define IGPUP_PROJECT_NIBBLE_BLUE 1
+
+#define IGPUP_PROJECT_STR_(x) #x
+#define IGPUP_PROJECT_XSTR_(x) IGPUP_PROJECT_STR_(x)
+
+/*!
+ * \brief Dithers images on the host with multiple threads.
+ *
+ * The image is split into bands of rows that are processed by the shared
+ * ThreadPool.
+ * Output is identical to the output of the GrayscaleDither and ColorDither
+ * OpenCL kernels, so this can be used in place of OpenCL.
+ *
+ * Blue noise is first expanded into per-pixel thresholds with
+ * GetGrayscaleThresholds() or GetColorThresholds(), which are shared with the
+ * OpenCL kernels. Each row is then dithered with SIMDDither using the given
+ * ISA. ISA::kScalar is the reference implementation.
+ *
+ * Output is packed: grayscale is 1 bit per pixel (PixelFormat::Bilevel),
+ * color is 4 bits per pixel (PixelFormat::Palette16). Each row starts on a
+ * byte boundary.
+ */
+class CPUDither {
+ public:
+  /*!
+   * \brief Returns the blue-noise threshold of every pixel of a grayscale
+   * image.
+   *
+   * The blue noise is rotated by blue_noise_offset (same as BN_INDEX() in the
+   * old kernels) and repeated to input_width bytes per row. Image row y uses
+   * row y % GetThresholdRows() of the result, so dithering needs no per-pixel
+   * index math.
+   *
+   * first_row is the row of the whole image that input row 0 is at, which is
+   * not 0 when an image is dithered in strips.
+   */
+  static std::vector<uint8_t> GetGrayscaleThresholds(
+      const uint8_t *blue_noise, unsigned int blue_noise_width,
+      unsigned int blue_noise_height, unsigned int input_width,
+      unsigned int input_height, unsigned int first_row,
+      unsigned int blue_noise_offset);
+
+  /*!
+   * \brief Returns the blue-noise thresholds of every pixel of a RGBA image.
+   *
+   * Same as GetGrayscaleThresholds(), but with 4 bytes per pixel. The red,
+   * green, and blue thresholds are rotated by their respective
+   * blue_noise_offsets. The alpha threshold is 255.
+   */
+  static std::vector<uint8_t> GetColorThresholds(
+      const uint8_t *blue_noise, unsigned int blue_noise_width,
+      unsigned int blue_noise_height, unsigned int input_width,
+      unsigned int input_height, unsigned int first_row,
+      const std::array<unsigned int, 3> &blue_noise_offsets);
+
+  /*!
+   * \brief Returns the blue-noise thresholds of every pixel of a planar
+   * image.
+   *
+   * Same as GetColorThresholds(), but as 3 planes of red, green, and blue
+   * thresholds, each GetThresholdRows() * input_width bytes. There is no
+   * alpha plane, since alpha is not dithered.
+   */
+  static std::vector<uint8_t> GetPlanarColorThresholds(
+      const uint8_t *blue_noise, unsigned int blue_noise_width,
+      unsigned int blue_noise_height, unsigned int input_width,
+      unsigned int input_height, unsigned int first_row,
+      const std::array<unsigned int, 3> &blue_noise_offsets);
+
+  /// Returns the number of rows of thresholds for an image
+  static unsigned int GetThresholdRows(unsigned int blue_noise_height,
+                                       unsigned int input_height) {
+    return blue_noise_height < input_height ? blue_noise_height : input_height;
+  }
+
+  /*!
+   * \brief Dithers an image of InputFormat into OutputFormat.
+   *
+   * InputFormat and OutputFormat are PixelFormat layouts. This is instantiated
+   * for the layouts Image dithers, which are:
+   *  - Gray8 into Bilevel, with thresholds from GetGrayscaleThresholds().
+   *  - RGBA32 into Bilevel, with thresholds from GetGrayscaleThresholds(). Each
+   *    row is converted with ColorToGray() while dithering, so there is no
+   *    full-size intermediate grayscale image.
+   *  - RGBA32 into Palette16, with thresholds from GetColorThresholds(). The
+   *    red, green, and blue channels are stored as IGPUP_PROJECT_NIBBLE_* bits
+   *    and the alpha channel is dropped.
+   */
+  template <typename InputFormat, typename OutputFormat>
+  static void Dither(const uint8_t *input, const uint8_t *thresholds,
+                     unsigned int threshold_rows, uint8_t *output,
+                     unsigned int input_width, unsigned int input_height,
+                     SIMDDither::ISA isa);
+
+  /*!
+   * \brief Dithers a PixelFormat::PlanarRGB image into OutputFormat.
+   *
+   * The red, green, and blue planes are plane_size bytes apart. This is
+   * instantiated for:
+   *  - Bilevel, with thresholds from GetGrayscaleThresholds(). Rows of the 3
+   *    planes are converted with ColorToGray() while dithering.
+   *  - Palette16, with thresholds from GetPlanarColorThresholds(). Each
+   *    channel is thresholded as its own contiguous row before the channels
+   *    are packed into IGPUP_PROJECT_NIBBLE_* bits.
+   */
+  template <typename OutputFormat>
+  static void DitherPlanar(const uint8_t *input, std::size_t plane_size,
+                           const uint8_t *thresholds,
+                           unsigned int threshold_rows, uint8_t *output,
+                           unsigned int input_width, unsigned int input_height,
+                           SIMDDither::ISA isa);
+
+  /// Converts rgb to gray with fixed-point luminance weights
+  static uint8_t ColorToGray(uint8_t red, uint8_t green, uint8_t blue) {
+    return (IGPUP_PROJECT_GRAY_WEIGHT_RED * static_cast<unsigned int>(red) +
+            IGPUP_PROJECT_GRAY_WEIGHT_GREEN * static_cast<unsigned int>(green) +
+            IGPUP_PROJECT_GRAY_WEIGHT_BLUE * static_cast<unsigned int>(blue) +
+            (1u << (IGPUP_PROJECT_GRAY_WEIGHT_SHIFT - 1))) >>
+           IGPUP_PROJECT_GRAY_WEIGHT_SHIFT;
+  }
+};
+
+#endif
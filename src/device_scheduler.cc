@@ -0,0 +1,111 @@
+#include "device_scheduler.h"
+
+constexpr unsigned int DeviceScheduler::kMinStripRows;
+constexpr double DeviceScheduler::kSmoothing;
+
+std::mutex DeviceScheduler::mutex_;
+std::vector<double> DeviceScheduler::pixels_per_second_;
+std::vector<unsigned int> DeviceScheduler::strip_counts_;
+
+std::vector<unsigned int> DeviceScheduler::SplitRows(
+    unsigned int rows, const std::vector<std::size_t> &devices) {
+  const std::size_t device_count = devices.size();
+  std::vector<unsigned int> device_rows(device_count, 0);
+  if (device_count == 0) {
+    return device_rows;
+  }
+
+  std::vector<double> weights(device_count, 0.0);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    double measured_sum = 0.0;
+    std::size_t measured_count = 0;
+    for (std::size_t i = 0; i < device_count; ++i) {
+      if (devices[i] < pixels_per_second_.size() &&
+          pixels_per_second_[devices[i]] > 0.0) {
+        weights[i] = pixels_per_second_[devices[i]];
+        measured_sum += weights[i];
+        ++measured_count;
+      }
+    }
+    const double default_weight =
+        measured_count > 0 ? measured_sum / measured_count : 1.0;
+    for (double &weight : weights) {
+      if (weight <= 0.0) {
+        weight = default_weight;
+      }
+    }
+  }
+
+  // drop the slowest device until every remaining device gets enough rows
+  std::vector<bool> is_used(device_count, true);
+  std::size_t used_count = device_count;
+  while (true) {
+    double total_weight = 0.0;
+    for (std::size_t i = 0; i < device_count; ++i) {
+      if (is_used[i]) {
+        total_weight += weights[i];
+      }
+    }
+
+    std::size_t slowest = device_count;
+    for (std::size_t i = 0; i < device_count; ++i) {
+      if (!is_used[i]) {
+        continue;
+      }
+      device_rows[i] =
+          static_cast<unsigned int>(rows * (weights[i] / total_weight));
+      if (device_rows[i] < kMinStripRows &&
+          (slowest == device_count || weights[i] < weights[slowest])) {
+        slowest = i;
+      }
+    }
+
+    if (slowest == device_count || used_count == 1) {
+      break;
+    }
+    is_used[slowest] = false;
+    device_rows[slowest] = 0;
+    --used_count;
+  }
+
+  // rows lost to rounding go to the fastest device
+  unsigned int assigned_rows = 0;
+  std::size_t fastest = device_count;
+  for (std::size_t i = 0; i < device_count; ++i) {
+    assigned_rows += device_rows[i];
+    if (is_used[i] &&
+        (fastest == device_count || weights[i] > weights[fastest])) {
+      fastest = i;
+    }
+  }
+  device_rows[fastest] += rows - assigned_rows;
+
+  return device_rows;
+}
+
+void DeviceScheduler::AddMeasurement(std::size_t device,
+                                     unsigned long long pixels,
+                                     double seconds) {
+  if (pixels == 0 || seconds <= 0.0) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (pixels_per_second_.size() <= device) {
+    pixels_per_second_.resize(device + 1, 0.0);
+    strip_counts_.resize(device + 1, 0);
+  }
+
+  // the first strip of a device includes building its kernels, so it says
+  // little about its throughput
+  if (strip_counts_[device]++ == 0) {
+    return;
+  }
+
+  const double pixels_per_second = pixels / seconds;
+  double &smoothed = pixels_per_second_[device];
+  smoothed = smoothed <= 0.0 ? pixels_per_second
+                             : smoothed * (1.0 - kSmoothing) +
+                                   pixels_per_second * kSmoothing;
+}
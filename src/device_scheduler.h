@@ -0,0 +1,46 @@
+#ifndef IGPUP_DITHERING_PROJECT_DEVICE_SCHEDULER_H_
+#define IGPUP_DITHERING_PROJECT_DEVICE_SCHEDULER_H_
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+/*!
+ * \brief Splits the rows of images between OpenCL devices by their measured
+ * throughput.
+ *
+ * Every device gets a share of rows that is proportional to the pixels per
+ * second it dithered so far, so a fast GPU and a slower CPU runtime finish
+ * their strips at about the same time. Devices that were not measured yet get
+ * the average share.
+ */
+class DeviceScheduler {
+ public:
+  /*!
+   * \brief Returns the number of rows that each of devices dithers, in the
+   * order of devices.
+   *
+   * devices are indices of OpenCLContext::GetHandle(). The rows sum up to
+   * rows. Devices that would get fewer than kMinStripRows rows get none, so
+   * small images use fewer devices.
+   */
+  static std::vector<unsigned int> SplitRows(
+      unsigned int rows, const std::vector<std::size_t> &devices);
+
+  /// Records that device dithered pixels in seconds
+  static void AddMeasurement(std::size_t device, unsigned long long pixels,
+                             double seconds);
+
+ private:
+  static constexpr unsigned int kMinStripRows = 32;
+  /// Weight of a new measurement against the previous ones
+  static constexpr double kSmoothing = 0.25;
+
+  static std::mutex mutex_;
+  /// Smoothed pixels per second of each device, 0 if not measured yet
+  static std::vector<double> pixels_per_second_;
+  /// Number of strips each device dithered
+  static std::vector<unsigned int> strip_counts_;
+};
+
+#endif
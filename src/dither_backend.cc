@@ -0,0 +1,30 @@
+#include "dither_backend.h"
+
+bool ParseDitherBackend(const std::string &name, DitherBackend *backend_out) {
+  if (name == "auto") {
+    *backend_out = DitherBackend::kAuto;
+  } else if (name == "opencl") {
+    *backend_out = DitherBackend::kOpenCL;
+  } else if (name == "cpu") {
+    *backend_out = DitherBackend::kCPU;
+  } else if (name == "simd") {
+    *backend_out = DitherBackend::kSIMD;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+const char *DitherBackendToString(DitherBackend backend) {
+  switch (backend) {
+    case DitherBackend::kAuto:
+      return "auto";
+    case DitherBackend::kOpenCL:
+      return "opencl";
+    case DitherBackend::kCPU:
+      return "cpu";
+    case DitherBackend::kSIMD:
+      return "simd";
+  }
+  return "unknown";
+}
@@ -0,0 +1,26 @@
+#ifndef IGPUP_DITHERING_PROJECT_DITHER_BACKEND_H_
+#define IGPUP_DITHERING_PROJECT_DITHER_BACKEND_H_
+
+#include <string>
+
+/*!
+ * \brief Selects where dithering work is run.
+ *
+ * kAuto uses the backend that BackendTuner measured to be the fastest for the
+ * size of the image, and falls back to the CPU (with SIMD) if OpenCL fails.
+ * kCPU dithers with plain scalar loops on multiple threads, kSIMD
+ * additionally uses the widest vector instructions supported by the CPU.
+ */
+enum class DitherBackend { kAuto, kOpenCL, kCPU, kSIMD };
+
+/*!
+ * \brief Parses a backend name ("auto", "opencl", "cpu", or "simd").
+ *
+ * \return True on success, in which case backend_out is set.
+ */
+bool ParseDitherBackend(const std::string &name, DitherBackend *backend_out);
+
+/// Returns the name of the given backend
+const char *DitherBackendToString(DitherBackend backend);
+
+#endif
@@ -1,70 +1,299 @@
 #include "image.h"
 
+#include <algorithm>
 #include <array>
-#include <cassert>
+#include <atomic>
+#include <chrono>
 #include <cmath>
 #include <cstdio>
+#include <cstring>
 #include <ctime>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <mutex>
+
+#include "backend_tuner.h"
+#include "blue_noise_tuner.h"
+#include "cpu_dither.h"
+#include "device_scheduler.h"
+#include "pixel_format.h"
+#include "thread_pool.h"
+#include "work_group_tuner.h"
 
 #define IGPUP_PROJECT_GRAYSCALE_KERNEL_NAME_ "GrayscaleDither"
 #define IGPUP_PROJECT_COLOR_KERNEL_NAME_ "ColorDither"
+#define IGPUP_PROJECT_GRAYSCALE_FROM_COLOR_KERNEL_NAME_ \
+  "GrayscaleFromColorDither"
+
+// OpenCL helper of the kernels with color input, loads the red, green, and
+// blue channels of 8 pixels at row. RGBA is loaded with two 16 byte loads and
+// split into channels with swizzles, dropping alpha, planes with one 8 byte
+// load per channel.
+#define IGPUP_PROJECT_LOAD_RGB8_                                      \
+  "void LoadRGB8(__global const unsigned char *row,\n"                \
+  "              const unsigned int pixel_step,\n"                    \
+  "              const unsigned int channel_step,\n"                  \
+  "              uchar8 *red, uchar8 *green, uchar8 *blue) {\n"       \
+  "if (pixel_step == 4) {\n"                                          \
+  "  uchar16 low = vload16(0, row);\n"                                \
+  "  uchar16 high = vload16(1, row);\n"                               \
+  "  *red = (uchar8)(low.s048c, high.s048c);\n"                       \
+  "  *green = (uchar8)(low.s159d, high.s159d);\n"                     \
+  "  *blue = (uchar8)(low.s26ae, high.s26ae);\n"                      \
+  "} else {\n"                                                        \
+  "  *red = vload8(0, row);\n"                                        \
+  "  *green = vload8(0, row + channel_step);\n"                       \
+  "  *blue = vload8(0, row + channel_step * 2);\n"                    \
+  "}\n"                                                               \
+  "}\n"
+
+// OpenCL helper of the kernels that read blue noise from an image, loads the
+// thresholds of count pixels of a row. The sampler repeats the blue noise, so
+// the offsets need no wrapping.
+#define IGPUP_PROJECT_LOAD_THRESHOLDS_IMAGE_                               \
+  "__constant sampler_t kBlueNoiseSampler = CLK_NORMALIZED_COORDS_TRUE |\n" \
+  "  CLK_ADDRESS_REPEAT | CLK_FILTER_NEAREST;\n"                           \
+  "void LoadThresholds(read_only image2d_t blue_noise, const uint2 size,\n" \
+  "                    const uint2 offset, const unsigned int x,\n"        \
+  "                    const unsigned int y, const unsigned int count,\n"  \
+  "                    unsigned char *thresholds) {\n"                     \
+  "const float v = (y + offset.y + 0.5f) / size.y;\n"                      \
+  "for (unsigned int i = 0; i < count; ++i) {\n"                           \
+  "  const float u = (x + offset.x + i + 0.5f) / size.x;\n"                \
+  "  thresholds[i] =\n"                                                    \
+  "    read_imageui(blue_noise, kBlueNoiseSampler, (float2)(u, v)).x;\n"   \
+  "}\n"                                                                    \
+  "}\n"
+
+// Same as IGPUP_PROJECT_LOAD_THRESHOLDS_IMAGE_, but from blue noise in
+// address_space memory. The offsets are wrapped once per call, then the
+// column wraps by comparing.
+#define IGPUP_PROJECT_LOAD_THRESHOLDS_TILE_(address_space)            \
+  "void LoadThresholds(" address_space                                \
+  " const unsigned char *blue_noise,\n"                               \
+  "                    const uint2 size, const uint2 offset,\n"       \
+  "                    const unsigned int x, const unsigned int y,\n" \
+  "                    const unsigned int count,\n"                   \
+  "                    unsigned char *thresholds) {\n"                \
+  address_space " const unsigned char *row =\n"                       \
+  "  blue_noise + (y + offset.y) % size.y * size.x;\n"                \
+  "unsigned int column = (x + offset.x) % size.x;\n"                  \
+  "for (unsigned int i = 0; i < count; ++i) {\n"                      \
+  "  thresholds[i] = row[column];\n"                                  \
+  "  if (++column == size.x) {\n"                                     \
+  "    column = 0;\n"                                                 \
+  "  }\n"                                                             \
+  "}\n"                                                               \
+  "}\n"
+
+// OpenCL statements that dither the 16 pixels at input_row + x against the
+// 16 thresholds at the thresholds pointer, and store the two output bytes.
+// Each bit is selected in one lane only, so or-ing neighbouring lanes
+// together leaves the bytes.
+#define IGPUP_PROJECT_DITHER_GRAY16_(thresholds)                             \
+  "  uchar16 bits = select((uchar16)(0),\n"                                  \
+  "    (uchar16)(0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,\n"          \
+  "              0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01),\n"         \
+  "    vload16(0, input_row + x) > vload16(0, " thresholds "));\n"           \
+  "  uchar8 pairs = bits.even | bits.odd;\n"                                 \
+  "  uchar4 quads = pairs.even | pairs.odd;\n"                               \
+  "  vstore2(quads.even | quads.odd, idx, output_row);\n"
+
+// OpenCL statements that dither the 8 pixels in the red, green, and blue
+// vectors against the red_thresholds, green_thresholds, and blue_thresholds
+// vectors, and store the four output bytes
+#define IGPUP_PROJECT_DITHER_COLOR8_                                     \
+  "  uchar8 nibbles =\n"                                                 \
+  "    select((uchar8)(0), (uchar8)(" IGPUP_PROJECT_XSTR_(               \
+      IGPUP_PROJECT_NIBBLE_RED) "),\n"                                   \
+  "      red > red_thresholds)\n"                                        \
+  "    | select((uchar8)(0), (uchar8)(" IGPUP_PROJECT_XSTR_(             \
+      IGPUP_PROJECT_NIBBLE_GREEN) "),\n"                                 \
+  "      green > green_thresholds)\n"                                    \
+  "    | select((uchar8)(0), (uchar8)(" IGPUP_PROJECT_XSTR_(             \
+      IGPUP_PROJECT_NIBBLE_BLUE) "),\n"                                  \
+  "      blue > blue_thresholds);\n"                                     \
+  "  vstore4((nibbles.even << (uchar4)(4)) | nibbles.odd, idx,\n"        \
+  "    output_row);\n"
+
+// OpenCL statements that convert the 8 pixels in the red, green, and blue
+// vectors to gray with the same fixed-point weights as
+// CPUDither::ColorToGray(), dither them against the 8 thresholds at the
+// thresholds pointer, and store the output byte
+#define IGPUP_PROJECT_DITHER_GRAY8_(thresholds)                           \
+  "  uint8 gray = (" IGPUP_PROJECT_XSTR_(                                 \
+      IGPUP_PROJECT_GRAY_WEIGHT_RED) "u * convert_uint8(red)\n"           \
+  "    + " IGPUP_PROJECT_XSTR_(                                           \
+      IGPUP_PROJECT_GRAY_WEIGHT_GREEN) "u * convert_uint8(green)\n"       \
+  "    + " IGPUP_PROJECT_XSTR_(                                           \
+      IGPUP_PROJECT_GRAY_WEIGHT_BLUE) "u * convert_uint8(blue)\n"         \
+  "    + (1u << (" IGPUP_PROJECT_XSTR_(                                   \
+      IGPUP_PROJECT_GRAY_WEIGHT_SHIFT) " - 1)))\n"                        \
+  "    >> (uint8)(" IGPUP_PROJECT_XSTR_(                                  \
+      IGPUP_PROJECT_GRAY_WEIGHT_SHIFT) ");\n"                             \
+  "  uchar8 bits = select((uchar8)(0),\n"                                 \
+  "    (uchar8)(0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01),\n"       \
+  "    convert_char8(gray > convert_uint8(vload8(0, " thresholds "))));\n" \
+  "  uchar4 pairs = bits.even | bits.odd;\n"                              \
+  "  uchar2 quads = pairs.even | pairs.odd;\n"                            \
+  "  output_row[idx] = quads.even | quads.odd;\n"
+
+// OpenCL expression of the gray value of the pixel at the rgb pointer, same
+// as IGPUP_PROJECT_DITHER_GRAY8_ for one pixel
+#define IGPUP_PROJECT_GRAY_OF_RGB_                              \
+  "(" IGPUP_PROJECT_XSTR_(                                      \
+      IGPUP_PROJECT_GRAY_WEIGHT_RED) "u * rgb[0]\n"             \
+  "    + " IGPUP_PROJECT_XSTR_(                                 \
+      IGPUP_PROJECT_GRAY_WEIGHT_GREEN) "u * rgb[input_channel_step]\n" \
+  "    + " IGPUP_PROJECT_XSTR_(                                 \
+      IGPUP_PROJECT_GRAY_WEIGHT_BLUE) "u * rgb[input_channel_step * 2]\n" \
+  "    + (1u << (" IGPUP_PROJECT_XSTR_(                         \
+      IGPUP_PROJECT_GRAY_WEIGHT_SHIFT) " - 1))) >> " IGPUP_PROJECT_XSTR_( \
+      IGPUP_PROJECT_GRAY_WEIGHT_SHIFT)
+
+// OpenCL statements of the kernels that read the blue noise tile, that
+// dither the count pixels of work item idx at input_row + x * pixel_step
+// against the 8 thresholds of each channel in the thresholds array, and store
+// the four output bytes at output_row
+#define IGPUP_PROJECT_DITHER_COLOR_ITEM_                                  \
+  "if (count == 8) {\n"                                                   \
+  "  uchar8 red, green, blue;\n"                                          \
+  "  LoadRGB8(input_row + x * pixel_step, pixel_step,\n"                  \
+  "    input_channel_step, &red, &green, &blue);\n"                       \
+  "  uchar8 red_thresholds = vload8(0, thresholds[0]);\n"                 \
+  "  uchar8 green_thresholds = vload8(0, thresholds[1]);\n"               \
+  "  uchar8 blue_thresholds = vload8(0, thresholds[2]);\n"                \
+  IGPUP_PROJECT_DITHER_COLOR8_                                            \
+  "  return;\n"                                                           \
+  "}\n"                                                                   \
+  "const unsigned char bits[3] = {" IGPUP_PROJECT_XSTR_(                  \
+      IGPUP_PROJECT_NIBBLE_RED) ", " IGPUP_PROJECT_XSTR_(                 \
+      IGPUP_PROJECT_NIBBLE_GREEN) ", " IGPUP_PROJECT_XSTR_(               \
+      IGPUP_PROJECT_NIBBLE_BLUE) "};\n"                                   \
+  "unsigned char packed[4] = {0, 0, 0, 0};\n"                             \
+  "for (unsigned int i = 0; i < count; ++i) {\n"                          \
+  "  unsigned int pixel = (x + i) * pixel_step;\n"                        \
+  "  for (unsigned int c = 0; c < 3; ++c) {\n"                            \
+  "    if (input_row[pixel + c * input_channel_step] >\n"                 \
+  "        thresholds[c][i]) {\n"                                         \
+  "      packed[i / 2] |= bits[c] << (4 - i % 2 * 4);\n"                  \
+  "    }\n"                                                               \
+  "  }\n"                                                                 \
+  "}\n"                                                                   \
+  "for (unsigned int i = 0; i * 2 < count; ++i) {\n"                      \
+  "  output_row[idx * 4 + i] = packed[i];\n"                              \
+  "}\n"
+
+// Same as IGPUP_PROJECT_DITHER_COLOR_ITEM_, but converts the pixels to gray
+// and dithers them against the 8 thresholds of the thresholds array into one
+// output byte
+#define IGPUP_PROJECT_DITHER_GRAY_FROM_COLOR_ITEM_                        \
+  "if (count == 8) {\n"                                                   \
+  "  uchar8 red, green, blue;\n"                                          \
+  "  LoadRGB8(input_row + x * pixel_step, pixel_step,\n"                  \
+  "    input_channel_step, &red, &green, &blue);\n"                       \
+  IGPUP_PROJECT_DITHER_GRAY8_("thresholds")                               \
+  "  return;\n"                                                           \
+  "}\n"                                                                   \
+  "unsigned char packed = 0;\n"                                           \
+  "for (unsigned int i = 0; i < count; ++i) {\n"                          \
+  "  __global const unsigned char *rgb =\n"                               \
+  "    input_row + (x + i) * pixel_step;\n"                               \
+  "  if (" IGPUP_PROJECT_GRAY_OF_RGB_ " > thresholds[i]) {\n"             \
+  "    packed |= 0x80 >> i;\n"                                            \
+  "  }\n"                                                                 \
+  "}\n"                                                                   \
+  "output_row[idx] = packed;\n"
 
 const char *Image::kOpenCLGrayscaleKernel = nullptr;
 const char *Image::kOpenCLColorKernel = nullptr;
+const char *Image::kOpenCLGrayscaleFromColorKernel = nullptr;
 
 const std::string Image::kBufferInputName = "DitherBufferInput";
 const std::string Image::kBufferOutputName = "DitherBufferOutput";
+const std::string Image::kBufferThresholdsName = "DitherBufferThresholds";
 const std::string Image::kBufferBlueNoiseName = "DitherBufferBlueNoise";
-const std::string Image::kBufferBlueNoiseOffsetsName =
-    "DitherBufferBlueNoiseOffsets";
 
-const std::string Image::kGrayscaleKernelName =
-    IGPUP_PROJECT_GRAYSCALE_KERNEL_NAME_;
-const std::string Image::kColorKernelName = IGPUP_PROJECT_COLOR_KERNEL_NAME_;
+// indexed by BlueNoiseMemory
+const std::array<std::string, 3> Image::kGrayscaleKernelNames = {
+    IGPUP_PROJECT_GRAYSCALE_KERNEL_NAME_,
+    IGPUP_PROJECT_GRAYSCALE_KERNEL_NAME_ "Image",
+    IGPUP_PROJECT_GRAYSCALE_KERNEL_NAME_ "Local"};
+const std::array<std::string, 3> Image::kColorKernelNames = {
+    IGPUP_PROJECT_COLOR_KERNEL_NAME_, IGPUP_PROJECT_COLOR_KERNEL_NAME_ "Image",
+    IGPUP_PROJECT_COLOR_KERNEL_NAME_ "Local"};
+const std::array<std::string, 3> Image::kGrayscaleFromColorKernelNames = {
+    IGPUP_PROJECT_GRAYSCALE_FROM_COLOR_KERNEL_NAME_,
+    IGPUP_PROJECT_GRAYSCALE_FROM_COLOR_KERNEL_NAME_ "Image",
+    IGPUP_PROJECT_GRAYSCALE_FROM_COLOR_KERNEL_NAME_ "Local"};
+const std::string Image::kBatchGrayscaleKernelName = "BatchGrayscaleDither";
+const std::string Image::kBatchColorKernelName = "BatchColorDither";
 const std::string Image::kEmptyString = {};
 
+BlueNoiseMemory Image::blue_noise_memory_ = BlueNoiseMemory::kAuto;
+
 const std::array<png_color, 2> Image::kDitherBWPalette = {
     png_color{0, 0, 0},       // black
     png_color{255, 255, 255}  // white
 };
 
-const std::array<png_color, 8> Image::kDitherColorPalette = {
+// indexed by the IGPUP_PROJECT_NIBBLE_* bits, entries with only one of the
+// two green bits set are never used by dithering
+const std::array<png_color, 16> Image::kDitherColorPalette = {
     png_color{0, 0, 0},        // black
-    png_color{255, 255, 255},  // white
-    png_color{255, 0, 0},      // red
-    png_color{0, 255, 0},      // green
     png_color{0, 0, 255},      // blue
-    png_color{255, 255, 0},    // yellow
-    png_color{255, 0, 255},    // magenta
+    png_color{0, 85, 0},       // unused
+    png_color{0, 85, 255},     // unused
+    png_color{0, 170, 0},      // unused
+    png_color{0, 170, 255},    // unused
+    png_color{0, 255, 0},      // green
     png_color{0, 255, 255},    // cyan
+    png_color{255, 0, 0},      // red
+    png_color{255, 0, 255},    // magenta
+    png_color{255, 85, 0},     // unused
+    png_color{255, 85, 255},   // unused
+    png_color{255, 170, 0},    // unused
+    png_color{255, 170, 255},  // unused
+    png_color{255, 255, 0},    // yellow
+    png_color{255, 255, 255},  // white
 };
 
 Image::Image()
-    : blue_noise_offsets_{0, 0, 0},
+    : opencl_device_index_(-1),
+      opencl_blue_noise_memory_(BlueNoiseMemory::kAuto),
+      blue_noise_offsets_{0, 0, 0},
       data_(),
       width_(0),
       height_(0),
+      row_offset_(0),
+      plane_count_(0),
       is_grayscale_(true),
       is_dithered_grayscale_(false),
       is_dithered_color_(false),
-      is_preserving_blue_noise_offsets_(true) {
+      is_preserving_blue_noise_offsets_(true),
+      dither_backend_(DitherBackend::kAuto) {
   std::srand(std::time(nullptr));
   GenerateBlueNoiseOffsets();
 }
 
-Image::Image(const char *filename) : Image(std::string(filename)) {}
+Image::Image(const char *filename, bool planar)
+    : Image(std::string(filename), planar) {}
 
-Image::Image(const std::string &filename)
-    : blue_noise_offsets_{0, 0, 0},
+Image::Image(const std::string &filename, bool planar)
+    : opencl_device_index_(-1),
+      opencl_blue_noise_memory_(BlueNoiseMemory::kAuto),
+      blue_noise_offsets_{0, 0, 0},
       data_(),
       width_(0),
       height_(0),
+      row_offset_(0),
+      plane_count_(0),
       is_grayscale_(true),
       is_dithered_grayscale_(false),
       is_dithered_color_(false),
-      is_preserving_blue_noise_offsets_(true) {
+      is_preserving_blue_noise_offsets_(true),
+      dither_backend_(DitherBackend::kAuto) {
   if (filename.empty()) {
     std::cout << "ERROR: Image got empty filename string" << std::endl;
     return;
@@ -73,7 +302,7 @@ Image::Image(const std::string &filename)
     // filename expected to be .png
     std::cout << "INFO: PNG filename extension detected, decoding..."
               << std::endl;
-    DecodePNG(filename);
+    DecodePNG(filename, planar);
   } else if (filename.compare(filename.size() - 4, filename.size(), ".pgm") ==
              0) {
     // filename expected to be .pgm
@@ -85,7 +314,7 @@ Image::Image(const std::string &filename)
     // filename expected to be .ppm
     std::cout << "INFO: PPM filename extension detected, decoding..."
               << std::endl;
-    DecodePPM(filename);
+    DecodePPM(filename, planar);
   } else {
     // unknown filename extension
     std::cout << "ERROR: Unknown filename extension" << std::endl;
@@ -97,21 +326,32 @@ Image::Image(const std::string &filename)
 }
 
 bool Image::IsValid() const {
-  if (!data_.empty() && width_ > 0 && height_ > 0) {
-    if (is_grayscale_ && data_.size() == width_ * height_) {
-      return true;
-    } else if (!is_grayscale_ && data_.size() == 4 * width_ * height_) {
-      return true;
-    }
+  if (IsPlanar()) {
+    return width_ > 0 && height_ > 0 &&
+           data_.size() == plane_count_ * GetPlaneSize();
   }
-  return false;
+  return !data_.empty() && width_ > 0 && height_ > 0 &&
+         data_.size() == GetRowSize() * height_;
 }
 
 uint8_t *Image::GetData() { return data_.data(); }
 
 const uint8_t *Image::GetData() const { return data_.data(); }
 
-unsigned int Image::GetSize() const { return data_.size(); }
+std::size_t Image::GetSize() const { return data_.size(); }
+
+unsigned int Image::GetRowSize() const {
+  if (is_dithered_grayscale_) {
+    return PixelFormat::Bilevel::GetRowSize(width_);
+  } else if (is_dithered_color_) {
+    return PixelFormat::Palette16::GetRowSize(width_);
+  } else if (is_grayscale_) {
+    return width_;
+  } else if (IsPlanar()) {
+    return PixelFormat::PlanarRGB::GetRowSize(width_);
+  }
+  return width_ * 4;
+}
 
 unsigned int Image::GetWidth() const { return width_; }
 
@@ -119,6 +359,19 @@ unsigned int Image::GetHeight() const { return height_; }
 
 bool Image::IsGrayscale() const { return is_grayscale_; }
 
+bool Image::IsPlanar() const { return plane_count_ != 0; }
+
+unsigned int Image::GetPlaneCount() const { return plane_count_; }
+
+std::size_t Image::GetPlaneSize() const {
+  return IsPlanar() ? PixelFormat::PlanarRGB::GetPlaneSize(width_, height_)
+                    : 0;
+}
+
+bool Image::IsDithered() const {
+  return is_dithered_grayscale_ || is_dithered_color_;
+}
+
 bool Image::SaveAsPNG(const std::string &filename, bool overwrite) {
   if (!overwrite) {
     std::ifstream ifs(filename);
@@ -187,6 +440,10 @@ bool Image::SaveAsPNG(const std::string &filename, bool overwrite) {
                    PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
       png_set_PLTE(png_ptr, png_info_ptr, kDitherColorPalette.data(),
                    kDitherColorPalette.size());
+    } else if (IsPlanar() && plane_count_ == 3) {
+      png_set_IHDR(png_ptr, png_info_ptr, width_, height_, 8,
+                   PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+                   PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
     } else {
       png_set_IHDR(png_ptr, png_info_ptr, width_, height_, 8,
                    PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE,
@@ -197,81 +454,29 @@ bool Image::SaveAsPNG(const std::string &filename, bool overwrite) {
   // write png info
   png_write_info(png_ptr, png_info_ptr);
 
-  // write rows of image data
-  if (is_dithered_grayscale_) {
-    // using 1-bit palette in 1-bit color depth
-    std::vector<unsigned char> row;
-    unsigned char temp;
-    unsigned int bidx;
-    for (unsigned int y = 0; y < height_; ++y) {
-      row.clear();
-      temp = 0;
-      bidx = 0;
-      for (unsigned int x = 0; x < width_; ++x) {
-        if (data_.at(x + y * width_) != 0) {
-          temp |= 0x80 >> bidx;
-        }
-        ++bidx;
-        if (bidx >= 8) {
-          row.push_back(temp);
-          temp = 0;
-          bidx = 0;
-        }
-      }
-      row.push_back(temp);
-      png_write_row(png_ptr, row.data());
-    }
-  } else if (is_dithered_color_) {
-    // using 3-bit palette in 4-bit color depth
-    std::vector<unsigned char> row;
-    unsigned char temp;
-    unsigned int bidx;
-    unsigned char red, green, blue;
+  // write rows of image data, dithered data is already packed in the 1-bit or
+  // 4-bit palette format
+  const unsigned int row_size = GetRowSize();
+  if (IsPlanar() && !IsDithered()) {
+    // planes are interleaved again one row at a time
+    const std::size_t plane_size = GetPlaneSize();
+    std::vector<uint8_t> row(plane_count_ * width_);
     for (unsigned int y = 0; y < height_; ++y) {
-      row.clear();
-      temp = 0;
-      bidx = 0;
-      for (unsigned int x = 0; x < width_; ++x) {
-        red = data_.at(x * 4 + y * 4 * width_);
-        green = data_.at(x * 4 + y * 4 * width_ + 1);
-        blue = data_.at(x * 4 + y * 4 * width_ + 2);
-        if (red == 0 && green == 0 && blue == 0) {
-          // noop
-        } else if (red != 0 && green != 0 && blue != 0) {
-          temp |= 0x10 >> (bidx * 4);
-        } else if (red != 0 && green == 0 && blue == 0) {
-          temp |= 0x20 >> (bidx * 4);
-        } else if (red == 0 && green != 0 && blue == 0) {
-          temp |= 0x30 >> (bidx * 4);
-        } else if (red == 0 && green == 0 && blue != 0) {
-          temp |= 0x40 >> (bidx * 4);
-        } else if (red != 0 && green != 0 && blue == 0) {
-          temp |= 0x50 >> (bidx * 4);
-        } else if (red != 0 && green == 0 && blue != 0) {
-          temp |= 0x60 >> (bidx * 4);
-        } else if (red == 0 && green != 0 && blue != 0) {
-          temp |= 0x70 >> (bidx * 4);
-        } else {
-          assert(!"Unreachable");
-        }
-        ++bidx;
-        if (bidx >= 2) {
-          bidx = 0;
-          row.push_back(temp);
-          temp = 0;
-        }
+      if (plane_count_ == 3) {
+        PixelFormat::ConvertRowFromPlanes<PixelFormat::RGB24>(
+            data_.data() + static_cast<std::size_t>(y) * row_size, plane_size,
+            width_, row.data());
+      } else {
+        PixelFormat::ConvertRowFromPlanes<PixelFormat::RGBA32>(
+            data_.data() + static_cast<std::size_t>(y) * row_size, plane_size,
+            width_, row.data());
       }
-      row.push_back(temp);
       png_write_row(png_ptr, row.data());
     }
   } else {
-    // using full 8-bit per-channel colors
     for (unsigned int y = 0; y < height_; ++y) {
-      if (is_grayscale_) {
-        png_write_row(png_ptr, &data_.at(y * width_));
-      } else {
-        png_write_row(png_ptr, &data_.at(y * width_ * 4));
-      }
+      png_write_row(png_ptr,
+                    &data_.at(static_cast<std::size_t>(y) * row_size));
     }
   }
 
@@ -305,41 +510,66 @@ bool Image::SaveAsPPM(const std::string &filename, bool overwrite,
     }
   }
 
+  // the layout of the image is picked once for all rows
+  std::function<void(const uint8_t *, unsigned int, uint8_t *)> to_rgb_fn;
+  if (is_dithered_grayscale_) {
+    to_rgb_fn =
+        PixelFormat::ConvertRow<PixelFormat::Bilevel, PixelFormat::RGB24>;
+  } else if (is_dithered_color_) {
+    to_rgb_fn =
+        PixelFormat::ConvertRow<PixelFormat::Palette16, PixelFormat::RGB24>;
+  } else if (is_grayscale_) {
+    to_rgb_fn = PixelFormat::ConvertRow<PixelFormat::Gray8, PixelFormat::RGB24>;
+  } else if (IsPlanar()) {
+    // alpha plane is ignored
+    const std::size_t plane_size = GetPlaneSize();
+    to_rgb_fn = [plane_size](const uint8_t *input, unsigned int width,
+                             uint8_t *output) {
+      PixelFormat::ConvertRowFromPlanes<PixelFormat::RGB24>(input, plane_size,
+                                                            width, output);
+    };
+  } else {
+    // alpha is ignored
+    to_rgb_fn =
+        PixelFormat::ConvertRow<PixelFormat::RGBA32, PixelFormat::RGB24>;
+  }
+
   std::ofstream ofs(filename);
   if (packed) {
     ofs << "P6\n" << width_ << ' ' << height_ << "\n255\n";
-    for (unsigned int j = 0; j < height_; ++j) {
-      for (unsigned int i = 0; i < width_; ++i) {
-        if (is_grayscale_) {
-          for (unsigned int c = 0; c < 3; ++c) {
-            ofs.put(data_.at(i + j * width_));
-          }
-        } else {
-          // data is stored as rgba, but ppm is rgb
-          for (unsigned int c = 0; c < 3; ++c) {
-            ofs.put(data_.at(c + i * 4 + j * width_ * 4));
-          }
-        }
-      }
-    }
   } else {
     ofs << "P3\n" << width_ << ' ' << height_ << "\n255\n";
-    for (unsigned int j = 0; j < height_; ++j) {
-      for (unsigned int i = 0; i < width_; ++i) {
-        if (is_grayscale_) {
-          int value = data_.at(i + j * width_);
-          for (unsigned int c = 0; c < 3; ++c) {
-            ofs << value << ' ';
-          }
+  }
+
+  // rows are converted (and formatted as text) in parallel, a batch at a time
+  // so that only a batch of converted rows is held in memory
+  const unsigned int row_size = GetRowSize();
+  const unsigned int rgb_row_size = PixelFormat::RGB24::GetRowSize(width_);
+  std::vector<std::string> batch(kPPMRowsPerBatch);
+  for (unsigned int y = 0; y < height_; y += kPPMRowsPerBatch) {
+    const unsigned int batch_rows =
+        height_ - y < kPPMRowsPerBatch ? height_ - y : kPPMRowsPerBatch;
+    auto convert_fn = [&](unsigned int row_begin, unsigned int row_end) {
+      std::vector<uint8_t> rgb_row(rgb_row_size);
+      for (unsigned int row = row_begin; row < row_end; ++row) {
+        to_rgb_fn(data_.data() + static_cast<std::size_t>(y + row) * row_size,
+                  width_, rgb_row.data());
+        std::string &out = batch[row];
+        if (packed) {
+          out.assign(rgb_row.begin(), rgb_row.end());
         } else {
-          // data is stored as rgba, but ppm is rgb
-          for (unsigned int c = 0; c < 3; ++c) {
-            int value = data_.at(c + i * 4 + j * width_ * 4);
-            ofs << value << ' ';
+          out.clear();
+          for (uint8_t value : rgb_row) {
+            out += std::to_string(value);
+            out += ' ';
           }
+          out += '\n';
         }
       }
-      ofs << '\n';
+    };
+    ThreadPool::GetInstance().ParallelFor(0, batch_rows, 0, convert_fn);
+    for (unsigned int row = 0; row < batch_rows; ++row) {
+      ofs.write(batch[row].data(), batch[row].size());
     }
   }
 
@@ -351,28 +581,41 @@ bool Image::SaveAsPPM(const char *filename, bool overwrite, bool packed) {
 }
 
 uint8_t Image::ColorToGray(uint8_t red, uint8_t green, uint8_t blue) {
-  // values taken from Wikipedia article about conversion of color to grayscale
-  double y_linear = 0.2126 * (red / 255.0) + 0.7152 * (green / 255.0) +
-                    0.0722 * (blue / 255.0);
-
-  return std::round(y_linear * 255.0);
+  return CPUDither::ColorToGray(red, green, blue);
 }
 
 std::unique_ptr<Image> Image::ToGrayscale() const {
-  if (IsGrayscale()) {
+  if (is_dithered_color_) {
+    std::cout << "ERROR ToGrayscale: Image is already dithered" << std::endl;
+    return {};
+  } else if (IsGrayscale()) {
     return std::unique_ptr<Image>(new Image(*this));
   }
 
   std::unique_ptr<Image> grayscale_image = std::unique_ptr<Image>(new Image{});
   grayscale_image->width_ = this->width_;
   grayscale_image->height_ = this->height_;
-  grayscale_image->data_.resize(width_ * height_);
-
-  for (unsigned int i = 0; i < width_ * height_; ++i) {
-    grayscale_image->data_.at(i) =
-        ColorToGray(this->data_.at(i * 4), this->data_.at(i * 4 + 1),
-                    this->data_.at(i * 4 + 2));
-  }
+  grayscale_image->data_.resize(static_cast<std::size_t>(width_) * height_);
+
+  const uint8_t *input = data_.data();
+  uint8_t *gray = grayscale_image->data_.data();
+  const std::size_t plane_size = GetPlaneSize();
+  const unsigned int row_size = GetRowSize();
+  auto convert_fn = [&](unsigned int y_begin, unsigned int y_end) {
+    // rows are contiguous, so the band is converted as one row
+    if (IsPlanar()) {
+      PixelFormat::ConvertRowFromPlanes<PixelFormat::Gray8>(
+          input + static_cast<std::size_t>(y_begin) * row_size, plane_size,
+          (y_end - y_begin) * width_,
+          gray + static_cast<std::size_t>(y_begin) * width_);
+    } else {
+      PixelFormat::ConvertRow<PixelFormat::RGBA32, PixelFormat::Gray8>(
+          input + static_cast<std::size_t>(y_begin) * row_size,
+          (y_end - y_begin) * width_,
+          gray + static_cast<std::size_t>(y_begin) * width_);
+    }
+  };
+  ThreadPool::GetInstance().ParallelFor(0, height_, 0, convert_fn);
 
   return grayscale_image;
 }
@@ -384,96 +627,204 @@ std::unique_ptr<Image> Image::ToGrayscaleDitheredWithBlueNoise(
         << "ERROR ToGrayscaleDitheredWithBlueNoise: blue_noise is not grayscale"
         << std::endl;
     return {};
+  } else if (IsDithered()) {
+    std::cout
+        << "ERROR ToGrayscaleDitheredWithBlueNoise: Image is already dithered"
+        << std::endl;
+    return {};
+  }
+
+  // Color input is converted to grayscale while dithering, so there is no
+  // intermediate grayscale Image.
+  std::unique_ptr<Image> grayscale_image = std::unique_ptr<Image>(new Image{});
+  grayscale_image->width_ = width_;
+  grayscale_image->height_ = height_;
+  grayscale_image->data_.resize(PixelFormat::Bilevel::GetRowSize(width_) *
+                                height_);
+  grayscale_image->is_dithered_grayscale_ = true;
+
+  if (!is_preserving_blue_noise_offsets_) {
+    GenerateBlueNoiseOffsets();
   }
 
-  auto grayscale_image = ToGrayscale();
-  if (!grayscale_image) {
-    std::cout << "ERROR ToGrayscaleDitheredWithBlueNoise: Failed to get "
-                 "grayscale Image"
+  const DitherBackend backend = ResolveDitherBackend(true, blue_noise);
+  if (IsUsingOpenCL(backend)) {
+    const bool is_dithered =
+        DitherWithOpenCL(grayscale_image.get(), blue_noise, true);
+    if (is_dithered) {
+      return grayscale_image;
+    } else if (dither_backend_ == DitherBackend::kOpenCL) {
+      return {};
+    }
+    std::cout << "WARNING ToGrayscaleDitheredWithBlueNoise: OpenCL dithering "
+                 "failed, falling back to CPU dithering"
               << std::endl;
-    return {};
   }
-  grayscale_image->is_dithered_grayscale_ = true;
-  auto opencl_handle = GetOpenCLHandle();
+
+  const unsigned int threshold_rows =
+      CPUDither::GetThresholdRows(blue_noise->height_, height_);
+  const std::vector<uint8_t> thresholds =
+      GetGrayscaleThresholds(*blue_noise, 0, height_);
+  if (is_grayscale_) {
+    CPUDither::Dither<PixelFormat::Gray8, PixelFormat::Bilevel>(
+        data_.data(), thresholds.data(), threshold_rows,
+        grayscale_image->data_.data(), width_, height_, GetSIMDISA(backend));
+  } else if (IsPlanar()) {
+    CPUDither::DitherPlanar<PixelFormat::Bilevel>(
+        data_.data(), GetPlaneSize(), thresholds.data(), threshold_rows,
+        grayscale_image->data_.data(), width_, height_, GetSIMDISA(backend));
+  } else {
+    CPUDither::Dither<PixelFormat::RGBA32, PixelFormat::Bilevel>(
+        data_.data(), thresholds.data(), threshold_rows,
+        grayscale_image->data_.data(), width_, height_, GetSIMDISA(backend));
+  }
+
+  return grayscale_image;
+}
+
+bool Image::DitherGrayscaleWithOpenCL(Image *grayscale_image,
+                                      Image *blue_noise, OpenCLRows *rows) {
+  const OpenCLHandle::Ptr &opencl_handle = rows->handle;
   if (!opencl_handle) {
     std::cout
         << "ERROR ToGrayscaleDitheredWithBlueNoise: Failed to get OpenCLHandle"
         << std::endl;
-    return {};
+    return false;
   }
 
+  // color input is converted to grayscale by the kernel while dithering
+  const BlueNoiseMemory memory =
+      GetOpenCLBlueNoiseMemory(*rows, blue_noise, true);
+  const std::string &kernel_name = GetKernelName(
+      is_grayscale_ ? kGrayscaleKernelNames : kGrayscaleFromColorKernelNames,
+      memory);
+
+  // blue noise rotated by the offset, computed once instead of per pixel,
+  // unless the kernel reads the blue noise itself
+  std::vector<uint8_t> thresholds;
+  unsigned int threshold_rows = 0;
+  if (memory == BlueNoiseMemory::kBuffer) {
+    threshold_rows =
+        CPUDither::GetThresholdRows(blue_noise->height_, rows->count);
+    thresholds =
+        GetGrayscaleThresholds(*blue_noise, rows->first_row, rows->count);
+  }
+
+  // on devices that work on host memory, the input and output buffers use
+  // the data of the images instead of copies, and are created per image
+  const bool is_zero_copy = IsOpenCLZeroCopyUsable(*rows, *grayscale_image);
+  const std::size_t input_size = GetOpenCLInputSize(*rows);
+  const std::size_t output_size =
+      static_cast<std::size_t>(rows->count) * grayscale_image->GetRowSize();
+
   // first check if existing kernel/buffers can be used
-  if (opencl_handle->HasKernel(kGrayscaleKernelName) &&
-      !VerifyOpenCLBuffers(
-          kGrayscaleKernelName,
-          {kBufferInputName, kBufferOutputName, kBufferBlueNoiseName},
-          grayscale_image.get(), blue_noise)) {
-    opencl_handle->CleanupKernel(kGrayscaleKernelName);
+  std::vector<std::string> buffer_names;
+  if (!is_zero_copy) {
+    buffer_names = {kBufferInputName, kBufferOutputName};
+  }
+  if (memory == BlueNoiseMemory::kBuffer) {
+    buffer_names.push_back(kBufferThresholdsName);
+  }
+  if (opencl_handle->HasKernel(kernel_name) &&
+      !VerifyOpenCLBuffers(opencl_handle, kernel_name, buffer_names,
+                           input_size, output_size, thresholds.size())) {
+    // only the buffers depend on the size of the Image, so the kernel is kept
+    CleanupOpenCLBuffers(opencl_handle, kernel_name);
   }
 
   // set up kernel and buffers
-  const std::string &grayscale_kernel_name = GetGrayscaleKernelName();
+  const std::string &grayscale_kernel_name =
+      is_grayscale_
+          ? GetGrayscaleKernelName(opencl_handle, memory, *blue_noise)
+          : GetGrayscaleFromColorKernelName(opencl_handle, memory,
+                                            *blue_noise);
   if (grayscale_kernel_name.empty() ||
       !opencl_handle->HasKernel(grayscale_kernel_name)) {
     std::cout << "ERROR ToGrayscaleDitheredWithBlueNoise: Failed to init kernel"
               << std::endl;
-    return {};
+    return false;
   }
 
-  if (!opencl_handle->HasBuffer(grayscale_kernel_name, kBufferInputName)) {
+  if (is_zero_copy) {
+    if (!CreateZeroCopyOpenCLBuffers(opencl_handle, grayscale_kernel_name,
+                                     grayscale_image)) {
+      std::cout << "ERROR ToGrayscaleDitheredWithBlueNoise: Failed to alloc "
+                   "input and output buffers"
+                << std::endl;
+      opencl_handle->CleanupKernel(grayscale_kernel_name);
+      return false;
+    }
+  } else if (!opencl_handle->HasBuffer(grayscale_kernel_name,
+                                       kBufferInputName)) {
     if (!opencl_handle->CreateKernelBuffer(
-            grayscale_kernel_name, CL_MEM_READ_ONLY,
-            grayscale_image->data_.size(), nullptr, kBufferInputName)) {
+            grayscale_kernel_name, CL_MEM_READ_ONLY, input_size, nullptr,
+            kBufferInputName)) {
       std::cout << "ERROR ToGrayscaleDitheredWithBlueNoise: Failed to alloc "
                    "input buffer"
                 << std::endl;
       opencl_handle->CleanupKernel(grayscale_kernel_name);
-      return {};
+      return false;
     }
   }
 
-  if (!opencl_handle->SetKernelBufferData(
-          grayscale_kernel_name, kBufferInputName,
-          grayscale_image->data_.size(), grayscale_image->data_.data())) {
-    std::cout << "ERROR ToGrayscaleDitheredWithBlueNoise: Failed to init "
-                 "input buffer"
-              << std::endl;
-    opencl_handle->CleanupKernel(grayscale_kernel_name);
-    return {};
-  }
-
   if (!opencl_handle->HasBuffer(grayscale_kernel_name, kBufferOutputName)) {
     if (!opencl_handle->CreateKernelBuffer(
-            grayscale_kernel_name, CL_MEM_WRITE_ONLY,
-            grayscale_image->data_.size(), nullptr, kBufferOutputName)) {
+            grayscale_kernel_name, CL_MEM_WRITE_ONLY, output_size, nullptr,
+            kBufferOutputName)) {
       std::cout << "ERROR ToGrayscaleDitheredWithBlueNoise: Failed to set "
                    "output buffer"
                 << std::endl;
       opencl_handle->CleanupKernel(grayscale_kernel_name);
-      return {};
+      return false;
     }
   }
 
-  if (!opencl_handle->HasBuffer(grayscale_kernel_name, kBufferBlueNoiseName)) {
-    if (!opencl_handle->CreateKernelBuffer(
-            grayscale_kernel_name, CL_MEM_READ_ONLY, blue_noise->data_.size(),
-            nullptr, kBufferBlueNoiseName)) {
-      std::cout << "ERROR ToGrayscaleDitheredWithBlueNoise: Failed to alloc "
-                   "blue-noise buffer"
+  // the blue noise, or the thresholds expanded from it, at parameters 1 and 5
+  OpenCLHandle::Event thresholds_written;
+  if (memory != BlueNoiseMemory::kBuffer) {
+    if (!SetOpenCLBlueNoise(*rows, grayscale_kernel_name, memory, *blue_noise,
+                            1, is_grayscale_ ? 6 : 8, &thresholds_written)) {
+      opencl_handle->CleanupKernel(grayscale_kernel_name);
+      return false;
+    }
+  } else {
+    if (!opencl_handle->HasBuffer(grayscale_kernel_name,
+                                  kBufferThresholdsName)) {
+      if (!opencl_handle->CreateKernelBuffer(
+              grayscale_kernel_name, CL_MEM_READ_ONLY, thresholds.size(),
+              nullptr, kBufferThresholdsName)) {
+        std::cout << "ERROR ToGrayscaleDitheredWithBlueNoise: Failed to alloc "
+                     "thresholds buffer"
+                  << std::endl;
+        opencl_handle->CleanupKernel(grayscale_kernel_name);
+        return false;
+      }
+    }
+    if (!opencl_handle->SetKernelBufferDataAsync(
+            grayscale_kernel_name, kBufferThresholdsName, thresholds.size(),
+            thresholds.data(), {}, &thresholds_written)) {
+      std::cout << "ERROR ToGrayscaleDitheredWithBlueNoise: Failed to init "
+                   "thresholds buffer"
                 << std::endl;
       opencl_handle->CleanupKernel(grayscale_kernel_name);
-      return {};
+      return false;
+    }
+    if (!opencl_handle->AssignKernelBuffer(grayscale_kernel_name, 1,
+                                           kBufferThresholdsName)) {
+      std::cout
+          << "ERROR ToGrayscaleDitheredWithBlueNoise: Failed to set parameter 1"
+          << std::endl;
+      opencl_handle->CleanupKernel(grayscale_kernel_name);
+      return false;
+    }
+    if (!opencl_handle->AssignKernelArgument(
+            grayscale_kernel_name, 5, sizeof(unsigned int), &threshold_rows)) {
+      std::cout
+          << "ERROR ToGrayscaleDitheredWithBlueNoise: Failed to set parameter 5"
+          << std::endl;
+      opencl_handle->CleanupKernel(grayscale_kernel_name);
+      return false;
     }
-  }
-
-  if (!opencl_handle->SetKernelBufferData(
-          grayscale_kernel_name, kBufferBlueNoiseName, blue_noise->data_.size(),
-          blue_noise->data_.data())) {
-    std::cout << "ERROR ToGrayscaleDitheredWithBlueNoise: Failed to init "
-                 "blue-noise buffer"
-              << std::endl;
-    opencl_handle->CleanupKernel(grayscale_kernel_name);
-    return {};
   }
 
   // assign buffers/data to kernel parameters
@@ -483,15 +834,7 @@ std::unique_ptr<Image> Image::ToGrayscaleDitheredWithBlueNoise(
         << "ERROR ToGrayscaleDitheredWithBlueNoise: Failed to set parameter 0"
         << std::endl;
     opencl_handle->CleanupKernel(grayscale_kernel_name);
-    return {};
-  }
-  if (!opencl_handle->AssignKernelBuffer(grayscale_kernel_name, 1,
-                                         kBufferBlueNoiseName)) {
-    std::cout
-        << "ERROR ToGrayscaleDitheredWithBlueNoise: Failed to set parameter 1"
-        << std::endl;
-    opencl_handle->CleanupKernel(grayscale_kernel_name);
-    return {};
+    return false;
   }
   if (!opencl_handle->AssignKernelBuffer(grayscale_kernel_name, 2,
                                          kBufferOutputName)) {
@@ -499,7 +842,7 @@ std::unique_ptr<Image> Image::ToGrayscaleDitheredWithBlueNoise(
         << "ERROR ToGrayscaleDitheredWithBlueNoise: Failed to set parameter 2"
         << std::endl;
     opencl_handle->CleanupKernel(grayscale_kernel_name);
-    return {};
+    return false;
   }
   unsigned int width = grayscale_image->GetWidth();
   if (!opencl_handle->AssignKernelArgument(grayscale_kernel_name, 3,
@@ -508,89 +851,92 @@ std::unique_ptr<Image> Image::ToGrayscaleDitheredWithBlueNoise(
         << "ERROR ToGrayscaleDitheredWithBlueNoise: Failed to set parameter 3"
         << std::endl;
     opencl_handle->CleanupKernel(grayscale_kernel_name);
-    return {};
+    return false;
   }
-  unsigned int height = grayscale_image->GetHeight();
+  unsigned int height = rows->count;
   if (!opencl_handle->AssignKernelArgument(grayscale_kernel_name, 4,
                                            sizeof(unsigned int), &height)) {
     std::cout
         << "ERROR ToGrayscaleDitheredWithBlueNoise: Failed to set parameter 4"
         << std::endl;
     opencl_handle->CleanupKernel(grayscale_kernel_name);
-    return {};
-  }
-  unsigned int blue_noise_width = blue_noise->GetWidth();
-  if (!opencl_handle->AssignKernelArgument(
-          grayscale_kernel_name, 5, sizeof(unsigned int), &blue_noise_width)) {
-    std::cout
-        << "ERROR ToGrayscaleDitheredWithBlueNoise: Failed to set parameter 5"
-        << std::endl;
-    opencl_handle->CleanupKernel(grayscale_kernel_name);
-    return {};
-  }
-  unsigned int blue_noise_height = blue_noise->GetHeight();
-  if (!opencl_handle->AssignKernelArgument(
-          grayscale_kernel_name, 6, sizeof(unsigned int), &blue_noise_height)) {
-    std::cout
-        << "ERROR ToGrayscaleDitheredWithBlueNoise: Failed to set parameter 6"
-        << std::endl;
-    opencl_handle->CleanupKernel(grayscale_kernel_name);
-    return {};
-  }
-
-  if (!is_preserving_blue_noise_offsets_) {
-    GenerateBlueNoiseOffsets();
-  }
-  if (!opencl_handle->AssignKernelArgument(grayscale_kernel_name, 7,
-                                           sizeof(unsigned int),
-                                           &blue_noise_offsets_.at(0))) {
-    std::cout
-        << "ERROR ToGrayscaleDitheredWithBlueNoise: Failed to set parameter 7"
-        << std::endl;
-    opencl_handle->CleanupKernel(grayscale_kernel_name);
-    return {};
-  }
-
-  auto work_group_size = opencl_handle->GetWorkGroupSize(grayscale_kernel_name);
-  // DEBUG
-  // std::cout << "Got work_group_size == " << work_group_size << std::endl;
-
-  std::size_t work_group_size_0 = std::sqrt(work_group_size);
-  std::size_t work_group_size_1 = work_group_size_0;
-
-  while (work_group_size_0 > 1 && width % work_group_size_0 != 0) {
-    --work_group_size_0;
+    return false;
   }
-  while (work_group_size_1 > 1 && height % work_group_size_1 != 0) {
-    --work_group_size_1;
+  if (!is_grayscale_) {
+    // steps between pixels and between channels, of RGBA or of planes
+    unsigned int pixel_step = IsPlanar() ? 1 : 4;
+    unsigned int channel_step =
+        IsPlanar() ? GetOpenCLInputPlaneSize(*rows) : 1;
+    if (!opencl_handle->AssignKernelArgument(
+            grayscale_kernel_name, 6, sizeof(unsigned int), &pixel_step)) {
+      std::cout
+          << "ERROR ToGrayscaleDitheredWithBlueNoise: Failed to set parameter 6"
+          << std::endl;
+      opencl_handle->CleanupKernel(grayscale_kernel_name);
+      return false;
+    }
+    if (!opencl_handle->AssignKernelArgument(
+            grayscale_kernel_name, 7, sizeof(unsigned int), &channel_step)) {
+      std::cout
+          << "ERROR ToGrayscaleDitheredWithBlueNoise: Failed to set parameter 7"
+          << std::endl;
+      opencl_handle->CleanupKernel(grayscale_kernel_name);
+      return false;
+    }
   }
 
-  // DEBUG
-  // std::cout << "Using WIDTHxHEIGHT: " << width << "x" << height
-  //          << " with work_group_sizes: " << work_group_size_0 << "x"
-  //          << work_group_size_1 << std::endl;
-
-  if (!opencl_handle->ExecuteKernel2D(grayscale_kernel_name, width, height,
-                                      work_group_size_0, work_group_size_1,
-                                      true)) {
-    std::cout
-        << "ERROR ToGrayscaleDitheredWithBlueNoise: Failed to execute Kernel"
-        << std::endl;
-    opencl_handle->CleanupKernel(grayscale_kernel_name);
-    return {};
+  // each work item dithers a vector of pixels, the last of a row fewer
+  const unsigned int pixels_per_item = is_grayscale_
+                                           ? kOpenCLGrayscalePixelsPerItem
+                                           : kOpenCLColorPixelsPerItem;
+  const unsigned int row_items = (width + pixels_per_item - 1) /
+                                 pixels_per_item;
+  bool is_input_written = is_zero_copy;
+  const WorkGroupShape shape =
+      GetOpenCLWorkGroupShape(*rows, grayscale_kernel_name, row_items,
+                              thresholds_written, &is_input_written);
+
+  if (is_zero_copy) {
+    // the kernel works on the data of the images, so there are no copies to
+    // overlap with
+    const auto start = std::chrono::steady_clock::now();
+    OpenCLHandle::Event dithered;
+    if (!opencl_handle->ExecuteKernel2DAsync(
+            grayscale_kernel_name,
+            WorkGroupShape::PadGlobalSize(row_items, shape.size_0),
+            WorkGroupShape::PadGlobalSize(height, shape.size_1), shape.size_0,
+            shape.size_1, {thresholds_written}, &dithered)) {
+      std::cout
+          << "ERROR ToGrayscaleDitheredWithBlueNoise: Failed to execute Kernel"
+          << std::endl;
+      opencl_handle->CleanupKernel(grayscale_kernel_name);
+      return false;
+    }
+    if (!ReadZeroCopyOpenCLOutput(opencl_handle, grayscale_kernel_name,
+                                  dithered)) {
+      std::cout << "ERROR ToGrayscaleDitheredWithBlueNoise: Failed to map "
+                   "output buffer"
+                << std::endl;
+      opencl_handle->CleanupKernel(grayscale_kernel_name);
+      return false;
+    }
+    rows->seconds = std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+    return true;
   }
 
-  if (!opencl_handle->GetBufferData(grayscale_kernel_name, kBufferOutputName,
-                                    grayscale_image->GetSize(),
-                                    grayscale_image->data_.data())) {
-    std::cout << "ERROR ToGrayscaleDitheredWithBlueNoise: Failed to get output "
-                 "buffer data"
+  if (!DitherOpenCLStrips(rows, grayscale_kernel_name, grayscale_image,
+                          row_items, shape, thresholds_written,
+                          is_input_written)) {
+    std::cout << "ERROR ToGrayscaleDitheredWithBlueNoise: Failed to dither "
+                 "with OpenCL"
               << std::endl;
     opencl_handle->CleanupKernel(grayscale_kernel_name);
-    return {};
+    return false;
   }
 
-  return grayscale_image;
+  return true;
 }
 
 std::unique_ptr<Image> Image::ToColorDitheredWithBlueNoise(Image *blue_noise) {
@@ -606,121 +952,203 @@ std::unique_ptr<Image> Image::ToColorDitheredWithBlueNoise(Image *blue_noise) {
                  "non-grayscale"
               << std::endl;
     return {};
+  } else if (IsDithered()) {
+    std::cout << "ERROR ToColorDitheredWithBlueNoise: Image is already dithered"
+              << std::endl;
+    return {};
   }
 
-  auto opencl_handle = GetOpenCLHandle();
+  if (!is_preserving_blue_noise_offsets_) {
+    GenerateBlueNoiseOffsets();
+  }
+
+  std::unique_ptr<Image> result_image = std::unique_ptr<Image>(new Image{});
+  result_image->width_ = width_;
+  result_image->height_ = height_;
+  result_image->is_grayscale_ = false;
+  result_image->is_dithered_color_ = true;
+  result_image->data_.resize(PixelFormat::Palette16::GetRowSize(width_) *
+                             height_);
+
+  const DitherBackend backend = ResolveDitherBackend(false, blue_noise);
+  if (IsUsingOpenCL(backend)) {
+    const bool is_dithered =
+        DitherWithOpenCL(result_image.get(), blue_noise, false);
+    if (is_dithered) {
+      return result_image;
+    } else if (dither_backend_ == DitherBackend::kOpenCL) {
+      return {};
+    }
+    std::cout << "WARNING ToColorDitheredWithBlueNoise: OpenCL dithering "
+                 "failed, falling back to CPU dithering"
+              << std::endl;
+  }
+
+  const unsigned int threshold_rows =
+      CPUDither::GetThresholdRows(blue_noise->height_, height_);
+  const std::vector<uint8_t> thresholds =
+      GetColorThresholds(*blue_noise, 0, height_);
+  if (IsPlanar()) {
+    CPUDither::DitherPlanar<PixelFormat::Palette16>(
+        data_.data(), GetPlaneSize(), thresholds.data(), threshold_rows,
+        result_image->data_.data(), width_, height_, GetSIMDISA(backend));
+  } else {
+    CPUDither::Dither<PixelFormat::RGBA32, PixelFormat::Palette16>(
+        data_.data(), thresholds.data(), threshold_rows,
+        result_image->data_.data(), width_, height_, GetSIMDISA(backend));
+  }
+
+  return result_image;
+}
+
+bool Image::DitherColorWithOpenCL(Image *result_image, Image *blue_noise,
+                                  OpenCLRows *rows) {
+  const OpenCLHandle::Ptr &opencl_handle = rows->handle;
   if (!opencl_handle) {
     std::cout
         << "ERROR ToColorDitheredWithBlueNoise: Failed to get OpenCLHandle"
         << std::endl;
-    return {};
+    return false;
   }
 
+  const BlueNoiseMemory memory =
+      GetOpenCLBlueNoiseMemory(*rows, blue_noise, false);
+  const std::string &kernel_name = GetKernelName(kColorKernelNames, memory);
+
+  // blue noise rotated by the offsets, computed once instead of per pixel,
+  // unless the kernel reads the blue noise itself
+  std::vector<uint8_t> thresholds;
+  unsigned int threshold_rows = 0;
+  if (memory == BlueNoiseMemory::kBuffer) {
+    threshold_rows =
+        CPUDither::GetThresholdRows(blue_noise->height_, rows->count);
+    thresholds = GetColorThresholds(*blue_noise, rows->first_row, rows->count);
+  }
+
+  // on devices that work on host memory, the input and output buffers use
+  // the data of the images instead of copies, and are created per image
+  const bool is_zero_copy = IsOpenCLZeroCopyUsable(*rows, *result_image);
+  const std::size_t input_size = GetOpenCLInputSize(*rows);
+  const std::size_t output_size =
+      static_cast<std::size_t>(rows->count) * result_image->GetRowSize();
+
   // first check if existing kernel/buffers can be used
-  if (opencl_handle->HasKernel(kColorKernelName) &&
-      !VerifyOpenCLBuffers(
-          kColorKernelName,
-          {kBufferInputName, kBufferOutputName, kBufferBlueNoiseName}, this,
-          blue_noise)) {
-    opencl_handle->CleanupKernel(kColorKernelName);
+  std::vector<std::string> buffer_names;
+  if (!is_zero_copy) {
+    buffer_names = {kBufferInputName, kBufferOutputName};
+  }
+  if (memory == BlueNoiseMemory::kBuffer) {
+    buffer_names.push_back(kBufferThresholdsName);
+  }
+  if (opencl_handle->HasKernel(kernel_name) &&
+      !VerifyOpenCLBuffers(opencl_handle, kernel_name, buffer_names,
+                           input_size, output_size, thresholds.size())) {
+    // only the buffers depend on the size of the Image, so the kernel is kept
+    CleanupOpenCLBuffers(opencl_handle, kernel_name);
   }
 
   // set up kernel and buffers
-  const std::string &color_kernel_name = GetColorKernelName();
+  const std::string &color_kernel_name =
+      GetColorKernelName(opencl_handle, memory, *blue_noise);
   if (color_kernel_name.empty() ||
       !opencl_handle->HasKernel(color_kernel_name)) {
     std::cout << "ERROR ToColorDitheredWithBlueNoise: Failed to init "
                  "OpenCL Kernel"
               << std::endl;
     opencl_handle->CleanupKernel(color_kernel_name);
-    return {};
+    return false;
   }
 
-  if (!opencl_handle->HasBuffer(color_kernel_name, kBufferInputName)) {
+  if (is_zero_copy) {
+    if (!CreateZeroCopyOpenCLBuffers(opencl_handle, color_kernel_name,
+                                     result_image)) {
+      std::cout << "ERROR ToColorDitheredWithBlueNoise: Failed to alloc input "
+                   "and output buffers"
+                << std::endl;
+      opencl_handle->CleanupKernel(color_kernel_name);
+      return false;
+    }
+  } else if (!opencl_handle->HasBuffer(color_kernel_name, kBufferInputName)) {
     if (!opencl_handle->CreateKernelBuffer(color_kernel_name, CL_MEM_READ_ONLY,
-                                           this->data_.size(), nullptr,
+                                           input_size, nullptr,
                                            kBufferInputName)) {
       std::cout
           << "ERROR ToColorDitheredWithBlueNoise: Failed to alloc input buffer"
           << std::endl;
       opencl_handle->CleanupKernel(color_kernel_name);
-      return {};
+      return false;
     }
   }
 
-  if (!opencl_handle->SetKernelBufferData(color_kernel_name, kBufferInputName,
-                                          this->data_.size(),
-                                          this->data_.data())) {
-    std::cout
-        << "ERROR ToColorDitheredWithBlueNoise: Failed to init input buffer"
-        << std::endl;
-    opencl_handle->CleanupKernel(color_kernel_name);
-    return {};
-  }
-
   if (!opencl_handle->HasBuffer(color_kernel_name, kBufferOutputName)) {
-    if (!opencl_handle->CreateKernelBuffer(color_kernel_name, CL_MEM_WRITE_ONLY,
-                                           this->data_.size(), nullptr,
-                                           kBufferOutputName)) {
+    if (!opencl_handle->CreateKernelBuffer(
+            color_kernel_name, CL_MEM_WRITE_ONLY, output_size, nullptr,
+            kBufferOutputName)) {
       std::cout
           << "ERROR ToColorDitheredWithBlueNoise: Failed to set output buffer"
           << std::endl;
       opencl_handle->CleanupKernel(color_kernel_name);
-      return {};
+      return false;
     }
   }
 
-  if (!opencl_handle->HasBuffer(color_kernel_name, kBufferBlueNoiseName)) {
-    if (!opencl_handle->CreateKernelBuffer(color_kernel_name, CL_MEM_READ_ONLY,
-                                           blue_noise->data_.size(), nullptr,
-                                           kBufferBlueNoiseName)) {
-      std::cout << "ERROR ToColorDitheredWithBlueNoise: Failed to alloc "
-                   "blue-noise buffer"
+  // the blue noise, or the thresholds expanded from it, at parameters 1, 5,
+  // and 8
+  OpenCLHandle::Event thresholds_written;
+  if (memory != BlueNoiseMemory::kBuffer) {
+    if (!SetOpenCLBlueNoise(*rows, color_kernel_name, memory, *blue_noise, 3,
+                            8, &thresholds_written)) {
+      opencl_handle->CleanupKernel(color_kernel_name);
+      return false;
+    }
+  } else {
+    if (!opencl_handle->HasBuffer(color_kernel_name, kBufferThresholdsName)) {
+      if (!opencl_handle->CreateKernelBuffer(
+              color_kernel_name, CL_MEM_READ_ONLY, thresholds.size(), nullptr,
+              kBufferThresholdsName)) {
+        std::cout << "ERROR ToColorDitheredWithBlueNoise: Failed to alloc "
+                     "thresholds buffer"
+                  << std::endl;
+        opencl_handle->CleanupKernel(color_kernel_name);
+        return false;
+      }
+    }
+    if (!opencl_handle->SetKernelBufferDataAsync(
+            color_kernel_name, kBufferThresholdsName, thresholds.size(),
+            thresholds.data(), {}, &thresholds_written)) {
+      std::cout << "ERROR ToColorDitheredWithBlueNoise: Failed to init "
+                   "thresholds buffer"
                 << std::endl;
       opencl_handle->CleanupKernel(color_kernel_name);
-      return {};
+      return false;
     }
-  }
-
-  if (!opencl_handle->SetKernelBufferData(
-          color_kernel_name, kBufferBlueNoiseName, blue_noise->data_.size(),
-          blue_noise->data_.data())) {
-    std::cout << "ERROR ToColorDitheredWithBlueNoise: Failed to init "
-                 "blue-noise buffer"
-              << std::endl;
-    opencl_handle->CleanupKernel(color_kernel_name);
-    return {};
-  }
-
-  if (!opencl_handle->HasBuffer(color_kernel_name,
-                                kBufferBlueNoiseOffsetsName)) {
-    if (!opencl_handle->CreateKernelBuffer(
-            color_kernel_name, CL_MEM_READ_ONLY,
-            sizeof(unsigned int) * blue_noise_offsets_.size(), nullptr,
-            kBufferBlueNoiseOffsetsName)) {
+    if (!opencl_handle->AssignKernelBuffer(color_kernel_name, 1,
+                                           kBufferThresholdsName)) {
+      std::cout
+          << "ERROR ToColorDitheredWithBlueNoise: Failed to set parameter 1"
+          << std::endl;
+      opencl_handle->CleanupKernel(color_kernel_name);
+      return false;
+    }
+    if (!opencl_handle->AssignKernelArgument(
+            color_kernel_name, 5, sizeof(unsigned int), &threshold_rows)) {
       std::cout
-          << "ERROR ToColorDitheredWithBlueNoise: Failed to alloc blue-noise "
-             "offsets buffer"
+          << "ERROR ToColorDitheredWithBlueNoise: Failed to set parameter 5"
           << std::endl;
       opencl_handle->CleanupKernel(color_kernel_name);
-      return {};
+      return false;
+    }
+    unsigned int threshold_channel_step =
+        IsPlanar() ? threshold_rows * width_ : 1;
+    if (!opencl_handle->AssignKernelArgument(color_kernel_name, 8,
+                                             sizeof(unsigned int),
+                                             &threshold_channel_step)) {
+      std::cout
+          << "ERROR ToColorDitheredWithBlueNoise: Failed to set parameter 8"
+          << std::endl;
+      opencl_handle->CleanupKernel(color_kernel_name);
+      return false;
     }
-  }
-
-  if (!is_preserving_blue_noise_offsets_) {
-    GenerateBlueNoiseOffsets();
-  }
-
-  if (!opencl_handle->SetKernelBufferData(
-          color_kernel_name, kBufferBlueNoiseOffsetsName,
-          blue_noise_offsets_.size() * sizeof(unsigned int),
-          blue_noise_offsets_.data())) {
-    std::cout
-        << "ERROR ToColorDitheredWithBlueNoise: Failed to init blue-noise "
-           "offsets buffer"
-        << std::endl;
-    opencl_handle->CleanupKernel(color_kernel_name);
-    return {};
   }
 
   // assign buffers/data to kernel parameters
@@ -729,21 +1157,14 @@ std::unique_ptr<Image> Image::ToColorDitheredWithBlueNoise(Image *blue_noise) {
     std::cout << "ERROR ToColorDitheredWithBlueNoise: Failed to set parameter 0"
               << std::endl;
     opencl_handle->CleanupKernel(color_kernel_name);
-    return {};
-  }
-  if (!opencl_handle->AssignKernelBuffer(color_kernel_name, 1,
-                                         kBufferBlueNoiseName)) {
-    std::cout << "ERROR ToColorDitheredWithBlueNoise: Failed to set parameter 1"
-              << std::endl;
-    opencl_handle->CleanupKernel(color_kernel_name);
-    return {};
+    return false;
   }
   if (!opencl_handle->AssignKernelBuffer(color_kernel_name, 2,
                                          kBufferOutputName)) {
     std::cout << "ERROR ToColorDitheredWithBlueNoise: Failed to set parameter 2"
               << std::endl;
     opencl_handle->CleanupKernel(color_kernel_name);
-    return {};
+    return false;
   }
   unsigned int input_width = this->GetWidth();
   if (!opencl_handle->AssignKernelArgument(
@@ -751,181 +1172,482 @@ std::unique_ptr<Image> Image::ToColorDitheredWithBlueNoise(Image *blue_noise) {
     std::cout << "ERROR ToColorDitheredWithBlueNoise: Failed to set parameter 3"
               << std::endl;
     opencl_handle->CleanupKernel(color_kernel_name);
-    return {};
+    return false;
   }
-  unsigned int input_height = this->GetHeight();
+  unsigned int input_height = rows->count;
   if (!opencl_handle->AssignKernelArgument(
           color_kernel_name, 4, sizeof(unsigned int), &input_height)) {
     std::cout << "ERROR ToColorDitheredWithBlueNoise: Failed to set parameter 4"
               << std::endl;
     opencl_handle->CleanupKernel(color_kernel_name);
-    return {};
-  }
-  unsigned int blue_noise_width = blue_noise->GetWidth();
-  if (!opencl_handle->AssignKernelArgument(
-          color_kernel_name, 5, sizeof(unsigned int), &blue_noise_width)) {
-    std::cout << "ERROR ToColorDitheredWithBlueNoise: Failed to set parameter 5"
-              << std::endl;
-    opencl_handle->CleanupKernel(color_kernel_name);
-    return {};
+    return false;
   }
-  unsigned int blue_noise_height = blue_noise->GetHeight();
-  if (!opencl_handle->AssignKernelArgument(
-          color_kernel_name, 6, sizeof(unsigned int), &blue_noise_height)) {
+  // steps between pixels and between channels, of RGBA or of planes
+  unsigned int pixel_step = IsPlanar() ? 1 : 4;
+  if (!opencl_handle->AssignKernelArgument(color_kernel_name, 6,
+                                           sizeof(unsigned int), &pixel_step)) {
     std::cout << "ERROR ToColorDitheredWithBlueNoise: Failed to set parameter 6"
               << std::endl;
     opencl_handle->CleanupKernel(color_kernel_name);
-    return {};
+    return false;
   }
-  if (!opencl_handle->AssignKernelBuffer(color_kernel_name, 7,
-                                         kBufferBlueNoiseOffsetsName)) {
+  unsigned int input_channel_step =
+      IsPlanar() ? GetOpenCLInputPlaneSize(*rows) : 1;
+  if (!opencl_handle->AssignKernelArgument(
+          color_kernel_name, 7, sizeof(unsigned int), &input_channel_step)) {
     std::cout << "ERROR ToColorDitheredWithBlueNoise: Failed to set parameter 7"
               << std::endl;
     opencl_handle->CleanupKernel(color_kernel_name);
-    return {};
+    return false;
   }
 
-  auto work_group_size = opencl_handle->GetWorkGroupSize(color_kernel_name);
-  // DEBUG
-  // std::cout << "Got work_group_size == " << work_group_size << std::endl;
-
-  std::size_t work_group_size_0 = std::sqrt(work_group_size);
-  std::size_t work_group_size_1 = work_group_size_0;
-
-  while (work_group_size_0 > 1 && input_width % work_group_size_0 != 0) {
-    --work_group_size_0;
-  }
-  while (work_group_size_1 > 1 && input_height % work_group_size_1 != 0) {
-    --work_group_size_1;
+  // each work item dithers a vector of pixels, the last of a row fewer
+  const unsigned int row_items =
+      (input_width + kOpenCLColorPixelsPerItem - 1) / kOpenCLColorPixelsPerItem;
+  bool is_input_written = is_zero_copy;
+  const WorkGroupShape shape =
+      GetOpenCLWorkGroupShape(*rows, color_kernel_name, row_items,
+                              thresholds_written, &is_input_written);
+
+  if (is_zero_copy) {
+    // the kernel works on the data of the images, so there are no copies to
+    // overlap with
+    const auto start = std::chrono::steady_clock::now();
+    OpenCLHandle::Event dithered;
+    if (!opencl_handle->ExecuteKernel2DAsync(
+            color_kernel_name,
+            WorkGroupShape::PadGlobalSize(row_items, shape.size_0),
+            WorkGroupShape::PadGlobalSize(input_height, shape.size_1),
+            shape.size_0, shape.size_1, {thresholds_written}, &dithered)) {
+      std::cout
+          << "ERROR ToColorDitheredWithBlueNoise: Failed to execute Kernel"
+          << std::endl;
+      opencl_handle->CleanupKernel(color_kernel_name);
+      return false;
+    }
+    if (!ReadZeroCopyOpenCLOutput(opencl_handle, color_kernel_name,
+                                  dithered)) {
+      std::cout << "ERROR ToColorDitheredWithBlueNoise: Failed to map output "
+                   "buffer"
+                << std::endl;
+      opencl_handle->CleanupKernel(color_kernel_name);
+      return false;
+    }
+    rows->seconds = std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+    return true;
   }
 
-  // DEBUG
-  // std::cout << "Using WIDTHxHEIGHT: " << input_width << "x" << input_height
-  //          << " with work_group_sizes: " << work_group_size_0 << "x"
-  //          << work_group_size_1 << std::endl;
-
-  if (!opencl_handle->ExecuteKernel2D(color_kernel_name, input_width,
-                                      input_height, work_group_size_0,
-                                      work_group_size_1, true)) {
-    std::cout << "ERROR ToColorDitheredWithBlueNoise: Failed to execute Kernel"
+  if (!DitherOpenCLStrips(rows, color_kernel_name, result_image, row_items,
+                          shape, thresholds_written, is_input_written)) {
+    std::cout << "ERROR ToColorDitheredWithBlueNoise: Failed to dither with "
+                 "OpenCL"
               << std::endl;
     opencl_handle->CleanupKernel(color_kernel_name);
-    return {};
+    return false;
   }
 
-  std::unique_ptr<Image> result_image =
-      std::unique_ptr<Image>(new Image(*this));
-  result_image->is_dithered_color_ = true;
+  return true;
+}
 
-  if (!opencl_handle->GetBufferData(color_kernel_name, kBufferOutputName,
-                                    result_image->GetSize(),
-                                    result_image->data_.data())) {
-    std::cout << "ERROR ToColorDitheredWithBlueNoise: Failed to get output "
-                 "buffer data"
-              << std::endl;
-    opencl_handle->CleanupKernel(color_kernel_name);
-    return {};
+std::string Image::GetGrayscaleDitheringKernel(BlueNoiseMemory memory) {
+  if (memory != BlueNoiseMemory::kBuffer) {
+    return GetTileDitheringKernel(
+        GetKernelName(kGrayscaleKernelNames, memory), memory, false,
+        // each work item packs 16 pixels into two bytes, first pixel in the
+        // most significant bit
+        "if (idx >= (input_width + 15) / 16 || idy >= input_height) {\n"
+        "  return;\n"
+        "}\n"
+        "__global const unsigned char *input_row = input + idy * input_width;\n"
+        "__global unsigned char *output_row =\n"
+        "  output + idy * ((input_width + 7) / 8);\n"
+        "unsigned int x = idx * 16;\n"
+        "unsigned int count = min(16u, input_width - x);\n"
+        "unsigned char thresholds[16];\n"
+        "LoadThresholds(blue_noise, BLUE_NOISE_SIZE, blue_noise_offsets.s01,\n"
+        "  x, idy, count, thresholds);\n"
+        "if (count == 16) {\n" IGPUP_PROJECT_DITHER_GRAY16_("thresholds")
+        "  return;\n"
+        "}\n"
+        "unsigned char packed[2] = {0, 0};\n"
+        "for (unsigned int i = 0; i < count; ++i) {\n"
+        "  if (input_row[x + i] > thresholds[i]) {\n"
+        "    packed[i / 8] |= 0x80 >> (i % 8);\n"
+        "  }\n"
+        "}\n"
+        "output_row[idx * 2] = packed[0];\n"
+        "if (count > 8) {\n"
+        "  output_row[idx * 2 + 1] = packed[1];\n"
+        "}\n");
   }
 
-  return result_image;
-}
-
-const char *Image::GetGrayscaleDitheringKernel() {
   if (kOpenCLGrayscaleKernel == nullptr) {
     kOpenCLGrayscaleKernel =
-        "unsigned int BN_INDEX(\n"
-        "unsigned int x,\n"
-        "unsigned int y,\n"
-        "unsigned int o,\n"
-        "unsigned int bn_width,\n"
-        "unsigned int bn_height) {\n"
-        "unsigned int offset_x = (o % bn_width + x) % bn_width;\n"
-        "unsigned int offset_y = (o / bn_width + y) % bn_height;\n"
-        "return offset_x + offset_y * bn_width;\n"
-        "}\n"
-        "\n"
+        // thresholds are from CPUDither::GetGrayscaleThresholds(), so the blue
+        // noise offset is already applied
         "__kernel void " IGPUP_PROJECT_GRAYSCALE_KERNEL_NAME_
         "(\n"
         "__global const unsigned char *input,\n"
-        "__global const unsigned char *blue_noise,\n"
+        "__global const unsigned char *thresholds,\n"
         "__global unsigned char *output,\n"
         "const unsigned int input_width,\n"
         "const unsigned int input_height,\n"
-        "const unsigned int blue_noise_width,\n"
-        "const unsigned int blue_noise_height,\n"
-        "const unsigned int blue_noise_offset) {\n"
+        "const unsigned int threshold_rows) {\n"
+        // each work item packs 16 pixels into two bytes, first pixel in the
+        // most significant bit
         "unsigned int idx = get_global_id(0);\n"
         "unsigned int idy = get_global_id(1);\n"
-        "unsigned int b_i = BN_INDEX(idx, idy, blue_noise_offset,\n"
-        "blue_noise_width, blue_noise_height);\n"
-        "unsigned int input_index = idx + idy * input_width;\n"
-        "output[input_index] = input[input_index] > blue_noise[b_i] ? 255 : "
-        "0;\n"
+        // global work sizes may be padded to a multiple of the work group
+        // size
+        "if (idx >= (input_width + 15) / 16 || idy >= input_height) {\n"
+        "  return;\n"
+        "}\n"
+        "__global const unsigned char *input_row = input + idy * input_width;\n"
+        "__global const unsigned char *threshold_row =\n"
+        "  thresholds + (idy % threshold_rows) * input_width;\n"
+        "__global unsigned char *output_row =\n"
+        "  output + idy * ((input_width + 7) / 8);\n"
+        "unsigned int x = idx * 16;\n"
+        "if (x + 16 <= input_width) {\n" IGPUP_PROJECT_DITHER_GRAY16_(
+            "threshold_row + x") "  return;\n"
+        "}\n"
+        // the last work item of a row may have fewer pixels
+        "unsigned char packed[2] = {0, 0};\n"
+        "for (unsigned int i = 0; x + i < input_width; ++i) {\n"
+        "  if (input_row[x + i] > threshold_row[x + i]) {\n"
+        "    packed[i / 8] |= 0x80 >> (i % 8);\n"
+        "  }\n"
+        "}\n"
+        "output_row[idx * 2] = packed[0];\n"
+        "if (x + 8 < input_width) {\n"
+        "  output_row[idx * 2 + 1] = packed[1];\n"
+        "}\n"
         "}\n";
   }
 
   return kOpenCLGrayscaleKernel;
 }
 
-const char *Image::GetColorDitheringKernel() {
+std::string Image::GetColorDitheringKernel(BlueNoiseMemory memory) {
+  if (memory != BlueNoiseMemory::kBuffer) {
+    return GetTileDitheringKernel(
+        GetKernelName(kColorKernelNames, memory), memory, true,
+        // each work item packs 8 pixels into four bytes, 2 pixels per byte
+        // with the first pixel in the high nibble
+        "if (idx >= (input_width + 7) / 8 || idy >= input_height) {\n"
+        "  return;\n"
+        "}\n"
+        "__global const unsigned char *input_row =\n"
+        "  input + idy * input_width * pixel_step;\n"
+        "__global unsigned char *output_row =\n"
+        "  output + idy * ((input_width + 1) / 2);\n"
+        "unsigned int x = idx * 8;\n"
+        "unsigned int count = min(8u, input_width - x);\n"
+        "unsigned char thresholds[3][8];\n"
+        "LoadThresholds(blue_noise, BLUE_NOISE_SIZE, blue_noise_offsets.s01,\n"
+        "  x, idy, count, thresholds[0]);\n"
+        "LoadThresholds(blue_noise, BLUE_NOISE_SIZE, blue_noise_offsets.s23,\n"
+        "  x, idy, count, thresholds[1]);\n"
+        "LoadThresholds(blue_noise, BLUE_NOISE_SIZE, blue_noise_offsets.s45,\n"
+        "  x, idy, count, thresholds[2]);\n"
+        IGPUP_PROJECT_DITHER_COLOR_ITEM_);
+  }
+
   if (kOpenCLColorKernel == nullptr) {
     kOpenCLColorKernel =
-        "unsigned int BN_INDEX(\n"
-        "unsigned int x,\n"
-        "unsigned int y,\n"
-        "unsigned int o,\n"
-        "unsigned int bn_width,\n"
-        "unsigned int bn_height) {\n"
-        "unsigned int offset_x = (o % bn_width + x) % bn_width;\n"
-        "unsigned int offset_y = (o / bn_width + y) % bn_height;\n"
-        "return offset_x + offset_y * bn_width;\n"
-        "}\n"
-        "\n"
+        // thresholds are from CPUDither::GetColorThresholds() or
+        // CPUDither::GetPlanarColorThresholds(), in the same layout as the
+        // input. Channel c of pixel x of a row is at
+        // x * pixel_step + c * channel_step, which is (4, 1) for RGBA and
+        // (1, plane size) for planes.
+        IGPUP_PROJECT_LOAD_RGB8_
         "__kernel void " IGPUP_PROJECT_COLOR_KERNEL_NAME_
         "(\n"
         "__global const unsigned char *input,\n"
-        "__global const unsigned char *blue_noise,\n"
+        "__global const unsigned char *thresholds,\n"
         "__global unsigned char *output,\n"
         "const unsigned int input_width,\n"
         "const unsigned int input_height,\n"
-        "const unsigned int blue_noise_width,\n"
-        "const unsigned int blue_noise_height,\n"
-        "__global const unsigned int *blue_noise_offsets) {\n"
+        "const unsigned int threshold_rows,\n"
+        "const unsigned int pixel_step,\n"
+        "const unsigned int input_channel_step,\n"
+        "const unsigned int threshold_channel_step) {\n"
+        // each work item packs 8 pixels into four bytes, 2 pixels per byte
+        // with the first pixel in the high nibble
         "unsigned int idx = get_global_id(0);\n"
         "unsigned int idy = get_global_id(1);\n"
-        "  unsigned int b_i[3] = {\n"
-        "    BN_INDEX(idx, idy, blue_noise_offsets[0], blue_noise_width,\n"
-        "      blue_noise_height),\n"
-        "    BN_INDEX(idx, idy, blue_noise_offsets[1], blue_noise_width,\n"
-        "      blue_noise_height),\n"
-        "    BN_INDEX(idx, idy, blue_noise_offsets[2], blue_noise_width,\n"
-        "      blue_noise_height)\n"
-        "  };\n"
-        // input is 4 bytes per pixel, alpha channel is merely copied
-        "  for (unsigned int i = 0; i < 4; ++i) {\n"
-        "    unsigned int input_index = idx * 4 + idy * input_width * 4 + i;\n"
-        "    if (i < 3) {\n"
-        "      output[input_index] = input[input_index] > blue_noise[b_i[i]] ? "
-        "      255 : 0;\n"
-        "    } else {\n"
-        "      output[input_index] = input[input_index];\n"
+        // global work sizes may be padded to a multiple of the work group
+        // size
+        "if (idx >= (input_width + 7) / 8 || idy >= input_height) {\n"
+        "  return;\n"
+        "}\n"
+        "__global const unsigned char *input_row =\n"
+        "  input + idy * input_width * pixel_step;\n"
+        "__global const unsigned char *threshold_row =\n"
+        "  thresholds + (idy % threshold_rows) * input_width * pixel_step;\n"
+        "__global unsigned char *output_row =\n"
+        "  output + idy * ((input_width + 1) / 2);\n"
+        "unsigned int x = idx * 8;\n"
+        "if (x + 8 <= input_width) {\n"
+        "  uchar8 red, green, blue, red_thresholds, green_thresholds,\n"
+        "    blue_thresholds;\n"
+        "  LoadRGB8(input_row + x * pixel_step, pixel_step,\n"
+        "    input_channel_step, &red, &green, &blue);\n"
+        "  LoadRGB8(threshold_row + x * pixel_step, pixel_step,\n"
+        "    threshold_channel_step, &red_thresholds, &green_thresholds,\n"
+        "    &blue_thresholds);\n" IGPUP_PROJECT_DITHER_COLOR8_
+        "  return;\n"
+        "}\n"
+        // the last work item of a row may have fewer pixels
+        "const unsigned char bits[3] = {" IGPUP_PROJECT_XSTR_(
+            IGPUP_PROJECT_NIBBLE_RED) ", " IGPUP_PROJECT_XSTR_(
+            IGPUP_PROJECT_NIBBLE_GREEN) ", " IGPUP_PROJECT_XSTR_(
+            IGPUP_PROJECT_NIBBLE_BLUE) "};\n"
+        "unsigned char packed[4] = {0, 0, 0, 0};\n"
+        "for (unsigned int i = 0; x + i < input_width; ++i) {\n"
+        // alpha channel is dropped
+        "  unsigned int pixel = (x + i) * pixel_step;\n"
+        "  for (unsigned int c = 0; c < 3; ++c) {\n"
+        "    if (input_row[pixel + c * input_channel_step] >\n"
+        "        threshold_row[pixel + c * threshold_channel_step]) {\n"
+        "      packed[i / 2] |= bits[c] << (4 - i % 2 * 4);\n"
         "    }\n"
         "  }\n"
+        "}\n"
+        "for (unsigned int i = 0; x + i * 2 < input_width; ++i) {\n"
+        "  output_row[idx * 4 + i] = packed[i];\n"
+        "}\n"
         "}\n";
   }
 
   return kOpenCLColorKernel;
 }
 
-OpenCLHandle::Ptr Image::GetOpenCLHandle() {
-  if (!opencl_handle_) {
-    opencl_handle_ = OpenCLContext::GetHandle();
+std::string Image::GetGrayscaleFromColorDitheringKernel(
+    BlueNoiseMemory memory) {
+  if (memory != BlueNoiseMemory::kBuffer) {
+    return GetTileDitheringKernel(
+        GetKernelName(kGrayscaleFromColorKernelNames, memory), memory, true,
+        // each work item packs 8 pixels into one byte, first pixel in the
+        // most significant bit
+        "if (idx >= (input_width + 7) / 8 || idy >= input_height) {\n"
+        "  return;\n"
+        "}\n"
+        "__global const unsigned char *input_row =\n"
+        "  input + idy * input_width * pixel_step;\n"
+        "__global unsigned char *output_row =\n"
+        "  output + idy * ((input_width + 7) / 8);\n"
+        "unsigned int x = idx * 8;\n"
+        "unsigned int count = min(8u, input_width - x);\n"
+        "unsigned char thresholds[8];\n"
+        "LoadThresholds(blue_noise, BLUE_NOISE_SIZE, blue_noise_offsets.s01,\n"
+        "  x, idy, count, thresholds);\n"
+        IGPUP_PROJECT_DITHER_GRAY_FROM_COLOR_ITEM_);
+  }
+
+  if (kOpenCLGrayscaleFromColorKernel == nullptr) {
+    kOpenCLGrayscaleFromColorKernel =
+        // thresholds are from CPUDither::GetGrayscaleThresholds(), input is
+        // RGBA or planes like the input of the color kernel
+        IGPUP_PROJECT_LOAD_RGB8_
+        "__kernel void " IGPUP_PROJECT_GRAYSCALE_FROM_COLOR_KERNEL_NAME_
+        "(\n"
+        "__global const unsigned char *input,\n"
+        "__global const unsigned char *thresholds,\n"
+        "__global unsigned char *output,\n"
+        "const unsigned int input_width,\n"
+        "const unsigned int input_height,\n"
+        "const unsigned int threshold_rows,\n"
+        "const unsigned int pixel_step,\n"
+        "const unsigned int input_channel_step) {\n"
+        // each work item packs 8 pixels into one byte, first pixel in the
+        // most significant bit
+        "unsigned int idx = get_global_id(0);\n"
+        "unsigned int idy = get_global_id(1);\n"
+        // global work sizes may be padded to a multiple of the work group
+        // size
+        "if (idx >= (input_width + 7) / 8 || idy >= input_height) {\n"
+        "  return;\n"
+        "}\n"
+        "__global const unsigned char *input_row =\n"
+        "  input + idy * input_width * pixel_step;\n"
+        "__global const unsigned char *threshold_row =\n"
+        "  thresholds + (idy % threshold_rows) * input_width;\n"
+        "__global unsigned char *output_row =\n"
+        "  output + idy * ((input_width + 7) / 8);\n"
+        "unsigned int x = idx * 8;\n"
+        "if (x + 8 <= input_width) {\n"
+        "  uchar8 red, green, blue;\n"
+        "  LoadRGB8(input_row + x * pixel_step, pixel_step,\n"
+        "    input_channel_step, &red, &green, &blue);\n"
+        IGPUP_PROJECT_DITHER_GRAY8_("threshold_row + x")
+        "  return;\n"
+        "}\n"
+        // the last work item of a row may have fewer pixels
+        "unsigned char packed = 0;\n"
+        "for (unsigned int i = 0; x + i < input_width; ++i) {\n"
+        "  __global const unsigned char *rgb =\n"
+        "    input_row + (x + i) * pixel_step;\n"
+        "  if (" IGPUP_PROJECT_GRAY_OF_RGB_ " > threshold_row[x + i]) {\n"
+        "    packed |= 0x80 >> i;\n"
+        "  }\n"
+        "}\n"
+        "output_row[idx] = packed;\n"
+        "}\n";
   }
 
-  return opencl_handle_;
+  return kOpenCLGrayscaleFromColorKernel;
+}
+
+std::string Image::GetTileDitheringKernel(const std::string &kernel_name,
+                                          BlueNoiseMemory memory,
+                                          bool is_color_input,
+                                          const char *body) {
+  const bool is_image = memory == BlueNoiseMemory::kImage;
+  // blue noise is the tile from the blue noise Image, pixel (x, y) of the
+  // input uses its pixel ((x + offset x) % width, (y + offset y) % height).
+  // The offsets of channel c are blue_noise_offsets.s(2c) and .s(2c + 1).
+  // The size is a constant if given in the build options (see
+  // GetBlueNoiseBuildOptions()), so wrapping compiles to masks for powers of
+  // two.
+  return std::string(
+             "#ifdef IGPUP_PROJECT_BLUE_NOISE_WIDTH\n"
+             "#define BLUE_NOISE_SIZE (uint2)(IGPUP_PROJECT_BLUE_NOISE_WIDTH, "
+             "IGPUP_PROJECT_BLUE_NOISE_HEIGHT)\n"
+             "#else\n"
+             "#define BLUE_NOISE_SIZE blue_noise_size\n"
+             "#endif\n") +
+         (is_image ? IGPUP_PROJECT_LOAD_THRESHOLDS_IMAGE_
+                   : IGPUP_PROJECT_LOAD_THRESHOLDS_TILE_("__local")) +
+         (is_color_input ? IGPUP_PROJECT_LOAD_RGB8_ : "") +
+         "__kernel void " + kernel_name +
+         "(\n"
+         "__global const unsigned char *input,\n" +
+         (is_image ? "read_only image2d_t blue_noise,\n"
+                   : "__global const unsigned char *global_blue_noise,\n") +
+         "__global unsigned char *output,\n"
+         "const unsigned int input_width,\n"
+         "const unsigned int input_height,\n"
+         "const uint2 blue_noise_size,\n" +
+         (is_color_input ? "const unsigned int pixel_step,\n"
+                           "const unsigned int input_channel_step,\n"
+                         : "") +
+         "const uint8 blue_noise_offsets" +
+         (is_image ? "" : ",\n__local unsigned char *blue_noise") +
+         ") {\n"
+         "unsigned int idx = get_global_id(0);\n"
+         "unsigned int idy = get_global_id(1);\n" +
+         // every work item of the group takes part in the copy, so it is
+         // before skipping the work items past the image
+         (is_image ? ""
+                   : "event_t copied = async_work_group_copy(blue_noise,\n"
+                     "  global_blue_noise, BLUE_NOISE_SIZE.x * "
+                     "BLUE_NOISE_SIZE.y, 0);\n"
+                     "wait_group_events(1, &copied);\n") +
+         body + "}\n";
+}
+
+std::string Image::GetBatchGrayscaleDitheringKernel() {
+  return GetBatchDitheringKernel(
+      kBatchGrayscaleKernelName,
+      // each work item packs 8 pixels into one byte, first pixel in the most
+      // significant bit. Grayscale images have a channel step of 0, and the
+      // gray weights add up to 1, so their pixels stay the same.
+      "__global unsigned char *output_row =\n"
+      "  output + info.s5 + idy * ((input_width + 7) / 8);\n"
+      "unsigned char thresholds[8];\n"
+      "LoadThresholds(blue_noise, blue_noise_size, info.s89, x, idy, count,\n"
+      "  thresholds);\n" IGPUP_PROJECT_DITHER_GRAY_FROM_COLOR_ITEM_);
+}
+
+std::string Image::GetBatchColorDitheringKernel() {
+  return GetBatchDitheringKernel(
+      kBatchColorKernelName,
+      // each work item packs 8 pixels into four bytes, 2 pixels per byte with
+      // the first pixel in the high nibble
+      "__global unsigned char *output_row =\n"
+      "  output + info.s5 + idy * ((input_width + 1) / 2);\n"
+      "unsigned char thresholds[3][8];\n"
+      "LoadThresholds(blue_noise, blue_noise_size, info.s89, x, idy, count,\n"
+      "  thresholds[0]);\n"
+      "LoadThresholds(blue_noise, blue_noise_size, info.sab, x, idy, count,\n"
+      "  thresholds[1]);\n"
+      "LoadThresholds(blue_noise, blue_noise_size, info.scd, x, idy, count,\n"
+      "  thresholds[2]);\n" IGPUP_PROJECT_DITHER_COLOR_ITEM_);
+}
+
+std::string Image::GetBatchDitheringKernel(const std::string &kernel_name,
+                                           const char *body) {
+  // images holds for each image: its first work item, work items per row,
+  // width, height, input and output offsets, pixel_step and
+  // input_channel_step of LoadRGB8(), and the blue noise offsets of each
+  // channel like blue_noise_offsets of GetTileDitheringKernel()
+  static_assert(kBatchImageInfoSize == 16,
+                "the batch kernels load the values of an image as a uint16");
+  return std::string(IGPUP_PROJECT_LOAD_THRESHOLDS_TILE_("__global")
+                         IGPUP_PROJECT_LOAD_RGB8_) +
+         "__kernel void " + kernel_name +
+         "(\n"
+         "__global const unsigned char *input,\n"
+         "__global const unsigned int *images,\n"
+         "__global const unsigned char *blue_noise,\n"
+         "__global unsigned char *output,\n"
+         "const unsigned int image_count,\n"
+         "const unsigned int item_count,\n"
+         "const uint2 blue_noise_size) {\n"
+         "const unsigned int id = get_global_id(0);\n"
+         // the global work size may be padded to a multiple of the work group
+         // size
+         "if (id >= item_count) {\n"
+         "  return;\n"
+         "}\n"
+         // the image of the work item is the last one starting at or before
+         // it
+         "unsigned int first = 0;\n"
+         "unsigned int last = image_count - 1;\n"
+         "while (first < last) {\n"
+         "  unsigned int middle = (first + last + 1) / 2;\n"
+         "  if (images[middle * " +
+         std::to_string(kBatchImageInfoSize) +
+         "] <= id) {\n"
+         "    first = middle;\n"
+         "  } else {\n"
+         "    last = middle - 1;\n"
+         "  }\n"
+         "}\n"
+         "const uint16 info = vload16(first, images);\n"
+         "const unsigned int idx = (id - info.s0) % info.s1;\n"
+         "const unsigned int idy = (id - info.s0) / info.s1;\n"
+         "const unsigned int input_width = info.s2;\n"
+         "const unsigned int pixel_step = info.s6;\n"
+         "const unsigned int input_channel_step = info.s7;\n"
+         "__global const unsigned char *input_row =\n"
+         "  input + info.s4 + idy * input_width * pixel_step;\n"
+         "unsigned int x = idx * 8;\n"
+         "unsigned int count = min(8u, input_width - x);\n" +
+         body + "}\n";
+}
+
+OpenCLHandle::Ptr Image::GetOpenCLHandle() const {
+  return OpenCLContext::GetHandle(
+      opencl_device_index_ < 0 ? 0 : opencl_device_index_);
+}
+
+void Image::SetDitherBackend(DitherBackend backend) {
+  dither_backend_ = backend;
+}
+
+DitherBackend Image::GetDitherBackend() const { return dither_backend_; }
+
+void Image::SetBlueNoiseMemory(BlueNoiseMemory memory) {
+  blue_noise_memory_ = memory;
 }
 
-void Image::DecodePNG(const std::string &filename) {
+BlueNoiseMemory Image::GetBlueNoiseMemory() { return blue_noise_memory_; }
+
+void Image::DecodePNG(const std::string &filename, bool planar) {
   FILE *file = std::fopen(filename.c_str(), "rb");
   if (!file) {
     std::cout << "ERROR: Failed to open \"" << filename << '"' << std::endl;
@@ -1019,32 +1741,58 @@ void Image::DecodePNG(const std::string &filename) {
 
   png_byte **row_pointers = png_get_rows(png_ptr, png_info_ptr);
 
-  data_.clear();
-  if (channels == 3 || channels == 4) {
-    data_.reserve(width_ * 4 * height_);
-  } else if (channels == 1) {
-    data_.reserve(width_ * height_);
+  // the layout of the png is picked once for all rows
+  void (*convert_row_fn)(const uint8_t *, unsigned int, uint8_t *);
+  if (channels == 1) {
+    convert_row_fn =
+        PixelFormat::ConvertRow<PixelFormat::Gray8, PixelFormat::Gray8>;
+  } else if (channels == 3) {
+    convert_row_fn =
+        PixelFormat::ConvertRow<PixelFormat::RGB24, PixelFormat::RGBA32>;
+  } else if (channels == 4) {
+    convert_row_fn =
+        PixelFormat::ConvertRow<PixelFormat::RGBA32, PixelFormat::RGBA32>;
   } else {
     std::cout << "ERROR: PNG has invalid channel count == " << channels
               << std::endl;
     png_destroy_read_struct(&png_ptr, &png_info_ptr, &png_end_info_ptr);
     return;
   }
-  for (unsigned int y = 0; y < height_; ++y) {
-    for (unsigned int x = 0; x < width_; ++x) {
-      if (is_grayscale_) {
-        data_.push_back(row_pointers[y][x]);
-      } else if (channels == 3) {
-        for (unsigned int c = 0; c < channels; ++c) {
-          data_.push_back(row_pointers[y][x * channels + c]);
-        }
-        data_.push_back(255);
-      } else /* if (channels == 4) */ {
-        for (unsigned int c = 0; c < channels; ++c) {
-          data_.push_back(row_pointers[y][x * channels + c]);
+
+  if (planar && !is_grayscale_) {
+    // rows are split straight into planes, with no alpha plane if the png
+    // has no alpha
+    plane_count_ = channels;
+    const std::size_t plane_size = GetPlaneSize();
+    data_.resize(plane_count_ * plane_size);
+    auto convert_fn = [&](unsigned int y_begin, unsigned int y_end) {
+      for (unsigned int y = y_begin; y < y_end; ++y) {
+        if (channels == 3) {
+          PixelFormat::ConvertRowToPlanes<PixelFormat::RGB24>(
+              row_pointers[y], width_,
+              data_.data() + static_cast<std::size_t>(y) * width_,
+              plane_size);
+        } else {
+          PixelFormat::ConvertRowToPlanes<PixelFormat::RGBA32>(
+              row_pointers[y], width_,
+              data_.data() + static_cast<std::size_t>(y) * width_,
+              plane_size);
         }
       }
-    }
+    };
+    ThreadPool::GetInstance().ParallelFor(0, height_, 0, convert_fn);
+  } else {
+    const unsigned int row_size =
+        is_grayscale_ ? PixelFormat::Gray8::GetRowSize(width_)
+                      : PixelFormat::RGBA32::GetRowSize(width_);
+    data_.resize(static_cast<std::size_t>(row_size) * height_);
+    auto convert_fn = [&](unsigned int y_begin, unsigned int y_end) {
+      for (unsigned int y = y_begin; y < y_end; ++y) {
+        convert_row_fn(row_pointers[y], width_,
+                       data_.data() + static_cast<std::size_t>(y) * row_size);
+      }
+    };
+    ThreadPool::GetInstance().ParallelFor(0, height_, 0, convert_fn);
   }
 
   // cleanup
@@ -1052,7 +1800,13 @@ void Image::DecodePNG(const std::string &filename) {
   fclose(file);
 
   // verify
-  if (is_grayscale_) {
+  if (IsPlanar()) {
+    if (data_.size() != plane_count_ * GetPlaneSize()) {
+      std::cout << "WARNING: data_.size() doesn't match planes of width_ * "
+                   "height_"
+                << std::endl;
+    }
+  } else if (is_grayscale_) {
     if (data_.size() != width_ * height_) {
       std::cout << "WARNING: data_.size() doesn't match width_ * height_"
                 << std::endl;
@@ -1219,7 +1973,7 @@ void Image::DecodePGM(const std::string &filename) {
   }
 }
 
-void Image::DecodePPM(const std::string &filename) {
+void Image::DecodePPM(const std::string &filename, bool planar) {
   is_grayscale_ = false;
   std::ifstream ifs(filename);
   if (!ifs.is_open()) {
@@ -1268,22 +2022,21 @@ void Image::DecodePPM(const std::string &filename) {
     float max_value = int_input;
 
     // parse data
-    data_.clear();
-    data_.reserve(width_ * height_ * 4);
+    unsigned int pixel_step;
+    std::size_t channel_step;
+    PreparePPMData(planar, &pixel_step, &channel_step);
     float value;
     for (unsigned int i = 0; i < width_ * height_ * 3; ++i) {
       ifs >> int_input;
       if (!ifs.good()) {
         std::cout << "ERROR: Failed to parse file (PPM data) \"" << filename
                   << '"' << std::endl;
+        data_.clear();
         return;
       }
       value = static_cast<float>(int_input) / max_value;
-      data_.push_back(std::round(value * 255.0F));
-      if (i % 3 == 2) {
-        // PPM is RGB but Image stores as RGBA
-        data_.push_back(255);
-      }
+      data_[(i / 3) * pixel_step + (i % 3) * channel_step] =
+          std::round(value * 255.0F);
     }
   } else if (str_input.compare("P6") == 0) {
     // data stored in raw format
@@ -1341,33 +2094,31 @@ void Image::DecodePPM(const std::string &filename) {
     }
 
     // parse raw data
-    data_.clear();
-    data_.reserve(width_ * height_ * 4);
+    unsigned int pixel_step;
+    std::size_t channel_step;
+    PreparePPMData(planar, &pixel_step, &channel_step);
     float value;
     for (unsigned int i = 0; i < width_ * height_ * 3; ++i) {
       if (max_value_int == 255) {
         value = ifs.get() / max_value;
-        data_.push_back(std::round(value * 255.0F));
         if (!ifs.good()) {
           std::cout << "ERROR: Failed to parse file (PPM data) \"" << filename
                     << '"' << std::endl;
+          data_.clear();
           return;
         }
       } else /* if (max_value_int == 65535) */ {
         value = (ifs.get() & 0xFF) | ((ifs.get() << 8) & 0xFF00);
         value /= max_value;
-        data_.push_back(std::round(value * 255.0F));
         if (!ifs.good()) {
           std::cout << "ERROR: Failed to parse file (PPM data 16-bit) \""
                     << filename << '"' << std::endl;
+          data_.clear();
           return;
         }
       }
-
-      if (i % 3 == 2) {
-        // PPM is RGB but Image stores as RGBA
-        data_.push_back(255);
-      }
+      data_[(i / 3) * pixel_step + (i % 3) * channel_step] =
+          std::round(value * 255.0F);
     }
 
     if (ifs.get() != decltype(ifs)::traits_type::eof()) {
@@ -1380,34 +2131,383 @@ void Image::DecodePPM(const std::string &filename) {
   }
 }
 
-const std::string &Image::GetGrayscaleKernelName() {
-  if (!GetOpenCLHandle()) {
-    return kEmptyString;
-  } else if (!opencl_handle_->HasKernel(kGrayscaleKernelName)) {
-    if (!opencl_handle_->CreateKernelFromSource(GetGrayscaleDitheringKernel(),
-                                                kGrayscaleKernelName)) {
-      std::cout << "ERROR: Failed to create " << kGrayscaleKernelName
-                << " OpenCL Kernel" << std::endl;
-      return kEmptyString;
+void Image::PreparePPMData(bool planar, unsigned int *pixel_step,
+                           std::size_t *channel_step) {
+  if (planar) {
+    // PPM has no alpha, so there is no alpha plane
+    plane_count_ = 3;
+    *pixel_step = 1;
+    *channel_step = GetPlaneSize();
+    data_.assign(plane_count_ * GetPlaneSize(), 0);
+  } else {
+    // PPM is RGB but Image stores as RGBA, alpha is left at 255
+    *pixel_step = 4;
+    *channel_step = 1;
+    data_.assign(PixelFormat::RGBA32::GetRowSize(width_) * height_, 255);
+  }
+}
+
+const std::string &Image::GetGrayscaleKernelName(
+    const OpenCLHandle::Ptr &opencl_handle, BlueNoiseMemory memory,
+    const Image &blue_noise) {
+  const std::string &kernel_name = GetKernelName(kGrayscaleKernelNames, memory);
+  return CreateOpenCLKernel(opencl_handle, kernel_name,
+                            GetGrayscaleDitheringKernel, memory, blue_noise)
+             ? kernel_name
+             : kEmptyString;
+}
+
+const std::string &Image::GetGrayscaleFromColorKernelName(
+    const OpenCLHandle::Ptr &opencl_handle, BlueNoiseMemory memory,
+    const Image &blue_noise) {
+  const std::string &kernel_name =
+      GetKernelName(kGrayscaleFromColorKernelNames, memory);
+  return CreateOpenCLKernel(opencl_handle, kernel_name,
+                            GetGrayscaleFromColorDitheringKernel, memory,
+                            blue_noise)
+             ? kernel_name
+             : kEmptyString;
+}
+
+const std::string &Image::GetColorKernelName(
+    const OpenCLHandle::Ptr &opencl_handle, BlueNoiseMemory memory,
+    const Image &blue_noise) {
+  const std::string &kernel_name = GetKernelName(kColorKernelNames, memory);
+  return CreateOpenCLKernel(opencl_handle, kernel_name,
+                            GetColorDitheringKernel, memory, blue_noise)
+             ? kernel_name
+             : kEmptyString;
+}
+
+bool Image::CreateOpenCLKernel(const OpenCLHandle::Ptr &opencl_handle,
+                               const std::string &kernel_name,
+                               std::string (*get_source)(BlueNoiseMemory),
+                               BlueNoiseMemory memory,
+                               const Image &blue_noise) {
+  if (!opencl_handle) {
+    return false;
+  }
+
+  const std::string build_options =
+      GetBlueNoiseBuildOptions(memory, blue_noise);
+  if (opencl_handle->HasKernel(kernel_name) &&
+      opencl_handle->GetKernelBuildOptions(kernel_name) != build_options) {
+    // built for blue noise of another size, which stays in the program cache
+    opencl_handle->CleanupKernel(kernel_name);
+  }
+  if (!opencl_handle->HasKernel(kernel_name) &&
+      !opencl_handle->CreateKernelFromSource(get_source(memory), kernel_name,
+                                             build_options)) {
+    std::cout << "ERROR: Failed to create " << kernel_name << " OpenCL Kernel"
+              << std::endl;
+    return false;
+  }
+
+  return true;
+}
+
+std::string Image::GetBlueNoiseBuildOptions(BlueNoiseMemory memory,
+                                            const Image &blue_noise) {
+  if (memory == BlueNoiseMemory::kBuffer) {
+    // the buffer kernels only wrap once per row
+    return {};
+  }
+  return "-D IGPUP_PROJECT_BLUE_NOISE_WIDTH=" +
+         std::to_string(blue_noise.width_) +
+         " -D IGPUP_PROJECT_BLUE_NOISE_HEIGHT=" +
+         std::to_string(blue_noise.height_);
+}
+
+const std::string &Image::GetKernelName(
+    const std::array<std::string, 3> &kernel_names, BlueNoiseMemory memory) {
+  return kernel_names.at(static_cast<std::size_t>(memory));
+}
+
+std::vector<uint8_t> Image::GetGrayscaleThresholds(const Image &blue_noise,
+                                                   unsigned int first_row,
+                                                   unsigned int rows) const {
+  return CPUDither::GetGrayscaleThresholds(
+      blue_noise.data_.data(), blue_noise.width_, blue_noise.height_, width_,
+      rows, row_offset_ + first_row, blue_noise_offsets_.at(0));
+}
+
+std::vector<uint8_t> Image::GetColorThresholds(const Image &blue_noise,
+                                               unsigned int first_row,
+                                               unsigned int rows) const {
+  if (IsPlanar()) {
+    return CPUDither::GetPlanarColorThresholds(
+        blue_noise.data_.data(), blue_noise.width_, blue_noise.height_, width_,
+        rows, row_offset_ + first_row, blue_noise_offsets_);
+  }
+  return CPUDither::GetColorThresholds(
+      blue_noise.data_.data(), blue_noise.width_, blue_noise.height_, width_,
+      rows, row_offset_ + first_row, blue_noise_offsets_);
+}
+
+DitherBackend Image::ResolveDitherBackend(bool grayscale, Image *blue_noise) {
+  if (dither_backend_ != DitherBackend::kAuto) {
+    return dither_backend_;
+  }
+  return BackendTuner::GetBackend(width_, height_, grayscale, blue_noise,
+                                  GetOpenCLHandle(), GetOpenCLSplitDevices());
+}
+
+bool Image::IsUsingOpenCL(DitherBackend backend) {
+  switch (backend) {
+    case DitherBackend::kCPU:
+    case DitherBackend::kSIMD:
+      return false;
+    case DitherBackend::kOpenCL:
+      return true;
+    case DitherBackend::kAuto:
+    default:
+      break;
+  }
+
+  auto opencl_handle = GetOpenCLHandle();
+  return opencl_handle && opencl_handle->IsValid();
+}
+
+SIMDDither::ISA Image::GetSIMDISA(DitherBackend backend) const {
+  if (backend == DitherBackend::kCPU) {
+    return SIMDDither::ISA::kScalar;
+  }
+  return SIMDDither::GetISA();
+}
+
+std::vector<std::size_t> Image::GetOpenCLSplitDevices() const {
+  std::vector<std::size_t> devices;
+  if (opencl_device_index_ >= 0) {
+    return devices;
+  }
+  const std::size_t device_count = OpenCLContext::GetDeviceCount();
+  if (device_count < 2) {
+    return devices;
+  }
+
+  for (std::size_t i = 0; i < device_count; ++i) {
+    auto handle = OpenCLContext::GetHandle(i);
+    if (handle && handle->IsValid()) {
+      devices.push_back(i);
+    }
+  }
+  if (devices.size() < 2) {
+    devices.clear();
+  }
+  return devices;
+}
+
+bool Image::DitherWithOpenCL(Image *result_image, Image *blue_noise,
+                             bool grayscale) {
+  const std::vector<std::size_t> devices = GetOpenCLSplitDevices();
+  if (!devices.empty()) {
+    return DitherWithOpenCLDevices(result_image, blue_noise, grayscale,
+                                   devices);
+  }
+  OpenCLRows rows{GetOpenCLHandle(), 0, height_, 0.0};
+  return grayscale ? DitherGrayscaleWithOpenCL(result_image, blue_noise, &rows)
+                   : DitherColorWithOpenCL(result_image, blue_noise, &rows);
+}
+
+bool Image::DitherWithOpenCLDevices(Image *result_image, Image *blue_noise,
+                                    bool grayscale,
+                                    const std::vector<std::size_t> &devices) {
+  const std::vector<unsigned int> device_rows =
+      DeviceScheduler::SplitRows(height_, devices);
+
+  // every device reads its rows from data_ and writes them into result_image
+  // directly, devices that get no rows are left out
+  std::vector<OpenCLRows> rows;
+  std::vector<std::size_t> row_devices;
+  unsigned int first_row = 0;
+  for (std::size_t i = 0; i < devices.size(); ++i) {
+    if (device_rows[i] > 0) {
+      rows.push_back({OpenCLHandle::Ptr(), first_row, device_rows[i], 0.0});
+      row_devices.push_back(devices[i]);
+    }
+    first_row += device_rows[i];
+  }
+
+  std::atomic<bool> is_success(true);
+  auto dither_fn = [&](unsigned int begin, unsigned int end) {
+    for (unsigned int i = begin; i < end; ++i) {
+      // handles are per thread, and the rows may be dithered on a thread of
+      // the pool
+      rows[i].handle = OpenCLContext::GetHandle(row_devices[i]);
+      const bool is_dithered =
+          grayscale
+              ? DitherGrayscaleWithOpenCL(result_image, blue_noise, &rows[i])
+              : DitherColorWithOpenCL(result_image, blue_noise, &rows[i]);
+      if (!is_dithered) {
+        std::cout << "ERROR: Failed to dither rows " << rows[i].first_row
+                  << " to " << rows[i].first_row + rows[i].count
+                  << " on OpenCL device " << row_devices[i] << std::endl;
+        is_success = false;
+        continue;
+      }
+
+      // only the time on the device, the copies and thresholds on the host
+      // cost the same on every device
+      DeviceScheduler::AddMeasurement(
+          row_devices[i],
+          static_cast<unsigned long long>(width_) * rows[i].count,
+          rows[i].seconds);
+    }
+  };
+  if (rows.size() == 1) {
+    // e.g. small images, which are not worth splitting
+    dither_fn(0, 1);
+  } else {
+    ThreadPool::GetInstance().ParallelFor(0, rows.size(), 1, dither_fn);
+  }
+
+  return is_success;
+}
+
+std::size_t Image::GetOpenCLInputPlaneSize(const OpenCLRows &rows) const {
+  return IsPlanar() ? PixelFormat::PlanarRGB::GetPlaneSize(width_, rows.count)
+                    : 0;
+}
+
+std::size_t Image::GetOpenCLInputSize(const OpenCLRows &rows) const {
+  return IsPlanar() ? plane_count_ * GetOpenCLInputPlaneSize(rows)
+                    : static_cast<std::size_t>(rows.count) * GetRowSize();
+}
+
+bool Image::WriteOpenCLInput(const OpenCLRows &rows,
+                             const OpenCLHandle::BufferRef &input,
+                             unsigned int first_row, unsigned int count,
+                             std::size_t queue_index,
+                             OpenCLHandle::Event *written) const {
+  const unsigned int row_size = GetRowSize();
+  const unsigned int plane_count = IsPlanar() ? plane_count_ : 1;
+  const std::size_t input_plane_size = GetOpenCLInputPlaneSize(rows);
+  for (unsigned int plane = 0; plane < plane_count; ++plane) {
+    const std::size_t offset =
+        plane * input_plane_size +
+        static_cast<std::size_t>(first_row) * row_size;
+    const std::size_t data_offset =
+        plane * GetPlaneSize() +
+        static_cast<std::size_t>(rows.first_row + first_row) * row_size;
+    // planes are copied in order on the queue, so the last one is waited for
+    if (!rows.handle->SetKernelBufferRegionAsync(
+            input, offset, static_cast<std::size_t>(count) * row_size,
+            data_.data() + data_offset, queue_index, {},
+            plane + 1 == plane_count ? written : nullptr)) {
+      return false;
     }
   }
+  return true;
+}
 
-  return kGrayscaleKernelName;
+WorkGroupShape Image::GetOpenCLWorkGroupShape(
+    const OpenCLRows &rows, const std::string &kernel_name,
+    unsigned int global_work_size_0,
+    const OpenCLHandle::Event &thresholds_written, bool *is_input_written) {
+  const OpenCLHandle::Ptr &opencl_handle = rows.handle;
+  // candidates dither all of rows, the output is overwritten afterwards
+  auto run_fn = [&](const WorkGroupShape &shape) {
+    // the input is copied before the first run, so that the runs time the
+    // same work as dithering rows
+    if (!*is_input_written) {
+      OpenCLHandle::Event input_written;
+      if (!WriteOpenCLInput(rows,
+                            opencl_handle->GetBuffer(
+                                opencl_handle->GetKernel(kernel_name),
+                                kBufferInputName),
+                            0, rows.count, 0, &input_written) ||
+          !input_written.Wait()) {
+        return false;
+      }
+      *is_input_written = true;
+    }
+    OpenCLHandle::Event dithered;
+    return opencl_handle->ExecuteKernel2DAsync(
+               kernel_name,
+               WorkGroupShape::PadGlobalSize(global_work_size_0, shape.size_0),
+               WorkGroupShape::PadGlobalSize(rows.count, shape.size_1),
+               shape.size_0, shape.size_1, {thresholds_written}, &dithered) &&
+           dithered.Wait();
+  };
+  const unsigned int host_compute_units =
+      opencl_handle->HasUnifiedMemory()
+          ? opencl_handle->GetDeviceComputeUnits()
+          : 0;
+  return WorkGroupTuner::GetShape(opencl_handle->GetDeviceKey(), kernel_name,
+                                  width_, rows.count,
+                                  opencl_handle->GetWorkGroupSize(kernel_name),
+                                  host_compute_units, run_fn);
 }
 
-const std::string &Image::GetColorKernelName() {
-  if (!GetOpenCLHandle()) {
-    return kEmptyString;
-  } else if (!opencl_handle_->HasKernel(kColorKernelName)) {
-    if (!opencl_handle_->CreateKernelFromSource(GetColorDitheringKernel(),
-                                                kColorKernelName)) {
-      std::cout << "ERROR: Failed to create " << kColorKernelName
-                << " OpenCL Kernel" << std::endl;
-      return kEmptyString;
+bool Image::DitherOpenCLStrips(OpenCLRows *rows,
+                               const std::string &kernel_name,
+                               Image *result_image, unsigned int row_items,
+                               const WorkGroupShape &shape,
+                               const OpenCLHandle::Event &thresholds_written,
+                               bool is_input_written) {
+  const OpenCLHandle::Ptr &opencl_handle = rows->handle;
+  // strips are multiples of the work group height, so that only the last
+  // strip is padded
+  const std::size_t strip_count = std::max<std::size_t>(
+      std::min<std::size_t>(opencl_handle->GetQueueCount(),
+                            rows->count / kMinOpenCLStripRows),
+      1);
+  const unsigned int strip_rows = WorkGroupShape::PadGlobalSize(
+      (rows->count + strip_count - 1) / strip_count, shape.size_1);
+
+  const unsigned int output_row_size = result_image->GetRowSize();
+  // looked up once instead of for every command of every strip
+  const OpenCLHandle::KernelRef kernel = opencl_handle->GetKernel(kernel_name);
+  const OpenCLHandle::BufferRef input =
+      opencl_handle->GetBuffer(kernel, kBufferInputName);
+  const OpenCLHandle::BufferRef output =
+      opencl_handle->GetBuffer(kernel, kBufferOutputName);
+  const auto start = std::chrono::steady_clock::now();
+  OpenCLHandle::EventList outputs_read;
+  // each strip is copied in, dithered, and copied out on its own in-order
+  // queue, so the copies of a strip overlap with dithering other strips
+  std::size_t queue_index = 0;
+  for (unsigned int first_row = 0; first_row < rows->count;
+       first_row += strip_rows, ++queue_index) {
+    const unsigned int count = std::min(strip_rows, rows->count - first_row);
+    if (!is_input_written &&
+        !WriteOpenCLInput(*rows, input, first_row, count, queue_index,
+                          nullptr)) {
+      return false;
+    }
+
+    OpenCLHandle::Event dithered;
+    if (!opencl_handle->ExecuteKernel2DRegionAsync(
+            kernel, 0, first_row,
+            WorkGroupShape::PadGlobalSize(row_items, shape.size_0),
+            WorkGroupShape::PadGlobalSize(count, shape.size_1), shape.size_0,
+            shape.size_1, queue_index, {thresholds_written}, &dithered)) {
+      return false;
+    }
+
+    // rows of the output buffer are at rows->first_row of result_image
+    const std::size_t offset =
+        static_cast<std::size_t>(first_row) * output_row_size;
+    const std::size_t result_offset =
+        static_cast<std::size_t>(rows->first_row) * output_row_size + offset;
+    OpenCLHandle::Event output_read;
+    if (!opencl_handle->GetBufferRegionAsync(
+            output, offset, static_cast<std::size_t>(count) * output_row_size,
+            result_image->data_.data() + result_offset, queue_index,
+            {dithered}, &output_read)) {
+      return false;
     }
+    outputs_read.push_back(std::move(output_read));
   }
 
-  return kColorKernelName;
+  bool is_success = true;
+  for (auto &output_read : outputs_read) {
+    is_success = output_read.Wait() && is_success;
+  }
+  rows->seconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+          .count();
+  return is_success;
 }
 
 void Image::GenerateBlueNoiseOffsets() {
@@ -1430,28 +2530,208 @@ bool Image::DuplicateBlueNoiseOffsetExists() const {
   return false;
 }
 
-bool Image::VerifyOpenCLBuffers(const std::string &kernel_name,
+BlueNoiseMemory Image::GetOpenCLBlueNoiseMemory(const OpenCLRows &rows,
+                                                Image *blue_noise,
+                                                bool grayscale) {
+  static std::once_flag image_warning;
+  static std::once_flag local_warning;
+  BlueNoiseMemory memory = opencl_blue_noise_memory_ != BlueNoiseMemory::kAuto
+                               ? opencl_blue_noise_memory_
+                               : blue_noise_memory_;
+  if (memory == BlueNoiseMemory::kAuto) {
+    // only picks memories that the device can hold blue_noise in
+    return BlueNoiseTuner::GetMemory(width_, rows.count, grayscale,
+                                     blue_noise, rows.handle);
+  } else if (memory == BlueNoiseMemory::kImage &&
+             !rows.handle->HasImageSupport()) {
+    std::call_once(image_warning, [] {
+      std::cout << "WARNING: OpenCL device has no image support, reading "
+                   "blue noise from a buffer"
+                << std::endl;
+    });
+    return BlueNoiseMemory::kBuffer;
+  } else if (memory == BlueNoiseMemory::kLocal &&
+             blue_noise->data_.size() > rows.handle->GetDeviceLocalMemSize()) {
+    std::call_once(local_warning, [] {
+      std::cout << "WARNING: Blue noise does not fit in OpenCL local memory, "
+                   "reading it from a buffer"
+                << std::endl;
+    });
+    return BlueNoiseMemory::kBuffer;
+  }
+  return memory;
+}
+
+bool Image::SetOpenCLBlueNoise(const OpenCLRows &rows,
+                               const std::string &kernel_name,
+                               BlueNoiseMemory memory, const Image &blue_noise,
+                               unsigned int channel_count,
+                               unsigned int offsets_index,
+                               OpenCLHandle::Event *written) {
+  const OpenCLHandle::Ptr &opencl_handle = rows.handle;
+  const std::size_t size = blue_noise.data_.size();
+  if (opencl_handle->HasBuffer(kernel_name, kBufferBlueNoiseName) &&
+      opencl_handle->GetBufferSize(kernel_name, kBufferBlueNoiseName) !=
+          size) {
+    opencl_handle->CleanupBuffer(kernel_name, kBufferBlueNoiseName);
+  }
+
+  // the tile is copied every time like the thresholds of kBuffer, but it is
+  // only the size of the blue noise instead of the Image
+  const bool is_image = memory == BlueNoiseMemory::kImage;
+  bool is_copied = false;
+  if (is_image) {
+    is_copied =
+        (opencl_handle->HasBuffer(kernel_name, kBufferBlueNoiseName) ||
+         opencl_handle->CreateKernelImage(
+             kernel_name, CL_MEM_READ_ONLY, blue_noise.width_,
+             blue_noise.height_, nullptr, kBufferBlueNoiseName)) &&
+        opencl_handle->SetKernelImageDataAsync(
+            kernel_name, kBufferBlueNoiseName, blue_noise.width_,
+            blue_noise.height_, blue_noise.data_.data(), {}, written);
+  } else {
+    is_copied =
+        (opencl_handle->HasBuffer(kernel_name, kBufferBlueNoiseName) ||
+         opencl_handle->CreateKernelBuffer(kernel_name, CL_MEM_READ_ONLY,
+                                           size, nullptr,
+                                           kBufferBlueNoiseName)) &&
+        opencl_handle->SetKernelBufferDataAsync(
+            kernel_name, kBufferBlueNoiseName, size, blue_noise.data_.data(),
+            {}, written);
+  }
+  if (!is_copied) {
+    std::cout << "ERROR: Failed to copy blue noise to OpenCL "
+              << BlueNoiseMemoryToString(memory) << " memory" << std::endl;
+    return false;
+  }
+
+  // offsets of each channel as in CPUDither::GetColorThresholds()
+  cl_uint2 blue_noise_size;
+  blue_noise_size.s[0] = blue_noise.width_;
+  blue_noise_size.s[1] = blue_noise.height_;
+  cl_uint8 offsets;
+  std::memset(&offsets, 0, sizeof(offsets));
+  for (unsigned int c = 0; c < channel_count; ++c) {
+    offsets.s[c * 2] = blue_noise_offsets_.at(c) % blue_noise.width_;
+    offsets.s[c * 2 + 1] =
+        (blue_noise_offsets_.at(c) / blue_noise.width_ + row_offset_ +
+         rows.first_row) %
+        blue_noise.height_;
+  }
+  if (!opencl_handle->AssignKernelBuffer(kernel_name, 1,
+                                         kBufferBlueNoiseName) ||
+      !opencl_handle->AssignKernelArgument(kernel_name, 5, sizeof(cl_uint2),
+                                           &blue_noise_size) ||
+      !opencl_handle->AssignKernelArgument(kernel_name, offsets_index,
+                                           sizeof(cl_uint8), &offsets) ||
+      (memory == BlueNoiseMemory::kLocal &&
+       !opencl_handle->AssignKernelArgument(kernel_name, offsets_index + 1,
+                                            size, nullptr))) {
+    std::cout << "ERROR: Failed to set blue noise parameters of "
+              << kernel_name << std::endl;
+    return false;
+  }
+
+  return true;
+}
+
+void Image::CleanupOpenCLBuffers(const OpenCLHandle::Ptr &opencl_handle,
+                                 const std::string &kernel_name) {
+  for (const std::string &buffer_name :
+       {kBufferInputName, kBufferOutputName, kBufferThresholdsName}) {
+    if (opencl_handle->HasBuffer(kernel_name, buffer_name)) {
+      opencl_handle->CleanupBuffer(kernel_name, buffer_name);
+    }
+  }
+}
+
+bool Image::IsOpenCLZeroCopyUsable(const OpenCLRows &rows,
+                                   const Image &output_image) const {
+  typedef CacheAlignedAllocator<uint8_t> Allocator;
+  // buffers over some of the rows could reach into the rows of other devices
+  if (rows.first_row != 0 || rows.count != height_ ||
+      !rows.handle->HasUnifiedMemory()) {
+    return false;
+  }
+  // integrated GPUs copy host memory that does not start on a page, and the
+  // device may need more
+  const std::size_t alignment = std::max(
+      rows.handle->GetDeviceMemBaseAddrAlign(), Allocator::kPageSize);
+  for (const Image *image : {this, &output_image}) {
+    if (Allocator::GetAlignment(image->data_.size()) % alignment != 0 ||
+        reinterpret_cast<std::uintptr_t>(image->data_.data()) % alignment !=
+            0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool Image::CreateZeroCopyOpenCLBuffers(const OpenCLHandle::Ptr &opencl_handle,
+                                        const std::string &kernel_name,
+                                        Image *output_image) {
+  typedef CacheAlignedAllocator<uint8_t> Allocator;
+  // buffers of a previous image that was copied to the device
+  for (const std::string &buffer_name : {kBufferInputName, kBufferOutputName}) {
+    if (opencl_handle->HasBuffer(kernel_name, buffer_name)) {
+      opencl_handle->CleanupBuffer(kernel_name, buffer_name);
+    }
+  }
+  // sizes are padded to whole pages, which the data of both images holds
+  return opencl_handle->CreateKernelBuffer(
+             kernel_name, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR,
+             Allocator::GetAllocatedSize(data_.size()), data_.data(),
+             kBufferInputName) &&
+         opencl_handle->CreateKernelBuffer(
+             kernel_name, CL_MEM_WRITE_ONLY | CL_MEM_USE_HOST_PTR,
+             Allocator::GetAllocatedSize(output_image->data_.size()),
+             output_image->data_.data(), kBufferOutputName);
+}
+
+bool Image::ReadZeroCopyOpenCLOutput(const OpenCLHandle::Ptr &opencl_handle,
+                                     const std::string &kernel_name,
+                                     const OpenCLHandle::Event &dithered) {
+  // mapping makes the output visible in the output image's data, which the
+  // returned pointer points to
+  void *output = opencl_handle->MapKernelBuffer(kernel_name, kBufferOutputName,
+                                                CL_MAP_READ, {dithered});
+  OpenCLHandle::Event unmapped;
+  if (output == nullptr ||
+      !opencl_handle->UnmapKernelBuffer(kernel_name, kBufferOutputName, output,
+                                        &unmapped) ||
+      !unmapped.Wait()) {
+    return false;
+  }
+
+  // the buffers must not outlive the images' data, and the kernel finished
+  // before the unmap
+  opencl_handle->ReleaseHostBuffer(kernel_name, kBufferInputName);
+  opencl_handle->ReleaseHostBuffer(kernel_name, kBufferOutputName);
+  return true;
+}
+
+bool Image::VerifyOpenCLBuffers(const OpenCLHandle::Ptr &opencl_handle,
+                                const std::string &kernel_name,
                                 const std::vector<std::string> &buffer_names,
-                                const Image *input_image,
-                                const Image *blue_noise_image) const {
+                                std::size_t input_size,
+                                std::size_t output_size,
+                                std::size_t thresholds_size) const {
   std::size_t size;
   for (auto &buffer_name : buffer_names) {
-    size = opencl_handle_->GetBufferSize(kernel_name, buffer_name);
+    size = opencl_handle->GetBufferSize(kernel_name, buffer_name);
     if (size == 0) {
       return false;
     }
-    if (buffer_name == kBufferInputName || buffer_name == kBufferOutputName) {
-      if (input_image->is_grayscale_) {
-        if (size != input_image->width_ * input_image->height_) {
-          return false;
-        }
-      } else {
-        if (size != input_image->width_ * input_image->height_ * 4) {
-          return false;
-        }
+    if (buffer_name == kBufferInputName) {
+      if (size != input_size) {
+        return false;
+      }
+    } else if (buffer_name == kBufferOutputName) {
+      if (size != output_size) {
+        return false;
       }
-    } else if (buffer_name == kBufferBlueNoiseName) {
-      if (size != blue_noise_image->width_ * blue_noise_image->height_) {
+    } else if (buffer_name == kBufferThresholdsName) {
+      if (size != thresholds_size) {
         return false;
       }
     }
@@ -1,6 +1,8 @@
 #ifndef IGPUP_DITHERING_PROJECT_IMAGE_H_
 #define IGPUP_DITHERING_PROJECT_IMAGE_H_
 
+#include <array>
+#include <cstddef>
 #include <cstdint>
 #include <memory>
 #include <string>
@@ -8,7 +10,12 @@
 
 #include <png.h>
 
+#include "aligned_allocator.h"
+#include "blue_noise_memory.h"
+#include "dither_backend.h"
 #include "opencl_handle.h"
+#include "simd_dither.h"
+#include "work_group_tuner.h"
 
 class Image {
  public:
@@ -21,11 +28,15 @@ class Image {
    *
    * Image supports decoding .png, .pgm, and .ppm . Decoding only checks the
    * filename suffix as a guide on which file-type to expect.
+   *
+   * If planar is true, color images are decoded into separate R, G, B (and A
+   * if the file has alpha) planes, see IsPlanar(). Grayscale images are not
+   * affected.
    */
-  explicit Image(const char *filename);
+  explicit Image(const char *filename, bool planar = false);
 
-  /// Same constructor as Image(const char *filename)
-  explicit Image(const std::string &filename);
+  /// Same constructor as Image(const char *filename, bool planar)
+  explicit Image(const std::string &filename, bool planar = false);
 
   // allow copy
   Image(const Image &other) = default;
@@ -53,8 +64,13 @@ class Image {
    *
    * For grayscale images, each pixel is one byte.
    * For colored images, each pixel is 4 bytes: R, G, B, and Alpha.
+   * Planar images hold 3 or 4 planes of GetPlaneSize() bytes, see IsPlanar().
+   * Dithered images are packed, see IsDithered().
    */
-  unsigned int GetSize() const;
+  std::size_t GetSize() const;
+  /// Returns the number of bytes in a row of the image's data (of one plane
+  /// if planar).
+  unsigned int GetRowSize() const;
   /// Returns the width of the image.
   unsigned int GetWidth() const;
   /// Returns the height of the image.
@@ -63,6 +79,35 @@ class Image {
   /// Returns true if the image is grayscale. If false, then the image is RGBA.
   bool IsGrayscale() const;
 
+  /*!
+   * \brief Returns true if the color image is stored as planes.
+   *
+   * Planar images hold the red, green, and blue channels (and alpha, only if
+   * the decoded file had alpha) in separate planes of PixelFormat::PlanarRGB,
+   * each starting on a cache line. Dithering reads each channel as one
+   * contiguous stream.
+   */
+  bool IsPlanar() const;
+
+  /// Returns the number of channel planes, 0 if the image is not planar.
+  unsigned int GetPlaneCount() const;
+
+  /// Returns the number of bytes from the start of a plane to the next one.
+  std::size_t GetPlaneSize() const;
+
+  /*!
+   * \brief Returns true if the image is the packed output of dithering.
+   *
+   * Dithered grayscale images hold 1 bit per pixel, with the first pixel of a
+   * byte in the most significant bit (same as 1-bit PNG and
+   * AV_PIX_FMT_MONOBLACK).
+   * Dithered color images hold 4 bits per pixel, with the first pixel of a
+   * byte in the high nibble. Each nibble has the IGPUP_PROJECT_NIBBLE_* bits
+   * of cpu_dither.h set (same as AV_PIX_FMT_RGB4).
+   * Rows start on a byte boundary.
+   */
+  bool IsDithered() const;
+
   /*!
    * \brief Saves the current image data as a PNG file.
    *
@@ -124,55 +169,411 @@ class Image {
    */
   std::unique_ptr<Image> ToColorDitheredWithBlueNoise(Image *blue_noise);
 
-  /// Returns the grayscale Dithering Kernel function as a C string
-  static const char *GetGrayscaleDitheringKernel();
+  /// Returns the grayscale Dithering Kernel function that reads the blue
+  /// noise from memory
+  static std::string GetGrayscaleDitheringKernel(
+      BlueNoiseMemory memory = BlueNoiseMemory::kBuffer);
 
-  /// Returns the color Dithering Kernel function as a C string
-  static const char *GetColorDitheringKernel();
+  /// Returns the color Dithering Kernel function that reads the blue noise
+  /// from memory
+  static std::string GetColorDitheringKernel(
+      BlueNoiseMemory memory = BlueNoiseMemory::kBuffer);
 
-  /// Returns the OpenCLHandle::Ptr instance
-  OpenCLHandle::Ptr GetOpenCLHandle();
+  /*!
+   * \brief Returns the Dithering Kernel function that takes RGBA input and
+   * outputs dithered grayscale, reading the blue noise from memory.
+   */
+  static std::string GetGrayscaleFromColorDitheringKernel(
+      BlueNoiseMemory memory = BlueNoiseMemory::kBuffer);
+
+  /*!
+   * \brief Returns the Dithering Kernel function that dithers a batch of
+   * grayscale, RGBA, or planar images to grayscale in one launch (see
+   * BatchDither).
+   */
+  static std::string GetBatchGrayscaleDitheringKernel();
+
+  /// Same as GetBatchGrayscaleDitheringKernel(), but dithers RGBA or planar
+  /// images to color
+  static std::string GetBatchColorDitheringKernel();
+
+  /// Returns the OpenCLHandle of the calling thread for the device of this
+  /// Image, see OpenCLContext::GetHandle()
+  OpenCLHandle::Ptr GetOpenCLHandle() const;
+
+  /*!
+   * \brief Sets where dithering is done.
+   *
+   * The default is DitherBackend::kAuto, which uses the fastest backend
+   * measured by BackendTuner and falls back to dithering on the CPU if OpenCL
+   * fails.
+   */
+  void SetDitherBackend(DitherBackend backend);
+
+  /// Returns the DitherBackend used by the dithering functions
+  DitherBackend GetDitherBackend() const;
+
+  /*!
+   * \brief Sets where the OpenCL kernels of every Image read the blue noise
+   * from.
+   *
+   * The default is BlueNoiseMemory::kAuto, which uses the fastest memory
+   * measured by BlueNoiseTuner for each device and image size. Devices that
+   * cannot hold the blue noise in the given memory use
+   * BlueNoiseMemory::kBuffer instead.
+   */
+  static void SetBlueNoiseMemory(BlueNoiseMemory memory);
+
+  /// Returns the BlueNoiseMemory set with SetBlueNoiseMemory()
+  static BlueNoiseMemory GetBlueNoiseMemory();
 
  private:
+  friend class BackendTuner;
+  friend class BatchDither;
+  friend class BlueNoiseTuner;
   friend class Video;
+  friend class StreamDither;
 
   static constexpr unsigned int kBlueNoiseOffsetMax = 128;
+  static constexpr unsigned int kPPMRowsPerBatch = 256;
+  /// Fewest rows of a strip that is dithered on its own OpenCL queue
+  static constexpr unsigned int kMinOpenCLStripRows = 64;
+  /// Pixels of a row dithered by each work item of the grayscale kernel,
+  /// must match GetGrayscaleDitheringKernel()
+  static constexpr unsigned int kOpenCLGrayscalePixelsPerItem = 16;
+  /// Pixels of a row dithered by each work item of the color and grayscale
+  /// from color kernels
+  static constexpr unsigned int kOpenCLColorPixelsPerItem = 8;
+  /// Values per image in the table of the batch kernels, must match
+  /// GetBatchDitheringKernel()
+  static constexpr unsigned int kBatchImageInfoSize = 16;
   static const char *kOpenCLGrayscaleKernel;
   static const char *kOpenCLColorKernel;
+  static const char *kOpenCLGrayscaleFromColorKernel;
   static const std::array<png_color, 2> kDitherBWPalette;
-  static const std::array<png_color, 8> kDitherColorPalette;
+  static const std::array<png_color, 16> kDitherColorPalette;
   static const std::string kBufferInputName;
   static const std::string kBufferOutputName;
+  static const std::string kBufferThresholdsName;
   static const std::string kBufferBlueNoiseName;
-  static const std::string kBufferBlueNoiseOffsetsName;
-  static const std::string kGrayscaleKernelName;
-  static const std::string kColorKernelName;
+  /// Kernel names, indexed by BlueNoiseMemory
+  static const std::array<std::string, 3> kGrayscaleKernelNames;
+  static const std::array<std::string, 3> kColorKernelNames;
+  static const std::array<std::string, 3> kGrayscaleFromColorKernelNames;
+  static const std::string kBatchGrayscaleKernelName;
+  static const std::string kBatchColorKernelName;
   static const std::string kEmptyString;
-  OpenCLHandle::Ptr opencl_handle_;
+  static BlueNoiseMemory blue_noise_memory_;
+  /// Device of GetOpenCLHandle(), or -1 to split rows between every device
+  int opencl_device_index_;
+  /// Memory that the OpenCL kernels read the blue noise from for this Image,
+  /// or BlueNoiseMemory::kAuto to use blue_noise_memory_
+  BlueNoiseMemory opencl_blue_noise_memory_;
   std::array<unsigned int, 3> blue_noise_offsets_;
-  /// Internally holds rgba or grayscale (1 channel)
-  std::vector<uint8_t> data_;
+  /// Internally holds rgba, grayscale (1 channel), planes of rgb(a), or packed
+  /// dithered pixels
+  std::vector<uint8_t, CacheAlignedAllocator<uint8_t>> data_;
   unsigned int width_;
   unsigned int height_;
+  /// Row of the whole image that row 0 is at, when dithering in strips
+  unsigned int row_offset_;
+  /// Number of channel planes of a planar image, 0 if interleaved
+  unsigned int plane_count_;
   bool is_grayscale_;
   bool is_dithered_grayscale_;
   bool is_dithered_color_;
   bool is_preserving_blue_noise_offsets_;
+  DitherBackend dither_backend_;
+
+  /// Rows of this Image that one OpenCL device dithers
+  struct OpenCLRows {
+    OpenCLHandle::Ptr handle;
+    unsigned int first_row;
+    unsigned int count;
+    /// Seconds from enqueuing the dithering of the rows to reading their
+    /// output, which DeviceScheduler weighs devices by
+    double seconds;
+  };
 
-  void DecodePNG(const std::string &filename);
+  void DecodePNG(const std::string &filename, bool planar);
   void DecodePGM(const std::string &filename);
-  void DecodePPM(const std::string &filename);
+  void DecodePPM(const std::string &filename, bool planar);
+
+  /*!
+   * \brief Sizes data_ for the pixels of a PPM of width_ x height_.
+   *
+   * Sets the steps between pixels and between channels, so that channel c of
+   * pixel i is at i * pixel_step + c * channel_step of data_.
+   */
+  void PreparePPMData(bool planar, unsigned int *pixel_step,
+                      std::size_t *channel_step);
+
+  const std::string &GetGrayscaleKernelName(
+      const OpenCLHandle::Ptr &opencl_handle, BlueNoiseMemory memory,
+      const Image &blue_noise);
+  const std::string &GetColorKernelName(const OpenCLHandle::Ptr &opencl_handle,
+                                        BlueNoiseMemory memory,
+                                        const Image &blue_noise);
+  const std::string &GetGrayscaleFromColorKernelName(
+      const OpenCLHandle::Ptr &opencl_handle, BlueNoiseMemory memory,
+      const Image &blue_noise);
+
+  /*!
+   * \brief Creates kernel_name on opencl_handle from the source of
+   * get_source, specialized for blue_noise, unless it exists with the same
+   * specialization.
+   *
+   * \return True on success.
+   */
+  bool CreateOpenCLKernel(const OpenCLHandle::Ptr &opencl_handle,
+                          const std::string &kernel_name,
+                          std::string (*get_source)(BlueNoiseMemory),
+                          BlueNoiseMemory memory, const Image &blue_noise);
+
+  /*!
+   * \brief Returns the build options that specialize the kernels reading
+   * from memory for blue_noise.
+   *
+   * The kernels of BlueNoiseMemory::kImage and BlueNoiseMemory::kLocal get
+   * the blue noise size as constants.
+   */
+  static std::string GetBlueNoiseBuildOptions(BlueNoiseMemory memory,
+                                              const Image &blue_noise);
+
+  /*!
+   * \brief Returns a kernel named kernel_name that dithers a batch of images
+   * from one input buffer into one output buffer.
+   *
+   * Each work item dithers 8 pixels of a row of one of the images, found
+   * from the table of kBatchImageInfoSize values per image that
+   * BatchDither fills. body dithers the pixels of work item (idx, idy) of
+   * the image, whose values are in info.
+   */
+  static std::string GetBatchDitheringKernel(const std::string &kernel_name,
+                                             const char *body);
+
+  /// Returns the entry of kernel_names for memory
+  static const std::string &GetKernelName(
+      const std::array<std::string, 3> &kernel_names, BlueNoiseMemory memory);
+
+  /*!
+   * \brief Returns a kernel named kernel_name that reads the blue noise
+   * tile from image or local memory.
+   *
+   * body dithers the pixels of work item (idx, idy) with LoadThresholds().
+   * If is_color_input is true, the kernel also takes the pixel_step and
+   * input_channel_step of LoadRGB8().
+   */
+  static std::string GetTileDitheringKernel(const std::string &kernel_name,
+                                            BlueNoiseMemory memory,
+                                            bool is_color_input,
+                                            const char *body);
+
+  /// Returns the thresholds of CPUDither::GetGrayscaleThresholds() for rows
+  /// rows of this Image from first_row
+  std::vector<uint8_t> GetGrayscaleThresholds(const Image &blue_noise,
+                                              unsigned int first_row,
+                                              unsigned int rows) const;
+
+  /*!
+   * \brief Returns the thresholds of CPUDither::GetColorThresholds() for
+   * rows rows of this Image from first_row, or of
+   * CPUDither::GetPlanarColorThresholds() if it is planar.
+   */
+  std::vector<uint8_t> GetColorThresholds(const Image &blue_noise,
+                                          unsigned int first_row,
+                                          unsigned int rows) const;
+
+  /*!
+   * \brief Returns the backend to dither this Image with.
+   *
+   * This is dither_backend_, or for DitherBackend::kAuto, the backend picked
+   * by BackendTuner for the size of this Image and the device of
+   * GetOpenCLHandle().
+   */
+  DitherBackend ResolveDitherBackend(bool grayscale, Image *blue_noise);
+
+  /// Returns true if the dithering functions should try OpenCL first
+  bool IsUsingOpenCL(DitherBackend backend);
+
+  /// Returns the ISA used when dithering on the CPU
+  SIMDDither::ISA GetSIMDISA(DitherBackend backend) const;
+
+  /*!
+   * \brief Dithers this Image into result_image with OpenCL, grayscale or
+   * color, split between the devices of GetOpenCLSplitDevices() if any.
+   *
+   * \return True on success.
+   */
+  bool DitherWithOpenCL(Image *result_image, Image *blue_noise,
+                        bool grayscale);
+
+  /*!
+   * \brief Dithers rows of this Image into the same rows of grayscale_image
+   * on the device of rows, and sets its seconds.
+   *
+   * \return True on success.
+   */
+  bool DitherGrayscaleWithOpenCL(Image *grayscale_image, Image *blue_noise,
+                                 OpenCLRows *rows);
+
+  /*!
+   * \brief Dithers rows of this Image into the same rows of result_image on
+   * the device of rows, and sets its seconds.
+   *
+   * \return True on success.
+   */
+  bool DitherColorWithOpenCL(Image *result_image, Image *blue_noise,
+                             OpenCLRows *rows);
+
+  /*!
+   * \brief Returns the memory that the kernels read blue_noise from on the
+   * device of rows.
+   *
+   * This is opencl_blue_noise_memory_ or blue_noise_memory_, for
+   * BlueNoiseMemory::kAuto the memory picked by BlueNoiseTuner for the size
+   * of rows and grayscale or color dithering. It is
+   * BlueNoiseMemory::kBuffer if the device has no image support or too
+   * little local memory for blue_noise.
+   */
+  BlueNoiseMemory GetOpenCLBlueNoiseMemory(const OpenCLRows &rows,
+                                           Image *blue_noise, bool grayscale);
+
+  /*!
+   * \brief Copies blue_noise to the image or local memory kernel
+   * kernel_name, and assigns it with its size and the offsets of
+   * channel_count channels.
+   *
+   * The offsets are parameter offsets_index, the __local tile of
+   * BlueNoiseMemory::kLocal is the parameter after it. The offsets start at
+   * the first row of rows. written is set to the event of the copy.
+   *
+   * \return True on success.
+   */
+  bool SetOpenCLBlueNoise(const OpenCLRows &rows,
+                          const std::string &kernel_name,
+                          BlueNoiseMemory memory, const Image &blue_noise,
+                          unsigned int channel_count,
+                          unsigned int offsets_index,
+                          OpenCLHandle::Event *written);
+
+  /*!
+   * \brief Returns the valid OpenCL devices that rows are split between, or
+   * no devices if rows are dithered on the device of GetOpenCLHandle().
+   */
+  std::vector<std::size_t> GetOpenCLSplitDevices() const;
+
+  /*!
+   * \brief Dithers rows of this Image on every OpenCL device at once, into
+   * result_image.
+   *
+   * Rows are split by DeviceScheduler from the measured throughput of each
+   * device. Each device copies its rows from data_ and into result_image
+   * itself, and if only one device gets rows, it dithers them on the
+   * calling thread.
+   *
+   * \return True on success.
+   */
+  bool DitherWithOpenCLDevices(Image *result_image, Image *blue_noise,
+                               bool grayscale,
+                               const std::vector<std::size_t> &devices);
+
+  /// Returns the size of a plane of rows in the input buffer, 0 if this
+  /// Image is not planar
+  std::size_t GetOpenCLInputPlaneSize(const OpenCLRows &rows) const;
 
-  const std::string &GetGrayscaleKernelName();
-  const std::string &GetColorKernelName();
+  /// Returns the size of the input buffer for rows, with planes of
+  /// GetOpenCLInputPlaneSize() if this Image is planar
+  std::size_t GetOpenCLInputSize(const OpenCLRows &rows) const;
+
+  /*!
+   * \brief Enqueues copying count rows from first_row of rows of this Image
+   * to the same rows of input, on queue queue_index.
+   *
+   * written, if not nullptr, is set to the event of the last copy.
+   *
+   * \return True on success.
+   */
+  bool WriteOpenCLInput(const OpenCLRows &rows,
+                        const OpenCLHandle::BufferRef &input,
+                        unsigned int first_row, unsigned int count,
+                        std::size_t queue_index,
+                        OpenCLHandle::Event *written) const;
+
+  /*!
+   * \brief Returns the work group shape to dither rows with kernel_name,
+   * from WorkGroupTuner.
+   *
+   * The kernel's arguments must be assigned already. If the shape was not
+   * measured yet, the kernel is run with every candidate shape after
+   * thresholds_written. Unless is_input_written is true, rows are copied to
+   * the input buffer before the first run, and is_input_written is set.
+   */
+  WorkGroupShape GetOpenCLWorkGroupShape(
+      const OpenCLRows &rows, const std::string &kernel_name,
+      unsigned int global_work_size_0,
+      const OpenCLHandle::Event &thresholds_written, bool *is_input_written);
+
+  /*!
+   * \brief Copies rows of this Image to the device, dithers them with
+   * kernel_name, and copies the output into the same rows of result_image,
+   * in strips of rows, then sets the seconds of rows.
+   *
+   * row_items is the global work size of a row, before padding to shape.
+   * Strips use one queue each (see OpenCLHandle::GetQueueCount()), so that
+   * copying one strip overlaps with dithering another. The kernel's
+   * arguments must be assigned already, and its input and output buffers
+   * must hold rows. If is_input_written is true, the input buffer holds
+   * rows already and only the output is copied.
+   *
+   * \return True on success.
+   */
+  bool DitherOpenCLStrips(OpenCLRows *rows, const std::string &kernel_name,
+                          Image *result_image, unsigned int row_items,
+                          const WorkGroupShape &shape,
+                          const OpenCLHandle::Event &thresholds_written,
+                          bool is_input_written);
 
   void GenerateBlueNoiseOffsets();
   bool DuplicateBlueNoiseOffsetExists() const;
 
-  bool VerifyOpenCLBuffers(const std::string &kernel_name,
+  /// Removes the buffers of kernel_name on opencl_handle, but not the kernel
+  void CleanupOpenCLBuffers(const OpenCLHandle::Ptr &opencl_handle,
+                            const std::string &kernel_name);
+
+  /*!
+   * \brief Returns true if rows are all of this Image, the device of rows
+   * has unified memory, and the data of this Image and output_image is
+   * aligned so that the device uses it without copying.
+   *
+   * Data of at least a page starts on a page (see CacheAlignedAllocator).
+   * Smaller images are copied like on other devices.
+   */
+  bool IsOpenCLZeroCopyUsable(const OpenCLRows &rows,
+                              const Image &output_image) const;
+
+  /*!
+   * \brief Creates input and output buffers that use the data of this Image
+   * and output_image, see IsOpenCLZeroCopyUsable().
+   */
+  bool CreateZeroCopyOpenCLBuffers(const OpenCLHandle::Ptr &opencl_handle,
+                                   const std::string &kernel_name,
+                                   Image *output_image);
+
+  /*!
+   * \brief Waits for dithered and makes the output visible in the data of
+   * the output image, then releases the buffers of
+   * CreateZeroCopyOpenCLBuffers() without waiting for other commands.
+   */
+  bool ReadZeroCopyOpenCLOutput(const OpenCLHandle::Ptr &opencl_handle,
+                                const std::string &kernel_name,
+                                const OpenCLHandle::Event &dithered);
+
+  bool VerifyOpenCLBuffers(const OpenCLHandle::Ptr &opencl_handle,
+                           const std::string &kernel_name,
                            const std::vector<std::string> &buffer_names,
-                           const Image *input_image,
-                           const Image *blue_noise_image) const;
+                           std::size_t input_size, std::size_t output_size,
+                           std::size_t thresholds_size) const;
 };
 
 #endif
@@ -1,8 +1,87 @@
 #include <iostream>
 
 #include "arg_parse.h"
+#include "backend_tuner.h"
+#include "batch_dither.h"
+#include "blue_noise_tuner.h"
 #include "image.h"
+#include "opencl_profiler.h"
+#include "stream_dither.h"
+#include "thread_pool.h"
 #include "video.h"
+#include "work_group_tuner.h"
+
+namespace {
+/// Reports the OpenCL profile when destructed, which is after the Images
+/// declared later in main are done with OpenCL
+class ProfileReport {
+ public:
+  explicit ProfileReport(const Args &args)
+      : is_printing_(args.do_profile_),
+        json_filename_(args.profile_json_filename_) {}
+
+  ~ProfileReport() {
+    if (is_printing_) {
+      OpenCLProfiler::PrintSummary(std::cout);
+    }
+    if (!json_filename_.empty()) {
+      OpenCLProfiler::WriteJSON(json_filename_);
+    }
+  }
+
+ private:
+  bool is_printing_;
+  std::string json_filename_;
+};
+
+/// Dithers each of several input images to the output filename at the same
+/// position with one BatchDither, returns the exit code of main
+int DitherImages(const Args &args, Image *blue_noise) {
+  if (args.input_filenames.size() != args.output_filenames.size()) {
+    std::cout << "ERROR: Got " << args.input_filenames.size()
+              << " input images but " << args.output_filenames.size()
+              << " output filenames" << std::endl;
+    Args::PrintUsage();
+    return 9;
+  }
+
+  std::vector<std::unique_ptr<Image>> input_images;
+  std::vector<Image *> images;
+  for (const std::string &filename : args.input_filenames) {
+    input_images.emplace_back(new Image(filename, args.do_planar_));
+    if (!input_images.back()->IsValid()) {
+      std::cout << "ERROR: Invalid input image file \"" << filename << '"'
+                << std::endl;
+      Args::PrintUsage();
+      return 2;
+    }
+    input_images.back()->SetDitherBackend(args.dither_backend_);
+    images.push_back(input_images.back().get());
+  }
+
+  BatchDither batch_dither;
+  std::vector<std::unique_ptr<Image>> output_images =
+      args.do_dither_grayscaled_
+          ? batch_dither.ToGrayscaleDitheredWithBlueNoise(images, blue_noise)
+          : batch_dither.ToColorDitheredWithBlueNoise(images, blue_noise);
+  for (std::size_t i = 0; i < output_images.size(); ++i) {
+    if (!output_images[i]) {
+      std::cout << "ERROR: Failed to dither input image \""
+                << args.input_filenames[i] << '"' << std::endl;
+      Args::PrintUsage();
+      return args.do_dither_grayscaled_ ? 3 : 5;
+    }
+    if (!output_images[i]->SaveAsPNG(args.output_filenames[i],
+                                     args.do_overwrite_)) {
+      std::cout << "ERROR: Failed to saved dithered image from input \""
+                << args.input_filenames[i] << '"' << std::endl;
+      Args::PrintUsage();
+      return args.do_dither_grayscaled_ ? 4 : 6;
+    }
+  }
+  return 0;
+}
+}  // namespace
 
 int main(int argc, char **argv) {
   Args args{};
@@ -10,6 +89,24 @@ int main(int argc, char **argv) {
     return 0;
   }
 
+  OpenCLContext::SetDeviceSelection(args.cl_platform_index_,
+                                    args.cl_device_index_);
+  if (args.do_list_devices_) {
+    OpenCLContext::PrintDevices(std::cout);
+    return 0;
+  }
+
+  ThreadPool::SetThreadCount(args.thread_count_);
+  OpenCLContext::SetProgramCacheDirectory(args.cache_directory_);
+  BackendTuner::SetCacheDirectory(args.cache_directory_);
+  WorkGroupTuner::SetCacheDirectory(args.cache_directory_);
+  BlueNoiseTuner::SetCacheDirectory(args.cache_directory_);
+  OpenCLProfiler::SetEnabled(args.do_profile_ ||
+                             !args.profile_json_filename_.empty());
+  ProfileReport profile_report(args);
+  OpenCLContext::SetPipelineDepth(args.pipeline_depth_);
+  Image::SetBlueNoiseMemory(args.blue_noise_memory_);
+
   Image blue_noise(args.blue_noise_filename);
   if (!blue_noise.IsValid() || !blue_noise.IsGrayscale()) {
     std::cout << "ERROR: Invalid blue noise file \"" << args.blue_noise_filename
@@ -18,14 +115,28 @@ int main(int argc, char **argv) {
     return 1;
   }
 
-  if (args.do_dither_image_) {
-    Image input_image(args.input_filename);
+  if (args.do_dither_image_ && args.do_stream_) {
+    StreamDither stream_dither(args.input_filename);
+    stream_dither.SetDitherBackend(args.dither_backend_);
+    if (!stream_dither.DitherToPNG(args.output_filename, &blue_noise,
+                                   args.do_dither_grayscaled_,
+                                   args.do_overwrite_)) {
+      std::cout << "ERROR: Failed to dither input image \""
+                << args.input_filename << "\" in strips" << std::endl;
+      Args::PrintUsage();
+      return 8;
+    }
+  } else if (args.do_dither_image_ && args.input_filenames.size() > 1) {
+    return DitherImages(args, &blue_noise);
+  } else if (args.do_dither_image_) {
+    Image input_image(args.input_filename, args.do_planar_);
     if (!input_image.IsValid()) {
       std::cout << "ERROR: Invalid input image file \"" << args.input_filename
                 << '"' << std::endl;
       Args::PrintUsage();
       return 2;
     }
+    input_image.SetDitherBackend(args.dither_backend_);
 
     if (args.do_dither_grayscaled_) {
       auto output_image =
@@ -59,6 +170,7 @@ int main(int argc, char **argv) {
     }
   } else {
     Video video(args.input_filename);
+    video.SetDitherBackend(args.dither_backend_);
     if (!video.DitherVideo(args.output_filename, &blue_noise,
                            args.do_dither_grayscaled_, args.do_overwrite_,
                            args.do_video_pngs_)) {
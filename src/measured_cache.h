@@ -0,0 +1,172 @@
+#ifndef IGPUP_DITHERING_PROJECT_MEASURED_CACHE_H_
+#define IGPUP_DITHERING_PROJECT_MEASURED_CACHE_H_
+
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+
+#include "cache_dir.h"
+
+/*!
+ * \brief Values that are measured once per key, e.g. the fastest backend for
+ * an image size on a device, and saved to a file in the cache directory.
+ *
+ * Used by BackendTuner, WorkGroupTuner, and BlueNoiseTuner. Values are
+ * measured without holding the lock, so other keys are not blocked. Callers
+ * that need a key while another thread measures it get a fallback value that
+ * is not cached, instead of waiting: they may be tasks of the ThreadPool that
+ * the measuring thread waits for.
+ *
+ * The file has a key and value per line, read by a ParseLineFn and written by
+ * a WriteLineFn. Lines that do not parse are skipped.
+ */
+template <typename Key, typename Value>
+class MeasuredCache {
+ public:
+  /// Reads line into key and value, returns false if it is not valid
+  typedef bool (*ParseLineFn)(const std::string &line, Key *key, Value *value);
+  /// Writes key and value as one line to out, without the newline
+  typedef void (*WriteLineFn)(std::ostream &out, const Key &key,
+                              const Value &value);
+
+  /*!
+   * \brief Creates a cache saved to name in GetCacheDirectory().
+   *
+   * description names the values in warnings, e.g. "work group sizes".
+   */
+  MeasuredCache(const char *name, const char *description,
+                ParseLineFn parse_line, WriteLineFn write_line)
+      : values_(),
+        measuring_(),
+        name_(name),
+        description_(description),
+        parse_line_(parse_line),
+        write_line_(write_line),
+        directory_(GetCacheDirectory()),
+        is_loaded_(false) {}
+
+  // no copy
+  MeasuredCache(const MeasuredCache &other) = delete;
+  MeasuredCache &operator=(const MeasuredCache &other) = delete;
+
+  /*!
+   * \brief Returns the value of key, measured with measure_fn if it is
+   * neither loaded nor measured yet.
+   *
+   * Returns fallback without caching it if another thread is measuring key.
+   */
+  Value Get(const Key &key, const Value &fallback,
+            const std::function<Value()> &measure_fn) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!is_loaded_) {
+      Load();
+      is_loaded_ = true;
+    }
+
+    auto iter = values_.find(key);
+    if (iter != values_.end()) {
+      return iter->second;
+    } else if (measuring_.count(key) != 0) {
+      return fallback;
+    }
+
+    measuring_.insert(key);
+    lock.unlock();
+    Value value = measure_fn();
+    lock.lock();
+    measuring_.erase(key);
+    values_[key] = value;
+    Save();
+    return value;
+  }
+
+  /*!
+   * \brief Sets the directory that the file is loaded from and saved to.
+   *
+   * An empty directory disables the file, so values are measured once per
+   * run.
+   */
+  void SetDirectory(const std::string &directory) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    directory_ = directory;
+    values_.clear();
+    is_loaded_ = false;
+  }
+
+ private:
+  std::mutex mutex_;
+  std::map<Key, Value> values_;
+  /// Keys that are being measured, without holding mutex_
+  std::set<Key> measuring_;
+  const char *name_;
+  const char *description_;
+  ParseLineFn parse_line_;
+  WriteLineFn write_line_;
+  std::string directory_;
+  bool is_loaded_;
+
+  /// Returns the file in directory_, or an empty string if there is none
+  std::string GetFilename() const {
+    return directory_.empty() ? std::string() : directory_ + '/' + name_;
+  }
+
+  /// Loads values_ from the file, mutex_ must be locked
+  void Load() {
+    const std::string filename = GetFilename();
+    if (filename.empty()) {
+      return;
+    }
+    std::ifstream ifs(filename);
+    if (!ifs.is_open()) {
+      // not measured yet
+      return;
+    }
+
+    std::string line;
+    while (std::getline(ifs, line)) {
+      Key key;
+      Value value;
+      if (parse_line_(line, &key, &value)) {
+        values_[key] = value;
+      }
+    }
+  }
+
+  /// Saves values_ to the file, mutex_ must be locked
+  void Save() const {
+    const std::string filename = GetFilename();
+    if (filename.empty()) {
+      return;
+    }
+
+    // written to a temporary file first, so that other processes never load
+    // a partially written file
+    const std::string temp_filename = GetTemporaryFilename(filename);
+    bool is_written = false;
+    {
+      std::ofstream ofs;
+      if (CreateParentDirectories(temp_filename)) {
+        ofs.open(temp_filename);
+      }
+      for (const auto &entry : values_) {
+        write_line_(ofs, entry.first, entry.second);
+        ofs << '\n';
+      }
+      is_written = ofs.is_open() && ofs.good();
+    }
+    if (is_written &&
+        std::rename(temp_filename.c_str(), filename.c_str()) == 0) {
+      return;
+    }
+    std::remove(temp_filename.c_str());
+    std::cout << "WARNING: Failed to save " << description_ << " to \""
+              << filename << '"' << std::endl;
+  }
+};
+
+#endif
@@ -1,30 +1,352 @@
 #include "opencl_handle.h"
 
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <iterator>
+#include <sstream>
 #include <vector>
 
-OpenCLContext::Ptr OpenCLContext::instance_ = {};
+#include "cache_dir.h"
+#include "opencl_profiler.h"
 
-OpenCLContext::OpenCLHandle::OpenCLHandle() : opencl_ptr_(), kernels_() {}
+namespace {
+/// 64-bit FNV-1a, used to name program cache files
+uint64_t HashString(const std::string &str, uint64_t hash) {
+  for (unsigned char c : str) {
+    hash ^= c;
+    hash *= 0x100000001B3ULL;
+  }
+  return hash;
+}
+
+/// Returns a string parameter of the device, or an empty string on failure
+std::string GetDeviceInfoString(cl_device_id device_id, cl_device_info param) {
+  std::size_t size = 0;
+  if (clGetDeviceInfo(device_id, param, 0, nullptr, &size) != CL_SUCCESS ||
+      size == 0) {
+    return {};
+  }
+  std::vector<char> value(size);
+  if (clGetDeviceInfo(device_id, param, size, value.data(), nullptr) !=
+      CL_SUCCESS) {
+    return {};
+  }
+  return std::string(value.data());
+}
+
+/// Returns a string parameter of the platform, or an empty string on failure
+std::string GetPlatformInfoString(cl_platform_id platform_id,
+                                  cl_platform_info param) {
+  std::size_t size = 0;
+  if (clGetPlatformInfo(platform_id, param, 0, nullptr, &size) !=
+          CL_SUCCESS ||
+      size == 0) {
+    return {};
+  }
+  std::vector<char> value(size);
+  if (clGetPlatformInfo(platform_id, param, size, value.data(), nullptr) !=
+      CL_SUCCESS) {
+    return {};
+  }
+  return std::string(value.data());
+}
+
+/// Returns a parameter of the device, or default_value on failure
+template <typename T>
+T GetDeviceInfoValue(cl_device_id device_id, cl_device_info param,
+                     T default_value) {
+  T value;
+  if (clGetDeviceInfo(device_id, param, sizeof(T), &value, nullptr) !=
+      CL_SUCCESS) {
+    return default_value;
+  }
+  return value;
+}
+
+/// Returns true if the device works on host memory
+bool IsUnifiedMemoryDevice(cl_device_id device_id) {
+  if ((GetDeviceInfoValue<cl_device_type>(device_id, CL_DEVICE_TYPE, 0) &
+       CL_DEVICE_TYPE_CPU) != 0) {
+    return true;
+  }
+  // deprecated since OpenCL 2.0, but still reported by integrated GPUs
+  return GetDeviceInfoValue<cl_bool>(device_id, CL_DEVICE_HOST_UNIFIED_MEMORY,
+                                     CL_FALSE) == CL_TRUE;
+}
+
+/// Returns every platform, or none on failure
+std::vector<cl_platform_id> GetPlatforms() {
+  cl_uint num_platforms = 0;
+  if (clGetPlatformIDs(0, nullptr, &num_platforms) != CL_SUCCESS ||
+      num_platforms == 0) {
+    return {};
+  }
+  std::vector<cl_platform_id> platform_ids(num_platforms);
+  if (clGetPlatformIDs(num_platforms, platform_ids.data(), nullptr) !=
+      CL_SUCCESS) {
+    return {};
+  }
+  return platform_ids;
+}
+
+/// Returns every device of the platform in the order of their indices for
+/// OpenCLContext::SetDeviceSelection(), or none on failure
+std::vector<cl_device_id> GetPlatformDevices(cl_platform_id platform_id) {
+  cl_uint num_devices = 0;
+  if (clGetDeviceIDs(platform_id, CL_DEVICE_TYPE_ALL, 0, nullptr,
+                     &num_devices) != CL_SUCCESS ||
+      num_devices == 0) {
+    return {};
+  }
+  std::vector<cl_device_id> device_ids(num_devices);
+  if (clGetDeviceIDs(platform_id, CL_DEVICE_TYPE_ALL, num_devices,
+                     device_ids.data(), nullptr) != CL_SUCCESS) {
+    return {};
+  }
+  return device_ids;
+}
+
+/// Returns true if the device can be used to dither
+bool IsUsableDevice(cl_device_id device_id) {
+  return GetDeviceInfoValue<cl_bool>(device_id, CL_DEVICE_AVAILABLE,
+                                     CL_FALSE) == CL_TRUE &&
+         GetDeviceInfoValue<cl_bool>(device_id, CL_DEVICE_COMPILER_AVAILABLE,
+                                     CL_FALSE) == CL_TRUE;
+}
+
+/// Returns the type of the device as printed by OpenCLContext::PrintDevices()
+const char *GetDeviceTypeName(cl_device_id device_id) {
+  const cl_device_type type =
+      GetDeviceInfoValue<cl_device_type>(device_id, CL_DEVICE_TYPE, 0);
+  if ((type & CL_DEVICE_TYPE_GPU) != 0) {
+    return "GPU";
+  } else if ((type & CL_DEVICE_TYPE_ACCELERATOR) != 0) {
+    return "accelerator";
+  } else if ((type & CL_DEVICE_TYPE_CPU) != 0) {
+    return "CPU";
+  }
+  return "other";
+}
+}  // namespace
+
+std::vector<OpenCLContext::WeakPtr> OpenCLContext::instances_;
+std::vector<OpenCLContext::Device> OpenCLContext::devices_;
+bool OpenCLContext::is_devices_enumerated_ = false;
+std::mutex OpenCLContext::instances_mutex_;
+constexpr unsigned int OpenCLContext::kDefaultPipelineDepth;
+
+unsigned int OpenCLContext::pipeline_depth_ =
+    OpenCLContext::kDefaultPipelineDepth;
+std::string OpenCLContext::program_cache_directory_ = GetCacheDirectory();
+int OpenCLContext::selected_platform_index_ = -1;
+int OpenCLContext::selected_device_index_ = -1;
+
+constexpr std::size_t OpenCLContext::OpenCLHandle::kMaxPooledBuffers;
+constexpr std::size_t OpenCLContext::OpenCLHandle::kMinPoolSizeClass;
+
+OpenCLContext::OpenCLHandle::OpenCLHandle()
+    : opencl_ptr_(),
+      device_index_(0),
+      kernels_(),
+      queues_(),
+      buffer_pool_() {}
 
 OpenCLContext::OpenCLHandle::~OpenCLHandle() {
   std::cout << "Destructing OpenCLHandle..." << std::endl;
   CleanupAllKernels();
-  OpenCLContext::CleanupInstance();
+  ClearBufferPool();
+  // timings must be read before the queues and context are released
+  OpenCLProfiler::Collect();
+  for (cl_command_queue queue : queues_) {
+    clReleaseCommandQueue(queue);
+  }
+  // the context is released with opencl_ptr_ if this is its last handle
+}
+
+std::size_t OpenCLContext::OpenCLHandle::GetDeviceIndex() const {
+  return device_index_;
+}
+
+std::size_t OpenCLContext::OpenCLHandle::GetQueueCount() const {
+  return queues_.size();
+}
+
+std::string OpenCLContext::OpenCLHandle::GetDeviceKey() {
+  const auto &context_ptr = opencl_ptr_;
+  if (!context_ptr || !context_ptr->IsValid()) {
+    return {};
+  }
+  std::ostringstream key;
+  key << std::hex
+      << HashString(context_ptr->GetDeviceDescription(),
+                    0xCBF29CE484222325ULL);
+  return key.str();
 }
 
 bool OpenCLContext::OpenCLHandle::IsValid() const {
-  auto context = opencl_ptr_.lock();
-  if (!context) {
+  if (!opencl_ptr_) {
+    return false;
+  }
+
+  return opencl_ptr_->IsValid() && !queues_.empty();
+}
+
+OpenCLContext::OpenCLHandle::Event::Event() : event_(nullptr) {}
+
+OpenCLContext::OpenCLHandle::Event::Event(cl_event event) : event_(event) {}
+
+OpenCLContext::OpenCLHandle::Event::~Event() {
+  if (event_) {
+    clReleaseEvent(event_);
+  }
+}
+
+OpenCLContext::OpenCLHandle::Event::Event(const Event &other)
+    : event_(other.event_) {
+  if (event_) {
+    clRetainEvent(event_);
+  }
+}
+
+OpenCLContext::OpenCLHandle::Event &
+OpenCLContext::OpenCLHandle::Event::operator=(const Event &other) {
+  if (other.event_) {
+    clRetainEvent(other.event_);
+  }
+  if (event_) {
+    clReleaseEvent(event_);
+  }
+  event_ = other.event_;
+  return *this;
+}
+
+OpenCLContext::OpenCLHandle::Event::Event(Event &&other)
+    : event_(other.event_) {
+  other.event_ = nullptr;
+}
+
+OpenCLContext::OpenCLHandle::Event &
+OpenCLContext::OpenCLHandle::Event::operator=(Event &&other) {
+  if (this != &other) {
+    if (event_) {
+      clReleaseEvent(event_);
+    }
+    event_ = other.event_;
+    other.event_ = nullptr;
+  }
+  return *this;
+}
+
+bool OpenCLContext::OpenCLHandle::Event::IsValid() const {
+  return event_ != nullptr;
+}
+
+bool OpenCLContext::OpenCLHandle::Event::IsComplete() const {
+  if (!event_) {
+    return true;
+  }
+  cl_int status = CL_COMPLETE;
+  cl_int err_num =
+      clGetEventInfo(event_, CL_EVENT_COMMAND_EXECUTION_STATUS,
+                     sizeof(cl_int), &status, nullptr);
+  // negative statuses are errors, the command will not run
+  return err_num != CL_SUCCESS || status <= CL_COMPLETE;
+}
+
+bool OpenCLContext::OpenCLHandle::Event::Wait() {
+  if (!event_) {
+    return true;
+  }
+  cl_int err_num = clWaitForEvents(1, &event_);
+  if (err_num != CL_SUCCESS) {
+    std::cout << "ERROR: OpenCLHandle::Event::Wait: Failed to wait on command ("
+              << err_num << ")" << std::endl;
     return false;
   }
+  return true;
+}
+
+OpenCLContext::OpenCLHandle::KernelRef::KernelRef() : kernel_(nullptr) {}
+
+OpenCLContext::OpenCLHandle::KernelRef::KernelRef(
+    std::pair<const std::string, KernelInfo> *kernel)
+    : kernel_(kernel) {}
+
+bool OpenCLContext::OpenCLHandle::KernelRef::IsValid() const {
+  return kernel_ != nullptr;
+}
+
+OpenCLContext::OpenCLHandle::BufferRef::BufferRef()
+    : kernel_(nullptr), buffer_(nullptr) {}
+
+OpenCLContext::OpenCLHandle::BufferRef::BufferRef(
+    std::pair<const std::string, KernelInfo> *kernel,
+    std::pair<const std::string, BufferInfo> *buffer)
+    : kernel_(kernel), buffer_(buffer) {}
+
+bool OpenCLContext::OpenCLHandle::BufferRef::IsValid() const {
+  return buffer_ != nullptr;
+}
+
+cl_int OpenCLContext::OpenCLHandle::SetKernelArgument(KernelInfo *kernel_info,
+                                                      unsigned int idx,
+                                                      std::size_t data_size,
+                                                      const void *data_ptr) {
+  if (kernel_info->arguments_.size() <= idx) {
+    kernel_info->arguments_.resize(idx + 1, {false, 0, {}});
+  }
+  ArgumentValue &argument = kernel_info->arguments_[idx];
+  const unsigned char *bytes = static_cast<const unsigned char *>(data_ptr);
+  if (argument.is_set && argument.size == data_size &&
+      (data_ptr == nullptr
+           ? argument.data.empty()
+           : argument.data.size() == data_size &&
+                 std::equal(bytes, bytes + data_size, argument.data.begin()))) {
+    return CL_SUCCESS;
+  }
+
+  cl_int err_num =
+      clSetKernelArg(kernel_info->kernel_, idx, data_size, data_ptr);
+  argument.is_set = err_num == CL_SUCCESS;
+  argument.size = data_size;
+  if (data_ptr == nullptr) {
+    argument.data.clear();
+  } else {
+    argument.data.assign(bytes, bytes + data_size);
+  }
+  return err_num;
+}
+
+void OpenCLContext::OpenCLHandle::ForgetBufferArguments(KernelInfo *kernel_info,
+                                                       cl_mem mem) {
+  const unsigned char *bytes = reinterpret_cast<const unsigned char *>(&mem);
+  for (ArgumentValue &argument : kernel_info->arguments_) {
+    if (argument.is_set && argument.data.size() == sizeof(cl_mem) &&
+        std::equal(bytes, bytes + sizeof(cl_mem), argument.data.begin())) {
+      argument.is_set = false;
+    }
+  }
+}
 
-  return context->IsValid();
+std::vector<cl_event> OpenCLContext::OpenCLHandle::GetEvents(
+    const EventList &wait_list) {
+  std::vector<cl_event> events;
+  events.reserve(wait_list.size());
+  for (const Event &event : wait_list) {
+    if (event.event_) {
+      events.push_back(event.event_);
+    }
+  }
+  return events;
 }
 
 bool OpenCLContext::OpenCLHandle::CreateKernelFromSource(
-    const std::string &kernel_fn, const std::string &kernel_name) {
+    const std::string &kernel_fn, const std::string &kernel_name,
+    const std::string &build_options) {
   if (!IsValid()) {
     std::cout << "ERROR: OpenCLContext is not initialized" << std::endl;
     return false;
@@ -36,36 +358,19 @@ bool OpenCLContext::OpenCLHandle::CreateKernelFromSource(
   }
 
   cl_int err_num;
-  KernelInfo kernel_info = {nullptr, nullptr, {}};
+  KernelInfo kernel_info = {nullptr, nullptr, build_options, {}, {}};
 
-  OpenCLContext::Ptr context_ptr = opencl_ptr_.lock();
+  const auto &context_ptr = opencl_ptr_;
   if (!context_ptr) {
     std::cout << "ERROR: OpenCLHandle: OpenCLContext is not initialized"
               << std::endl;
     return false;
   }
 
-  const char *source_c_str = kernel_fn.c_str();
-  kernel_info.program_ = clCreateProgramWithSource(
-      context_ptr->context_, 1, &source_c_str, nullptr, &err_num);
-  if (err_num != CL_SUCCESS) {
-    std::cout << "ERROR: OpenCLHandle: Failed to create program from source"
-              << std::endl;
-    return false;
-  }
-
-  err_num = clBuildProgram(kernel_info.program_, 0, nullptr, nullptr, nullptr,
-                           nullptr);
-  if (err_num != CL_SUCCESS) {
-    std::cout << "ERROR: OpenCLHandle: Failed to compile kernel" << std::endl;
-    std::vector<char> build_log;
-    build_log.resize(16384);
-    build_log.at(16383) = 0;
-    clGetProgramBuildInfo(kernel_info.program_, context_ptr->device_id_,
-                          CL_PROGRAM_BUILD_LOG, build_log.size(),
-                          build_log.data(), nullptr);
-    std::cout << build_log.data();
-    clReleaseProgram(kernel_info.program_);
+  // programs are shared by the handles of every thread, each handle creates
+  // its own kernel so that arguments are not shared
+  kernel_info.program_ = context_ptr->GetProgram(kernel_fn, build_options);
+  if (!kernel_info.program_) {
     return false;
   }
 
@@ -84,7 +389,8 @@ bool OpenCLContext::OpenCLHandle::CreateKernelFromSource(
 }
 
 bool OpenCLContext::OpenCLHandle::CreateKernelFromSource(
-    const char *kernel_fn, const std::string &kernel_name) {
+    const char *kernel_fn, const std::string &kernel_name,
+    const std::string &build_options) {
   if (!IsValid()) {
     std::cout << "ERROR: OpenCLContext is not initialized" << std::endl;
     return false;
@@ -94,11 +400,13 @@ bool OpenCLContext::OpenCLHandle::CreateKernelFromSource(
         << kernel_name << '"' << std::endl;
     return false;
   }
-  return CreateKernelFromSource(std::string(kernel_fn), kernel_name);
+  return CreateKernelFromSource(std::string(kernel_fn), kernel_name,
+                                build_options);
 }
 
 bool OpenCLContext::OpenCLHandle::CreateKernelFromFile(
-    const std::string &filename, const std::string &kernel_name) {
+    const std::string &filename, const std::string &kernel_name,
+    const std::string &build_options) {
   if (!IsValid()) {
     std::cout << "ERROR: OpenCLContext is not initialized" << std::endl;
     return false;
@@ -125,11 +433,12 @@ bool OpenCLContext::OpenCLHandle::CreateKernelFromFile(
       return false;
     }
   }
-  return CreateKernelFromSource(source, kernel_name);
+  return CreateKernelFromSource(source, kernel_name, build_options);
 }
 
 bool OpenCLContext::OpenCLHandle::CreateKernelFromFile(
-    const char *filename, const std::string &kernel_name) {
+    const char *filename, const std::string &kernel_name,
+    const std::string &build_options) {
   if (!IsValid()) {
     std::cout << "ERROR: OpenCLContext is not initialized" << std::endl;
     return false;
@@ -139,7 +448,8 @@ bool OpenCLContext::OpenCLHandle::CreateKernelFromFile(
         << kernel_name << '"' << std::endl;
     return false;
   }
-  return CreateKernelFromFile(std::string(filename), kernel_name);
+  return CreateKernelFromFile(std::string(filename), kernel_name,
+                              build_options);
 }
 
 bool OpenCLContext::OpenCLHandle::CreateKernelBuffer(
@@ -170,7 +480,7 @@ bool OpenCLContext::OpenCLHandle::CreateKernelBuffer(
     }
   }
 
-  auto opencl_context = opencl_ptr_.lock();
+  const auto &opencl_context = opencl_ptr_;
   if (!opencl_context) {
     std::cout << "ERROR: OpenCLHandle::CreateKernelBuffer: OpenCLContext is "
                  "not initialized"
@@ -178,26 +488,57 @@ bool OpenCLContext::OpenCLHandle::CreateKernelBuffer(
     return false;
   }
 
-  cl_int err_num;
+  cl_int err_num = CL_SUCCESS;
   cl_mem mem_object;
+  std::size_t capacity = 0;
 
-  mem_object = clCreateBuffer(opencl_context->context_, flags, buf_size,
-                              host_ptr, &err_num);
-  if (err_num != CL_SUCCESS) {
+  if (host_ptr == nullptr) {
+    mem_object = AcquirePooledBuffer(opencl_context->context_, flags,
+                                     buf_size, &capacity);
+  } else {
+    mem_object = clCreateBuffer(opencl_context->context_, flags, buf_size,
+                                host_ptr, &err_num);
+  }
+  if (mem_object == nullptr || err_num != CL_SUCCESS) {
     std::cout
         << "ERROR: OpenCLHandle::CreateKernelBuffer: Failed to create buffer"
         << std::endl;
     return false;
   }
 
-  buffer_map->insert({buffer_name, {mem_object, buf_size}});
+  buffer_map->insert({buffer_name, {mem_object, buf_size, flags, capacity}});
 
   return true;
 }
 
 bool OpenCLContext::OpenCLHandle::SetKernelBufferData(
     const std::string &kernel_name, const std::string &buffer_name,
-    std::size_t data_size, void *data_ptr) {
+    std::size_t data_size, const void *data_ptr) {
+  Event event;
+  return SetKernelBufferDataAsync(kernel_name, buffer_name, data_size,
+                                  data_ptr, {}, &event) &&
+         event.Wait();
+}
+
+bool OpenCLContext::OpenCLHandle::SetKernelBufferDataAsync(
+    const std::string &kernel_name, const std::string &buffer_name,
+    std::size_t data_size, const void *data_ptr, const EventList &wait_list,
+    Event *event) {
+  std::size_t buffer_size = GetBufferSize(kernel_name, buffer_name);
+  if (buffer_size > data_size) {
+    std::cout
+        << "WARNING: OpenCLHandle::SetKernelBufferData: device buffer has size "
+        << buffer_size << ", but given data_size is " << data_size
+        << " (warning due to smaller size)" << std::endl;
+  }
+  return SetKernelBufferRegionAsync(kernel_name, buffer_name, 0, data_size,
+                                    data_ptr, 0, wait_list, event);
+}
+
+bool OpenCLContext::OpenCLHandle::SetKernelBufferRegionAsync(
+    const std::string &kernel_name, const std::string &buffer_name,
+    std::size_t offset, std::size_t data_size, const void *data_ptr,
+    std::size_t queue_index, const EventList &wait_list, Event *event) {
   if (!IsValid()) {
     std::cout << "ERROR: OpenCLContext is not initialized" << std::endl;
     return false;
@@ -217,37 +558,166 @@ bool OpenCLContext::OpenCLHandle::SetKernelBufferData(
     return false;
   }
 
-  if (buffer_info_iter->second.size < data_size) {
+  return SetKernelBufferRegionAsync(
+      BufferRef(&*kernel_info_iter, &*buffer_info_iter), offset, data_size,
+      data_ptr, queue_index, wait_list, event);
+}
+
+bool OpenCLContext::OpenCLHandle::SetKernelBufferRegionAsync(
+    const BufferRef &buffer, std::size_t offset, std::size_t data_size,
+    const void *data_ptr, std::size_t queue_index, const EventList &wait_list,
+    Event *event) {
+  if (!buffer.IsValid()) {
+    std::cout << "ERROR: OpenCLHandle::SetKernelBufferData: Invalid BufferRef"
+              << std::endl;
+    return false;
+  }
+  const BufferInfo &buffer_info = buffer.buffer_->second;
+
+  if (buffer_info.size < offset + data_size) {
     std::cout
         << "ERROR: OpenCLHandle::SetKernelBufferData: device buffer has size "
-        << buffer_info_iter->second.size << ", but given data_size is "
-        << data_size << " (error due to larger size)" << std::endl;
+        << buffer_info.size << ", but given data ends at "
+        << offset + data_size << " (error due to larger size)" << std::endl;
+    return false;
+  }
+
+  std::vector<cl_event> events = GetEvents(wait_list);
+  cl_event write_event;
+  cl_int err_num = clEnqueueWriteBuffer(
+      GetQueue(queue_index), buffer_info.mem,
+      CL_FALSE, offset, data_size, data_ptr,
+      static_cast<cl_uint>(events.size()),
+      events.empty() ? nullptr : events.data(), &write_event);
+  if (err_num != CL_SUCCESS) {
+    std::cout << "ERROR: OpenCLHandle::SetKernelBufferData: Failed to assign "
+                 "data to device buffer"
+              << std::endl;
+    return false;
+  }
+
+  if (OpenCLProfiler::IsEnabled()) {
+    OpenCLProfiler::Record(
+        "write " + buffer.kernel_->first + '/' + buffer.buffer_->first,
+        data_size, write_event);
+  }
+  Event written(write_event);
+  if (event) {
+    *event = std::move(written);
+  }
+  return true;
+}
+
+bool OpenCLContext::OpenCLHandle::CreateKernelImage(
+    const std::string &kernel_name, cl_mem_flags flags, std::size_t width,
+    std::size_t height, void *host_ptr, const std::string &image_name) {
+  if (!IsValid()) {
+    std::cout << "ERROR: OpenCLHandle::CreateKernelImage: OpenCLContext is "
+                 "not initialized"
+              << std::endl;
+    return false;
+  }
+
+  auto kernel_info_iter = kernels_.find(kernel_name);
+  if (kernel_info_iter == kernels_.end()) {
+    std::cout << "ERROR: OpenCLHandle::CreateKernelImage: Given kernel \""
+              << kernel_name << "\" doesn't exist" << std::endl;
+    return false;
+  }
+
+  auto *buffer_map = &kernel_info_iter->second.mem_objects_;
+  if (buffer_map->find(image_name) != buffer_map->end()) {
+    std::cout << "ERROR: OpenCLHandle::CreateKernelImage: Buffer with name \""
+              << image_name << "\" already exists" << std::endl;
+    return false;
+  }
+
+  const auto &opencl_context = opencl_ptr_;
+  if (!opencl_context) {
+    std::cout << "ERROR: OpenCLHandle::CreateKernelImage: OpenCLContext is "
+                 "not initialized"
+              << std::endl;
     return false;
-  } else if (buffer_info_iter->second.size > data_size) {
+  }
+
+  cl_image_format format;
+  format.image_channel_order = CL_R;
+  format.image_channel_data_type = CL_UNSIGNED_INT8;
+  cl_image_desc desc;
+  std::memset(&desc, 0, sizeof(desc));
+  desc.image_type = CL_MEM_OBJECT_IMAGE2D;
+  desc.image_width = width;
+  desc.image_height = height;
+
+  cl_int err_num;
+  cl_mem mem_object = clCreateImage(opencl_context->context_, flags, &format,
+                                    &desc, host_ptr, &err_num);
+  if (err_num != CL_SUCCESS) {
     std::cout
-        << "WARNING: OpenCLHandle::SetKernelBufferData: device buffer has size "
-        << buffer_info_iter->second.size << ", but given data_size is "
-        << data_size << " (warning due to smaller size)" << std::endl;
+        << "ERROR: OpenCLHandle::CreateKernelImage: Failed to create image"
+        << std::endl;
+    return false;
+  }
+
+  buffer_map->insert({image_name, {mem_object, width * height, flags, 0}});
+
+  return true;
+}
+
+bool OpenCLContext::OpenCLHandle::SetKernelImageDataAsync(
+    const std::string &kernel_name, const std::string &image_name,
+    std::size_t width, std::size_t height, const void *data_ptr,
+    const EventList &wait_list, Event *event) {
+  if (!IsValid()) {
+    std::cout << "ERROR: OpenCLContext is not initialized" << std::endl;
+    return false;
+  }
+  auto kernel_info_iter = kernels_.find(kernel_name);
+  if (kernel_info_iter == kernels_.end()) {
+    std::cout << "ERROR: OpenCLHandle::SetKernelImageData: Kernel with name \""
+              << kernel_name << "\" doesn't exist" << std::endl;
+    return false;
+  }
+
+  auto *buffer_map = &kernel_info_iter->second.mem_objects_;
+  auto buffer_info_iter = buffer_map->find(image_name);
+  if (buffer_info_iter == buffer_map->end()) {
+    std::cout << "ERROR: OpenCLHandle::SetKernelImageData: Image with name \""
+              << image_name << "\" doesn't exist" << std::endl;
+    return false;
   }
 
-  auto context_ptr = opencl_ptr_.lock();
+  const auto &context_ptr = opencl_ptr_;
   if (!context_ptr) {
-    std::cout << "ERROR: OpenCLHandle::SetKernelBufferData: OpenCLContext not "
+    std::cout << "ERROR: OpenCLHandle::SetKernelImageData: OpenCLContext not "
                  "initialized"
               << std::endl;
     return false;
   }
 
-  cl_int err_num = clEnqueueWriteBuffer(
-      context_ptr->queue_, buffer_info_iter->second.mem, CL_TRUE, 0,
-      buffer_info_iter->second.size, data_ptr, 0, nullptr, nullptr);
+  const std::size_t origin[3] = {0, 0, 0};
+  const std::size_t region[3] = {width, height, 1};
+  std::vector<cl_event> events = GetEvents(wait_list);
+  cl_event write_event;
+  cl_int err_num = clEnqueueWriteImage(
+      GetQueue(0), buffer_info_iter->second.mem, CL_FALSE,
+      origin, region, width, 0, data_ptr, static_cast<cl_uint>(events.size()),
+      events.empty() ? nullptr : events.data(), &write_event);
   if (err_num != CL_SUCCESS) {
-    std::cout << "ERROR: OpenCLHandle::SetKernelBufferData: Failed to assign "
-                 "data to device buffer"
+    std::cout << "ERROR: OpenCLHandle::SetKernelImageData: Failed to assign "
+                 "data to device image"
               << std::endl;
     return false;
   }
 
+  if (OpenCLProfiler::IsEnabled()) {
+    OpenCLProfiler::Record("write " + kernel_name + '/' + image_name,
+                           width * height, write_event);
+  }
+  Event written(write_event);
+  if (event) {
+    *event = std::move(written);
+  }
   return true;
 }
 
@@ -273,10 +743,24 @@ bool OpenCLContext::OpenCLHandle::AssignKernelBuffer(
     return false;
   }
 
-  cl_int err_num;
+  return AssignKernelBuffer(KernelRef(&*kernel_iter), idx,
+                            BufferRef(&*kernel_iter, &*buffer_info_iter));
+}
+
+bool OpenCLContext::OpenCLHandle::AssignKernelBuffer(const KernelRef &kernel,
+                                                     unsigned int idx,
+                                                     const BufferRef &buffer) {
+  if (!kernel.IsValid() || !buffer.IsValid() ||
+      buffer.kernel_ != kernel.kernel_) {
+    std::cout << "ERROR: OpenCLHandle::AssignKernelBuffer: Invalid KernelRef "
+                 "or BufferRef"
+              << std::endl;
+    return false;
+  }
 
-  err_num = clSetKernelArg(kernel_iter->second.kernel_, idx, sizeof(cl_mem),
-                           &buffer_info_iter->second.mem);
+  cl_int err_num = SetKernelArgument(&kernel.kernel_->second, idx,
+                                     sizeof(cl_mem),
+                                     &buffer.buffer_->second.mem);
   if (err_num != CL_SUCCESS) {
     std::cout << "ERROR: OpenCLHandle::AssignKernelBuffer: failed to assign "
                  "buffer to kernel argument"
@@ -302,17 +786,21 @@ bool OpenCLContext::OpenCLHandle::AssignKernelArgument(
     return false;
   }
 
-  auto context_ptr = opencl_ptr_.lock();
-  if (!context_ptr) {
-    std::cout << "ERROR: OpenCLHandle::AssignKernelArgument: OpenCLContext not "
-                 "initialized"
+  return AssignKernelArgument(KernelRef(&*iter), idx, data_size, data_ptr);
+}
+
+bool OpenCLContext::OpenCLHandle::AssignKernelArgument(const KernelRef &kernel,
+                                                       unsigned int idx,
+                                                       std::size_t data_size,
+                                                       const void *data_ptr) {
+  if (!kernel.IsValid()) {
+    std::cout << "ERROR: OpenCLHandle::AssignKernelArgument: Invalid KernelRef"
               << std::endl;
     return false;
   }
 
-  cl_int err_num;
-
-  err_num = clSetKernelArg(iter->second.kernel_, idx, data_size, data_ptr);
+  cl_int err_num = SetKernelArgument(&kernel.kernel_->second, idx, data_size,
+                                     data_ptr);
   if (err_num != CL_SUCCESS) {
     std::cout << "ERROR: OpenCLHandle::AssignKernelArgument: Failure to set "
                  "kernel arg"
@@ -331,7 +819,7 @@ std::array<std::size_t, 3> OpenCLContext::OpenCLHandle::GetGlobalWorkSize(
   }
   std::array<std::size_t, 3> sizes = {0, 0, 0};
 
-  auto context_ptr = opencl_ptr_.lock();
+  const auto &context_ptr = opencl_ptr_;
   if (!context_ptr) {
     std::cout << "ERROR: OpenCLHandle::GetGlobalWorkSize: OpenCLContext is not "
                  "initialized"
@@ -366,7 +854,7 @@ std::size_t OpenCLContext::OpenCLHandle::GetWorkGroupSize(
     std::cout << "ERROR: OpenCLContext is not initialized" << std::endl;
     return 0;
   }
-  auto context_ptr = opencl_ptr_.lock();
+  const auto &context_ptr = opencl_ptr_;
   if (!context_ptr) {
     std::cout << "ERROR: OpenCLHandle::GetWorkGroupSize: OpenCLContext is not "
                  "initialized"
@@ -400,7 +888,7 @@ std::size_t OpenCLContext::OpenCLHandle::GetDeviceMaxWorkGroupSize() {
     std::cout << "ERROR: OpenCLContext is not initialized" << std::endl;
     return 0;
   }
-  auto context_ptr = opencl_ptr_.lock();
+  const auto &context_ptr = opencl_ptr_;
   if (!context_ptr) {
     std::cout << "ERROR: OpenCLHandle::GetDeviceMaxWorkGroupSize: "
                  "OpenCLContext is not initialized"
@@ -420,82 +908,288 @@ std::size_t OpenCLContext::OpenCLHandle::GetDeviceMaxWorkGroupSize() {
   return value;
 }
 
-bool OpenCLContext::OpenCLHandle::ExecuteKernel(const std::string &kernel_name,
-                                                std::size_t global_work_size,
-                                                std::size_t local_work_size,
-                                                bool is_blocking) {
+std::size_t OpenCLContext::OpenCLHandle::GetDeviceMaxMemAllocSize() {
   if (!IsValid()) {
     std::cout << "ERROR: OpenCLContext is not initialized" << std::endl;
-    return false;
+    return 0;
   }
-  auto context_ptr = opencl_ptr_.lock();
+  const auto &context_ptr = opencl_ptr_;
   if (!context_ptr) {
-    std::cout << "ERROR: OpenCLHandle::ExecuteKernel: OpenCLContext is not "
-                 "initialized"
+    std::cout << "ERROR: OpenCLHandle::GetDeviceMaxMemAllocSize: "
+                 "OpenCLContext is not initialized"
               << std::endl;
-    return false;
-  }
-
-  auto kernel_iter = kernels_.find(kernel_name);
-  if (kernel_iter == kernels_.end()) {
-    std::cout << "ERROR: OpenCLHandle::ExecuteKernel: Kernel with name \""
-              << kernel_name << "\" doesn't exist" << std::endl;
-    return false;
+    return 0;
   }
-
-  cl_event event;
-  cl_int err_num = clEnqueueNDRangeKernel(
-      context_ptr->queue_, kernel_iter->second.kernel_, 1, nullptr,
-      &global_work_size, &local_work_size, 0, nullptr, &event);
+  cl_ulong value;
+  cl_int err_num =
+      clGetDeviceInfo(context_ptr->device_id_, CL_DEVICE_MAX_MEM_ALLOC_SIZE,
+                      sizeof(cl_ulong), &value, nullptr);
   if (err_num != CL_SUCCESS) {
-    std::cout << "ERROR: OpenCLHandle::ExecuteKernel: Failed to execute kernel"
+    std::cout << "ERROR: OpenCLHandle::GetDeviceMaxMemAllocSize: "
+                 "Failed to get max mem alloc size"
               << std::endl;
-    return false;
+    return 0;
   }
 
-  if (is_blocking) {
-    err_num = clWaitForEvents(1, &event);
-    if (err_num != CL_SUCCESS) {
-      std::cout << "WARNING: OpenCLHandle::ExecuteKernel: Explicit wait on "
-                   "kernel failed"
-                << std::endl;
-    }
-  }
+  return value;
+}
 
-  clReleaseEvent(event);
+std::size_t OpenCLContext::OpenCLHandle::GetDeviceLocalMemSize() {
+  if (!IsValid()) {
+    std::cout << "ERROR: OpenCLContext is not initialized" << std::endl;
+    return 0;
+  }
+  const auto &context_ptr = opencl_ptr_;
+  if (!context_ptr) {
+    std::cout << "ERROR: OpenCLHandle::GetDeviceLocalMemSize: "
+                 "OpenCLContext is not initialized"
+              << std::endl;
+    return 0;
+  }
+  cl_ulong value;
+  cl_int err_num =
+      clGetDeviceInfo(context_ptr->device_id_, CL_DEVICE_LOCAL_MEM_SIZE,
+                      sizeof(cl_ulong), &value, nullptr);
+  if (err_num != CL_SUCCESS) {
+    std::cout << "ERROR: OpenCLHandle::GetDeviceLocalMemSize: "
+                 "Failed to get local mem size"
+              << std::endl;
+    return 0;
+  }
 
-  return true;
+  return value;
 }
 
-bool OpenCLContext::OpenCLHandle::ExecuteKernel2D(
-    const std::string &kernel_name, std::size_t global_work_size_0,
-    std::size_t global_work_size_1, std::size_t local_work_size_0,
-    std::size_t local_work_size_1, bool is_blocking) {
+bool OpenCLContext::OpenCLHandle::HasImageSupport() {
   if (!IsValid()) {
     std::cout << "ERROR: OpenCLContext is not initialized" << std::endl;
     return false;
   }
-  auto context_ptr = opencl_ptr_.lock();
+  const auto &context_ptr = opencl_ptr_;
   if (!context_ptr) {
-    std::cout << "ERROR: OpenCLHandle::ExecuteKernel2D: OpenCLContext is not "
+    std::cout << "ERROR: OpenCLHandle::HasImageSupport: OpenCLContext is not "
                  "initialized"
               << std::endl;
     return false;
   }
 
-  auto kernel_iter = kernels_.find(kernel_name);
-  if (kernel_iter == kernels_.end()) {
-    std::cout << "ERROR: OpenCLHandle::ExecuteKernel2D: Kernel with name \""
-              << kernel_name << "\" doesn't exist" << std::endl;
-    return false;
-  }
+  cl_bool is_supported = CL_FALSE;
+  cl_int err_num =
+      clGetDeviceInfo(context_ptr->device_id_, CL_DEVICE_IMAGE_SUPPORT,
+                      sizeof(cl_bool), &is_supported, nullptr);
+  return err_num == CL_SUCCESS && is_supported == CL_TRUE;
+}
 
+bool OpenCLContext::OpenCLHandle::HasUnifiedMemory() {
+  if (!IsValid()) {
+    std::cout << "ERROR: OpenCLContext is not initialized" << std::endl;
+    return false;
+  }
+  const auto &context_ptr = opencl_ptr_;
+  if (!context_ptr) {
+    std::cout << "ERROR: OpenCLHandle::HasUnifiedMemory: OpenCLContext is not "
+                 "initialized"
+              << std::endl;
+    return false;
+  }
+
+  return context_ptr->is_unified_memory_;
+}
+
+std::size_t OpenCLContext::OpenCLHandle::GetDeviceMemBaseAddrAlign() {
+  if (!IsValid()) {
+    std::cout << "ERROR: OpenCLContext is not initialized" << std::endl;
+    return 0;
+  }
+  const auto &context_ptr = opencl_ptr_;
+  if (!context_ptr) {
+    std::cout << "ERROR: OpenCLHandle::GetDeviceMemBaseAddrAlign: "
+                 "OpenCLContext is not initialized"
+              << std::endl;
+    return 0;
+  }
+
+  return context_ptr->mem_base_addr_align_;
+}
+
+unsigned int OpenCLContext::OpenCLHandle::GetDeviceComputeUnits() {
+  if (!IsValid()) {
+    std::cout << "ERROR: OpenCLContext is not initialized" << std::endl;
+    return 0;
+  }
+  const auto &context_ptr = opencl_ptr_;
+  if (!context_ptr) {
+    std::cout << "ERROR: OpenCLHandle::GetDeviceComputeUnits: OpenCLContext "
+                 "is not initialized"
+              << std::endl;
+    return 0;
+  }
+
+  return context_ptr->compute_units_;
+}
+
+bool OpenCLContext::OpenCLHandle::ExecuteKernel(const std::string &kernel_name,
+                                                std::size_t global_work_size,
+                                                std::size_t local_work_size,
+                                                bool is_blocking) {
+  Event event;
+  if (!ExecuteKernelAsync(kernel_name, global_work_size, local_work_size, {},
+                          &event)) {
+    return false;
+  }
+
+  if (is_blocking && !event.Wait()) {
+    std::cout << "WARNING: OpenCLHandle::ExecuteKernel: Explicit wait on "
+                 "kernel failed"
+              << std::endl;
+  }
+
+  return true;
+}
+
+bool OpenCLContext::OpenCLHandle::ExecuteKernel2D(
+    const std::string &kernel_name, std::size_t global_work_size_0,
+    std::size_t global_work_size_1, std::size_t local_work_size_0,
+    std::size_t local_work_size_1, bool is_blocking) {
+  Event event;
+  if (!ExecuteKernel2DAsync(kernel_name, global_work_size_0,
+                            global_work_size_1, local_work_size_0,
+                            local_work_size_1, {}, &event)) {
+    return false;
+  }
+
+  if (is_blocking && !event.Wait()) {
+    std::cout << "WARNING: OpenCLHandle::ExecuteKernel2D: Explicit wait on "
+                 "kernel failed"
+              << std::endl;
+    return false;
+  }
+
+  return true;
+}
+
+bool OpenCLContext::OpenCLHandle::ExecuteKernelAsync(
+    const std::string &kernel_name, std::size_t global_work_size,
+    std::size_t local_work_size, const EventList &wait_list, Event *event) {
+  if (!IsValid()) {
+    std::cout << "ERROR: OpenCLContext is not initialized" << std::endl;
+    return false;
+  }
+  const auto &context_ptr = opencl_ptr_;
+  if (!context_ptr) {
+    std::cout << "ERROR: OpenCLHandle::ExecuteKernel: OpenCLContext is not "
+                 "initialized"
+              << std::endl;
+    return false;
+  }
+
+  auto kernel_iter = kernels_.find(kernel_name);
+  if (kernel_iter == kernels_.end()) {
+    std::cout << "ERROR: OpenCLHandle::ExecuteKernel: Kernel with name \""
+              << kernel_name << "\" doesn't exist" << std::endl;
+    return false;
+  }
+
+  return ExecuteKernelAsync(KernelRef(&*kernel_iter), global_work_size,
+                            local_work_size, wait_list, event);
+}
+
+bool OpenCLContext::OpenCLHandle::ExecuteKernelAsync(
+    const KernelRef &kernel, std::size_t global_work_size,
+    std::size_t local_work_size, const EventList &wait_list, Event *event) {
+  if (!kernel.IsValid()) {
+    std::cout << "ERROR: OpenCLHandle::ExecuteKernel: Invalid KernelRef"
+              << std::endl;
+    return false;
+  }
+
+  std::vector<cl_event> events = GetEvents(wait_list);
+  cl_event kernel_event;
+  cl_int err_num = clEnqueueNDRangeKernel(
+      GetQueue(0), kernel.kernel_->second.kernel_, 1, nullptr,
+      &global_work_size, &local_work_size, static_cast<cl_uint>(events.size()),
+      events.empty() ? nullptr : events.data(), &kernel_event);
+  if (err_num != CL_SUCCESS) {
+    std::cout << "ERROR: OpenCLHandle::ExecuteKernel: Failed to execute kernel"
+              << std::endl;
+    return false;
+  }
+
+  if (OpenCLProfiler::IsEnabled()) {
+    OpenCLProfiler::Record("kernel " + kernel.kernel_->first, 0,
+                           kernel_event);
+  }
+  Event executed(kernel_event);
+  if (event) {
+    *event = std::move(executed);
+  }
+  return true;
+}
+
+bool OpenCLContext::OpenCLHandle::ExecuteKernel2DAsync(
+    const std::string &kernel_name, std::size_t global_work_size_0,
+    std::size_t global_work_size_1, std::size_t local_work_size_0,
+    std::size_t local_work_size_1, const EventList &wait_list, Event *event) {
+  return ExecuteKernel2DRegionAsync(kernel_name, 0, 0, global_work_size_0,
+                                    global_work_size_1, local_work_size_0,
+                                    local_work_size_1, 0, wait_list, event);
+}
+
+bool OpenCLContext::OpenCLHandle::ExecuteKernel2DRegionAsync(
+    const std::string &kernel_name, std::size_t global_work_offset_0,
+    std::size_t global_work_offset_1, std::size_t global_work_size_0,
+    std::size_t global_work_size_1, std::size_t local_work_size_0,
+    std::size_t local_work_size_1, std::size_t queue_index,
+    const EventList &wait_list, Event *event) {
+  if (!IsValid()) {
+    std::cout << "ERROR: OpenCLContext is not initialized" << std::endl;
+    return false;
+  }
+  const auto &context_ptr = opencl_ptr_;
+  if (!context_ptr) {
+    std::cout << "ERROR: OpenCLHandle::ExecuteKernel2D: OpenCLContext is not "
+                 "initialized"
+              << std::endl;
+    return false;
+  }
+
+  auto kernel_iter = kernels_.find(kernel_name);
+  if (kernel_iter == kernels_.end()) {
+    std::cout << "ERROR: OpenCLHandle::ExecuteKernel2D: Kernel with name \""
+              << kernel_name << "\" doesn't exist" << std::endl;
+    return false;
+  }
+
+  return ExecuteKernel2DRegionAsync(
+      KernelRef(&*kernel_iter), global_work_offset_0, global_work_offset_1,
+      global_work_size_0, global_work_size_1, local_work_size_0,
+      local_work_size_1, queue_index, wait_list, event);
+}
+
+bool OpenCLContext::OpenCLHandle::ExecuteKernel2DRegionAsync(
+    const KernelRef &kernel, std::size_t global_work_offset_0,
+    std::size_t global_work_offset_1, std::size_t global_work_size_0,
+    std::size_t global_work_size_1, std::size_t local_work_size_0,
+    std::size_t local_work_size_1, std::size_t queue_index,
+    const EventList &wait_list, Event *event) {
+  if (!kernel.IsValid()) {
+    std::cout << "ERROR: OpenCLHandle::ExecuteKernel2D: Invalid KernelRef"
+              << std::endl;
+    return false;
+  }
+
+  std::size_t global_work_offset[2] = {global_work_offset_0,
+                                       global_work_offset_1};
   std::size_t global_work_size[2] = {global_work_size_0, global_work_size_1};
   std::size_t local_work_size[2] = {local_work_size_0, local_work_size_1};
-  cl_event event;
+  std::vector<cl_event> events = GetEvents(wait_list);
+  cl_event kernel_event;
   cl_int err_num = clEnqueueNDRangeKernel(
-      context_ptr->queue_, kernel_iter->second.kernel_, 2, nullptr,
-      global_work_size, local_work_size, 0, nullptr, &event);
+      GetQueue(queue_index), kernel.kernel_->second.kernel_, 2,
+      global_work_offset, global_work_size,
+      local_work_size_0 == 0 ? nullptr : local_work_size,
+      static_cast<cl_uint>(events.size()),
+      events.empty() ? nullptr : events.data(), &kernel_event);
   if (err_num != CL_SUCCESS) {
     std::cout
         << "ERROR: OpenCLHandle::ExecuteKernel2D: Failed to execute kernel"
@@ -503,19 +1197,14 @@ bool OpenCLContext::OpenCLHandle::ExecuteKernel2D(
     return false;
   }
 
-  if (is_blocking) {
-    err_num = clWaitForEvents(1, &event);
-    if (err_num != CL_SUCCESS) {
-      std::cout << "WARNING: OpenCLHandle::ExecuteKernel2D: Explicit wait on "
-                   "kernel failed"
-                << " (" << err_num << ")" << std::endl;
-      clReleaseEvent(event);
-      return false;
-    }
+  if (OpenCLProfiler::IsEnabled()) {
+    OpenCLProfiler::Record("kernel " + kernel.kernel_->first, 0,
+                           kernel_event);
+  }
+  Event executed(kernel_event);
+  if (event) {
+    *event = std::move(executed);
   }
-
-  clReleaseEvent(event);
-
   return true;
 }
 
@@ -523,14 +1212,49 @@ bool OpenCLContext::OpenCLHandle::GetBufferData(const std::string &kernel_name,
                                                 const std::string &buffer_name,
                                                 std::size_t out_size,
                                                 void *data_out) {
+  Event event;
+  return GetBufferDataAsync(kernel_name, buffer_name, out_size, data_out, {},
+                            &event) &&
+         event.Wait();
+}
+
+bool OpenCLContext::OpenCLHandle::GetBufferDataAsync(
+    const std::string &kernel_name, const std::string &buffer_name,
+    std::size_t out_size, void *data_out, const EventList &wait_list,
+    Event *event) {
+  std::size_t buffer_size = GetBufferSize(kernel_name, buffer_name);
+  std::size_t size;
+  if (buffer_size > out_size) {
+    std::cout << "WARNING: device memory size (" << buffer_size
+              << ") is greater than given size (" << out_size
+              << "), defaulting to smaller of the two sizes" << std::endl;
+    size = out_size;
+  } else if (buffer_size != 0 && buffer_size < out_size) {
+    std::cout << "WARNING: device memory size (" << buffer_size
+              << ") is smaller than given size (" << out_size
+              << "), defaulting to smaller of the two sizes" << std::endl;
+    size = buffer_size;
+  } else {
+    size = out_size;
+  }
+
+  return GetBufferRegionAsync(kernel_name, buffer_name, 0, size, data_out, 0,
+                              wait_list, event);
+}
+
+bool OpenCLContext::OpenCLHandle::GetBufferRegionAsync(
+    const std::string &kernel_name, const std::string &buffer_name,
+    std::size_t offset, std::size_t out_size, void *data_out,
+    std::size_t queue_index, const EventList &wait_list, Event *event) {
   if (!IsValid()) {
     std::cout << "ERROR: OpenCLContext is not initialized" << std::endl;
     return false;
   }
 
-  auto context_ptr = opencl_ptr_.lock();
+  const auto &context_ptr = opencl_ptr_;
   if (!context_ptr) {
     std::cout << "ERROR: OpenCLContext is not initialized" << std::endl;
+    return false;
   }
 
   auto kernel_iter = kernels_.find(kernel_name);
@@ -547,30 +1271,189 @@ bool OpenCLContext::OpenCLHandle::GetBufferData(const std::string &kernel_name,
     return false;
   }
 
-  std::size_t size;
-  if (buffer_iter->second.size > out_size) {
-    std::cout << "WARNING: device memory size (" << buffer_iter->second.size
-              << ") is greater than given size (" << out_size
-              << "), defaulting to smaller of the two sizes" << std::endl;
-    size = out_size;
-  } else if (buffer_iter->second.size < out_size) {
-    std::cout << "WARNING: device memory size (" << buffer_iter->second.size
-              << ") is smaller than given size (" << out_size
-              << "), defaulting to smaller of the two sizes" << std::endl;
-    size = buffer_iter->second.size;
-  } else {
-    size = out_size;
+  return GetBufferRegionAsync(BufferRef(&*kernel_iter, &*buffer_iter), offset,
+                              out_size, data_out, queue_index, wait_list,
+                              event);
+}
+
+bool OpenCLContext::OpenCLHandle::GetBufferRegionAsync(
+    const BufferRef &buffer, std::size_t offset, std::size_t out_size,
+    void *data_out, std::size_t queue_index, const EventList &wait_list,
+    Event *event) {
+  if (!buffer.IsValid()) {
+    std::cout << "ERROR: OpenCLHandle::GetBufferData: Invalid BufferRef"
+              << std::endl;
+    return false;
   }
+  const BufferInfo &buffer_info = buffer.buffer_->second;
 
-  cl_int err_num =
-      clEnqueueReadBuffer(context_ptr->queue_, buffer_iter->second.mem, CL_TRUE,
-                          0, size, data_out, 0, nullptr, nullptr);
+  if (buffer_info.size < offset + out_size) {
+    std::cout << "ERROR: OpenCLHandle::GetBufferData: device buffer has size "
+              << buffer_info.size << ", but read data ends at "
+              << offset + out_size << std::endl;
+    return false;
+  }
+
+  std::vector<cl_event> events = GetEvents(wait_list);
+  cl_event read_event;
+  cl_int err_num = clEnqueueReadBuffer(
+      GetQueue(queue_index), buffer_info.mem, CL_FALSE,
+      offset, out_size, data_out, static_cast<cl_uint>(events.size()),
+      events.empty() ? nullptr : events.data(), &read_event);
   if (err_num != CL_SUCCESS) {
     std::cout << "ERROR: OpenCLHandle::GetBufferData: Failed to get device data"
               << std::endl;
     return false;
   }
 
+  if (OpenCLProfiler::IsEnabled()) {
+    OpenCLProfiler::Record(
+        "read " + buffer.kernel_->first + '/' + buffer.buffer_->first,
+        out_size, read_event);
+  }
+  Event read(read_event);
+  if (event) {
+    *event = std::move(read);
+  }
+  return true;
+}
+
+void *OpenCLContext::OpenCLHandle::MapKernelBuffer(
+    const std::string &kernel_name, const std::string &buffer_name,
+    cl_map_flags flags, const EventList &wait_list) {
+  if (!IsValid()) {
+    std::cout << "ERROR: OpenCLContext is not initialized" << std::endl;
+    return nullptr;
+  }
+  const auto &context_ptr = opencl_ptr_;
+  if (!context_ptr) {
+    std::cout << "ERROR: OpenCLContext is not initialized" << std::endl;
+    return nullptr;
+  }
+
+  auto kernel_iter = kernels_.find(kernel_name);
+  if (kernel_iter == kernels_.end()) {
+    std::cout << "ERROR: OpenCLHandle::MapKernelBuffer: Kernel with name \""
+              << kernel_name << "\" doesn't exist" << std::endl;
+    return nullptr;
+  }
+
+  auto buffer_iter = kernel_iter->second.mem_objects_.find(buffer_name);
+  if (buffer_iter == kernel_iter->second.mem_objects_.end()) {
+    std::cout << "ERROR: OpenCLHandle::MapKernelBuffer: Buffer with name \""
+              << buffer_name << "\" doesn't exist" << std::endl;
+    return nullptr;
+  }
+
+  std::vector<cl_event> events = GetEvents(wait_list);
+  cl_int err_num;
+  cl_event map_event = nullptr;
+  void *mapped_ptr = clEnqueueMapBuffer(
+      GetQueue(0), buffer_iter->second.mem, CL_TRUE, flags, 0,
+      buffer_iter->second.size, static_cast<cl_uint>(events.size()),
+      events.empty() ? nullptr : events.data(),
+      OpenCLProfiler::IsEnabled() ? &map_event : nullptr, &err_num);
+  if (err_num != CL_SUCCESS) {
+    std::cout << "ERROR: OpenCLHandle::MapKernelBuffer: Failed to map buffer ("
+              << err_num << ")" << std::endl;
+    return nullptr;
+  }
+
+  if (map_event) {
+    OpenCLProfiler::Record("map " + kernel_name + '/' + buffer_name, 0,
+                           map_event);
+    clReleaseEvent(map_event);
+  }
+  return mapped_ptr;
+}
+
+bool OpenCLContext::OpenCLHandle::UnmapKernelBuffer(
+    const std::string &kernel_name, const std::string &buffer_name,
+    void *mapped_ptr, Event *event) {
+  if (!IsValid()) {
+    std::cout << "ERROR: OpenCLContext is not initialized" << std::endl;
+    return false;
+  }
+  const auto &context_ptr = opencl_ptr_;
+  if (!context_ptr) {
+    std::cout << "ERROR: OpenCLContext is not initialized" << std::endl;
+    return false;
+  }
+
+  auto kernel_iter = kernels_.find(kernel_name);
+  if (kernel_iter == kernels_.end()) {
+    std::cout << "ERROR: OpenCLHandle::UnmapKernelBuffer: Kernel with name \""
+              << kernel_name << "\" doesn't exist" << std::endl;
+    return false;
+  }
+
+  auto buffer_iter = kernel_iter->second.mem_objects_.find(buffer_name);
+  if (buffer_iter == kernel_iter->second.mem_objects_.end()) {
+    std::cout << "ERROR: OpenCLHandle::UnmapKernelBuffer: Buffer with name \""
+              << buffer_name << "\" doesn't exist" << std::endl;
+    return false;
+  }
+
+  cl_event unmap_event;
+  cl_int err_num =
+      clEnqueueUnmapMemObject(GetQueue(0), buffer_iter->second.mem,
+                              mapped_ptr, 0, nullptr, &unmap_event);
+  if (err_num != CL_SUCCESS) {
+    std::cout << "ERROR: OpenCLHandle::UnmapKernelBuffer: Failed to unmap "
+                 "buffer ("
+              << err_num << ")" << std::endl;
+    return false;
+  }
+
+  if (OpenCLProfiler::IsEnabled()) {
+    OpenCLProfiler::Record("unmap " + kernel_name + '/' + buffer_name, 0,
+                           unmap_event);
+  }
+  Event unmapped(unmap_event);
+  if (event) {
+    *event = std::move(unmapped);
+  }
+  return true;
+}
+
+OpenCLContext::OpenCLHandle::KernelRef
+OpenCLContext::OpenCLHandle::GetKernel(const std::string &kernel_name) {
+  auto kernel_iter = kernels_.find(kernel_name);
+  return kernel_iter == kernels_.end() ? KernelRef()
+                                       : KernelRef(&*kernel_iter);
+}
+
+OpenCLContext::OpenCLHandle::BufferRef OpenCLContext::OpenCLHandle::GetBuffer(
+    const KernelRef &kernel, const std::string &buffer_name) {
+  if (!kernel.IsValid()) {
+    return {};
+  }
+  auto *buffer_map = &kernel.kernel_->second.mem_objects_;
+  auto buffer_iter = buffer_map->find(buffer_name);
+  return buffer_iter == buffer_map->end()
+             ? BufferRef()
+             : BufferRef(kernel.kernel_, &*buffer_iter);
+}
+
+bool OpenCLContext::OpenCLHandle::Finish() {
+  if (!IsValid()) {
+    std::cout << "ERROR: OpenCLContext is not initialized" << std::endl;
+    return false;
+  }
+  const auto &context_ptr = opencl_ptr_;
+  if (!context_ptr) {
+    std::cout << "ERROR: OpenCLContext is not initialized" << std::endl;
+    return false;
+  }
+
+  for (cl_command_queue queue : queues_) {
+    cl_int err_num = clFinish(queue);
+    if (err_num != CL_SUCCESS) {
+      std::cout << "ERROR: OpenCLHandle::Finish: Failed to finish commands ("
+                << err_num << ")" << std::endl;
+      return false;
+    }
+  }
   return true;
 }
 
@@ -579,6 +1462,12 @@ bool OpenCLContext::OpenCLHandle::HasKernel(
   return kernels_.find(kernel_name) != kernels_.end();
 }
 
+std::string OpenCLContext::OpenCLHandle::GetKernelBuildOptions(
+    const std::string &kernel_name) const {
+  auto iter = kernels_.find(kernel_name);
+  return iter == kernels_.end() ? std::string() : iter->second.build_options_;
+}
+
 bool OpenCLContext::OpenCLHandle::HasBuffer(
     const std::string &kernel_name, const std::string &buffer_name) const {
   auto kernel_iter = kernels_.find(kernel_name);
@@ -608,18 +1497,8 @@ std::size_t OpenCLContext::OpenCLHandle::GetBufferSize(
     return 0;
   }
 
-  std::size_t size = 0;
-
-  cl_int err = clGetMemObjectInfo(buffer_iter->second.mem, CL_MEM_SIZE,
-                                  sizeof(std::size_t), &size, nullptr);
-  if (err != CL_SUCCESS) {
-    std::cout << "ERROR: Failed to query size of device buffer \""
-              << buffer_name << "\" with kernel \"" << kernel_name << '"'
-              << std::endl;
-    return 0;
-  }
-
-  return size;
+  // pooled buffers may be allocated larger than this
+  return buffer_iter->second.size;
 }
 
 bool OpenCLContext::OpenCLHandle::CleanupBuffer(
@@ -642,7 +1521,37 @@ bool OpenCLContext::OpenCLHandle::CleanupBuffer(
     return false;
   }
 
-  clReleaseMemObject(buffer_iter->second.mem);
+  // enqueued copies may still use host memory through the buffer
+  Finish();
+  ForgetBufferArguments(&kernel_iter->second, buffer_iter->second.mem);
+  ReleaseBuffer(buffer_iter->second);
+  kernel_iter->second.mem_objects_.erase(buffer_iter);
+
+  return true;
+}
+
+bool OpenCLContext::OpenCLHandle::ReleaseHostBuffer(
+    const std::string &kernel_name, const std::string &buffer_name) {
+  if (!IsValid()) {
+    std::cout << "ERROR: OpenCLContext is not initialized" << std::endl;
+    return false;
+  }
+  auto kernel_iter = kernels_.find(kernel_name);
+  if (kernel_iter == kernels_.end()) {
+    std::cout << "ERROR: OpenCLHandle::ReleaseHostBuffer: Kernel with name \""
+              << kernel_name << "\" doesn't exist" << std::endl;
+    return false;
+  }
+
+  auto buffer_iter = kernel_iter->second.mem_objects_.find(buffer_name);
+  if (buffer_iter == kernel_iter->second.mem_objects_.end()) {
+    std::cout << "ERROR: OpenCLHandle::ReleaseHostBuffer: Buffer with name \""
+              << buffer_name << "\" doesn't exist" << std::endl;
+    return false;
+  }
+
+  ForgetBufferArguments(&kernel_iter->second, buffer_iter->second.mem);
+  ReleaseBuffer(buffer_iter->second);
   kernel_iter->second.mem_objects_.erase(buffer_iter);
 
   return true;
@@ -661,9 +1570,11 @@ bool OpenCLContext::OpenCLHandle::CleanupKernel(
     return false;
   }
 
+  // enqueued copies may still use host memory through the buffers
+  Finish();
   for (auto buffer_iter = iter->second.mem_objects_.begin();
        buffer_iter != iter->second.mem_objects_.end(); ++buffer_iter) {
-    clReleaseMemObject(buffer_iter->second.mem);
+    ReleaseBuffer(buffer_iter->second);
   }
 
   clReleaseKernel(iter->second.kernel_);
@@ -677,11 +1588,14 @@ void OpenCLContext::OpenCLHandle::CleanupAllKernels() {
     std::cout << "ERROR: OpenCLContext is not initialized" << std::endl;
     return;
   }
+  if (!kernels_.empty()) {
+    Finish();
+  }
   for (auto kernel_iter = kernels_.begin(); kernel_iter != kernels_.end();
        ++kernel_iter) {
     for (auto buffer_iter = kernel_iter->second.mem_objects_.begin();
          buffer_iter != kernel_iter->second.mem_objects_.end(); ++buffer_iter) {
-      clReleaseMemObject(buffer_iter->second.mem);
+      ReleaseBuffer(buffer_iter->second);
     }
     clReleaseKernel(kernel_iter->second.kernel_);
     clReleaseProgram(kernel_iter->second.program_);
@@ -690,114 +1604,162 @@ void OpenCLContext::OpenCLHandle::CleanupAllKernels() {
   kernels_.clear();
 }
 
-OpenCLContext::OpenCLContext() : context_(nullptr), queue_(nullptr) {
-  //////////////////// set up cl_context
-  cl_int err_num;
-  cl_uint num_platforms;
-  std::vector<cl_platform_id> platform_ids;
+void OpenCLContext::OpenCLHandle::ClearBufferPool() {
+  for (const PooledBuffer &pooled : buffer_pool_) {
+    clReleaseMemObject(pooled.mem);
+  }
+  buffer_pool_.clear();
+}
 
-  err_num = clGetPlatformIDs(0, nullptr, &num_platforms);
-  if (err_num != CL_SUCCESS) {
-    std::cout << "ERROR: OpenCLContext: Failed to query OpenCL platforms"
-              << std::endl;
-    return;
-  } else if (num_platforms == 0) {
-    std::cout << "ERROR: OpenCLContext: Failed to find any OpenCL platforms"
-              << std::endl;
-    return;
+std::size_t OpenCLContext::OpenCLHandle::GetPoolSizeClass(std::size_t size) {
+  std::size_t size_class = kMinPoolSizeClass;
+  while (size_class < size && size_class <= SIZE_MAX / 2) {
+    size_class *= 2;
+  }
+  if (size_class / 4 * 3 >= size && size_class / 4 * 3 >= kMinPoolSizeClass) {
+    return size_class / 4 * 3;
   }
+  return size_class < size ? size : size_class;
+}
 
-  platform_ids.resize(num_platforms);
+cl_mem OpenCLContext::OpenCLHandle::AcquirePooledBuffer(
+    cl_context context, cl_mem_flags flags, std::size_t size,
+    std::size_t *capacity) {
+  const std::size_t size_class = GetPoolSizeClass(size);
+  auto best_iter = buffer_pool_.end();
+  for (auto iter = buffer_pool_.begin(); iter != buffer_pool_.end(); ++iter) {
+    if (iter->flags == flags && iter->capacity >= size &&
+        iter->capacity / 2 <= size_class &&
+        (best_iter == buffer_pool_.end() ||
+         iter->capacity < best_iter->capacity)) {
+      best_iter = iter;
+    }
+  }
+  if (best_iter != buffer_pool_.end()) {
+    cl_mem mem_object = best_iter->mem;
+    *capacity = best_iter->capacity;
+    buffer_pool_.erase(best_iter);
+    return mem_object;
+  }
 
-  err_num = clGetPlatformIDs(num_platforms, platform_ids.data(), nullptr);
-  if (err_num != CL_SUCCESS) {
-    std::cout << "ERROR: OpenCLContext: Failed to get OpenCL platform id(s)"
-              << std::endl;
-    return;
+  // the size class may not fit in one allocation when size does
+  *capacity = size_class;
+  const std::size_t max_alloc_size = GetDeviceMaxMemAllocSize();
+  if (max_alloc_size != 0 && size_class > max_alloc_size) {
+    *capacity = size;
   }
+  cl_int err_num;
+  cl_mem mem_object =
+      clCreateBuffer(context, flags, *capacity, nullptr, &err_num);
+  if (err_num != CL_SUCCESS && !buffer_pool_.empty()) {
+    // unused buffers may hold the device memory that is needed
+    ClearBufferPool();
+    mem_object = clCreateBuffer(context, flags, *capacity, nullptr, &err_num);
+  }
+  return err_num == CL_SUCCESS ? mem_object : nullptr;
+}
 
-  bool success = false;
-  for (cl_uint i = 0; i < num_platforms; ++i) {
-    cl_context_properties context_properties[] = {
-        CL_CONTEXT_PLATFORM,
-        reinterpret_cast<cl_context_properties>(platform_ids[i]), 0};
+void OpenCLContext::OpenCLHandle::ReleaseBuffer(
+    const BufferInfo &buffer_info) {
+  if (buffer_info.capacity == 0) {
+    clReleaseMemObject(buffer_info.mem);
+    return;
+  }
 
-    context_ = clCreateContextFromType(context_properties, CL_DEVICE_TYPE_GPU,
-                                       nullptr, nullptr, &err_num);
+  buffer_pool_.push_back(
+      {buffer_info.mem, buffer_info.flags, buffer_info.capacity});
+  if (buffer_pool_.size() > kMaxPooledBuffers) {
+    clReleaseMemObject(buffer_pool_.front().mem);
+    buffer_pool_.erase(buffer_pool_.begin());
+  }
+}
 
+bool OpenCLContext::OpenCLHandle::CreateQueues() {
+  // in-order queues, so that commands of one queue need no events between
+  // them while commands of different queues can overlap
+  const cl_queue_properties profiling_properties[] = {
+      CL_QUEUE_PROPERTIES, CL_QUEUE_PROFILING_ENABLE, 0};
+  for (unsigned int i = 0; i < pipeline_depth_; ++i) {
+    cl_int err_num;
+    cl_command_queue queue = clCreateCommandQueueWithProperties(
+        opencl_ptr_->context_, opencl_ptr_->device_id_,
+        OpenCLProfiler::IsEnabled() ? profiling_properties : nullptr,
+        &err_num);
     if (err_num != CL_SUCCESS) {
-      std::cout << "ERROR: OpenCLContext: Failed to create GPU context, "
-                << "trying CPU..." << std::endl;
-      context_ = clCreateContextFromType(context_properties, CL_DEVICE_TYPE_CPU,
-                                         nullptr, nullptr, &err_num);
-      if (err_num != CL_SUCCESS) {
-        std::cout << "ERROR: OpenCLContext: Failed to create CPU context"
-                  << std::endl;
-        context_ = nullptr;
-        continue;
-      } else {
-        success = true;
-        break;
+      std::cout << "ERROR: OpenCLHandle: Failed to create command queue"
+                << std::endl;
+      for (cl_command_queue created_queue : queues_) {
+        clReleaseCommandQueue(created_queue);
       }
-    } else {
-      success = true;
-      break;
+      queues_.clear();
+      return false;
     }
+    queues_.push_back(queue);
   }
-  if (!success) {
-    std::cout << "ERROR: OpenCLContext: Failed to find a valid OpenCL context!"
-              << std::endl;
-  }
-  //////////////////// end set up cl context
 
-  //////////////////// set up command queue
-  std::vector<cl_device_id> devices;
-  std::size_t device_buffer_size = -1;
+  return true;
+}
 
-  err_num = clGetContextInfo(context_, CL_CONTEXT_DEVICES, 0, nullptr,
-                             &device_buffer_size);
-  if (err_num != CL_SUCCESS) {
-    std::cout << "ERROR: OpenCLContext: Failed to get device count"
+cl_command_queue OpenCLContext::OpenCLHandle::GetQueue(
+    std::size_t queue_index) const {
+  return queues_[queue_index % queues_.size()];
+}
+
+OpenCLContext::OpenCLContext(const Device *device)
+    : weak_handles_(),
+      context_(nullptr),
+      device_id_(nullptr),
+      device_description_(),
+      is_unified_memory_(false),
+      mem_base_addr_align_(0),
+      compute_units_(0),
+      programs_(),
+      programs_mutex_() {
+  if (device == nullptr) {
+    std::cout << "ERROR: OpenCLContext: Failed to find a valid OpenCL context!"
               << std::endl;
-    clReleaseContext(context_);
-    context_ = nullptr;
-    return;
-  } else if (device_buffer_size == 0) {
-    std::cout << "ERROR: OpenCLContext: No devices available" << std::endl;
-    clReleaseContext(context_);
-    context_ = nullptr;
     return;
   }
 
-  devices.resize(device_buffer_size);
-  err_num = clGetContextInfo(context_, CL_CONTEXT_DEVICES, device_buffer_size,
-                             devices.data(), nullptr);
-  if (err_num != CL_SUCCESS) {
-    std::cout << "ERROR: OpenCLContext: Failed to get devices" << std::endl;
-    clReleaseContext(context_);
-    context_ = nullptr;
-    return;
-  }
+  //////////////////// set up cl_context
+  cl_int err_num;
+  cl_context_properties context_properties[] = {
+      CL_CONTEXT_PLATFORM,
+      reinterpret_cast<cl_context_properties>(device->platform_id), 0};
 
-  // uses first available device
-  queue_ = clCreateCommandQueueWithProperties(context_, devices.at(0), nullptr,
-                                              &err_num);
+  context_ = clCreateContext(context_properties, 1, &device->device_id,
+                             nullptr, nullptr, &err_num);
   if (err_num != CL_SUCCESS) {
-    std::cout << "ERROR: OpenCLContext: Failed to create command queue"
-              << std::endl;
-    clReleaseContext(context_);
+    std::cout << "ERROR: OpenCLContext: Failed to create context ("
+              << err_num << ")" << std::endl;
     context_ = nullptr;
     return;
   }
+  //////////////////// end set up cl context
 
-  device_id_ = devices.at(0);
-  //////////////////// end set up command queue
+  device_id_ = device->device_id;
+  // binaries and tuned settings are only valid for the same device and
+  // driver
+  device_description_ =
+      GetPlatformInfoString(device->platform_id, CL_PLATFORM_NAME) + '\n' +
+      GetPlatformInfoString(device->platform_id, CL_PLATFORM_VERSION) + '\n' +
+      GetDeviceInfoString(device_id_, CL_DEVICE_NAME) + '\n' +
+      GetDeviceInfoString(device_id_, CL_DEVICE_VERSION) + '\n' +
+      GetDeviceInfoString(device_id_, CL_DRIVER_VERSION);
+  is_unified_memory_ = IsUnifiedMemoryDevice(device_id_);
+  // reported in bits
+  mem_base_addr_align_ =
+      GetDeviceInfoValue<cl_uint>(device_id_, CL_DEVICE_MEM_BASE_ADDR_ALIGN,
+                                  0) /
+      8;
+  compute_units_ =
+      GetDeviceInfoValue<cl_uint>(device_id_, CL_DEVICE_MAX_COMPUTE_UNITS, 0);
 }
 
 OpenCLContext::~OpenCLContext() {
   std::cout << "Destructing OpenCLContext..." << std::endl;
-  if (queue_) {
-    clReleaseCommandQueue(queue_);
+  for (const auto &key_program : programs_) {
+    clReleaseProgram(key_program.second);
   }
   if (context_) {
     clReleaseContext(context_);
@@ -805,26 +1767,378 @@ OpenCLContext::~OpenCLContext() {
 }
 
 OpenCLContext::OpenCLHandle::Ptr OpenCLContext::GetHandle() {
-  if (!instance_) {
-    // cannot use make_unique due to private constructor
-    instance_ = std::unique_ptr<OpenCLContext>(new OpenCLContext());
+  return GetHandle(0);
+}
+
+OpenCLContext::OpenCLHandle::Ptr OpenCLContext::GetHandle(
+    std::size_t device_index) {
+  std::lock_guard<std::mutex> lock(instances_mutex_);
+  EnumerateDevices();
+
+  // without devices, index 0 is an invalid context so that callers can fall
+  // back like they do when OpenCL fails
+  if (device_index >= std::max<std::size_t>(devices_.size(), 1)) {
+    std::cout << "ERROR: OpenCLContext: There is no OpenCL device "
+              << device_index << std::endl;
+    return {};
+  }
+  if (instances_.size() <= device_index) {
+    instances_.resize(device_index + 1);
+  }
+
+  Ptr instance = instances_[device_index].lock();
+  if (!instance) {
+    // cannot use make_shared due to private constructor
+    instance = Ptr(new OpenCLContext(
+        devices_.empty() ? nullptr : &devices_[device_index]));
+    instances_[device_index] = instance;
   }
 
-  auto strong_handle = instance_->weak_handle_.lock();
+  OpenCLHandle::WeakPtr &weak_handle =
+      instance->weak_handles_[std::this_thread::get_id()];
+  auto strong_handle = weak_handle.lock();
   if (strong_handle) {
     return strong_handle;
   }
+  // forget handles of threads that are done with them
+  for (auto iter = instance->weak_handles_.begin();
+       iter != instance->weak_handles_.end();) {
+    if (iter->second.expired() && &iter->second != &weak_handle) {
+      iter = instance->weak_handles_.erase(iter);
+    } else {
+      ++iter;
+    }
+  }
   // cannot use make_shared due to private constructor
   strong_handle = std::shared_ptr<OpenCLHandle>(new OpenCLHandle());
-  strong_handle->opencl_ptr_ = instance_;
-  instance_->weak_handle_ = strong_handle;
+  strong_handle->opencl_ptr_ = instance;
+  strong_handle->device_index_ = device_index;
+  if (instance->IsValid()) {
+    // an invalid handle without queues, so that callers fall back
+    strong_handle->CreateQueues();
+  }
+  weak_handle = strong_handle;
+
+  // kept until the thread exits, so that callers can get the handle for
+  // every call and still reuse its kernels and buffers
+  static thread_local std::vector<OpenCLHandle::Ptr> thread_handles;
+  if (thread_handles.size() <= device_index) {
+    thread_handles.resize(device_index + 1);
+  }
+  thread_handles[device_index] = strong_handle;
 
   return strong_handle;
 }
 
-void OpenCLContext::CleanupInstance() {
-  // OpenCLHandle is destructing, cleanup context by calling destructor
-  instance_.reset();
+std::size_t OpenCLContext::GetDeviceCount() {
+  std::lock_guard<std::mutex> lock(instances_mutex_);
+  EnumerateDevices();
+  return devices_.size();
+}
+
+void OpenCLContext::SetPipelineDepth(unsigned int depth) {
+  pipeline_depth_ = std::max(depth, 1u);
+}
+
+unsigned int OpenCLContext::GetPipelineDepth() { return pipeline_depth_; }
+
+void OpenCLContext::SetProgramCacheDirectory(const std::string &directory) {
+  program_cache_directory_ = directory;
+}
+
+void OpenCLContext::SetDeviceSelection(int platform_index, int device_index) {
+  std::lock_guard<std::mutex> lock(instances_mutex_);
+  for (const WeakPtr &instance : instances_) {
+    if (!instance.expired()) {
+      std::cout << "WARNING: OpenCLContext: Ignoring device selection while "
+                   "devices are in use"
+                << std::endl;
+      return;
+    }
+  }
+
+  selected_platform_index_ = platform_index;
+  selected_device_index_ = device_index;
+  // enumerated again with the selection when next used
+  devices_.clear();
+  instances_.clear();
+  is_devices_enumerated_ = false;
+}
+
+void OpenCLContext::PrintDevices(std::ostream &out) {
+  std::lock_guard<std::mutex> lock(instances_mutex_);
+  EnumerateDevices();
+
+  const std::vector<cl_platform_id> platform_ids = GetPlatforms();
+  if (platform_ids.empty()) {
+    out << "No OpenCL platforms found" << std::endl;
+    return;
+  }
+  for (std::size_t p = 0; p < platform_ids.size(); ++p) {
+    out << "Platform " << p << ": "
+        << GetPlatformInfoString(platform_ids[p], CL_PLATFORM_NAME) << " ("
+        << GetPlatformInfoString(platform_ids[p], CL_PLATFORM_VERSION)
+        << ")\n";
+    const std::vector<cl_device_id> device_ids =
+        GetPlatformDevices(platform_ids[p]);
+    for (std::size_t d = 0; d < device_ids.size(); ++d) {
+      const cl_device_id device_id = device_ids[d];
+      bool is_used = false;
+      for (const Device &device : devices_) {
+        is_used = is_used || device.device_id == device_id;
+      }
+      out << (is_used ? "* " : "  ") << "Device " << d << ": "
+          << GetDeviceInfoString(device_id, CL_DEVICE_NAME) << " ("
+          << GetDeviceTypeName(device_id)
+          << (IsUsableDevice(device_id) ? "" : ", unavailable") << ")\n"
+          << "    compute units: "
+          << GetDeviceInfoValue<cl_uint>(device_id,
+                                         CL_DEVICE_MAX_COMPUTE_UNITS, 0)
+          << ", max alloc: "
+          << GetDeviceInfoValue<cl_ulong>(device_id,
+                                          CL_DEVICE_MAX_MEM_ALLOC_SIZE, 0) /
+                 (1024 * 1024)
+          << " MiB, local mem: "
+          << GetDeviceInfoValue<cl_ulong>(device_id, CL_DEVICE_LOCAL_MEM_SIZE,
+                                          0) /
+                 1024
+          << " KiB, unified memory: "
+          << (IsUnifiedMemoryDevice(device_id) ? "yes" : "no")
+          << ", images: "
+          << (GetDeviceInfoValue<cl_bool>(device_id, CL_DEVICE_IMAGE_SUPPORT,
+                                          CL_FALSE) == CL_TRUE
+                  ? "yes"
+                  : "no")
+          << '\n';
+    }
+  }
+  out << std::flush;
+}
+
+void OpenCLContext::EnumerateDevices() {
+  if (is_devices_enumerated_) {
+    return;
+  }
+  is_devices_enumerated_ = true;
+
+  const std::vector<cl_platform_id> platform_ids = GetPlatforms();
+  if (platform_ids.empty()) {
+    std::cout << "ERROR: OpenCLContext: Failed to find any OpenCL platforms"
+              << std::endl;
+    return;
+  }
+
+  // devices of platforms that are not selected are left empty
+  const int platform_index =
+      selected_device_index_ >= 0 && selected_platform_index_ < 0
+          ? 0
+          : selected_platform_index_;
+  std::vector<std::vector<cl_device_id>> platform_devices(
+      platform_ids.size());
+  for (std::size_t p = 0; p < platform_ids.size(); ++p) {
+    if (platform_index < 0 || static_cast<std::size_t>(platform_index) == p) {
+      platform_devices[p] = GetPlatformDevices(platform_ids[p]);
+    }
+  }
+
+  // GPUs of every platform come first, so device 0 is the device that was
+  // used when only one device was supported
+  const cl_device_type device_types[] = {
+      CL_DEVICE_TYPE_GPU, CL_DEVICE_TYPE_ACCELERATOR, CL_DEVICE_TYPE_CPU};
+  for (cl_device_type device_type : device_types) {
+    for (std::size_t p = 0; p < platform_ids.size(); ++p) {
+      const std::vector<cl_device_id> &device_ids = platform_devices[p];
+      for (std::size_t d = 0; d < device_ids.size(); ++d) {
+        const cl_device_type type = GetDeviceInfoValue<cl_device_type>(
+            device_ids[d], CL_DEVICE_TYPE, 0);
+        if ((selected_device_index_ < 0 ||
+             static_cast<std::size_t>(selected_device_index_) == d) &&
+            (type & device_type) != 0 && IsUsableDevice(device_ids[d])) {
+          devices_.push_back({platform_ids[p], device_ids[d]});
+        }
+      }
+    }
+  }
+
+  if (devices_.empty() && platform_index >= 0) {
+    std::cout << "ERROR: OpenCLContext: Failed to find the selected OpenCL "
+                 "devices (platform "
+              << platform_index;
+    if (selected_device_index_ >= 0) {
+      std::cout << ", device " << selected_device_index_;
+    }
+    std::cout << ')' << std::endl;
+  } else if (devices_.empty()) {
+    std::cout << "ERROR: OpenCLContext: Failed to find any OpenCL devices"
+              << std::endl;
+  }
+}
+
+bool OpenCLContext::IsValid() const { return context_ != nullptr; }
+
+const std::string &OpenCLContext::GetDeviceDescription() const {
+  return device_description_;
+}
+
+cl_program OpenCLContext::GetProgram(const std::string &source,
+                                     const std::string &build_options) {
+  // threads building the same program wait for the first one to finish
+  std::lock_guard<std::mutex> lock(programs_mutex_);
+  // fields are separated by a character that is in none of them
+  const std::string key = build_options + '\0' + source;
+  auto program_iter = programs_.find(key);
+  if (program_iter != programs_.end()) {
+    clRetainProgram(program_iter->second);
+    return program_iter->second;
+  }
+
+  cl_program program = nullptr;
+  const std::string cache_filename =
+      GetProgramCacheFilename(source, build_options);
+  if (!cache_filename.empty()) {
+    program = LoadProgramBinary(cache_filename, build_options);
+  }
+
+  if (!program) {
+    cl_int err_num;
+    const char *source_c_str = source.c_str();
+    program = clCreateProgramWithSource(context_, 1, &source_c_str, nullptr,
+                                        &err_num);
+    if (err_num != CL_SUCCESS) {
+      std::cout << "ERROR: OpenCLContext: Failed to create program from source"
+                << std::endl;
+      return nullptr;
+    }
+
+    err_num = clBuildProgram(program, 0, nullptr, build_options.c_str(),
+                             nullptr, nullptr);
+    if (err_num != CL_SUCCESS) {
+      std::cout << "ERROR: OpenCLContext: Failed to compile kernel";
+      if (!build_options.empty()) {
+        std::cout << " with options \"" << build_options << '"';
+      }
+      std::cout << std::endl;
+      std::vector<char> build_log;
+      build_log.resize(16384);
+      build_log.at(16383) = 0;
+      clGetProgramBuildInfo(program, device_id_, CL_PROGRAM_BUILD_LOG,
+                            build_log.size(), build_log.data(), nullptr);
+      std::cout << build_log.data();
+      clReleaseProgram(program);
+      return nullptr;
+    }
+
+    if (!cache_filename.empty()) {
+      SaveProgramBinary(program, cache_filename);
+    }
+  }
+
+  // one reference for programs_, one for the caller
+  clRetainProgram(program);
+  programs_.insert({key, program});
+  return program;
+}
+
+std::string OpenCLContext::GetProgramCacheFilename(
+    const std::string &source, const std::string &build_options) {
+  if (program_cache_directory_.empty()) {
+    return {};
+  }
+
+  // fields are separated by a character that is in none of them
+  uint64_t hash = HashString(source, 0xCBF29CE484222325ULL);
+  hash = HashString(std::string(1, '\0') + build_options, hash);
+  hash = HashString(std::string(1, '\0') + GetDeviceDescription(), hash);
+
+  std::ostringstream filename;
+  filename << program_cache_directory_ << "/igpup_dithering_cl_" << std::hex
+           << hash << ".bin";
+  return filename.str();
+}
+
+cl_program OpenCLContext::LoadProgramBinary(const std::string &filename,
+                                            const std::string &build_options) {
+  std::vector<unsigned char> binary;
+  {
+    std::ifstream ifs(filename, std::ios::binary);
+    if (!ifs.is_open()) {
+      // not cached yet
+      return nullptr;
+    }
+    binary.assign(std::istreambuf_iterator<char>(ifs),
+                  std::istreambuf_iterator<char>());
+  }
+  if (binary.empty()) {
+    return nullptr;
+  }
+
+  const std::size_t binary_size = binary.size();
+  const unsigned char *binary_ptr = binary.data();
+  cl_int binary_status;
+  cl_int err_num;
+  cl_program program =
+      clCreateProgramWithBinary(context_, 1, &device_id_, &binary_size,
+                                &binary_ptr, &binary_status, &err_num);
+  if (err_num != CL_SUCCESS || binary_status != CL_SUCCESS) {
+    std::cout << "WARNING: OpenCLContext: Cached program \"" << filename
+              << "\" was rejected, compiling from source" << std::endl;
+    if (err_num == CL_SUCCESS) {
+      clReleaseProgram(program);
+    }
+    return nullptr;
+  }
+
+  // binaries still need to be built before kernels are created from them
+  err_num = clBuildProgram(program, 1, &device_id_, build_options.c_str(),
+                           nullptr, nullptr);
+  if (err_num != CL_SUCCESS) {
+    std::cout << "WARNING: OpenCLContext: Failed to build cached program \""
+              << filename << "\", compiling from source" << std::endl;
+    clReleaseProgram(program);
+    return nullptr;
+  }
+
+  return program;
 }
 
-bool OpenCLContext::IsValid() const { return context_ && queue_; }
+void OpenCLContext::SaveProgramBinary(cl_program program,
+                                      const std::string &filename) {
+  // the program is built for device_id_ only
+  std::size_t binary_size = 0;
+  cl_int err_num = clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES,
+                                    sizeof(std::size_t), &binary_size, nullptr);
+  if (err_num != CL_SUCCESS || binary_size == 0) {
+    return;
+  }
+  std::vector<unsigned char> binary(binary_size);
+  unsigned char *binary_ptr = binary.data();
+  err_num = clGetProgramInfo(program, CL_PROGRAM_BINARIES,
+                             sizeof(unsigned char *), &binary_ptr, nullptr);
+  if (err_num != CL_SUCCESS) {
+    return;
+  }
+
+  // written to a temporary file first, so that another process never loads a
+  // partially written binary
+  const std::string temp_filename = GetTemporaryFilename(filename);
+  {
+    std::ofstream ofs;
+    if (CreateParentDirectories(temp_filename)) {
+      ofs.open(temp_filename, std::ios::binary);
+    }
+    if (!ofs.is_open()) {
+      std::cout << "WARNING: OpenCLContext: Failed to cache program to \""
+                << filename << '"' << std::endl;
+      return;
+    }
+    ofs.write(reinterpret_cast<const char *>(binary.data()), binary.size());
+    if (!ofs.good()) {
+      ofs.close();
+      std::remove(temp_filename.c_str());
+      return;
+    }
+  }
+  if (std::rename(temp_filename.c_str(), filename.c_str()) != 0) {
+    std::remove(temp_filename.c_str());
+  }
+}
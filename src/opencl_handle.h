@@ -3,7 +3,10 @@
 
 #include <array>
 #include <memory>
+#include <mutex>
+#include <ostream>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <utility>
 #include <vector>
@@ -26,12 +29,113 @@ class OpenCLContext {
    *
    * OpenCL is automatically cleaned up when all shared ptrs of OpenCLHandle are
    * destructed.
+   *
+   * Each handle uses one device, so kernels and buffers created with a handle
+   * belong to that device.
+   *
+   * Each thread gets its own handle of a device, with its own kernels,
+   * buffers, and command queues, while the context and compiled programs of
+   * the device are shared. A handle is not thread-safe, so it must only be
+   * used by one thread at a time, but threads may dither with their own
+   * handles at once.
    */
   class OpenCLHandle {
+   private:
+    // defined below, referred to by KernelRef and BufferRef
+    struct KernelInfo;
+    struct BufferInfo;
+
    public:
     typedef std::shared_ptr<OpenCLHandle> Ptr;
     typedef std::weak_ptr<OpenCLHandle> WeakPtr;
 
+    /*!
+     * \brief An enqueued command that can be waited on, or that later
+     * commands can wait on.
+     *
+     * Copies refer to the same command. A default constructed Event refers
+     * to no command and is always complete.
+     */
+    class Event {
+     public:
+      Event();
+      ~Event();
+
+      Event(const Event &other);
+      Event &operator=(const Event &other);
+
+      Event(Event &&other);
+      Event &operator=(Event &&other);
+
+      /// Returns true if the Event refers to a command
+      bool IsValid() const;
+
+      /// Returns true if the command has finished, or failed
+      bool IsComplete() const;
+
+      /*!
+       * \brief Blocks until the command has finished.
+       *
+       * \return False if the command failed.
+       */
+      bool Wait();
+
+     private:
+      friend class OpenCLHandle;
+
+      /// Takes ownership of event
+      explicit Event(cl_event event);
+
+      cl_event event_;
+    };
+
+    typedef std::vector<Event> EventList;
+
+    /*!
+     * \brief A kernel of a handle, looked up once with GetKernel() instead of
+     * by name on every call.
+     *
+     * A KernelRef is valid until its kernel is cleaned up, and must only be
+     * used with the handle that it was got from. A default constructed
+     * KernelRef refers to no kernel.
+     */
+    class KernelRef {
+     public:
+      KernelRef();
+
+      /// Returns true if the KernelRef refers to a kernel
+      bool IsValid() const;
+
+     private:
+      friend class OpenCLHandle;
+
+      explicit KernelRef(std::pair<const std::string, KernelInfo> *kernel);
+
+      std::pair<const std::string, KernelInfo> *kernel_;
+    };
+
+    /*!
+     * \brief A buffer or image of a kernel, looked up once with GetBuffer().
+     *
+     * Same as KernelRef, but is also invalidated by cleaning up the buffer.
+     */
+    class BufferRef {
+     public:
+      BufferRef();
+
+      /// Returns true if the BufferRef refers to a buffer
+      bool IsValid() const;
+
+     private:
+      friend class OpenCLHandle;
+
+      BufferRef(std::pair<const std::string, KernelInfo> *kernel,
+                std::pair<const std::string, BufferInfo> *buffer);
+
+      std::pair<const std::string, KernelInfo> *kernel_;
+      std::pair<const std::string, BufferInfo> *buffer_;
+    };
+
     ~OpenCLHandle();
 
     // no copy
@@ -44,16 +148,49 @@ class OpenCLContext {
 
     bool IsValid() const;
 
+    /// Returns the device_index this handle was got with from GetHandle()
+    std::size_t GetDeviceIndex() const;
+
+    /*!
+     * \brief Returns the number of command queues of the handle, see
+     * OpenCLContext::SetPipelineDepth().
+     *
+     * Commands given the same queue_index run in order, and commands of
+     * different queues may run at the same time, e.g. a copy to the device
+     * while a kernel runs. Queue indices wrap around, so any index is valid.
+     */
+    std::size_t GetQueueCount() const;
+
+    /*!
+     * \brief Returns a short name of the device that is the same across runs
+     * for the same platform, device, and driver versions.
+     *
+     * \return An empty string if the handle is invalid.
+     */
+    std::string GetDeviceKey();
+
     /*!
      * \brief Compiles a kernel from source that can be referenced with the
      * given kernel name.
      *
+     * The compiled program is saved to the program cache (see
+     * OpenCLContext::SetProgramCacheDirectory()), and is loaded from it
+     * instead of compiling the same source again for the same device and
+     * driver. If the cached binary is rejected, the source is compiled.
+     *
+     * build_options are passed to clBuildProgram(), e.g. "-D NAME=value"
+     * defines that specialize the source. Programs are cached per source and
+     * build_options, so each specialized variant is compiled once. Variants
+     * of the same source need different kernel names to be created at the
+     * same time, see GetKernelBuildOptions().
+     *
      * The created kernel can be free'd with a call to CleanupKernel().
      *
      * \return True on success.
      */
     bool CreateKernelFromSource(const std::string &kernel_fn,
-                                const std::string &kernel_name);
+                                const std::string &kernel_name,
+                                const std::string &build_options = {});
 
     /*!
      * \brief Compiles a kernel from source that can be referenced with the
@@ -64,7 +201,8 @@ class OpenCLContext {
      * \return True on success.
      */
     bool CreateKernelFromSource(const char *kernel_fn,
-                                const std::string &kernel_name);
+                                const std::string &kernel_name,
+                                const std::string &build_options = {});
 
     /*!
      * \brief Compiles a kernel from a file that can be referenced with the
@@ -75,7 +213,8 @@ class OpenCLContext {
      * \return True on success.
      */
     bool CreateKernelFromFile(const std::string &filename,
-                              const std::string &kernel_name);
+                              const std::string &kernel_name,
+                              const std::string &build_options = {});
 
     /*!
      * \brief Compiles a kernel from a file that can be referenced with the
@@ -86,7 +225,8 @@ class OpenCLContext {
      * \return True on success.
      */
     bool CreateKernelFromFile(const char *filename,
-                              const std::string &kernel_name);
+                              const std::string &kernel_name,
+                              const std::string &build_options = {});
 
     /*!
      * \brief Creates a cl_mem buffer that can be referenced with the given
@@ -97,7 +237,11 @@ class OpenCLContext {
      * that was used to create it.
      *
      * If host_ptr set to nullptr, then the created buffer will be
-     * uninitialized.
+     * uninitialized. Such buffers are taken from a pool of buffers that were
+     * cleaned up before, shared by every kernel of this handle, so that a
+     * changed image size does not allocate device memory every time. Pooled
+     * buffers are allocated in size classes that grow geometrically, and may
+     * be larger than buf_size.
      *
      * \return True on success.
      */
@@ -115,13 +259,76 @@ class OpenCLContext {
      */
     bool SetKernelBufferData(const std::string &kernel_name,
                              const std::string &buffer_name,
-                             std::size_t data_size, void *data_ptr);
+                             std::size_t data_size, const void *data_ptr);
+
+    /*!
+     * \brief Enqueues assigning host data to an existing device buffer, and
+     * returns without waiting for it.
+     *
+     * The copy starts after the commands of wait_list have finished. data_ptr
+     * must stay valid until the Event stored in event (if not nullptr) is
+     * complete.
+     *
+     * \return True on success.
+     */
+    bool SetKernelBufferDataAsync(const std::string &kernel_name,
+                                  const std::string &buffer_name,
+                                  std::size_t data_size, const void *data_ptr,
+                                  const EventList &wait_list, Event *event);
+
+    /*!
+     * \brief Same as SetKernelBufferDataAsync(), but copies data_size bytes
+     * to the part of the buffer starting at offset, on the queue at
+     * queue_index.
+     *
+     * \return True on success.
+     */
+    bool SetKernelBufferRegionAsync(const std::string &kernel_name,
+                                    const std::string &buffer_name,
+                                    std::size_t offset, std::size_t data_size,
+                                    const void *data_ptr,
+                                    std::size_t queue_index,
+                                    const EventList &wait_list, Event *event);
+
+    /*!
+     * \brief Creates a 2D image of width x height single byte pixels
+     * (CL_R, CL_UNSIGNED_INT8) that can be referenced with the given
+     * image_name.
+     *
+     * Like buffers, the image is stored with the specified kernel's data, and
+     * is used with the buffer functions of this class, e.g.
+     * AssignKernelBuffer() and CleanupBuffer(). Its size is width * height.
+     *
+     * If host_ptr set to nullptr, then the created image will be
+     * uninitialized.
+     *
+     * \return True on success.
+     */
+    bool CreateKernelImage(const std::string &kernel_name, cl_mem_flags flags,
+                           std::size_t width, std::size_t height,
+                           void *host_ptr, const std::string &image_name);
+
+    /*!
+     * \brief Enqueues copying width x height bytes of host data to an
+     * existing image, and returns without waiting for it.
+     *
+     * Same as SetKernelBufferDataAsync(), but for images created with
+     * CreateKernelImage().
+     *
+     * \return True on success.
+     */
+    bool SetKernelImageDataAsync(const std::string &kernel_name,
+                                 const std::string &image_name,
+                                 std::size_t width, std::size_t height,
+                                 const void *data_ptr,
+                                 const EventList &wait_list, Event *event);
 
     /*!
      * \brief Assign a previously created buffer to a kernel function's
      * parameter.
      *
-     * idx refers to the parameter index for the kernel function.
+     * idx refers to the parameter index for the kernel function. Like
+     * AssignKernelArgument(), assigning the same buffer again does nothing.
      *
      * \return true on success.
      */
@@ -131,7 +338,12 @@ class OpenCLContext {
     /*!
      * \brief Assign data to a kernel function's parameter.
      *
-     * idx refers to the parameter index for the kernel function.
+     * idx refers to the parameter index for the kernel function. If
+     * data_ptr is nullptr, the parameter is a __local buffer of data_size
+     * bytes.
+     *
+     * The last value assigned to each parameter is kept, so assigning the
+     * same value again does not call clSetKernelArg().
      *
      * \return true on success.
      */
@@ -155,6 +367,55 @@ class OpenCLContext {
 
     std::size_t GetDeviceMaxWorkGroupSize();
 
+    /*!
+     * \brief Gets the size associated with CL_DEVICE_MAX_MEM_ALLOC_SIZE.
+     *
+     * This is the largest buffer that can be created with
+     * CreateKernelBuffer().
+     *
+     * \return 0 on failure.
+     */
+    std::size_t GetDeviceMaxMemAllocSize();
+
+    /*!
+     * \brief Gets the size associated with CL_DEVICE_LOCAL_MEM_SIZE.
+     *
+     * This is the most local memory that a work group can use.
+     *
+     * \return 0 on failure.
+     */
+    std::size_t GetDeviceLocalMemSize();
+
+    /// Returns true if the device supports images (CL_DEVICE_IMAGE_SUPPORT)
+    bool HasImageSupport();
+
+    /*!
+     * \brief Returns true if the device works on host memory, like CPU
+     * devices and most integrated GPUs.
+     *
+     * Buffers created with CL_MEM_USE_HOST_PTR on such devices use the
+     * host memory directly instead of copying it to and from the device.
+     */
+    bool HasUnifiedMemory();
+
+    /*!
+     * \brief Gets the alignment in bytes of CL_DEVICE_MEM_BASE_ADDR_ALIGN.
+     *
+     * Host memory of buffers created with CL_MEM_USE_HOST_PTR must be
+     * aligned to this to be used without copying.
+     *
+     * \return 0 on failure.
+     */
+    std::size_t GetDeviceMemBaseAddrAlign();
+
+    /*!
+     * \brief Gets the number associated with CL_DEVICE_MAX_COMPUTE_UNITS,
+     * which is the number of cores of CPU devices.
+     *
+     * \return 0 on failure.
+     */
+    unsigned int GetDeviceComputeUnits();
+
     /*!
      * \brief Executes the kernel with the given kernel_name.
      *
@@ -175,6 +436,52 @@ class OpenCLContext {
                          std::size_t local_work_size_0,
                          std::size_t local_work_size_1, bool is_blocking);
 
+    /*!
+     * \brief Enqueues executing the kernel with the given kernel_name, and
+     * returns without waiting for it.
+     *
+     * The kernel starts after the commands of wait_list have finished. Its
+     * Event is stored in event if not nullptr.
+     *
+     * \return true on success.
+     */
+    bool ExecuteKernelAsync(const std::string &kernel_name,
+                            std::size_t global_work_size,
+                            std::size_t local_work_size,
+                            const EventList &wait_list, Event *event);
+
+    /*!
+     * \brief Enqueues executing the kernel with the given kernel_name, and
+     * returns without waiting for it.
+     *
+     * The kernel starts after the commands of wait_list have finished. Its
+     * Event is stored in event if not nullptr. Local work sizes of 0 let the
+     * implementation pick them.
+     *
+     * \return true on success.
+     */
+    bool ExecuteKernel2DAsync(const std::string &kernel_name,
+                              std::size_t global_work_size_0,
+                              std::size_t global_work_size_1,
+                              std::size_t local_work_size_0,
+                              std::size_t local_work_size_1,
+                              const EventList &wait_list, Event *event);
+
+    /*!
+     * \brief Same as ExecuteKernel2DAsync(), but the global ids of the work
+     * items start at the global work offsets, on the queue at queue_index.
+     *
+     * This executes a part of a larger range, e.g. a strip of rows.
+     *
+     * \return true on success.
+     */
+    bool ExecuteKernel2DRegionAsync(
+        const std::string &kernel_name, std::size_t global_work_offset_0,
+        std::size_t global_work_offset_1, std::size_t global_work_size_0,
+        std::size_t global_work_size_1, std::size_t local_work_size_0,
+        std::size_t local_work_size_1, std::size_t queue_index,
+        const EventList &wait_list, Event *event);
+
     /*!
      * \brief Copies device memory to data_out.
      *
@@ -184,14 +491,140 @@ class OpenCLContext {
                        const std::string &buffer_name, std::size_t out_size,
                        void *data_out);
 
+    /*!
+     * \brief Enqueues copying device memory to data_out, and returns without
+     * waiting for it.
+     *
+     * The copy starts after the commands of wait_list have finished. data_out
+     * must not be used until the Event stored in event (if not nullptr) is
+     * complete.
+     *
+     * \return True on success.
+     */
+    bool GetBufferDataAsync(const std::string &kernel_name,
+                            const std::string &buffer_name,
+                            std::size_t out_size, void *data_out,
+                            const EventList &wait_list, Event *event);
+
+    /*!
+     * \brief Same as GetBufferDataAsync(), but copies out_size bytes of the
+     * part of the buffer starting at offset, on the queue at queue_index.
+     *
+     * \return True on success.
+     */
+    bool GetBufferRegionAsync(const std::string &kernel_name,
+                              const std::string &buffer_name,
+                              std::size_t offset, std::size_t out_size,
+                              void *data_out, std::size_t queue_index,
+                              const EventList &wait_list, Event *event);
+
+    /*!
+     * \brief Returns a KernelRef of the kernel with the given kernel_name.
+     *
+     * The functions that take a KernelRef or BufferRef skip looking up the
+     * kernel and buffer by name, for commands that are enqueued for every
+     * image or strip.
+     *
+     * \return An invalid KernelRef if the kernel doesn't exist.
+     */
+    KernelRef GetKernel(const std::string &kernel_name);
+
+    /*!
+     * \brief Returns a BufferRef of the buffer or image of kernel with the
+     * given buffer_name.
+     *
+     * \return An invalid BufferRef if the buffer doesn't exist.
+     */
+    BufferRef GetBuffer(const KernelRef &kernel,
+                        const std::string &buffer_name);
+
+    /// Same as SetKernelBufferRegionAsync(), but of a BufferRef
+    bool SetKernelBufferRegionAsync(const BufferRef &buffer,
+                                    std::size_t offset, std::size_t data_size,
+                                    const void *data_ptr,
+                                    std::size_t queue_index,
+                                    const EventList &wait_list, Event *event);
+
+    /// Same as AssignKernelBuffer(), but of a KernelRef and a BufferRef of it
+    bool AssignKernelBuffer(const KernelRef &kernel, unsigned int idx,
+                            const BufferRef &buffer);
+
+    /// Same as AssignKernelArgument(), but of a KernelRef
+    bool AssignKernelArgument(const KernelRef &kernel, unsigned int idx,
+                              std::size_t data_size, const void *data_ptr);
+
+    /// Same as ExecuteKernelAsync(), but of a KernelRef
+    bool ExecuteKernelAsync(const KernelRef &kernel,
+                            std::size_t global_work_size,
+                            std::size_t local_work_size,
+                            const EventList &wait_list, Event *event);
+
+    /// Same as ExecuteKernel2DRegionAsync(), but of a KernelRef
+    bool ExecuteKernel2DRegionAsync(
+        const KernelRef &kernel, std::size_t global_work_offset_0,
+        std::size_t global_work_offset_1, std::size_t global_work_size_0,
+        std::size_t global_work_size_1, std::size_t local_work_size_0,
+        std::size_t local_work_size_1, std::size_t queue_index,
+        const EventList &wait_list, Event *event);
+
+    /// Same as GetBufferRegionAsync(), but of a BufferRef
+    bool GetBufferRegionAsync(const BufferRef &buffer, std::size_t offset,
+                              std::size_t out_size, void *data_out,
+                              std::size_t queue_index,
+                              const EventList &wait_list, Event *event);
+
+    /*!
+     * \brief Maps a buffer into host memory, blocking until it is mapped.
+     *
+     * Mapping starts after the commands of wait_list have finished. flags
+     * are CL_MAP_READ and/or CL_MAP_WRITE. The returned pointer is within
+     * the buffer's host_ptr if it was created with CL_MEM_USE_HOST_PTR, so
+     * no data is copied on devices with unified memory.
+     *
+     * The buffer must be unmapped with UnmapKernelBuffer() before a kernel
+     * uses it again.
+     *
+     * \return nullptr on failure.
+     */
+    void *MapKernelBuffer(const std::string &kernel_name,
+                          const std::string &buffer_name, cl_map_flags flags,
+                          const EventList &wait_list);
+
+    /*!
+     * \brief Enqueues unmapping a pointer returned by MapKernelBuffer().
+     *
+     * The Event of the unmap is stored in event if not nullptr.
+     *
+     * \return True on success.
+     */
+    bool UnmapKernelBuffer(const std::string &kernel_name,
+                           const std::string &buffer_name, void *mapped_ptr,
+                           Event *event);
+
+    /*!
+     * \brief Blocks until every enqueued command of every queue has finished.
+     *
+     * \return True on success.
+     */
+    bool Finish();
+
     /// Returns true if the kernel exists
     bool HasKernel(const std::string &kernel_name) const;
 
+    /*!
+     * \brief Returns the build options that the kernel was created with.
+     *
+     * A kernel that was built with other options than needed can be removed
+     * with CleanupKernel() and created again, which loads the other variant
+     * from the program cache if it was compiled before.
+     */
+    std::string GetKernelBuildOptions(const std::string &kernel_name) const;
+
     /// Returns true if the buffer exists with the kernel
     bool HasBuffer(const std::string &kernel_name,
                    const std::string &buffer_name) const;
 
-    /// Returns the buffer size in bytes, or 0 if error
+    /// Returns the buffer size in bytes as it was created, or 0 if error
     std::size_t GetBufferSize(const std::string &kernel_name,
                               const std::string &buffer_name) const;
 
@@ -199,45 +632,147 @@ class OpenCLContext {
      * \brief Cleans up a mem buffer.
      *
      * If using CleanupKernel(), there is no need to call this function with the
-     * same kernel_id as it will cleanup the associated mem buffers.
+     * same kernel_id as it will cleanup the associated mem buffers. Buffers
+     * created without host memory are returned to the pool of
+     * CreateKernelBuffer() instead of being released.
+     *
+     * Waits for every enqueued command first.
      *
      * \return true if clean has occurred.
      */
     bool CleanupBuffer(const std::string &kernel_name,
                        const std::string &buffer_name);
 
+    /*!
+     * \brief Cleans up a buffer without waiting for enqueued commands.
+     *
+     * For buffers created with CL_MEM_USE_HOST_PTR for a single image, whose
+     * last command is known to have finished. Unlike CleanupBuffer(), only the
+     * kernel parameters that the buffer was assigned to must be assigned
+     * again.
+     *
+     * \return true if clean has occurred.
+     */
+    bool ReleaseHostBuffer(const std::string &kernel_name,
+                           const std::string &buffer_name);
+
     /*!
      * \brief Cleans up a kernel object and its associated data (including mem
      * buffers).
      *
+     * Waits for every enqueued command first.
+     *
      * \return true if cleanup has occurred.
      */
     bool CleanupKernel(const std::string &kernel_name);
 
     /*!
      * \brief Cleans up all Kernel data (including mem buffers).
+     *
+     * Waits for every enqueued command first.
      */
     void CleanupAllKernels();
 
+    /// Releases the pooled buffers that no kernel uses
+    void ClearBufferPool();
+
    private:
     friend class OpenCLContext;
 
     struct BufferInfo {
       cl_mem mem;
       std::size_t size;
+      cl_mem_flags flags;
+      /// Allocated size of a buffer from the pool, 0 if not pooled
+      std::size_t capacity;
+    };
+
+    struct PooledBuffer {
+      cl_mem mem;
+      cl_mem_flags flags;
+      std::size_t capacity;
+    };
+
+    /// Most unused buffers kept in buffer_pool_, the oldest are released
+    static constexpr std::size_t kMaxPooledBuffers = 8;
+    /// Smallest size class of pooled buffers
+    static constexpr std::size_t kMinPoolSizeClass = 4096;
+
+    /// Last value assigned to a kernel parameter
+    struct ArgumentValue {
+      bool is_set;
+      std::size_t size;
+      /// Empty for __local parameters, which only have a size
+      std::vector<unsigned char> data;
     };
 
     struct KernelInfo {
       cl_kernel kernel_;
       cl_program program_;
+      std::string build_options_;
       std::unordered_map<std::string, BufferInfo> mem_objects_;
+      /// Indexed by parameter
+      std::vector<ArgumentValue> arguments_;
     };
 
     OpenCLHandle();
 
-    OpenCLContext::WeakPtr opencl_ptr_;
+    /// Creates pipeline_depth_ queues on the device of opencl_ptr_
+    bool CreateQueues();
+
+    /// Returns the queue at queue_index, wrapping around
+    cl_command_queue GetQueue(std::size_t queue_index) const;
+
+    /*!
+     * \brief Calls clSetKernelArg() unless parameter idx of kernel_info was
+     * last assigned the same value.
+     *
+     * \return The result of clSetKernelArg(), or CL_SUCCESS if skipped.
+     */
+    static cl_int SetKernelArgument(KernelInfo *kernel_info, unsigned int idx,
+                                    std::size_t data_size,
+                                    const void *data_ptr);
+
+    /// Forgets the parameters of kernel_info that mem was assigned to, since
+    /// a buffer created later may get the same cl_mem
+    static void ForgetBufferArguments(KernelInfo *kernel_info, cl_mem mem);
+
+    /// Returns the cl_events of wait_list, skipping invalid Events
+    static std::vector<cl_event> GetEvents(const EventList &wait_list);
+
+    /*!
+     * \brief Returns the size that a pooled buffer of size bytes is allocated
+     * with.
+     *
+     * Size classes are powers of two and the halfway steps between them, so
+     * at most a third of a buffer is unused.
+     */
+    static std::size_t GetPoolSizeClass(std::size_t size);
+
+    /*!
+     * \brief Returns the smallest pooled buffer of flags that fits size bytes
+     * and is at most twice its size class, or allocates a new one.
+     *
+     * capacity is set to the allocated size.
+     *
+     * \return nullptr on failure.
+     */
+    cl_mem AcquirePooledBuffer(cl_context context, cl_mem_flags flags,
+                               std::size_t size, std::size_t *capacity);
+
+    /// Returns a pooled buffer to buffer_pool_, or releases any other buffer
+    void ReleaseBuffer(const BufferInfo &buffer_info);
+
+    /// Shared by the handles of every thread, released with the last of them
+    OpenCLContext::Ptr opencl_ptr_;
+    /// Index of the device for OpenCLContext::GetHandle()
+    std::size_t device_index_;
 
     std::unordered_map<std::string, KernelInfo> kernels_;
+    /// In-order queues, pipeline_depth_ of them
+    std::vector<cl_command_queue> queues_;
+    /// Unused buffers from CleanupBuffer(), the most recently used last
+    std::vector<PooledBuffer> buffer_pool_;
   };
 
   ~OpenCLContext();
@@ -250,22 +785,150 @@ class OpenCLContext {
   OpenCLContext(OpenCLContext &&other) = delete;
   OpenCLContext &operator=(OpenCLContext &&other) = delete;
 
-  /// Returns a OpenCLHandle wrapped in a std::shared_ptr
+  /// Returns the OpenCLHandle of the first device (see GetHandle(std::size_t))
   static OpenCLHandle::Ptr GetHandle();
 
+  /*!
+   * \brief Returns the OpenCLHandle of the calling thread for the device at
+   * device_index wrapped in a std::shared_ptr.
+   *
+   * Devices of every platform are used, GPUs first, then accelerators, then
+   * CPUs. The handle is shared by every caller of the same thread and kept
+   * until the thread exits, other threads get handles of their own. Callers
+   * should get it for every call instead of keeping it, so that it is never
+   * used by another thread.
+   *
+   * \return An empty ptr if there is no such device.
+   */
+  static OpenCLHandle::Ptr GetHandle(std::size_t device_index);
+
+  /*!
+   * \brief Returns the number of OpenCL devices that are available and can
+   * compile kernels.
+   */
+  static std::size_t GetDeviceCount();
+
+  /*!
+   * \brief Sets the number of command queues of devices whose handles are
+   * got afterwards.
+   *
+   * This is how many strips of an image can be in flight at once, e.g. one
+   * being copied to the device, one being dithered, and one being copied
+   * back. Defaults to kDefaultPipelineDepth, and is at least 1.
+   */
+  static void SetPipelineDepth(unsigned int depth);
+
+  /// Returns the depth set by SetPipelineDepth()
+  static unsigned int GetPipelineDepth();
+
+  /*!
+   * \brief Restricts the devices that are used to those of the platform at
+   * platform_index, and of those to the device at device_index.
+   *
+   * Indices are the ones printed by PrintDevices(), -1 uses every platform
+   * or device. A device_index without a platform_index is of platform 0.
+   * Ignored while handles of the devices exist.
+   */
+  static void SetDeviceSelection(int platform_index, int device_index);
+
+  /*!
+   * \brief Prints every OpenCL platform and device with their indices for
+   * SetDeviceSelection(), and the capabilities that dithering depends on.
+   *
+   * Devices that are used are marked with '*'.
+   */
+  static void PrintDevices(std::ostream &out);
+
+  /*!
+   * \brief Sets the directory that compiled programs are cached in.
+   *
+   * Defaults to GetCacheDirectory(). An empty directory disables the cache.
+   */
+  static void SetProgramCacheDirectory(const std::string &directory);
+
  private:
-  OpenCLContext();
+  struct Device {
+    cl_platform_id platform_id;
+    cl_device_id device_id;
+  };
 
-  static Ptr instance_;
-  OpenCLHandle::WeakPtr weak_handle_;
+  static constexpr unsigned int kDefaultPipelineDepth = 3;
+
+  /// Creates a context of device, or an invalid context if nullptr
+  explicit OpenCLContext(const Device *device);
+
+  /// Indexed by device, created by GetHandle() and alive while any handle of
+  /// the device is
+  static std::vector<WeakPtr> instances_;
+  /// Filled once by EnumerateDevices()
+  static std::vector<Device> devices_;
+  static bool is_devices_enumerated_;
+  /// Guards instances_, devices_, and weak_handles_ of every instance
+  static std::mutex instances_mutex_;
+  static unsigned int pipeline_depth_;
+  static std::string program_cache_directory_;
+  /// Set by SetDeviceSelection(), -1 if not restricted
+  static int selected_platform_index_;
+  static int selected_device_index_;
+  /// Handle of each thread
+  std::unordered_map<std::thread::id, OpenCLHandle::WeakPtr> weak_handles_;
 
   cl_context context_;
-  cl_command_queue queue_;
   cl_device_id device_id_;
+  /// Platform, device, and driver names and versions
+  std::string device_description_;
+  /// Queried once, since dithering checks them for every image
+  bool is_unified_memory_;
+  /// CL_DEVICE_MEM_BASE_ADDR_ALIGN in bytes
+  std::size_t mem_base_addr_align_;
+  unsigned int compute_units_;
+  /// Built programs by build options and source, shared by every handle
+  std::unordered_map<std::string, cl_program> programs_;
+  /// Guards programs_ and the program cache files
+  std::mutex programs_mutex_;
 
-  static void CleanupInstance();
+  /*!
+   * \brief Fills devices_ on first use, instances_mutex_ must be locked.
+   *
+   * Only the devices of SetDeviceSelection() are used.
+   */
+  static void EnumerateDevices();
 
   bool IsValid() const;
+
+  /// Returns the platform, device, and driver names and versions
+  const std::string &GetDeviceDescription() const;
+
+  /*!
+   * \brief Returns the program built from source with build_options,
+   * building it only the first time it is asked for.
+   *
+   * The program is retained for the caller, who releases it.
+   *
+   * \return nullptr if the program failed to build.
+   */
+  cl_program GetProgram(const std::string &source,
+                        const std::string &build_options);
+
+  /*!
+   * \brief Returns the program cache file of a program built from source
+   * with build_options on this device.
+   *
+   * Returns an empty string if the program cache is disabled.
+   */
+  std::string GetProgramCacheFilename(const std::string &source,
+                                      const std::string &build_options);
+
+  /*!
+   * \brief Creates and builds a program from a cached binary.
+   *
+   * \return nullptr if there is no cached binary or it was rejected.
+   */
+  cl_program LoadProgramBinary(const std::string &filename,
+                               const std::string &build_options);
+
+  /// Saves the binary of a built program, failures are only warned about
+  void SaveProgramBinary(cl_program program, const std::string &filename);
 };
 
 typedef OpenCLContext::OpenCLHandle OpenCLHandle;
@@ -0,0 +1,188 @@
+#include "opencl_profiler.h"
+
+#include <algorithm>
+#include <array>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+
+namespace {
+/// Returns str with quotes and backslashes escaped for JSON
+std::string EscapeJSON(const std::string &str) {
+  std::string escaped;
+  for (char c : str) {
+    if (c == '"' || c == '\\') {
+      escaped.push_back('\\');
+    }
+    escaped.push_back(c);
+  }
+  return escaped;
+}
+
+/// Returns the time from begin to end, or 0 if the device reported them out
+/// of order
+cl_ulong GetElapsed(cl_ulong begin, cl_ulong end) {
+  return end > begin ? end - begin : 0;
+}
+
+/// Returns bytes per nanosecond, which is the same as GB/s
+double GetGBPerSecond(unsigned long long bytes, cl_ulong duration) {
+  return duration == 0 ? 0.0 : static_cast<double>(bytes) / duration;
+}
+}  // namespace
+
+constexpr std::size_t OpenCLProfiler::kMaxPendingCommands;
+
+std::mutex OpenCLProfiler::mutex_;
+bool OpenCLProfiler::is_enabled_ = false;
+std::vector<OpenCLProfiler::Command> OpenCLProfiler::pending_;
+std::map<std::string, OpenCLProfiler::Stats> OpenCLProfiler::stats_;
+
+void OpenCLProfiler::SetEnabled(bool is_enabled) { is_enabled_ = is_enabled; }
+
+bool OpenCLProfiler::IsEnabled() { return is_enabled_; }
+
+void OpenCLProfiler::Record(const std::string &name, std::size_t bytes,
+                            cl_event event) {
+  if (!is_enabled_ || event == nullptr) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (clRetainEvent(event) != CL_SUCCESS) {
+    return;
+  }
+  pending_.push_back(Command{name, bytes, event});
+  if (pending_.size() >= kMaxPendingCommands) {
+    CollectPending(false);
+  }
+}
+
+void OpenCLProfiler::Collect() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  CollectPending(true);
+}
+
+void OpenCLProfiler::PrintSummary(std::ostream &out) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  CollectPending(true);
+
+  // most expensive first
+  std::vector<std::pair<cl_ulong, const std::string *>> order;
+  std::size_t name_width = 8;
+  for (const auto &name_stats : stats_) {
+    name_width = std::max(name_width, name_stats.first.size() + 2);
+    cl_ulong total = 0;
+    for (cl_ulong duration : name_stats.second.durations) {
+      total += duration;
+    }
+    order.emplace_back(total, &name_stats.first);
+  }
+  std::sort(order.rbegin(), order.rend());
+
+  out << "OpenCL profile (times in ms):\n"
+      << std::left << std::setw(name_width) << "command" << std::right
+      << std::setw(8) << "count" << std::setw(11) << "total"
+      << std::setw(10) << "p50" << std::setw(10) << "p99" << std::setw(11)
+      << "queued" << std::setw(11) << "submitted" << std::setw(12) << "MB"
+      << std::setw(9) << "GB/s" << '\n'
+      << std::fixed;
+  for (const auto &total_name : order) {
+    const Stats &stats = stats_.at(*total_name.second);
+    out << std::left << std::setw(name_width) << *total_name.second
+        << std::right << std::setw(8) << stats.durations.size()
+        << std::setprecision(3)
+        << std::setw(11) << total_name.first / 1e6 << std::setw(10)
+        << GetPercentile(stats.durations, 50) / 1e6 << std::setw(10)
+        << GetPercentile(stats.durations, 99) / 1e6 << std::setw(11)
+        << stats.queued_duration / 1e6 << std::setw(11)
+        << stats.submitted_duration / 1e6 << std::setw(12)
+        << stats.bytes / 1e6 << std::setprecision(2) << std::setw(9)
+        << GetGBPerSecond(stats.bytes, total_name.first) << '\n';
+  }
+  out << std::defaultfloat << std::flush;
+}
+
+bool OpenCLProfiler::WriteJSON(const std::string &filename) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  CollectPending(true);
+
+  std::ofstream ofs(filename);
+  if (!ofs.is_open()) {
+    std::cout << "ERROR: Failed to open \"" << filename
+              << "\" to write the OpenCL profile" << std::endl;
+    return false;
+  }
+
+  ofs << "{\n";
+  bool is_first = true;
+  for (const auto &name_stats : stats_) {
+    const Stats &stats = name_stats.second;
+    cl_ulong total = 0;
+    for (cl_ulong duration : stats.durations) {
+      total += duration;
+    }
+    ofs << (is_first ? "" : ",\n") << "  \"" << EscapeJSON(name_stats.first)
+        << "\": {\"count\": " << stats.durations.size()
+        << ", \"total_ns\": " << total
+        << ", \"p50_ns\": " << GetPercentile(stats.durations, 50)
+        << ", \"p99_ns\": " << GetPercentile(stats.durations, 99)
+        << ", \"queued_ns\": " << stats.queued_duration
+        << ", \"submitted_ns\": " << stats.submitted_duration
+        << ", \"bytes\": " << stats.bytes
+        << ", \"gb_per_s\": " << GetGBPerSecond(stats.bytes, total) << '}';
+    is_first = false;
+  }
+  ofs << "\n}\n";
+
+  return ofs.good();
+}
+
+void OpenCLProfiler::CollectPending(bool is_waiting) {
+  std::vector<Command> unfinished;
+  for (Command &command : pending_) {
+    cl_int status = CL_COMPLETE;
+    if (!is_waiting) {
+      clGetEventInfo(command.event, CL_EVENT_COMMAND_EXECUTION_STATUS,
+                     sizeof(cl_int), &status, nullptr);
+      if (status > CL_COMPLETE) {
+        unfinished.push_back(command);
+        continue;
+      }
+    } else if (clWaitForEvents(1, &command.event) != CL_SUCCESS) {
+      status = -1;
+    }
+
+    // failed commands have no timings
+    std::array<cl_ulong, 4> times{};
+    const std::array<cl_profiling_info, 4> params{
+        CL_PROFILING_COMMAND_QUEUED, CL_PROFILING_COMMAND_SUBMIT,
+        CL_PROFILING_COMMAND_START, CL_PROFILING_COMMAND_END};
+    bool is_timed = status == CL_COMPLETE;
+    for (std::size_t i = 0; is_timed && i < params.size(); ++i) {
+      is_timed = clGetEventProfilingInfo(command.event, params[i],
+                                         sizeof(cl_ulong), &times[i],
+                                         nullptr) == CL_SUCCESS;
+    }
+    if (is_timed) {
+      Stats &stats = stats_[command.name];
+      stats.bytes += command.bytes;
+      stats.durations.push_back(GetElapsed(times[2], times[3]));
+      stats.queued_duration += GetElapsed(times[0], times[1]);
+      stats.submitted_duration += GetElapsed(times[1], times[2]);
+    }
+    clReleaseEvent(command.event);
+  }
+  pending_ = std::move(unfinished);
+}
+
+cl_ulong OpenCLProfiler::GetPercentile(const std::vector<cl_ulong> &durations,
+                                       unsigned int percentile) {
+  if (durations.empty()) {
+    return 0;
+  }
+  std::vector<cl_ulong> sorted(durations);
+  std::size_t index = (sorted.size() - 1) * percentile / 100;
+  std::nth_element(sorted.begin(), sorted.begin() + index, sorted.end());
+  return sorted[index];
+}
@@ -0,0 +1,111 @@
+#ifndef IGPUP_DITHERING_PROJECT_OPENCL_PROFILER_H_
+#define IGPUP_DITHERING_PROJECT_OPENCL_PROFILER_H_
+
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+/*!
+ * \brief Collects the device timings of the commands enqueued by OpenCLHandle.
+ *
+ * Profiling is off by default. When it is enabled before the first
+ * OpenCLHandle is got, queues are created with CL_QUEUE_PROFILING_ENABLE and
+ * every copy, kernel, map, and unmap is recorded under a name like
+ * "kernel GrayscaleDither" or "write GrayscaleDither/Input". Timings are
+ * summed up per name, so the cost of uploads, dithering, and readback can be
+ * told apart.
+ */
+class OpenCLProfiler {
+ public:
+  /// Enables profiling, must be called before the first OpenCLHandle is got
+  static void SetEnabled(bool is_enabled);
+
+  /// Returns true if profiling is enabled
+  static bool IsEnabled();
+
+  /*!
+   * \brief Records the command of event under name.
+   *
+   * bytes are the bytes copied by the command, 0 for kernels. The event is
+   * retained until its timings are collected. Does nothing if profiling is
+   * disabled.
+   */
+  static void Record(const std::string &name, std::size_t bytes,
+                     cl_event event);
+
+  /*!
+   * \brief Waits for every recorded command and collects its timings.
+   *
+   * OpenCLHandle calls this before its context is released.
+   */
+  static void Collect();
+
+  /*!
+   * \brief Prints a table of the collected timings per name.
+   *
+   * Each row has the command count, the total and the 50th and 99th
+   * percentile of the time from start to end, the total time waited on the
+   * host (from queued to submit) and on the device (from submit to start),
+   * the bytes copied, and the resulting GB/s.
+   */
+  static void PrintSummary(std::ostream &out);
+
+  /*!
+   * \brief Writes the collected timings to filename as JSON.
+   *
+   * The JSON holds an object per name with the same values as
+   * PrintSummary(), times in nanoseconds.
+   *
+   * \return True on success.
+   */
+  static bool WriteJSON(const std::string &filename);
+
+ private:
+  struct Command {
+    std::string name;
+    std::size_t bytes;
+    cl_event event;
+  };
+
+  struct Stats {
+    unsigned long long bytes;
+    /// Time from start to end of each command
+    std::vector<cl_ulong> durations;
+    /// Time from queued to submit of all commands
+    cl_ulong queued_duration;
+    /// Time from submit to start of all commands
+    cl_ulong submitted_duration;
+  };
+
+  /// Records of pending_ are collected once there are this many
+  static constexpr std::size_t kMaxPendingCommands = 256;
+
+  static std::mutex mutex_;
+  static bool is_enabled_;
+  /// Recorded commands whose timings are not collected yet
+  static std::vector<Command> pending_;
+  static std::map<std::string, Stats> stats_;
+
+  /*!
+   * \brief Collects the timings of pending_ commands and releases their
+   * events, mutex_ must be locked.
+   *
+   * If is_waiting is false, commands that have not finished are kept.
+   */
+  static void CollectPending(bool is_waiting);
+
+  /// Returns the percentile (0 to 100) of durations
+  static cl_ulong GetPercentile(const std::vector<cl_ulong> &durations,
+                                unsigned int percentile);
+};
+
+#endif
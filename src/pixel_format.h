@@ -0,0 +1,251 @@
+#ifndef IGPUP_DITHERING_PROJECT_PIXEL_FORMAT_H_
+#define IGPUP_DITHERING_PROJECT_PIXEL_FORMAT_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "cpu_dither.h"
+
+/*!
+ * \brief Layouts of pixels in a row of image data.
+ *
+ * Each layout is a type, so loops over rows are templated on their input and
+ * output layouts and have no per-pixel branches on the layout. The layout of
+ * an image is picked once, before looping over its rows.
+ */
+struct PixelFormat {
+  /// 1 byte per pixel
+  struct Gray8 {
+    static unsigned int GetRowSize(unsigned int width) { return width; }
+  };
+
+  /// 3 bytes per pixel: R, G, B
+  struct RGB24 {
+    static unsigned int GetRowSize(unsigned int width) { return width * 3; }
+  };
+
+  /// 4 bytes per pixel: R, G, B, A
+  struct RGBA32 {
+    static unsigned int GetRowSize(unsigned int width) { return width * 4; }
+  };
+
+  /*!
+   * \brief 1 bit per pixel, first pixel in the most significant bit.
+   *
+   * Output of dithering to black and white. Pixels are dithered as Gray8
+   * before they are packed.
+   */
+  struct Bilevel {
+    typedef Gray8 DitherFormat;
+    static unsigned int GetRowSize(unsigned int width) {
+      return (width + 7) / 8;
+    }
+  };
+
+  /*!
+   * \brief 4 bits per pixel, first pixel in the high nibble.
+   *
+   * Output of dithering in color, each nibble has the IGPUP_PROJECT_NIBBLE_*
+   * bits set. Pixels are dithered as RGBA32 before they are packed.
+   */
+  struct Palette16 {
+    typedef RGBA32 DitherFormat;
+    static unsigned int GetRowSize(unsigned int width) {
+      return (width + 1) / 2;
+    }
+  };
+
+  /*!
+   * \brief Separate planes of R, G, B, and optionally A, 1 byte per pixel.
+   *
+   * Each plane holds the rows of one channel, and planes are
+   * GetPlaneSize() bytes apart so that every plane starts on a cache line.
+   * A row of each channel is then one contiguous stream.
+   */
+  struct PlanarRGB {
+    static constexpr unsigned int kPlaneAlignment = 64;
+    static unsigned int GetRowSize(unsigned int width) { return width; }
+    static std::size_t GetPlaneSize(unsigned int width, unsigned int height) {
+      std::size_t size = static_cast<std::size_t>(width) * height;
+      return (size + kPlaneAlignment - 1) / kPlaneAlignment * kPlaneAlignment;
+    }
+  };
+
+  /*!
+   * \brief Converts width pixels from one layout to another.
+   *
+   * Only the conversions used by Image and CPUDither are defined. Alpha is
+   * 255 when added and is ignored when dropped.
+   */
+  template <typename From, typename To>
+  static void ConvertRow(const uint8_t *input, unsigned int width,
+                         uint8_t *output);
+
+  /*!
+   * \brief Converts width pixels of From into PlanarRGB planes that are
+   * plane_size bytes apart.
+   *
+   * RGB24 fills 3 planes, RGBA32 fills 4.
+   */
+  template <typename From>
+  static void ConvertRowToPlanes(const uint8_t *input, unsigned int width,
+                                 uint8_t *output, std::size_t plane_size);
+
+  /*!
+   * \brief Converts width pixels of PlanarRGB planes that are plane_size bytes
+   * apart into To.
+   *
+   * RGBA32 reads 4 planes, Gray8 and RGB24 read 3.
+   */
+  template <typename To>
+  static void ConvertRowFromPlanes(const uint8_t *input,
+                                   std::size_t plane_size, unsigned int width,
+                                   uint8_t *output);
+};
+
+template <>
+inline void PixelFormat::ConvertRow<PixelFormat::Gray8, PixelFormat::Gray8>(
+    const uint8_t *input, unsigned int width, uint8_t *output) {
+  std::memcpy(output, input, width);
+}
+
+template <>
+inline void PixelFormat::ConvertRow<PixelFormat::RGBA32, PixelFormat::RGBA32>(
+    const uint8_t *input, unsigned int width, uint8_t *output) {
+  std::memcpy(output, input, width * 4);
+}
+
+template <>
+inline void PixelFormat::ConvertRow<PixelFormat::RGB24, PixelFormat::RGBA32>(
+    const uint8_t *input, unsigned int width, uint8_t *output) {
+  for (unsigned int x = 0; x < width; ++x) {
+    output[x * 4] = input[x * 3];
+    output[x * 4 + 1] = input[x * 3 + 1];
+    output[x * 4 + 2] = input[x * 3 + 2];
+    output[x * 4 + 3] = 255;
+  }
+}
+
+template <>
+inline void PixelFormat::ConvertRow<PixelFormat::RGBA32, PixelFormat::Gray8>(
+    const uint8_t *input, unsigned int width, uint8_t *output) {
+  for (unsigned int x = 0; x < width; ++x) {
+    output[x] = CPUDither::ColorToGray(input[x * 4], input[x * 4 + 1],
+                                       input[x * 4 + 2]);
+  }
+}
+
+template <>
+inline void PixelFormat::ConvertRow<PixelFormat::Gray8, PixelFormat::RGB24>(
+    const uint8_t *input, unsigned int width, uint8_t *output) {
+  for (unsigned int x = 0; x < width; ++x) {
+    output[x * 3] = output[x * 3 + 1] = output[x * 3 + 2] = input[x];
+  }
+}
+
+template <>
+inline void PixelFormat::ConvertRow<PixelFormat::RGBA32, PixelFormat::RGB24>(
+    const uint8_t *input, unsigned int width, uint8_t *output) {
+  for (unsigned int x = 0; x < width; ++x) {
+    output[x * 3] = input[x * 4];
+    output[x * 3 + 1] = input[x * 4 + 1];
+    output[x * 3 + 2] = input[x * 4 + 2];
+  }
+}
+
+template <>
+inline void PixelFormat::ConvertRow<PixelFormat::Bilevel, PixelFormat::RGB24>(
+    const uint8_t *input, unsigned int width, uint8_t *output) {
+  for (unsigned int x = 0; x < width; ++x) {
+    uint8_t value = (input[x / 8] & (0x80 >> (x % 8))) != 0 ? 255 : 0;
+    output[x * 3] = output[x * 3 + 1] = output[x * 3 + 2] = value;
+  }
+}
+
+template <>
+inline void
+PixelFormat::ConvertRow<PixelFormat::Palette16, PixelFormat::RGB24>(
+    const uint8_t *input, unsigned int width, uint8_t *output) {
+  for (unsigned int x = 0; x < width; ++x) {
+    unsigned int nibble = input[x / 2] >> (x % 2 == 0 ? 4 : 0);
+    // same colors as Image::kDitherColorPalette
+    output[x * 3] = (nibble & IGPUP_PROJECT_NIBBLE_RED) != 0 ? 255 : 0;
+    output[x * 3 + 1] = ((nibble & IGPUP_PROJECT_NIBBLE_GREEN) >> 1) * 85;
+    output[x * 3 + 2] = (nibble & IGPUP_PROJECT_NIBBLE_BLUE) != 0 ? 255 : 0;
+  }
+}
+
+template <>
+inline void PixelFormat::ConvertRowToPlanes<PixelFormat::RGB24>(
+    const uint8_t *input, unsigned int width, uint8_t *output,
+    std::size_t plane_size) {
+  uint8_t *red = output;
+  uint8_t *green = output + plane_size;
+  uint8_t *blue = output + plane_size * 2;
+  for (unsigned int x = 0; x < width; ++x) {
+    red[x] = input[x * 3];
+    green[x] = input[x * 3 + 1];
+    blue[x] = input[x * 3 + 2];
+  }
+}
+
+template <>
+inline void PixelFormat::ConvertRowToPlanes<PixelFormat::RGBA32>(
+    const uint8_t *input, unsigned int width, uint8_t *output,
+    std::size_t plane_size) {
+  uint8_t *red = output;
+  uint8_t *green = output + plane_size;
+  uint8_t *blue = output + plane_size * 2;
+  uint8_t *alpha = output + plane_size * 3;
+  for (unsigned int x = 0; x < width; ++x) {
+    red[x] = input[x * 4];
+    green[x] = input[x * 4 + 1];
+    blue[x] = input[x * 4 + 2];
+    alpha[x] = input[x * 4 + 3];
+  }
+}
+
+template <>
+inline void PixelFormat::ConvertRowFromPlanes<PixelFormat::Gray8>(
+    const uint8_t *input, std::size_t plane_size, unsigned int width,
+    uint8_t *output) {
+  const uint8_t *red = input;
+  const uint8_t *green = input + plane_size;
+  const uint8_t *blue = input + plane_size * 2;
+  for (unsigned int x = 0; x < width; ++x) {
+    output[x] = CPUDither::ColorToGray(red[x], green[x], blue[x]);
+  }
+}
+
+template <>
+inline void PixelFormat::ConvertRowFromPlanes<PixelFormat::RGB24>(
+    const uint8_t *input, std::size_t plane_size, unsigned int width,
+    uint8_t *output) {
+  const uint8_t *red = input;
+  const uint8_t *green = input + plane_size;
+  const uint8_t *blue = input + plane_size * 2;
+  for (unsigned int x = 0; x < width; ++x) {
+    output[x * 3] = red[x];
+    output[x * 3 + 1] = green[x];
+    output[x * 3 + 2] = blue[x];
+  }
+}
+
+template <>
+inline void PixelFormat::ConvertRowFromPlanes<PixelFormat::RGBA32>(
+    const uint8_t *input, std::size_t plane_size, unsigned int width,
+    uint8_t *output) {
+  const uint8_t *red = input;
+  const uint8_t *green = input + plane_size;
+  const uint8_t *blue = input + plane_size * 2;
+  const uint8_t *alpha = input + plane_size * 3;
+  for (unsigned int x = 0; x < width; ++x) {
+    output[x * 4] = red[x];
+    output[x * 4 + 1] = green[x];
+    output[x * 4 + 2] = blue[x];
+    output[x * 4 + 3] = alpha[x];
+  }
+}
+
+#endif
@@ -0,0 +1,132 @@
+#include "simd_dither.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IGPUP_DITHERING_PROJECT_SIMD_X86_
+#include <immintrin.h>
+#endif
+
+bool SIMDDither::is_isa_overridden_ = false;
+SIMDDither::ISA SIMDDither::isa_override_ = SIMDDither::ISA::kScalar;
+
+namespace {
+// Each vectorized loop processes as many whole vectors as fit in count, and
+// returns the number of bytes processed.
+
+#ifdef IGPUP_DITHERING_PROJECT_SIMD_X86_
+__attribute__((target("sse2"))) unsigned int ThresholdSSE2(
+    const uint8_t *input, const uint8_t *thresholds, uint8_t *output,
+    unsigned int count) {
+  unsigned int i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i *>(input + i));
+    __m128i threshold =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(thresholds + i));
+    // there is no unsigned byte compare, but max(a, b) == b means a <= b
+    __m128i not_greater =
+        _mm_cmpeq_epi8(_mm_max_epu8(in, threshold), threshold);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(output + i),
+                     _mm_andnot_si128(not_greater, _mm_set1_epi8(-1)));
+  }
+  return i;
+}
+
+__attribute__((target("avx2"))) unsigned int ThresholdAVX2(
+    const uint8_t *input, const uint8_t *thresholds, uint8_t *output,
+    unsigned int count) {
+  unsigned int i = 0;
+  for (; i + 32 <= count; i += 32) {
+    __m256i in =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(input + i));
+    __m256i threshold =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(thresholds + i));
+    __m256i not_greater =
+        _mm256_cmpeq_epi8(_mm256_max_epu8(in, threshold), threshold);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(output + i),
+                        _mm256_andnot_si256(not_greater, _mm256_set1_epi8(-1)));
+  }
+  return i;
+}
+
+__attribute__((target("avx512f,avx512bw"))) unsigned int ThresholdAVX512(
+    const uint8_t *input, const uint8_t *thresholds, uint8_t *output,
+    unsigned int count) {
+  unsigned int i = 0;
+  for (; i + 64 <= count; i += 64) {
+    __m512i in = _mm512_loadu_si512(input + i);
+    __m512i threshold = _mm512_loadu_si512(thresholds + i);
+    _mm512_storeu_si512(
+        output + i, _mm512_movm_epi8(_mm512_cmpgt_epu8_mask(in, threshold)));
+  }
+  return i;
+}
+#endif  // IGPUP_DITHERING_PROJECT_SIMD_X86_
+}  // namespace
+
+SIMDDither::ISA SIMDDither::GetBestISA() {
+#ifdef IGPUP_DITHERING_PROJECT_SIMD_X86_
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512bw")) {
+    return ISA::kAVX512;
+  } else if (__builtin_cpu_supports("avx2")) {
+    return ISA::kAVX2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    return ISA::kSSE2;
+  }
+#endif
+  return ISA::kScalar;
+}
+
+SIMDDither::ISA SIMDDither::GetISA() {
+  if (is_isa_overridden_) {
+    return isa_override_;
+  }
+  static const ISA best_isa = GetBestISA();
+  return best_isa;
+}
+
+void SIMDDither::SetISA(ISA isa) {
+  ISA best_isa = GetBestISA();
+  isa_override_ = static_cast<int>(isa) > static_cast<int>(best_isa)
+                      ? best_isa
+                      : isa;
+  is_isa_overridden_ = true;
+}
+
+const char *SIMDDither::ISAToString(ISA isa) {
+  switch (isa) {
+    case ISA::kScalar:
+      return "scalar";
+    case ISA::kSSE2:
+      return "SSE2";
+    case ISA::kAVX2:
+      return "AVX2";
+    case ISA::kAVX512:
+      return "AVX-512";
+  }
+  return "unknown";
+}
+
+void SIMDDither::ThresholdRow(const uint8_t *input, const uint8_t *thresholds,
+                              uint8_t *output, unsigned int count, ISA isa) {
+  unsigned int i = 0;
+  switch (isa) {
+#ifdef IGPUP_DITHERING_PROJECT_SIMD_X86_
+    case ISA::kAVX512:
+      i = ThresholdAVX512(input, thresholds, output, count);
+      break;
+    case ISA::kAVX2:
+      i = ThresholdAVX2(input, thresholds, output, count);
+      break;
+    case ISA::kSSE2:
+      i = ThresholdSSE2(input, thresholds, output, count);
+      break;
+#endif
+    default:
+      break;
+  }
+
+  // scalar reference, also handles the tail of the vectorized loops
+  for (; i < count; ++i) {
+    output[i] = input[i] > thresholds[i] ? 255 : 0;
+  }
+}
@@ -0,0 +1,52 @@
+#ifndef IGPUP_DITHERING_PROJECT_SIMD_DITHER_H_
+#define IGPUP_DITHERING_PROJECT_SIMD_DITHER_H_
+
+#include <cstdint>
+
+/*!
+ * \brief Vectorized blue-noise threshold loops for dithering on the host.
+ *
+ * The widest instruction set supported by the running CPU is detected at
+ * runtime. ISA::kScalar is a plain loop that is used as the reference
+ * implementation (see test/simd_dither_test.cc), and as the fallback on CPUs
+ * without vector support.
+ *
+ * Thresholds are given per byte (see CPUDither::GetGrayscaleThresholds()), so
+ * the loops are plain streaming compares.
+ */
+class SIMDDither {
+ public:
+  enum class ISA { kScalar, kSSE2, kAVX2, kAVX512 };
+
+  /// Returns the widest ISA supported by the running CPU
+  static ISA GetBestISA();
+
+  /// Returns the ISA used by default, which is GetBestISA() unless overridden
+  static ISA GetISA();
+
+  /*!
+   * \brief Overrides the ISA returned by GetISA().
+   *
+   * ISAs not supported by the running CPU are clamped to GetBestISA().
+   */
+  static void SetISA(ISA isa);
+
+  /// Returns the name of the given ISA
+  static const char *ISAToString(ISA isa);
+
+  /*!
+   * \brief Dithers count bytes.
+   *
+   * output[i] = input[i] > thresholds[i] ? 255 : 0
+   *
+   * input and output may point to the same memory.
+   */
+  static void ThresholdRow(const uint8_t *input, const uint8_t *thresholds,
+                           uint8_t *output, unsigned int count, ISA isa);
+
+ private:
+  static bool is_isa_overridden_;
+  static ISA isa_override_;
+};
+
+#endif
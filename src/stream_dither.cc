@@ -0,0 +1,266 @@
+#include "stream_dither.h"
+
+#include <algorithm>
+#include <array>
+#include <fstream>
+#include <iostream>
+
+constexpr std::size_t StreamDither::kDefaultStripBytes;
+
+StreamDither::StreamDither(const char *input_filename)
+    : StreamDither(std::string(input_filename)) {}
+
+StreamDither::StreamDither(const std::string &input_filename)
+    : strip_(),
+      dithered_strip_(),
+      input_filename_(input_filename),
+      strip_rows_(0),
+      input_file_(nullptr),
+      output_file_(nullptr),
+      png_read_ptr_(nullptr),
+      png_read_info_ptr_(nullptr),
+      png_write_ptr_(nullptr),
+      png_write_info_ptr_(nullptr) {}
+
+StreamDither::~StreamDither() { Cleanup(); }
+
+bool StreamDither::DitherToPNG(const char *output_filename, Image *blue_noise,
+                               bool grayscale, bool overwrite) {
+  return DitherToPNG(std::string(output_filename), blue_noise, grayscale,
+                     overwrite);
+}
+
+bool StreamDither::DitherToPNG(const std::string &output_filename,
+                               Image *blue_noise, bool grayscale,
+                               bool overwrite) {
+  if (!overwrite) {
+    std::ifstream ifs(output_filename);
+    if (ifs.is_open()) {
+      std::cout << "ERROR: File \"" << output_filename
+                << "\" exists but overwrite == false" << std::endl;
+      return false;
+    }
+  }
+
+  input_file_ = std::fopen(input_filename_.c_str(), "rb");
+  if (!input_file_) {
+    std::cout << "ERROR: Failed to open \"" << input_filename_ << '"'
+              << std::endl;
+    return false;
+  }
+
+  // Check header of file to check if it is actually a png file.
+  {
+    std::array<unsigned char, 8> buf;
+    if (std::fread(buf.data(), 1, 8, input_file_) != 8 ||
+        png_sig_cmp(reinterpret_cast<png_const_bytep>(buf.data()), 0, 8) !=
+            0) {
+      std::cout << "ERROR: File \"" << input_filename_
+                << "\" is not a png file" << std::endl;
+      Cleanup();
+      return false;
+    }
+  }
+
+  output_file_ = std::fopen(output_filename.c_str(), "wb");
+  if (!output_file_) {
+    std::cout << "ERROR: Failed to open file \"" << output_filename
+              << "\" for writing png" << std::endl;
+    Cleanup();
+    return false;
+  }
+
+  // init required structs for png decoding and encoding
+  png_read_ptr_ =
+      png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+  if (png_read_ptr_) {
+    png_read_info_ptr_ = png_create_info_struct(png_read_ptr_);
+  }
+  png_write_ptr_ =
+      png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+  if (png_write_ptr_) {
+    png_write_info_ptr_ = png_create_info_struct(png_write_ptr_);
+  }
+  if (!png_read_info_ptr_ || !png_write_info_ptr_) {
+    std::cout << "ERROR: Failed to initialize libpng for streaming \""
+              << input_filename_ << '"' << std::endl;
+    Cleanup();
+    return false;
+  }
+
+  // required to handle libpng errors
+  if (setjmp(png_jmpbuf(png_read_ptr_))) {
+    Cleanup();
+    return false;
+  }
+  if (setjmp(png_jmpbuf(png_write_ptr_))) {
+    Cleanup();
+    return false;
+  }
+
+  png_init_io(png_read_ptr_, input_file_);
+  png_set_sig_bytes(png_read_ptr_, 8);
+  png_read_info(png_read_ptr_, png_read_info_ptr_);
+
+  unsigned int width = png_get_image_width(png_read_ptr_, png_read_info_ptr_);
+  unsigned int height =
+      png_get_image_height(png_read_ptr_, png_read_info_ptr_);
+  png_byte color_type = png_get_color_type(png_read_ptr_, png_read_info_ptr_);
+  png_byte bit_depth = png_get_bit_depth(png_read_ptr_, png_read_info_ptr_);
+
+  if (png_get_interlace_type(png_read_ptr_, png_read_info_ptr_) !=
+      PNG_INTERLACE_NONE) {
+    std::cout << "ERROR: Interlaced PNG \"" << input_filename_
+              << "\" can't be dithered in strips" << std::endl;
+    Cleanup();
+    return false;
+  }
+
+  // have libpng convert rows to the layout of Image::data_ (8-bit gray or
+  // RGBA), so that rows are read into the strip as is
+  bool is_input_grayscale = (color_type & PNG_COLOR_MASK_COLOR) == 0;
+  if (color_type == PNG_COLOR_TYPE_PALETTE) {
+    png_set_palette_to_rgb(png_read_ptr_);
+  } else if (is_input_grayscale && bit_depth < 8) {
+    png_set_expand_gray_1_2_4_to_8(png_read_ptr_);
+  }
+  if (bit_depth == 16) {
+    png_set_strip_16(png_read_ptr_);
+  }
+  if (is_input_grayscale) {
+    if (color_type & PNG_COLOR_MASK_ALPHA) {
+      png_set_strip_alpha(png_read_ptr_);
+    }
+  } else if (!(color_type & PNG_COLOR_MASK_ALPHA)) {
+    png_set_filler(png_read_ptr_, 0xFF, PNG_FILLER_AFTER);
+  }
+  png_read_update_info(png_read_ptr_, png_read_info_ptr_);
+
+  unsigned int row_size = is_input_grayscale ? width : width * 4;
+  if (png_get_rowbytes(png_read_ptr_, png_read_info_ptr_) != row_size) {
+    std::cout << "ERROR: Unsupported PNG format in \"" << input_filename_ << '"'
+              << std::endl;
+    Cleanup();
+    return false;
+  } else if (!grayscale && is_input_grayscale) {
+    std::cout << "ERROR: Can't color dither grayscale PNG \"" << input_filename_
+              << '"' << std::endl;
+    Cleanup();
+    return false;
+  }
+
+  // set output image information, same as Image::SaveAsPNG()
+  png_init_io(png_write_ptr_, output_file_);
+  if (grayscale) {
+    png_set_IHDR(png_write_ptr_, png_write_info_ptr_, width, height, 1,
+                 PNG_COLOR_TYPE_PALETTE, PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_set_PLTE(png_write_ptr_, png_write_info_ptr_,
+                 Image::kDitherBWPalette.data(),
+                 Image::kDitherBWPalette.size());
+  } else {
+    png_set_IHDR(png_write_ptr_, png_write_info_ptr_, width, height, 4,
+                 PNG_COLOR_TYPE_PALETTE, PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_set_PLTE(png_write_ptr_, png_write_info_ptr_,
+                 Image::kDitherColorPalette.data(),
+                 Image::kDitherColorPalette.size());
+  }
+  png_write_info(png_write_ptr_, png_write_info_ptr_);
+
+  // the same strip_ is used for every strip, so its blue noise offsets stay
+  // the same
+  strip_.width_ = width;
+  strip_.is_grayscale_ = is_input_grayscale;
+  strip_.is_preserving_blue_noise_offsets_ = true;
+  unsigned int strip_rows = GetStripRows(row_size, height);
+
+  for (unsigned int y = 0; y < height; y += strip_rows) {
+    strip_.height_ = std::min(strip_rows, height - y);
+    strip_.row_offset_ = y;
+    strip_.data_.resize(strip_.height_ * row_size);
+    for (unsigned int row = 0; row < strip_.height_; ++row) {
+      png_read_row(png_read_ptr_, &strip_.data_.at(row * row_size), nullptr);
+    }
+
+    if (grayscale) {
+      dithered_strip_ = strip_.ToGrayscaleDitheredWithBlueNoise(blue_noise);
+    } else {
+      dithered_strip_ = strip_.ToColorDitheredWithBlueNoise(blue_noise);
+    }
+    if (!dithered_strip_) {
+      std::cout << "ERROR: Failed to dither rows " << y << " to "
+                << y + strip_.height_ << " of \"" << input_filename_ << '"'
+                << std::endl;
+      Cleanup();
+      return false;
+    }
+
+    // dithered rows are already packed in the 1-bit or 4-bit palette format
+    unsigned int dithered_row_size = dithered_strip_->GetRowSize();
+    for (unsigned int row = 0; row < strip_.height_; ++row) {
+      png_write_row(png_write_ptr_,
+                    &dithered_strip_->data_.at(row * dithered_row_size));
+    }
+  }
+
+  // finish reading and writing image data
+  png_read_end(png_read_ptr_, nullptr);
+  png_write_end(png_write_ptr_, png_write_info_ptr_);
+
+  Cleanup();
+  return true;
+}
+
+void StreamDither::SetDitherBackend(DitherBackend backend) {
+  strip_.SetDitherBackend(backend);
+}
+
+void StreamDither::SetStripRows(unsigned int rows) { strip_rows_ = rows; }
+
+unsigned int StreamDither::GetStripRows(unsigned int row_size,
+                                        unsigned int height) {
+  unsigned int rows = strip_rows_;
+  if (rows == 0) {
+    // the input buffer is the largest buffer used for a strip
+    std::size_t max_bytes = kDefaultStripBytes;
+    if (strip_.IsUsingOpenCL(strip_.GetDitherBackend())) {
+      std::size_t max_alloc_size =
+          strip_.GetOpenCLHandle()->GetDeviceMaxMemAllocSize();
+      if (max_alloc_size != 0 && max_alloc_size < max_bytes) {
+        max_bytes = max_alloc_size;
+      }
+    }
+    rows = max_bytes / row_size;
+  }
+
+  if (rows == 0) {
+    return 1;
+  }
+  return rows < height ? rows : height;
+}
+
+void StreamDither::Cleanup() {
+  dithered_strip_.reset();
+  strip_.data_.clear();
+  strip_.data_.shrink_to_fit();
+  if (png_read_ptr_) {
+    png_destroy_read_struct(&png_read_ptr_,
+                            png_read_info_ptr_ ? &png_read_info_ptr_ : nullptr,
+                            nullptr);
+    png_read_info_ptr_ = nullptr;
+  }
+  if (png_write_ptr_) {
+    png_destroy_write_struct(
+        &png_write_ptr_, png_write_info_ptr_ ? &png_write_info_ptr_ : nullptr);
+    png_write_info_ptr_ = nullptr;
+  }
+  if (input_file_) {
+    std::fclose(input_file_);
+    input_file_ = nullptr;
+  }
+  if (output_file_) {
+    std::fclose(output_file_);
+    output_file_ = nullptr;
+  }
+}
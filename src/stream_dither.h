@@ -0,0 +1,85 @@
+#ifndef IGPUP_DITHERING_PROJECT_STREAM_DITHER_H_
+#define IGPUP_DITHERING_PROJECT_STREAM_DITHER_H_
+
+#include <cstdio>
+#include <memory>
+#include <string>
+
+#include <png.h>
+
+#include "dither_backend.h"
+#include "image.h"
+
+/*!
+ * \brief Helper class that dithers a PNG in horizontal strips, for images too
+ * large to be held in memory.
+ *
+ * Rows are read from the input PNG one strip at a time, dithered with Image,
+ * and written to the output PNG as they are dithered. Only one strip of input
+ * and output is held in memory at a time. The blue noise continues across
+ * strips, so the output is the same as dithering the whole image at once.
+ *
+ * Only non-interlaced PNG input is supported.
+ */
+class StreamDither {
+ public:
+  explicit StreamDither(const char *input_filename);
+  explicit StreamDither(const std::string &input_filename);
+
+  ~StreamDither();
+
+  // disable copy
+  StreamDither(const StreamDither &other) = delete;
+  StreamDither &operator=(const StreamDither &other) = delete;
+
+  // disable move
+  StreamDither(StreamDither &&other) = delete;
+  StreamDither &operator=(StreamDither &&other) = delete;
+
+  /// Same as DitherToPNG(const std::string&, Image*, bool, bool)
+  bool DitherToPNG(const char *output_filename, Image *blue_noise,
+                   bool grayscale = false, bool overwrite = false);
+
+  /*!
+   * \brief Dithers the input PNG into a PNG with the given output_filename.
+   *
+   * \return True on success.
+   */
+  bool DitherToPNG(const std::string &output_filename, Image *blue_noise,
+                   bool grayscale = false, bool overwrite = false);
+
+  /// Sets where strips are dithered (see Image::SetDitherBackend())
+  void SetDitherBackend(DitherBackend backend);
+
+  /*!
+   * \brief Sets the number of rows in a strip.
+   *
+   * The default of 0 picks as many rows as fit in kDefaultStripBytes of input,
+   * and in CL_DEVICE_MAX_MEM_ALLOC_SIZE if strips are dithered with OpenCL.
+   */
+  void SetStripRows(unsigned int rows);
+
+ private:
+  static constexpr std::size_t kDefaultStripBytes = 64 * 1024 * 1024;
+
+  Image strip_;
+  std::unique_ptr<Image> dithered_strip_;
+  std::string input_filename_;
+  unsigned int strip_rows_;
+  // libpng state is held here instead of in locals, as libpng errors longjmp
+  // out of DitherToPNG()
+  FILE *input_file_;
+  FILE *output_file_;
+  png_structp png_read_ptr_;
+  png_infop png_read_info_ptr_;
+  png_structp png_write_ptr_;
+  png_infop png_write_info_ptr_;
+
+  /// Returns the number of rows in a strip of input rows of row_size bytes
+  unsigned int GetStripRows(unsigned int row_size, unsigned int height);
+
+  /// Frees libpng structs and closes files
+  void Cleanup();
+};
+
+#endif
@@ -0,0 +1,197 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <exception>
+
+namespace {
+// Each pool gives its worker threads an index into its queues.
+thread_local const ThreadPool *tl_worker_pool = nullptr;
+thread_local int tl_worker_index = -1;
+}  // namespace
+
+constexpr unsigned int ThreadPool::kRangesPerThread;
+constexpr unsigned int ThreadPool::kMinRangeSize;
+
+std::unique_ptr<ThreadPool> ThreadPool::instance_;
+std::mutex ThreadPool::instance_mutex_;
+unsigned int ThreadPool::instance_thread_count_ = 0;
+
+ThreadPool::ThreadPool(unsigned int thread_count)
+    : queues_(),
+      threads_(),
+      wake_mutex_(),
+      wake_condition_(),
+      queued_count_(0),
+      next_queue_(0),
+      thread_count_(thread_count),
+      is_stopping_(false) {
+  if (thread_count_ == 0) {
+    thread_count_ = std::thread::hardware_concurrency();
+    if (thread_count_ == 0) {
+      thread_count_ = 1;
+    }
+  }
+
+  // queues are all created before any worker can steal from them
+  for (unsigned int i = 1; i < thread_count_; ++i) {
+    queues_.emplace_back(new TaskQueue{});
+  }
+  for (unsigned int i = 0; i < queues_.size(); ++i) {
+    threads_.emplace_back(&ThreadPool::WorkerLoop, this, i);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(wake_mutex_);
+    is_stopping_ = true;
+  }
+  wake_condition_.notify_all();
+  for (auto &thread : threads_) {
+    thread.join();
+  }
+}
+
+ThreadPool &ThreadPool::GetInstance() {
+  std::lock_guard<std::mutex> lock(instance_mutex_);
+  if (!instance_) {
+    instance_ = std::unique_ptr<ThreadPool>(
+        new ThreadPool(instance_thread_count_));
+  }
+  return *instance_;
+}
+
+void ThreadPool::SetThreadCount(unsigned int count) {
+  std::lock_guard<std::mutex> lock(instance_mutex_);
+  if (count == instance_thread_count_) {
+    return;
+  }
+  instance_thread_count_ = count;
+  instance_.reset();
+}
+
+unsigned int ThreadPool::GetThreadCount() const { return thread_count_; }
+
+void ThreadPool::ParallelFor(
+    unsigned int begin, unsigned int end, unsigned int grain_size,
+    const std::function<void(unsigned int, unsigned int)> &fn) {
+  if (end <= begin) {
+    return;
+  }
+  const unsigned int size = end - begin;
+  if (grain_size == 0) {
+    grain_size = std::max(kMinRangeSize,
+                          size / (thread_count_ * kRangesPerThread) + 1);
+  }
+  const unsigned int range_count = (size + grain_size - 1) / grain_size;
+  if (threads_.empty() || range_count == 1) {
+    fn(begin, end);
+    return;
+  }
+
+  // this call waits for all ranges, so ranges can reference its locals
+  std::mutex done_mutex;
+  std::condition_variable done_condition;
+  unsigned int remaining = range_count;
+  std::exception_ptr exception;
+  for (unsigned int range = 0; range < range_count; ++range) {
+    unsigned int range_begin = begin + range * grain_size;
+    unsigned int range_end = std::min(range_begin + grain_size, end);
+    Push([&fn, &done_mutex, &done_condition, &remaining, &exception,
+          range_begin, range_end]() {
+      std::exception_ptr range_exception;
+      try {
+        fn(range_begin, range_end);
+      } catch (...) {
+        range_exception = std::current_exception();
+      }
+      std::lock_guard<std::mutex> lock(done_mutex);
+      if (range_exception && !exception) {
+        exception = range_exception;
+      }
+      if (--remaining == 0) {
+        done_condition.notify_all();
+      }
+    });
+  }
+
+  const int index = GetWorkerIndex();
+  std::unique_lock<std::mutex> lock(done_mutex);
+  while (remaining != 0) {
+    lock.unlock();
+    const bool did_run = RunTask(index);
+    lock.lock();
+    if (!did_run) {
+      // every range was taken, the last ones are running on other threads
+      done_condition.wait(lock, [&remaining]() { return remaining == 0; });
+    }
+  }
+  if (exception) {
+    std::rethrow_exception(exception);
+  }
+}
+
+int ThreadPool::GetWorkerIndex() const {
+  return tl_worker_pool == this ? tl_worker_index : -1;
+}
+
+void ThreadPool::Push(std::function<void()> task) {
+  int index = GetWorkerIndex();
+  if (index < 0) {
+    index = next_queue_.fetch_add(1) % queues_.size();
+  }
+  {
+    std::lock_guard<std::mutex> lock(queues_[index]->mutex);
+    queues_[index]->tasks.push_back(std::move(task));
+  }
+  queued_count_.fetch_add(1);
+  {
+    // a worker checks queued_count_ with wake_mutex_ held before it waits,
+    // so it can't miss this notify
+    std::lock_guard<std::mutex> lock(wake_mutex_);
+  }
+  wake_condition_.notify_one();
+}
+
+bool ThreadPool::RunTask(int index) {
+  std::function<void()> task;
+  if (index >= 0) {
+    TaskQueue &queue = *queues_[index];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (!queue.tasks.empty()) {
+      task = std::move(queue.tasks.back());
+      queue.tasks.pop_back();
+    }
+  }
+  for (unsigned int i = 1; !task && i <= queues_.size(); ++i) {
+    TaskQueue &queue = *queues_[(index + i) % queues_.size()];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (!queue.tasks.empty()) {
+      task = std::move(queue.tasks.front());
+      queue.tasks.pop_front();
+    }
+  }
+  if (!task) {
+    return false;
+  }
+
+  queued_count_.fetch_sub(1);
+  task();
+  return true;
+}
+
+void ThreadPool::WorkerLoop(unsigned int index) {
+  tl_worker_pool = this;
+  tl_worker_index = index;
+  while (true) {
+    if (RunTask(index)) {
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(wake_mutex_);
+    wake_condition_.wait(
+        lock, [this]() { return is_stopping_ || queued_count_.load() != 0; });
+    if (is_stopping_ && queued_count_.load() == 0) {
+      return;
+    }
+  }
+}
@@ -0,0 +1,145 @@
+#ifndef IGPUP_DITHERING_PROJECT_THREAD_POOL_H_
+#define IGPUP_DITHERING_PROJECT_THREAD_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+/*!
+ * \brief Work-stealing thread pool shared by all CPU-side stages.
+ *
+ * Every worker thread has its own queue of tasks. Workers take tasks from the
+ * back of their own queue, and steal from the front of other queues when
+ * theirs is empty, so no worker idles while another has queued tasks.
+ *
+ * Use GetInstance() to get the shared pool, which is created on first use.
+ */
+class ThreadPool {
+ public:
+  /*!
+   * \brief Creates a pool with thread_count - 1 worker threads.
+   *
+   * The thread that calls ParallelFor() also runs tasks, so thread_count
+   * threads work on a ParallelFor(). A thread_count of 0 uses the number of
+   * hardware threads.
+   */
+  explicit ThreadPool(unsigned int thread_count);
+
+  /// Runs all queued tasks, then stops the worker threads
+  ~ThreadPool();
+
+  // disable copy
+  ThreadPool(const ThreadPool &other) = delete;
+  ThreadPool &operator=(const ThreadPool &other) = delete;
+
+  // disable move
+  ThreadPool(ThreadPool &&other) = delete;
+  ThreadPool &operator=(ThreadPool &&other) = delete;
+
+  /// Returns the pool shared by Image, Video, and CPUDither
+  static ThreadPool &GetInstance();
+
+  /*!
+   * \brief Sets the number of threads of the shared pool.
+   *
+   * A count of 0 (the default) uses the number of hardware threads. If the
+   * shared pool exists with a different count, it is recreated, so this must
+   * not be called while the shared pool is in use.
+   */
+  static void SetThreadCount(unsigned int count);
+
+  /// Returns the number of threads that work on a ParallelFor()
+  unsigned int GetThreadCount() const;
+
+  /*!
+   * \brief Queues fn to run on a worker thread.
+   *
+   * If the pool has no worker threads, fn is run before returning.
+   *
+   * \return A future for the result of fn.
+   */
+  template <typename Fn>
+  std::future<typename std::result_of<Fn()>::type> Submit(Fn fn);
+
+  /*!
+   * \brief Calls fn on ranges of [begin, end) in parallel, and returns when
+   * all ranges are done.
+   *
+   * fn receives the first (inclusive) and last (exclusive) index of a range.
+   * Ranges have grain_size indices (except the last), or if grain_size is 0,
+   * are sized so that every thread gets several ranges to balance the load.
+   * The calling thread also runs ranges (and other queued tasks) until none
+   * are left to take, so this can be called from a task. It then blocks
+   * until the ranges running on other threads are done.
+   *
+   * If fn throws, the remaining ranges still run, and the first exception
+   * is rethrown once all ranges are done.
+   */
+  void ParallelFor(unsigned int begin, unsigned int end,
+                   unsigned int grain_size,
+                   const std::function<void(unsigned int, unsigned int)> &fn);
+
+ private:
+  struct TaskQueue {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+  };
+
+  static constexpr unsigned int kRangesPerThread = 8;
+  static constexpr unsigned int kMinRangeSize = 4;
+
+  static std::unique_ptr<ThreadPool> instance_;
+  static std::mutex instance_mutex_;
+  static unsigned int instance_thread_count_;
+
+  std::vector<std::unique_ptr<TaskQueue>> queues_;
+  std::vector<std::thread> threads_;
+  std::mutex wake_mutex_;
+  std::condition_variable wake_condition_;
+  std::atomic<unsigned int> queued_count_;
+  std::atomic<unsigned int> next_queue_;
+  unsigned int thread_count_;
+  bool is_stopping_;
+
+  /// Returns the index of the calling worker thread's queue, or -1
+  int GetWorkerIndex() const;
+
+  /// Queues a task on the calling worker's queue, or round-robin otherwise
+  void Push(std::function<void()> task);
+
+  /*!
+   * \brief Runs one queued task.
+   *
+   * Takes from the back of queue index if it is a worker's, otherwise steals
+   * from the front of the other queues.
+   *
+   * \return False if no task was queued.
+   */
+  bool RunTask(int index);
+
+  void WorkerLoop(unsigned int index);
+};
+
+template <typename Fn>
+std::future<typename std::result_of<Fn()>::type> ThreadPool::Submit(Fn fn) {
+  typedef typename std::result_of<Fn()>::type Result;
+  // std::function must be copyable, so the task is shared
+  std::shared_ptr<std::packaged_task<Result()>> task =
+      std::make_shared<std::packaged_task<Result()>>(std::move(fn));
+  std::future<Result> future = task->get_future();
+  if (threads_.empty()) {
+    (*task)();
+  } else {
+    Push([task]() { (*task)(); });
+  }
+  return future;
+}
+
+#endif
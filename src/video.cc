@@ -6,6 +6,9 @@
 #include <fstream>
 #include <iostream>
 
+#include "pixel_format.h"
+#include "thread_pool.h"
+
 Video::Video(const char *video_filename) : Video(std::string(video_filename)) {}
 
 Video::Video(const std::string &video_filename)
@@ -15,9 +18,11 @@ Video::Video(const std::string &video_filename)
       sws_enc_context_(nullptr),
       frame_count_(0),
       packet_count_(0),
-      was_grayscale_(false) {}
+      was_grayscale_(false),
+      png_writes_() {}
 
 Video::~Video() {
+  WaitForPNGWrites(0);
   if (sws_dec_context_ != nullptr) {
     sws_freeContext(sws_dec_context_);
   }
@@ -407,6 +412,9 @@ bool Video::DitherVideo(const std::string &output_filename, Image *blue_noise,
     av_write_trailer(avf_enc_context);
   }
 
+  // frames may still be being written
+  bool is_png_writing_ok = WaitForPNGWrites(0);
+
   // cleanup
   if (enc_codec_context) {
     IGPUP_DITHERING_avcodec_close_ctx(&enc_codec_context);
@@ -421,7 +429,11 @@ bool Video::DitherVideo(const std::string &output_filename, Image *blue_noise,
   av_packet_free(&pkt);
   avcodec_free_context(&codec_ctx);
   avformat_close_input(&avf_dec_context);
-  return true;
+  return is_png_writing_ok;
+}
+
+void Video::SetDitherBackend(DitherBackend backend) {
+  image_.SetDitherBackend(backend);
 }
 
 std::tuple<bool, std::vector<AVFrame *>> Video::HandleDecodingPacket(
@@ -490,20 +502,17 @@ std::tuple<bool, std::vector<AVFrame *>> Video::HandleDecodingPacket(
     image_.height_ = frame->height;
     image_.is_grayscale_ = false;
     image_.data_.resize(frame->width * frame->height * 4);
-    for (unsigned int y = 0; (int)y < frame->height; ++y) {
-      for (unsigned int x = 0; (int)x < frame->width; ++x) {
-        image_.data_.at(x * 4 + y * 4 * frame->width) =
-            temp_frame->data[0][x * 4 + y * 4 * frame->width];
-        image_.data_.at(1 + x * 4 + y * 4 * frame->width) =
-            temp_frame->data[0][1 + x * 4 + y * 4 * frame->width];
-        image_.data_.at(2 + x * 4 + y * 4 * frame->width) =
-            temp_frame->data[0][2 + x * 4 + y * 4 * frame->width];
-        image_.data_.at(3 + x * 4 + y * 4 * frame->width) =
-            temp_frame->data[0][3 + x * 4 + y * 4 * frame->width];
+    auto copy_fn = [&](unsigned int y_begin, unsigned int y_end) {
+      for (unsigned int y = y_begin; y < y_end; ++y) {
+        // rows of temp_frame may be padded to linesize
+        PixelFormat::ConvertRow<PixelFormat::RGBA32, PixelFormat::RGBA32>(
+            temp_frame->data[0] + y * temp_frame->linesize[0], frame->width,
+            image_.data_.data() + y * 4 * frame->width);
       }
-    }
+    };
+    ThreadPool::GetInstance().ParallelFor(0, frame->height, 0, copy_fn);
 
-    av_frame_unref(temp_frame);
+    av_frame_free(&temp_frame);
 
     std::unique_ptr<Image> dithered_image;
     if (grayscale) {
@@ -517,8 +526,6 @@ std::tuple<bool, std::vector<AVFrame *>> Video::HandleDecodingPacket(
     }
 
     if (output_as_pngs) {
-      // free temp_frame as it will not be used on this branch
-      av_frame_free(&temp_frame);
       // get png output name padded with zeroes
       std::string out_name = "output_";
       unsigned int tens = 1;
@@ -530,22 +537,28 @@ std::tuple<bool, std::vector<AVFrame *>> Video::HandleDecodingPacket(
       }
       out_name += std::to_string(frame_count_);
       out_name += ".png";
-      // write png from frame
-      if (!dithered_image->SaveAsPNG(out_name, true)) {
+      // write png from frame on the ThreadPool while the next frames are
+      // decoded and dithered, with a frame per thread at most
+      std::shared_ptr<Image> png_image(std::move(dithered_image));
+      auto write_fn = [png_image, out_name]() {
+        return png_image->SaveAsPNG(out_name, true);
+      };
+      png_writes_.push_back(ThreadPool::GetInstance().Submit(write_fn));
+      if (!WaitForPNGWrites(ThreadPool::GetInstance().GetThreadCount())) {
         return {false, {}};
       }
     } else {
-      // convert grayscale/RGBA to YUV444p
+      // convert packed dithered grayscale/color to YUV444p
       if (sws_enc_context_ != nullptr && color_changed) {
-        // switched between grayscale/RGBA, context needs to be recreated
+        // switched between grayscale/color, context needs to be recreated
         sws_freeContext(sws_enc_context_);
         sws_enc_context_ = nullptr;
       }
       if (sws_enc_context_ == nullptr) {
         sws_enc_context_ = sws_getContext(
             frame->width, frame->height,
-            grayscale ? AVPixelFormat::AV_PIX_FMT_GRAY8
-                      : AVPixelFormat::AV_PIX_FMT_RGBA,
+            grayscale ? AVPixelFormat::AV_PIX_FMT_MONOBLACK
+                      : AVPixelFormat::AV_PIX_FMT_RGB4_BYTE,
             frame->width, frame->height, AVPixelFormat::AV_PIX_FMT_YUV444P,
             SWS_BILINEAR, nullptr, nullptr, nullptr);
         if (sws_enc_context_ == nullptr) {
@@ -554,44 +567,52 @@ std::tuple<bool, std::vector<AVFrame *>> Video::HandleDecodingPacket(
         }
       }
 
-      // rgba data info
-      if (grayscale) {
-        av_frame_free(&temp_frame);
+      // dithered grayscale is already in the MONOBLACK layout, so it is read
+      // in place
+      const uint8_t *src_data[4] = {dithered_image->data_.data(), nullptr,
+                                    nullptr, nullptr};
+      int src_linesize[4] = {static_cast<int>(dithered_image->GetRowSize()), 0,
+                             0, 0};
+      if (!grayscale) {
+        // swscale can't read 4-bit RGB4, so the nibbles are split into one
+        // byte per pixel (RGB4_BYTE), which keeps the same bit layout
         temp_frame = av_frame_alloc();
-        temp_frame->format = AVPixelFormat::AV_PIX_FMT_GRAY8;
-        temp_frame->width = frame->width;
-        temp_frame->height = frame->height;
-        return_value = av_frame_get_buffer(temp_frame, 0);
-        if (return_value != 0) {
-          std::cout << "ERROR: Failed to init temp_frame for conversion from "
-                       "grayscale"
+        if (temp_frame == nullptr) {
+          std::cout << "ERROR: Failed to alloc temp_frame for conversion from "
+                       "dithered color"
                     << std::endl;
-          av_frame_free(&temp_frame);
           return {false, {}};
         }
-        std::memcpy(temp_frame->data[0], dithered_image->data_.data(),
-                    frame->width * frame->height);
-      } else {
-        temp_frame->format = AVPixelFormat::AV_PIX_FMT_RGBA;
+        temp_frame->format = AVPixelFormat::AV_PIX_FMT_RGB4_BYTE;
         temp_frame->width = frame->width;
         temp_frame->height = frame->height;
         return_value = av_frame_get_buffer(temp_frame, 0);
         if (return_value != 0) {
-          std::cout
-              << "ERROR: Failed to init temp_frame for conversion from RGBA"
-              << std::endl;
+          std::cout << "ERROR: Failed to init temp_frame for conversion from "
+                       "dithered color"
+                    << std::endl;
           av_frame_free(&temp_frame);
           return {false, {}};
         }
-        std::memcpy(temp_frame->data[0], dithered_image->data_.data(),
-                    4 * frame->width * frame->height);
+        auto expand_fn = [&](unsigned int y_begin, unsigned int y_end) {
+          for (unsigned int y = y_begin; y < y_end; ++y) {
+            const uint8_t *packed_row = src_data[0] + y * src_linesize[0];
+            uint8_t *byte_row =
+                temp_frame->data[0] + y * temp_frame->linesize[0];
+            for (unsigned int x = 0; (int)x < frame->width; ++x) {
+              byte_row[x] = (packed_row[x / 2] >> (x % 2 == 0 ? 4 : 0)) & 0xF;
+            }
+          }
+        };
+        ThreadPool::GetInstance().ParallelFor(0, frame->height, 0, expand_fn);
+        src_data[0] = temp_frame->data[0];
+        src_linesize[0] = temp_frame->linesize[0];
       }
 
       AVFrame *yuv_frame = av_frame_alloc();
       if (frame == nullptr) {
-        std::cout
-            << "ERROR: Failed to alloc AVFrame for receiving YUV444p from RGBA"
-            << std::endl;
+        std::cout << "ERROR: Failed to alloc AVFrame for receiving YUV444p"
+                  << std::endl;
         av_frame_free(&temp_frame);
         return {false, {}};
       }
@@ -601,10 +622,11 @@ std::tuple<bool, std::vector<AVFrame *>> Video::HandleDecodingPacket(
       return_value = av_frame_get_buffer(yuv_frame, 0);
 
       return_value =
-          sws_scale(sws_enc_context_, temp_frame->data, temp_frame->linesize, 0,
-                    frame->height, yuv_frame->data, yuv_frame->linesize);
+          sws_scale(sws_enc_context_, src_data, src_linesize, 0, frame->height,
+                    yuv_frame->data, yuv_frame->linesize);
       if (return_value <= 0) {
-        std::cout << "ERROR: Failed to convert RGBA to YUV444p with sws_scale"
+        std::cout << "ERROR: Failed to convert dithered frame to YUV444p with "
+                     "sws_scale"
                   << std::endl;
         av_frame_free(&yuv_frame);
         av_frame_free(&temp_frame);
@@ -626,6 +648,17 @@ std::tuple<bool, std::vector<AVFrame *>> Video::HandleDecodingPacket(
   return {true, return_frames};
 }
 
+bool Video::WaitForPNGWrites(std::size_t max_pending) {
+  bool is_ok = true;
+  while (png_writes_.size() > max_pending) {
+    if (!png_writes_.front().get()) {
+      is_ok = false;
+    }
+    png_writes_.pop_front();
+  }
+  return is_ok;
+}
+
 bool Video::HandleEncodingFrame(AVFormatContext *enc_format_ctx,
                                 AVCodecContext *enc_codec_ctx,
                                 AVFrame *yuv_frame, AVStream *video_stream) {
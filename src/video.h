@@ -1,6 +1,8 @@
 #ifndef IGPUP_DITHERING_PROJECT_VIDEO_H_
 #define IGPUP_DITHERING_PROJECT_VIDEO_H_
 
+#include <deque>
+#include <future>
 #include <tuple>
 
 extern "C" {
@@ -64,6 +66,9 @@ class Video {
                    bool grayscale = false, bool overwrite = false,
                    bool output_as_pngs = false);
 
+  /// Sets where the video frames are dithered (see Image::SetDitherBackend())
+  void SetDitherBackend(DitherBackend backend);
+
  private:
   Image image_;
   std::string input_filename_;
@@ -72,12 +77,21 @@ class Video {
   unsigned int frame_count_;
   unsigned int packet_count_;
   bool was_grayscale_;
+  // PNGs of frames that are being written by the ThreadPool
+  std::deque<std::future<bool>> png_writes_;
 
   std::tuple<bool, std::vector<AVFrame *>> HandleDecodingPacket(
       AVCodecContext *codec_ctx, AVPacket *pkt, AVFrame *frame,
       Image *blue_noise, bool grayscale, bool color_changed,
       bool output_as_pngs);
 
+  /*!
+   * \brief Waits until at most max_pending PNG frames are being written.
+   *
+   * \return False if writing a PNG failed.
+   */
+  bool WaitForPNGWrites(std::size_t max_pending);
+
   bool HandleEncodingFrame(AVFormatContext *enc_format_ctx,
                            AVCodecContext *enc_codec_ctx, AVFrame *yuv_frame,
                            AVStream *video_stream);
@@ -0,0 +1,132 @@
+#include "work_group_tuner.h"
+
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+#include "backend_tuner.h"
+
+constexpr unsigned int WorkGroupTuner::kTimedRuns;
+constexpr std::size_t WorkGroupTuner::kMaxHostWorkGroupSize;
+
+MeasuredCache<WorkGroupTuner::Key, WorkGroupShape> WorkGroupTuner::shapes_(
+    "igpup_dithering_work_groups", "work group sizes",
+    &WorkGroupTuner::ParseCacheLine, &WorkGroupTuner::WriteCacheLine);
+
+std::size_t WorkGroupShape::PadGlobalSize(std::size_t global_size,
+                                          std::size_t local_size) {
+  if (local_size == 0) {
+    return global_size;
+  }
+  return (global_size + local_size - 1) / local_size * local_size;
+}
+
+WorkGroupShape WorkGroupTuner::GetShape(const std::string &device_key,
+                                        const std::string &kernel_name,
+                                        unsigned int width, unsigned int height,
+                                        std::size_t max_work_group_size,
+                                        unsigned int host_compute_units,
+                                        const RunFn &run_fn) {
+  const Key key(device_key, kernel_name,
+                BackendTuner::GetBucket(width, height));
+
+  // 0 x 0 lets the implementation pick, which is always valid while another
+  // thread measures the same key
+  return shapes_.Get(key, WorkGroupShape{0, 0}, [&]() {
+    std::cout << "INFO: Timing work group sizes of " << kernel_name << " for "
+              << BackendTuner::GetBucketName(std::get<2>(key)) << " images..."
+              << std::endl;
+    WorkGroupShape shape =
+        Measure(height, max_work_group_size, host_compute_units, run_fn);
+    std::cout << "INFO: Using work group size " << shape.size_0 << 'x'
+              << shape.size_1 << " for " << kernel_name << std::endl;
+    return shape;
+  });
+}
+
+void WorkGroupTuner::SetCacheDirectory(const std::string &directory) {
+  shapes_.SetDirectory(directory);
+}
+
+WorkGroupShape WorkGroupTuner::Measure(unsigned int height,
+                                       std::size_t max_work_group_size,
+                                       unsigned int host_compute_units,
+                                       const RunFn &run_fn) {
+  // 0 x 0 lets the implementation pick, the others are wide rows of work
+  // items since each reads a contiguous part of its row
+  std::vector<WorkGroupShape> candidates{{0, 0}};
+  const std::size_t max_items =
+      host_compute_units > 0 ? kMaxHostWorkGroupSize : 256;
+  for (std::size_t items = 64; items <= max_items; items *= 2) {
+    for (std::size_t size_1 = 1; size_1 <= 16; size_1 *= 2) {
+      // on host devices, taller work groups must still leave a group of
+      // rows for each core, in case a row is one work group
+      if (items <= max_work_group_size && items / size_1 >= 4 &&
+          (size_1 == 1 ||
+           (height + size_1 - 1) / size_1 >= host_compute_units)) {
+        candidates.push_back({items / size_1, size_1});
+      }
+    }
+  }
+  if (max_work_group_size > 0 && max_work_group_size < 64) {
+    candidates.push_back({max_work_group_size, 1});
+  }
+
+  WorkGroupShape best_shape{0, 0};
+  double best_seconds = -1.0;
+  for (const WorkGroupShape &shape : candidates) {
+    double seconds = TimeShape(shape, run_fn);
+    if (seconds >= 0.0 && (best_seconds < 0.0 || seconds < best_seconds)) {
+      best_seconds = seconds;
+      best_shape = shape;
+    }
+  }
+  return best_shape;
+}
+
+double WorkGroupTuner::TimeShape(const WorkGroupShape &shape,
+                                 const RunFn &run_fn) {
+  double best_seconds = -1.0;
+  // the first run is not timed, it may upload the kernel to the device
+  for (unsigned int run = 0; run <= kTimedRuns; ++run) {
+    auto start = std::chrono::steady_clock::now();
+    bool is_run = run_fn(shape);
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    if (!is_run) {
+      return -1.0;
+    } else if (run > 0 &&
+               (best_seconds < 0.0 || elapsed.count() < best_seconds)) {
+      best_seconds = elapsed.count();
+    }
+  }
+  return best_seconds;
+}
+
+bool WorkGroupTuner::ParseCacheLine(const std::string &line, Key *key,
+                                    WorkGroupShape *shape) {
+  // "<device key> <kernel> <bucket> <size 0> <size 1>"
+  std::istringstream iss(line);
+  std::string device_key;
+  std::string kernel_name;
+  std::string bucket_name;
+  if (!(iss >> device_key >> kernel_name >> bucket_name >> shape->size_0 >>
+        shape->size_1)) {
+    return false;
+  }
+  for (unsigned int i = 0; i < BackendTuner::GetBucketCount(); ++i) {
+    if (bucket_name == BackendTuner::GetBucketName(i)) {
+      *key = Key(device_key, kernel_name, i);
+      return true;
+    }
+  }
+  return false;
+}
+
+void WorkGroupTuner::WriteCacheLine(std::ostream &out, const Key &key,
+                                    const WorkGroupShape &shape) {
+  out << std::get<0>(key) << ' ' << std::get<1>(key) << ' '
+      << BackendTuner::GetBucketName(std::get<2>(key)) << ' ' << shape.size_0
+      << ' ' << shape.size_1;
+}
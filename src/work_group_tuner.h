@@ -0,0 +1,105 @@
+#ifndef IGPUP_DITHERING_PROJECT_WORK_GROUP_TUNER_H_
+#define IGPUP_DITHERING_PROJECT_WORK_GROUP_TUNER_H_
+
+#include <cstddef>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <tuple>
+
+#include "measured_cache.h"
+
+/*!
+ * \brief Local work size of a 2D kernel launch.
+ *
+ * A shape of 0 x 0 lets the OpenCL implementation pick the local work size.
+ * Otherwise global work sizes are padded up to multiples of the shape, and
+ * kernels skip the work items past the image.
+ */
+struct WorkGroupShape {
+  std::size_t size_0;
+  std::size_t size_1;
+
+  /// Returns global_size rounded up to a multiple of local_size (if not 0)
+  static std::size_t PadGlobalSize(std::size_t global_size,
+                                   std::size_t local_size);
+};
+
+/*!
+ * \brief Picks the fastest work group shape of a kernel on a device.
+ *
+ * Like BackendTuner, images are sorted into buckets by their number of
+ * pixels. The first time a kernel dithers a bucket on a device, every
+ * candidate shape is timed and the fastest is used from then on. Results are
+ * saved to a cache file per device key (see OpenCLHandle::GetDeviceKey()),
+ * so later runs reuse them.
+ *
+ * Shapes do not have to divide the image size, so images with odd or prime
+ * sizes use the same shapes as others instead of 1 x 1 work groups.
+ */
+class WorkGroupTuner {
+ public:
+  /// Launches a kernel with a shape and waits for it, returns false on failure
+  typedef std::function<bool(const WorkGroupShape &)> RunFn;
+
+  /*!
+   * \brief Returns the fastest shape for kernel_name dithering a width x
+   * height image on the device of device_key.
+   *
+   * max_work_group_size is CL_KERNEL_WORK_GROUP_SIZE of the kernel. run_fn
+   * is called for each candidate shape when measuring.
+   *
+   * host_compute_units is the number of compute units of a device that works
+   * on host memory, like a CPU device, or 0 for other devices. Such devices
+   * run each work group on one core, so they are also timed with larger work
+   * groups, split into enough groups of rows to keep every core busy.
+   *
+   * Other threads are not blocked while a shape is measured. Those that need
+   * the same key, e.g. for an identical device, get a 0 x 0 shape until it
+   * is measured.
+   */
+  static WorkGroupShape GetShape(const std::string &device_key,
+                                 const std::string &kernel_name,
+                                 unsigned int width, unsigned int height,
+                                 std::size_t max_work_group_size,
+                                 unsigned int host_compute_units,
+                                 const RunFn &run_fn);
+
+  /*!
+   * \brief Sets the directory that measured shapes are loaded from and saved
+   * to, as "igpup_dithering_work_groups".
+   *
+   * Defaults to GetCacheDirectory(). An empty directory disables the cache
+   * file, so shapes are measured once per run.
+   */
+  static void SetCacheDirectory(const std::string &directory);
+
+ private:
+  /// Device key, kernel name, and bucket
+  typedef std::tuple<std::string, std::string, unsigned int> Key;
+
+  static constexpr unsigned int kTimedRuns = 3;
+  /// Largest work group timed on devices that work on host memory
+  static constexpr std::size_t kMaxHostWorkGroupSize = 4096;
+
+  static MeasuredCache<Key, WorkGroupShape> shapes_;
+
+  /// Times each candidate shape, returns the fastest
+  static WorkGroupShape Measure(unsigned int height,
+                                std::size_t max_work_group_size,
+                                unsigned int host_compute_units,
+                                const RunFn &run_fn);
+
+  /// Returns the fastest of kTimedRuns in seconds, or a negative value if a
+  /// run failed
+  static double TimeShape(const WorkGroupShape &shape, const RunFn &run_fn);
+
+  /// Reads a line of the cache file, see MeasuredCache
+  static bool ParseCacheLine(const std::string &line, Key *key,
+                             WorkGroupShape *shape);
+  /// Writes a line of the cache file, see MeasuredCache
+  static void WriteCacheLine(std::ostream &out, const Key &key,
+                             const WorkGroupShape &shape);
+};
+
+#endif
@@ -0,0 +1,81 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include "simd_dither.h"
+
+// Compares each ISA supported by the running CPU against ISA::kScalar, on
+// counts that are not multiples of any vector width and on unaligned
+// pointers, so that both the vector loops and their tails are checked.
+
+namespace {
+bool CheckISA(SIMDDither::ISA isa) {
+  constexpr unsigned int kMaxCount = 300;
+  constexpr unsigned int kMaxAlignment = 64;
+  // neither 0 nor 255, so it is never a dithered output
+  constexpr uint8_t kSentinel = 0x5a;
+  std::vector<uint8_t> input(kMaxCount + kMaxAlignment);
+  std::vector<uint8_t> thresholds(kMaxCount + kMaxAlignment);
+  for (std::size_t i = 0; i < input.size(); ++i) {
+    input[i] = static_cast<uint8_t>((i * 2654435761ULL) >> 24);
+    // every few bytes equal the input, which must not be greater
+    thresholds[i] = i % 7 == 0 ? input[i]
+                               : static_cast<uint8_t>((i * 40503ULL) >> 8);
+  }
+
+  std::vector<uint8_t> expected(kMaxCount);
+  std::vector<uint8_t> output(kMaxCount + kMaxAlignment);
+  std::vector<uint8_t> in_place(kMaxCount + kMaxAlignment);
+  for (unsigned int offset = 0; offset < kMaxAlignment; offset += 3) {
+    for (unsigned int count = 0; count <= kMaxCount; ++count) {
+      SIMDDither::ThresholdRow(input.data() + offset,
+                               thresholds.data() + offset, expected.data(),
+                               count, SIMDDither::ISA::kScalar);
+      std::fill(output.begin(), output.end(), kSentinel);
+      SIMDDither::ThresholdRow(input.data() + offset,
+                               thresholds.data() + offset,
+                               output.data() + offset, count, isa);
+      in_place = input;
+      SIMDDither::ThresholdRow(in_place.data() + offset,
+                               thresholds.data() + offset,
+                               in_place.data() + offset, count, isa);
+      if (std::memcmp(expected.data(), output.data() + offset, count) != 0 ||
+          std::memcmp(expected.data(), in_place.data() + offset, count) !=
+              0) {
+        std::cout << "FAILED: " << SIMDDither::ISAToString(isa)
+                  << " differs from scalar with count " << count
+                  << " and offset " << offset << std::endl;
+        return false;
+      } else if (std::count(output.begin(), output.end(), kSentinel) !=
+                 static_cast<std::ptrdiff_t>(output.size() - count)) {
+        std::cout << "FAILED: " << SIMDDither::ISAToString(isa)
+                  << " writes outside of count " << count << " and offset "
+                  << offset << std::endl;
+        return false;
+      }
+    }
+  }
+  std::cout << "PASSED: " << SIMDDither::ISAToString(isa) << std::endl;
+  return true;
+}
+}  // namespace
+
+int main() {
+  const SIMDDither::ISA isas[] = {SIMDDither::ISA::kSSE2,
+                                  SIMDDither::ISA::kAVX2,
+                                  SIMDDither::ISA::kAVX512};
+  const SIMDDither::ISA best_isa = SIMDDither::GetBestISA();
+  bool is_success = true;
+  for (SIMDDither::ISA isa : isas) {
+    if (static_cast<int>(isa) > static_cast<int>(best_isa)) {
+      std::cout << "SKIPPED: " << SIMDDither::ISAToString(isa)
+                << " is not supported by this CPU" << std::endl;
+    } else if (!CheckISA(isa)) {
+      is_success = false;
+    }
+  }
+  return is_success ? EXIT_SUCCESS : EXIT_FAILURE;
+}